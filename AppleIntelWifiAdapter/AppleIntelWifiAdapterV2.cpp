@@ -15,6 +15,7 @@
 #include "IO80211Interface.h"
 #include "IWLApple80211.hpp"
 #include "IWLDebug.h"
+#include "IWLTrace.h"
 
 OSDefineMetaClassAndStructors(AppleIntelWifiAdapterV2, IO80211Controller)
 #define super IO80211Controller
@@ -29,6 +30,27 @@ OSDefineMetaClassAndStructors(AppleIntelWifiAdapterV2, IO80211Controller)
     fInterrupt = NULL;
   }
 
+  if (rxPollTimer) {
+    rxPollTimer->cancelTimeout();
+    irqLoop->removeEventSource(rxPollTimer);
+    rxPollTimer->release();
+    rxPollTimer = NULL;
+  }
+
+  if (txPollTimer) {
+    txPollTimer->cancelTimeout();
+    irqLoop->removeEventSource(txPollTimer);
+    txPollTimer->release();
+    txPollTimer = NULL;
+  }
+
+  if (intMitTimer) {
+    intMitTimer->cancelTimeout();
+    irqLoop->removeEventSource(intMitTimer);
+    intMitTimer->release();
+    intMitTimer = NULL;
+  }
+
   if (gate) {
     gate->release();
     gate = NULL;
@@ -56,6 +78,7 @@ OSDefineMetaClassAndStructors(AppleIntelWifiAdapterV2, IO80211Controller)
 void AppleIntelWifiAdapterV2::free() {
   IWL_DEBUG(0, "Driver free()\n");
   releaseAll();
+  iwl_evt_free();
   super::free();
 }
 
@@ -110,6 +133,67 @@ IOService *AppleIntelWifiAdapterV2::probe(IOService *provider, SInt32 *score) {
   return this;
 }
 
+/*
+ * Runtime logging controls, settable from user space (e.g. with ioio):
+ * IWLLogMask and IWLTraceMask replace the IWL_DL_* masks, IWLTraceDump
+ * prints the trace ring to the system log. IWLEventTrace turns the
+ * binary event tracer on or off, IWLEventDump publishes its rings as the
+ * IWLEventRecords data property (scripts/iwl_evt_decode.py reads it).
+ */
+IOReturn AppleIntelWifiAdapterV2::setProperties(OSObject *properties) {
+  OSDictionary *dict = OSDynamicCast(OSDictionary, properties);
+  OSNumber *mask;
+  bool handled = false;
+
+  if (!dict) return super::setProperties(properties);
+
+  mask = OSDynamicCast(OSNumber, dict->getObject("IWLLogMask"));
+  if (mask) {
+    iwl_log_mask = mask->unsigned32BitValue();
+    handled = true;
+  }
+  mask = OSDynamicCast(OSNumber, dict->getObject("IWLTraceMask"));
+  if (mask) {
+    iwl_trace_mask = mask->unsigned32BitValue();
+    handled = true;
+  }
+  if (dict->getObject("IWLTraceDump")) {
+    iwl_trace_dump();
+    handled = true;
+  }
+  mask = OSDynamicCast(OSNumber, dict->getObject("IWLEventTrace"));
+  if (mask) {
+    if (iwl_evt_enable(mask->unsigned32BitValue() != 0))
+      return kIOReturnNoMemory;
+    handled = true;
+  }
+  if (dict->getObject("IWLEventDump")) {
+    OSData *snap = iwl_evt_snapshot();
+
+    /* recording was never turned on, or no memory */
+    if (!snap) return kIOReturnError;
+    setProperty("IWLEventRecords", snap);
+    snap->release();
+    handled = true;
+  }
+  mask = OSDynamicCast(OSNumber, dict->getObject("IWLIntMit"));
+  if (mask && drv && drv->trans) {
+    drv->trans->intMitSetAdaptive(mask->unsigned32BitValue() != 0);
+    handled = true;
+  }
+  if (dict->getObject("IWLIntMitDump") && drv && drv->trans) {
+    drv->trans->intMitDump();
+    handled = true;
+  }
+  mask = OSDynamicCast(OSNumber, dict->getObject("IWLScanStream"));
+  if (mask && drv && drv->m_pDevice && drv->m_pDevice->ie_dev) {
+    drv->m_pDevice->ie_dev->setScanStreaming(mask->unsigned32BitValue() != 0);
+    handled = true;
+  }
+
+  return handled ? kIOReturnSuccess : super::setProperties(properties);
+}
+
 bool AppleIntelWifiAdapterV2::createWorkLoop() {
   if (!workLoop) workLoop = IO80211WorkLoop::workLoop();
 
@@ -122,6 +206,9 @@ bool AppleIntelWifiAdapterV2::start(IOService *provider) {
   IWL_DEBUG(0, "Driver Start()\n");
   if (!super::start(provider)) return false;
 
+  iwl_log_init();
+  iwl_evt_init();
+
   if (!this->drv) {
     IWL_CRIT(0, "Missing this->drv\n");
     releaseAll();
@@ -210,6 +297,41 @@ bool AppleIntelWifiAdapterV2::startGated(IOService *provider) {
     return false;
   }
 
+  /* RX passes that run out of budget are continued from here */
+  rxPollTimer = IOTimerEventSource::timerEventSource(
+      this,
+      (IOTimerEventSource::Action)&AppleIntelWifiAdapterV2::rxPollOccured);
+  if (!rxPollTimer ||
+      irqLoop->addEventSource(rxPollTimer) != kIOReturnSuccess) {
+    IWL_CRIT(0, "add rx poll event source fail\n");
+    releaseAll();
+    return false;
+  }
+
+  /* data frames from outputPacket() are sent from here */
+  txStopping = false;
+  txPollTimer = IOTimerEventSource::timerEventSource(
+      this,
+      (IOTimerEventSource::Action)&AppleIntelWifiAdapterV2::txPollOccured);
+  if (!txPollTimer ||
+      irqLoop->addEventSource(txPollTimer) != kIOReturnSuccess) {
+    IWL_CRIT(0, "add tx poll event source fail\n");
+    releaseAll();
+    return false;
+  }
+
+  /* moves the coalescing timer down once interrupts stop coming */
+  intMitTimer = IOTimerEventSource::timerEventSource(
+      this,
+      (IOTimerEventSource::Action)&AppleIntelWifiAdapterV2::intMitOccured);
+  if (!intMitTimer ||
+      irqLoop->addEventSource(intMitTimer) != kIOReturnSuccess) {
+    IWL_CRIT(0, "add int mit event source fail\n");
+    releaseAll();
+    return false;
+  }
+
+  /* intrOccured() kicks the timers, they have to exist first */
   fInterrupt->enable();
 
   PMinit();
@@ -288,6 +410,7 @@ bool AppleIntelWifiAdapterV2::intrFilter(OSObject *object,
 
   // kprintf("interrupt filter ran\n");
   me->drv->trans->iwlWrite32(CSR_INT_MASK, 0x00000000);
+  me->drv->trans->int_mit.irq_stamp = mach_absolute_time();
   return true;
 }
 
@@ -298,8 +421,53 @@ void AppleIntelWifiAdapterV2::intrOccured(OSObject *object,
       reinterpret_cast<AppleIntelWifiAdapterV2 *>(object);
   if (o == 0) return;
 
-  kprintf("interrupt!!!\n");
+  IWL_DEBUG_ISR(0, "interrupt\n");
+  o->drv->trans->intMitIrq();
   o->drv->irqHandler(0, NULL);
+
+  if (o->drv->trans->rx_poll_scheduled) o->rxPollTimer->setTimeoutUS(0);
+  if (o->drv->trans->tx_wake) o->kickTxPoll();
+  if (o->drv->trans->intMitArmIdle())
+    o->intMitTimer->setTimeoutMS(IWL_INT_MIT_WINDOW_MS);
+}
+
+void AppleIntelWifiAdapterV2::rxPollOccured(OSObject *object,
+                                            IOTimerEventSource *sender) {
+  AppleIntelWifiAdapterV2 *o =
+      reinterpret_cast<AppleIntelWifiAdapterV2 *>(object);
+  if (o == 0) return;
+
+  /*
+   * Requeue instead of looping so other event sources on the workloop
+   * (command completions, timeouts) get to run between passes.
+   */
+  if (o->drv->rxPoll()) sender->setTimeoutUS(0);
+  if (o->drv->trans->tx_wake) o->kickTxPoll();
+}
+
+void AppleIntelWifiAdapterV2::intMitOccured(OSObject *object,
+                                            IOTimerEventSource *sender) {
+  AppleIntelWifiAdapterV2 *o =
+      reinterpret_cast<AppleIntelWifiAdapterV2 *>(object);
+  if (o == 0) return;
+
+  if (o->drv->trans->intMitIdle()) sender->setTimeoutMS(IWL_INT_MIT_WINDOW_MS);
+}
+
+void AppleIntelWifiAdapterV2::kickTxPoll() {
+  if (!txStopping && txPollTimer) txPollTimer->setTimeoutUS(0);
+}
+
+void AppleIntelWifiAdapterV2::txPollOccured(OSObject *object,
+                                            IOTimerEventSource *sender) {
+  AppleIntelWifiAdapterV2 *o =
+      reinterpret_cast<AppleIntelWifiAdapterV2 *>(object);
+  u32 hold_us;
+
+  if (o == 0) return;
+
+  hold_us = o->drv->txPoll();
+  if (hold_us && !o->txStopping) sender->setTimeoutUS(hold_us);
 }
 
 bool AppleIntelWifiAdapterV2::configureInterface(
@@ -310,6 +478,13 @@ bool AppleIntelWifiAdapterV2::configureInterface(
 void AppleIntelWifiAdapterV2::stop(IOService *provider) {
   IWL_DEBUG(0, "Driver Stop()\n");
   drv->m_pDevice->ie_dev->release();
+  /*
+   * stopDevice() flushes the Tx backlog, txPoll() must not run meanwhile.
+   * disable() waits for a txPoll() already on the workloop, and with
+   * txStopping set nobody arms the timer again.
+   */
+  txStopping = true;
+  if (txPollTimer) txPollTimer->disable();
   drv->stopDevice();
   releaseTimeout();
   if (fInterrupt) {
@@ -319,6 +494,27 @@ void AppleIntelWifiAdapterV2::stop(IOService *provider) {
     fInterrupt = NULL;
   }
 
+  if (rxPollTimer) {
+    rxPollTimer->cancelTimeout();
+    irqLoop->removeEventSource(rxPollTimer);
+    rxPollTimer->release();
+    rxPollTimer = NULL;
+  }
+
+  if (txPollTimer) {
+    txPollTimer->cancelTimeout();
+    irqLoop->removeEventSource(txPollTimer);
+    txPollTimer->release();
+    txPollTimer = NULL;
+  }
+
+  if (intMitTimer) {
+    intMitTimer->cancelTimeout();
+    irqLoop->removeEventSource(intMitTimer);
+    intMitTimer->release();
+    intMitTimer = NULL;
+  }
+
   if (netif) {
     netif->release();
     detachInterface(netif);
@@ -429,10 +625,12 @@ IOOutputQueue *AppleIntelWifiAdapterV2::createOutputQueue()
 */
 
 UInt32 AppleIntelWifiAdapterV2::outputPacket(mbuf_t m, void *param) {
-  IWL_INFO(0, "OSX asked us to output a packet\n");
+  int ret = drv->txEnqueue(m);
 
-  freePacket(m);
-  return 1;
+  if (ret < 0) return kIOReturnOutputDropped;
+  /* only the first frame of a burst needs to wake the workloop */
+  if (ret > 0) kickTxPoll();
+  return kIOReturnOutputSuccess;
 }
 
 IOReturn AppleIntelWifiAdapterV2::getMaxPacketSize(UInt32 *maxSize) const {
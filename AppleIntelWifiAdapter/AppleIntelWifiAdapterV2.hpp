@@ -13,6 +13,7 @@
 #include <IOKit/IOFilterInterruptEventSource.h>
 #include <IOKit/IOLib.h>
 #include <IOKit/IOService.h>
+#include <IOKit/IOTimerEventSource.h>
 #include <IOKit/network/IOEthernetController.h>
 #include <IOKit/pci/IOPCIDevice.h>
 #include <libkern/c++/OSString.h>
@@ -52,6 +53,7 @@ class AppleIntelWifiAdapterV2 : public IO80211Controller {
   bool startGated(IOService* provider);
   void stop(IOService* provider) override;
   IOService* probe(IOService* provider, SInt32* score) override;
+  IOReturn setProperties(OSObject* properties) override;
 
   SInt32 apple80211Request(unsigned int request_type, int request_number,
                            IO80211Interface* interface, void* data) override;
@@ -150,6 +152,8 @@ class AppleIntelWifiAdapterV2 : public IO80211Controller {
   // 18 - INT_MIT
   IOReturn getINT_MIT(IO80211Interface* interface,
                       struct apple80211_intmit_data* imd);
+  IOReturn setINT_MIT(IO80211Interface* interface,
+                      struct apple80211_intmit_data* imd);
   // 19 - POWER
   IOReturn getPOWER(IO80211Interface* interface,
                     struct apple80211_power_data* pd);
@@ -202,11 +206,19 @@ class AppleIntelWifiAdapterV2 : public IO80211Controller {
   void releaseAll();
   static void intrOccured(OSObject* object, IOInterruptEventSource*, int count);
   static bool intrFilter(OSObject* object, IOFilterInterruptEventSource* src);
+  static void rxPollOccured(OSObject* object, IOTimerEventSource* sender);
+  static void txPollOccured(OSObject* object, IOTimerEventSource* sender);
+  static void intMitOccured(OSObject* object, IOTimerEventSource* sender);
+  void kickTxPoll();
   bool addMediumType(UInt32 type, UInt32 speed, UInt32 code, char* name = 0);
   IWLMvmDriver* drv;
 
   IOGatedOutputQueue* fOutputQueue;
   IOInterruptEventSource* fInterrupt;
+  IOTimerEventSource* rxPollTimer;
+  IOTimerEventSource* txPollTimer;
+  IOTimerEventSource* intMitTimer;  // idle check of interrupt moderation
+  volatile bool txStopping;  // set by stop(), txPollTimer is not re-armed
   IO80211Interface* netif;
   IOCommandGate* gate;
   IO80211WorkLoop* workLoop;
@@ -102,7 +102,7 @@ SInt32 AppleIntelWifiAdapterV2::apple80211Request(unsigned int request_type,
       IOCTL_GET(request_type, NOISE, apple80211_noise_data);
       break;
     case APPLE80211_IOC_INT_MIT:  // 18
-      IOCTL_GET(request_type, INT_MIT, apple80211_intmit_data);
+      IOCTL(request_type, INT_MIT, apple80211_intmit_data);
       break;
     case APPLE80211_IOC_POWER:  // 19
       IOCTL(request_type, POWER, apple80211_power_data);
@@ -532,6 +532,22 @@ const char beacon_ie[] =
 
 const char *fake_ssid = "UPC5424297";
 
+/* the SSID and channel filters of the scan request */
+static bool iwl_scan_result_wanted(IWLCachedScan *scan,
+                                   apple80211_scan_data *sd,
+                                   apple80211_scan_multiple_data *sdm) {
+  apple80211_channel *channels = sd ? sd->channels : sdm->channels;
+  uint32_t num_channels = sd ? sd->num_channels : sdm->num_channels;
+
+  if (sd && sd->ssid_len && !scan->matchesSSID(sd->ssid, sd->ssid_len))
+    return false;
+  if (!num_channels) return true;
+  for (uint32_t i = 0; i < num_channels; i++) {
+    if (channels[i].channel == scan->getChannel().channel) return true;
+  }
+  return false;
+}
+
 IOReturn AppleIntelWifiAdapterV2::getSCAN_RESULT(
     IO80211Interface *interface, struct apple80211_scan_result **sr) {
   OSOrderedSet *scanCache = drv->m_pDevice->ie_dev->getScanCache();
@@ -545,145 +561,59 @@ IOReturn AppleIntelWifiAdapterV2::getSCAN_RESULT(
     return -1;
   }
 
-  OSObject *obj = NULL;
-
   apple80211_scan_data *scan_data = drv->m_pDevice->ie_dev->getScanData();
   apple80211_scan_multiple_data *scan_data_multi =
       drv->m_pDevice->ie_dev->getScanMultipleData();
-  bool multi_scan = false;
 
-  if (!scan_data) {
-    if (!scan_data_multi) {
-      drv->m_pDevice->ie_dev->unlockScanCache();
-      return 5;
-    } else {
-      multi_scan = true;
-    }
+  if (!scan_data && !scan_data_multi) {
+    drv->m_pDevice->ie_dev->unlockScanCache();
+    return 5;
   }
 
-  if (!multi_scan) {
-    if (scan_data->ssid_len != 0) {
-      for (int i = drv->m_pDevice->ie_dev->getScanIndex();
-           i < scanCache->getCount(); i++) {
-        OSObject *_can = scanCache->getObject(i);
-        if (_can == NULL) continue;
-
-        IWLCachedScan *candidate = OSDynamicCast(IWLCachedScan, _can);
-        if (candidate == NULL) continue;
-
-        if (candidate->getSSIDLen() == scan_data->ssid_len) {
-          const char *candidate_ssid = candidate->getSSID();
-          if (memcmp(candidate_ssid, scan_data->ssid,
-                     candidate->getSSIDLen()) == 0) {
-            if (scan_data->num_channels != 0) {
-              for (int chan = 0; chan < scan_data->num_channels; chan++) {
-                if (scan_data->channels[chan].channel ==
-                    candidate->getChannel().channel) {
-                  IWL_INFO(0, "Scan result (SSID: %s, channel: %d, RSSI: %d)\n",
-                           candidate_ssid, candidate->getChannel().channel,
-                           candidate->getRSSI());
-
-                  // clang-format off
-                  IOFree((void *)candidate_ssid, candidate->getSSIDLen() + 1);  // NOLINT(readability/casting)
-                  // clang-format on
-                  *sr = candidate->getNativeType();
-                  drv->m_pDevice->ie_dev->setScanIndex(i + 1);
-                  drv->m_pDevice->ie_dev->unlockScanCache();
-                  return kIOReturnSuccess;
-                }
-              }
-            } else {
-              IWL_INFO(0, "Scan result (SSID: %s, channel: %d, RSSI: %d)\n",
-                       candidate_ssid, candidate->getChannel().channel,
-                       candidate->getRSSI());
-              // clang-format off
-              IOFree((void *)candidate_ssid, candidate->getSSIDLen() + 1);  // NOLINT(readability/casting)
-              // clang-format on
-              *sr = candidate->getNativeType();
-              drv->m_pDevice->ie_dev->setScanIndex(i + 1);
-              drv->m_pDevice->ie_dev->unlockScanCache();
-              return kIOReturnSuccess;
-            }
-          }
-          // clang-format off
-          IOFree((void *)candidate_ssid, candidate->getSSIDLen() + 1);  // NOLINT(readability/casting)
-          // clang-format on
-        }
-      }
-      IOFree(scan_data, sizeof(apple80211_scan_data));
-      drv->m_pDevice->ie_dev->setScanData(NULL);
+  /* the result handed out by the previous call is done with */
+  drv->m_pDevice->ie_dev->holdStreamedScan(NULL);
+
+  if (drv->m_pDevice->ie_dev->getScanning() &&
+      drv->m_pDevice->ie_dev->getScanStreaming()) {
+    /* mid-sweep only the changes are handed out, see streamScan() */
+    IWLCachedScan *pending;
+
+    while ((pending = drv->m_pDevice->ie_dev->nextPendingScan())) {
+      if (!iwl_scan_result_wanted(pending, scan_data, scan_data_multi))
+        continue;
+      *sr = pending->getNativeType();
+      drv->m_pDevice->ie_dev->holdStreamedScan(pending);
       drv->m_pDevice->ie_dev->unlockScanCache();
-      return 5;
-    } else {
-      int scan_index = drv->m_pDevice->ie_dev->getScanIndex();
-      obj = scanCache->getObject(scan_index);
-      drv->m_pDevice->ie_dev->setScanIndex(scan_index + 1);
-    }
-  } else {
-    for (int i = drv->m_pDevice->ie_dev->getScanIndex();
-         i < scanCache->getCount(); i++) {
-      OSObject *_can = scanCache->getObject(i);
-      if (_can == NULL) continue;
-
-      IWLCachedScan *candidate = OSDynamicCast(IWLCachedScan, _can);
-      if (candidate == NULL) continue;
-
-      if (scan_data_multi->num_channels != 0) {
-        for (int chan = 0; chan < scan_data_multi->num_channels; chan++) {
-          if (scan_data_multi->channels[chan].channel ==
-              candidate->getChannel().channel) {
-            const char *candidate_ssid = candidate->getSSID();
-            IWL_INFO(0, "Scan result (SSID: %s, channel: %d, RSSI: %d)\n",
-                     candidate_ssid, candidate->getChannel().channel,
-                     candidate->getRSSI());
-
-            // clang-format off
-            IOFree((void *)candidate_ssid, candidate->getSSIDLen() + 1);  // NOLINT(readability/casting)
-            // clang-format on
-            *sr = candidate->getNativeType();
-            drv->m_pDevice->ie_dev->setScanIndex(i + 1);
-            drv->m_pDevice->ie_dev->unlockScanCache();
-            return kIOReturnSuccess;
-          }
-        }
-      } else {
-        const char *candidate_ssid = candidate->getSSID();
-        IWL_INFO(0, "Scan result (SSID: %s, channel: %d, RSSI: %d)\n",
-                 candidate_ssid, candidate->getChannel().channel,
-                 candidate->getRSSI());
-        // clang-format off
-        IOFree((void *)candidate_ssid, candidate->getSSIDLen() + 1);  // NOLINT(readability/casting)
-        // clang-format on
-        *sr = candidate->getNativeType();
-        drv->m_pDevice->ie_dev->setScanIndex(i + 1);
-        drv->m_pDevice->ie_dev->unlockScanCache();
-        return kIOReturnSuccess;
-      }
+      return kIOReturnSuccess;
     }
+    drv->m_pDevice->ie_dev->unlockScanCache();
+    return 5;
   }
 
-  if (obj == NULL) {
-    IWL_INFO(0, "Reached end of scan\n");
-    IOFree(scan_data, sizeof(apple80211_scan_data));
-    drv->m_pDevice->ie_dev->setScanData(NULL);
+  /* the first call of a drain filters and sorts the cache once */
+  if (drv->m_pDevice->ie_dev->getScanIndex() == 0 &&
+      !drv->m_pDevice->ie_dev->prepareScanResults(scan_data,
+                                                  scan_data_multi)) {
     drv->m_pDevice->ie_dev->unlockScanCache();
-    return 5;
+    return kIOReturnNoMemory;
   }
 
-  IWLCachedScan *scan = OSDynamicCast(IWLCachedScan, obj);
-  if (!scan) {
-    IWL_INFO(0, "Could not cast OSObject to cached scan...\n");
+  IWLCachedScan *scan = drv->m_pDevice->ie_dev->nextScanResult();
+  if (scan == NULL) {
+    IWL_INFO(0, "Reached end of scan\n");
+    if (scan_data) IOFree(scan_data, sizeof(apple80211_scan_data));
+    drv->m_pDevice->ie_dev->setScanData(NULL);
     drv->m_pDevice->ie_dev->unlockScanCache();
-    return -1;
+    return 5;
   }
 
   apple80211_scan_result *result = scan->getNativeType();
   if (result != NULL) {
     *sr = result;  // valid until the next scan request, cannot guarantee
                    // whether IE will remain
-    IWL_INFO(0, "Scan result (SSID: %s, channel: %d, RSSI: %d)\n",
-             result->asr_ssid, result->asr_channel.channel, result->asr_rssi);
-
+    IWL_INFO(0, "Scan result (SSID: %.*s, channel: %d, RSSI: %d)\n",
+             result->asr_ssid_len, result->asr_ssid,
+             result->asr_channel.channel, result->asr_rssi);
   } else {
     IWL_ERR(0, "Scan result was bad\n");
   }
@@ -843,7 +773,18 @@ IOReturn AppleIntelWifiAdapterV2::getNOISE(IO80211Interface *interface,
 IOReturn AppleIntelWifiAdapterV2::getINT_MIT(
     IO80211Interface *interface, struct apple80211_intmit_data *imd) {
   imd->version = APPLE80211_VERSION;
-  imd->int_mit = APPLE80211_INT_MIT_AUTO;
+  imd->int_mit = drv->trans->int_mit.adaptive ? APPLE80211_INT_MIT_AUTO
+                                              : APPLE80211_INT_MIT_OFF;
+  return kIOReturnSuccess;
+}
+
+IOReturn AppleIntelWifiAdapterV2::setINT_MIT(
+    IO80211Interface *interface, struct apple80211_intmit_data *imd) {
+  if (imd->int_mit != APPLE80211_INT_MIT_OFF &&
+      imd->int_mit != APPLE80211_INT_MIT_AUTO)
+    return kIOReturnBadArgument;
+
+  drv->trans->intMitSetAdaptive(imd->int_mit == APPLE80211_INT_MIT_AUTO);
   return kIOReturnSuccess;
 }
 
@@ -974,41 +915,36 @@ IOReturn AppleIntelWifiAdapterV2::setASSOCIATE(
 
       apple80211_channel bss_chan = best_obj->getChannel();
 
-      int err = iwl_phy_ctxt_changed(drv, &drv->m_pDevice->phy_ctx[0],
-                                     &bss_chan, 1, 1);
-      if (err) {
-        IWL_ERR(0, "Failed to update phy context\n");
-        return kIOReturnError;
+      /*
+       * The firmware runs the command queue in order, so the whole
+       * bring-up is queued at once and waited for a single time; the
+       * batch names the failing command if any.
+       */
+      struct iwl_hcmd_batch *batch = iwl_hcmd_batch_alloc(drv->trans);
+      if (!batch) {
+        IWL_ERR(0, "Failed to allocate command batch\n");
+        return kIOReturnNoMemory;
       }
 
+      int err = iwl_phy_ctxt_changed(drv, &drv->m_pDevice->phy_ctx[0],
+                                     &bss_chan, 1, 1, batch);
       bss->setPhyCtx(&drv->m_pDevice->phy_ctx[0]);
-
-      err = iwl_mac_ctxt_cmd(drv, FW_CTXT_ACTION_ADD, 0);
-      if (err) {
-        IWL_ERR(0, "Failed to add MAC context\n");
-        return kIOReturnError;
-      }
-
-      err = iwl_binding_cmd(drv, FW_CTXT_ACTION_ADD);
-      if (err) {
-        IWL_ERR(0, "Failed to bind\n");
-        return kIOReturnError;
-      }
-
-      err = iwl_mvm_sta_send_to_fw(drv, false, 0);
+      if (!err) err = iwl_mac_ctxt_cmd(drv, FW_CTXT_ACTION_ADD, 0, batch);
+      if (!err) err = iwl_binding_cmd(drv, FW_CTXT_ACTION_ADD, batch);
+      if (!err) err = iwl_mvm_sta_send_to_fw(drv, false, 0, batch);
+      if (!err) err = iwl_mvm_sta_send_lq(drv, batch);
+      if (!err) err = iwl_mac_ctxt_cmd(drv, FW_CTXT_ACTION_MODIFY, 0, batch);
+      if (!err) iwl_protect_session(drv, 500, 500 /* XXX magic */, batch);
+
+      /* wait even on error, the queued commands must be drained */
+      int ret = iwl_hcmd_batch_wait(batch);
+      iwl_hcmd_batch_put(batch);
+      if (!err) err = ret;
       if (err) {
-        IWL_ERR(0, "Failed to send STA to fw\n");
+        IWL_ERR(0, "Failed to set up the association: %d\n", err);
         return kIOReturnError;
       }
 
-      err = iwl_mac_ctxt_cmd(drv, FW_CTXT_ACTION_MODIFY, 0);
-      if (err) {
-        IWL_ERR(0, "Failed to update MAC context\n");
-        return kIOReturnError;
-      }
-
-      iwl_protect_session(drv, 500, 500 /* XXX magic number */);
-
       interface->setLinkState(IO80211LinkState::kIO80211NetworkLinkUp, 0);
 
     } else {
@@ -1204,7 +1140,7 @@ IOReturn AppleIntelWifiAdapterV2::setSCANCACHE_CLEAR(
   if (scanCache != NULL) {
     if (!drv->m_pDevice->ie_dev->lockScanCache()) return kIOReturnError;
 
-    scanCache->flushCollection();
+    drv->m_pDevice->ie_dev->flushScanCache();
 
     drv->m_pDevice->ie_dev->unlockScanCache();
   }
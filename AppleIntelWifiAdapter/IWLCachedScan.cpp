@@ -8,9 +8,6 @@
 
 #include "IWLCachedScan.hpp"
 
-#include <sys/kpi_mbuf.h>
-#include <sys/mbuf.h>
-
 #include "IWLDebug.h"
 #include "apple80211/apple80211_ioctl.h"
 #include "compat/openbsd/sys/endian.h"
@@ -19,20 +16,70 @@
 #define super OSObject
 OSDefineMetaClassAndStructors(IWLCachedScan, OSObject);
 
-#define check_packet()                                              \
-  if (!packet) {                                                    \
-    IWL_ERR(0, "Packet should exist in IWLCachedScan (func: %s)\n", \
-            __FUNCTION__);                                          \
-    return NULL;                                                    \
+#define check_ie()                                               \
+  if (!ie) {                                                     \
+    IWL_ERR(0, "IEs should exist in IWLCachedScan (func: %s)\n", \
+            __FUNCTION__);                                       \
+    return NULL;                                                 \
   }
 
 /*
-    The idea is for this class to be as non-copy as possible.
-    The point of fixed offsets are to do such
-    (but, they are indeed safe as these are fixed offsets defined within the
-   IEEE 802.11 spec)
+    The idea is for this class to be as small as possible: the fixed
+    fields it needs are copied out of the beacon (at fixed offsets defined
+    within the IEEE 802.11 spec), the IEs go into the scan arena, and the
+    Rx buffer is not held on to.
 */
 
+/*
+ * iwl_scan_arena_alloc - carve len bytes out of the cache's chunk
+ *
+ * Moves *arena on to a new chunk when the current one is full. IEs too
+ * big for a chunk get one of their own that the cache does not keep. The
+ * caller gets a reference on the chunk the bytes live in.
+ */
+static uint8_t* iwl_scan_arena_alloc(struct iwl_scan_arena** arena,
+                                     uint32_t len,
+                                     struct iwl_scan_arena** owner) {
+  const uint32_t room = IWL_SCAN_ARENA_SIZE - sizeof(struct iwl_scan_arena);
+  struct iwl_scan_arena* cur = *arena;
+  uint8_t* p;
+
+  if (len > room) {
+    uint32_t size = sizeof(*cur) + len;
+
+    cur = reinterpret_cast<struct iwl_scan_arena*>(IOMalloc(size));
+    if (!cur) return NULL;
+    cur->refcount = 1;  // the entry's
+    cur->size = size;
+    cur->used = len;
+    *owner = cur;
+    return cur->data;
+  }
+
+  if (!cur || cur->used + len > room) {
+    struct iwl_scan_arena* next = reinterpret_cast<struct iwl_scan_arena*>(
+        IOMalloc(IWL_SCAN_ARENA_SIZE));
+
+    if (!next) return NULL;
+    next->refcount = 1;  // the cache's
+    next->size = IWL_SCAN_ARENA_SIZE;
+    next->used = 0;
+    if (cur) iwl_scan_arena_put(cur);
+    *arena = cur = next;
+  }
+
+  p = &cur->data[cur->used];
+  cur->used += (len + 7) & ~7U;
+  if (cur->used > room) cur->used = room;
+  OSIncrementAtomic(&cur->refcount);
+  *owner = cur;
+  return p;
+}
+
+void iwl_scan_arena_put(struct iwl_scan_arena* arena) {
+  if (OSDecrementAtomic(&arena->refcount) == 1) IOFree(arena, arena->size);
+}
+
 SInt32 orderCachedScans(const OSMetaClassBase* obj1,
                         const OSMetaClassBase* obj2, void* context) {
   IWLCachedScan* cachedScan_l = OSDynamicCast(IWLCachedScan, obj1);
@@ -65,58 +112,33 @@ bool IWLCachedScan::update(iwl_rx_phy_info* phy_info, int rssi, int noise) {
   return true;
 }
 
-uint8_t* search_ie(uint8_t* ie, uint16_t size, uint8_t capa) {
-  size_t ie_len = size;
-  uint8_t* ie_iterator = ie;
-  while (1) {
-    uint8_t v6;
-    if (ie_len < 3 || *ie_iterator != capa) {
-      uint8_t sect_len = *(ie_iterator + 1);
-      ie_len = ie_len - 2 - sect_len;
-      if (ie_len <= 0) return NULL;
-
-      ie_iterator = (ie_iterator + sect_len + 2);
-      v6 = *(ie_iterator + 1);
-      goto LABEL_10;
-    }
-    v6 = *(ie_iterator + 1);
-    if (ie_len - 2 >= v6) {
-      return ie_iterator;
-    }
-  LABEL_10:
-    if (v6 + 2 > ie_len) return NULL;
-  }
-}
-
-bool IWLCachedScan::init(mbuf_t mbuf, int offset, int whOffset,
+bool IWLCachedScan::init(struct iwl_scan_arena** arena,
+                         struct ieee80211_elem_index* elems,
+                         const ieee80211_frame* wh, uint32_t len,
                          iwl_rx_phy_info* phy_info, int rssi, int noise) {
+  const uint8_t* frame = reinterpret_cast<const uint8_t*>(wh);
+
   if (!super::init()) return false;
 
-  errno_t err = mbuf_dup(mbuf, MBUF_DONTWAIT, &buf);
+  // 24 byte header, then timestamp, beacon interval and capabilities
+  if (len <= 36) return false;
 
-  if (err != 0) {
-    IWL_ERR(0, "mbuf dup complained\n");
+  if (frame[36] != 0x00) {
+    IWL_ERR(0, "potentially uncompliant frame, first IE is %x\n", frame[36]);
     return false;
   }
 
-  if (!buf) return false;
-
-  packet = reinterpret_cast<iwl_rx_packet*>(
-      (u8*)mbuf_data((mbuf_t)buf) + (offset));  // NOLINT(readability/casting)
-
-  if (!packet) return false;
-
-  wh = reinterpret_cast<ieee80211_frame*>(packet->data + whOffset);
-  iwl_rx_mpdu_res_start* rx_res =
-      reinterpret_cast<iwl_rx_mpdu_res_start*>(packet->data);
-
-  this->ie_len = rx_res->byte_count - 36;
-
-  if (this->ie_len <= 0) return false;
-
-  if (le16toh(rx_res->byte_count) <= 36) return false;
+  this->ie_len = len - 36;
+  this->ie = iwl_scan_arena_alloc(arena, this->ie_len, &this->arena);
+  if (!this->ie) {
+    IWL_ERR(0, "no room for %d bytes of IEs\n", this->ie_len);
+    return false;
+  }
+  memcpy(this->ie, frame + 36, this->ie_len);
 
-  this->ie = (reinterpret_cast<uint8_t*>(wh) + 36);
+  memcpy(this->bssid, wh->i_addr3, IEEE80211_ADDR_LEN);
+  this->beacon_interval = (frame[33] << 8) | frame[32];
+  this->capabilities = (frame[35] << 8) | frame[34];
 
   this->noise = noise;
   this->rssi = rssi;
@@ -124,35 +146,19 @@ bool IWLCachedScan::init(mbuf_t mbuf, int offset, int whOffset,
   memcpy(&this->phy_info, phy_info, sizeof(iwl_rx_phy_info));  // necessary
   this->absolute_time = mach_absolute_time();
 
-  if (this->ie[0] != 0x00) {
-    IWL_ERR(0, "potentially uncompliant frame\n");
-    IWL_INFO(0, "wh: %x, ie: %x\n", reinterpret_cast<uint8_t*>(wh)[39], ie[5]);
-    IWL_INFO(0, "wh: %x, ie: %x\n", reinterpret_cast<uint8_t*>(wh)[38],
-             ie[4]);  // first byte
-    IWL_INFO(0, "wh: %x, ie: %x\n", reinterpret_cast<uint8_t*>(wh)[37],
-             ie[3]);  // len
-    IWL_INFO(0, "wh: %x, ie: %x\n", reinterpret_cast<uint8_t*>(wh)[36],
-             ie[2]);  // indicator
-    IWL_INFO(0, "wh: %x, ie: %x\n", reinterpret_cast<uint8_t*>(wh)[35], ie[1]);
-    IWL_INFO(0, "wh: %x, ie: %x\n", reinterpret_cast<uint8_t*>(wh)[34], ie[0]);
-    IWL_INFO(0, "wh: %x\n", reinterpret_cast<uint8_t*>(wh)[34]);
-    IWL_INFO(0, "wh: %x\n", reinterpret_cast<uint8_t*>(wh)[33]);
-    IWL_INFO(0, "wh: %x\n", reinterpret_cast<uint8_t*>(wh)[32]);
-    IWL_INFO(0, "wh: %x\n", reinterpret_cast<uint8_t*>(wh)[31]);
-    IWL_INFO(0, "wh: %x\n", reinterpret_cast<uint8_t*>(wh)[30]);
-    IWL_INFO(0, "wh: %x\n", reinterpret_cast<uint8_t*>(wh)[29]);
-    return false;
-  }
-
   this->n_basic_rates = 0;
   this->n_ext_rates = 0;
   this->n_rates = 0;
   this->n_hw_rates = 0;
 
-  uint8_t* rate_ptr = search_ie(this->ie, this->ie_len, 0x01);
-  uint8_t* ext_rates = search_ie(this->ie, this->ie_len, 0x32);
+  // one pass over the IEs, every element found fits in the buffer
+  if (ieee80211_elem_index(this->ie, this->ie + this->ie_len, elems))
+    IWL_DEBUG_SCAN(0, "truncated IE in beacon\n");
 
-  size_t index = 0;
+  const uint8_t* rate_ptr =
+      ieee80211_elem_find(elems, IEEE80211_ELEMID_RATES);
+  const uint8_t* ext_rates =
+      ieee80211_elem_find(elems, IEEE80211_ELEMID_XRATES);
 
   if (rate_ptr == NULL) return NULL;
 
@@ -177,7 +183,7 @@ bool IWLCachedScan::init(mbuf_t mbuf, int offset, int whOffset,
 
       this->n_rates += n_ext_rates;
 
-      for (int i = 0; i < 4; i++) {
+      for (int i = 0; i < n_ext_rates; i++) {
         this->ext_rates[i] = (*(ext_rates + 2 + i));
       }
     }
@@ -193,8 +199,8 @@ bool IWLCachedScan::init(mbuf_t mbuf, int offset, int whOffset,
 
   // 20 - 40 is valid for HT / VHT, but 80 - 160 is ONLY valid for VHT
 
-  uint8_t* vht_op = search_ie(this->ie, this->ie_len, 0xC0);
-  if (vht_op && channel.channel > 15) {
+  const uint8_t* vht_op = ieee80211_elem_find(elems, 0xC0);  // VHT op
+  if (vht_op && vht_op[1] >= 1 && channel.channel > 15) {
     this->vht_supported = true;
 
     uint8_t vht_width = *(vht_op + 2);
@@ -206,8 +212,8 @@ bool IWLCachedScan::init(mbuf_t mbuf, int offset, int whOffset,
     }
   }
 
-  uint8_t* ht_op = search_ie(this->ie, this->ie_len, 0x3D);
-  if (ht_op) {
+  const uint8_t* ht_op = ieee80211_elem_find(elems, IEEE80211_ELEMID_HTOP);
+  if (ht_op && ht_op[1] >= 2) {
     this->ht_supported = true;
 
     if (!this->vht_supported) {
@@ -223,6 +229,11 @@ bool IWLCachedScan::init(mbuf_t mbuf, int offset, int whOffset,
     }
   }
 
+  const uint8_t* ht_cap =
+      ieee80211_elem_find(elems, IEEE80211_ELEMID_HTCAPS);
+  if (ht_cap && ht_cap[1] >= 2) this->ht_caps = ht_cap[2] | (ht_cap[3] << 8);
+  if (ht_cap && ht_cap[1] >= 3) this->ampdu_params = ht_cap[4];
+
   if (!this->vht_supported && !this->ht_supported) {
     channel.flags |= APPLE80211_C_FLAG_20MHZ;
   }
@@ -231,12 +242,17 @@ bool IWLCachedScan::init(mbuf_t mbuf, int offset, int whOffset,
 }
 
 void IWLCachedScan::free() {
-  super::free();
-
-  if (buf) {
-    mbuf_free(buf);
+  if (result) {
+    IOFree(result, sizeof(apple80211_scan_result));
+    result = NULL;
   }
-  packet = NULL;
+  if (arena) {
+    iwl_scan_arena_put(arena);
+    arena = NULL;
+  }
+  ie = NULL;
+
+  super::free();
 }
 
 apple80211_channel IWLCachedScan::getChannel() { return channel; }
@@ -246,7 +262,7 @@ uint64_t IWLCachedScan::getTimestamp() { return phy_info.timestamp; }
 uint64_t IWLCachedScan::getSysTimestamp() { return absolute_time; }
 
 const char* IWLCachedScan::getSSID() {  // ensure to free this resulting buffer
-  check_packet()
+  check_ie()
 
       if (ie[0] != 0x00) {
     IWL_ERR(0, "haven't handled this yet\n");
@@ -267,7 +283,7 @@ const char* IWLCachedScan::getSSID() {  // ensure to free this resulting buffer
 }
 
 uint32_t IWLCachedScan::getSSIDLen() {
-  check_packet()
+  check_ie()
 
       if (ie[0] != 0x00) {
     IWL_ERR(0, "haven't handled this yet\n");
@@ -284,23 +300,20 @@ uint32_t IWLCachedScan::getSSIDLen() {
   return ssid_len;
 }
 
+/* compares against the SSID in place, unlike getSSID() */
+bool IWLCachedScan::matchesSSID(const uint8_t* ssid, uint32_t ssid_len) {
+  if (!ie || ie[0] != 0x00) return false;
+
+  return getSSIDLen() == ssid_len && memcmp(&ie[2], ssid, ssid_len) == 0;
+}
+
 uint32_t IWLCachedScan::getRSSI() { return rssi; }
 
 uint32_t IWLCachedScan::getNoise() { return noise; }
 
-uint16_t IWLCachedScan::getCapabilities() {
-  check_packet()
+uint16_t IWLCachedScan::getCapabilities() { return capabilities; }
 
-          return (*(reinterpret_cast<uint8_t*>(wh) + 35) << 8) |
-      (*(reinterpret_cast<uint8_t*>(wh) + 34));
-  // these are stored in the fixed parameters, offsets are fine here
-}
-
-uint8_t* IWLCachedScan::getBSSID() {
-  check_packet()
-
-      return &wh->i_addr3[0];
-}
+uint8_t* IWLCachedScan::getBSSID() { return bssid; }
 
 uint8_t IWLCachedScan::getNumRates() { return this->n_rates; }
 
@@ -311,31 +324,31 @@ uint8_t IWLCachedScan::getNumBasicRates() { return this->n_basic_rates; }
 uint8_t IWLCachedScan::getNumHWRates() { return this->n_hw_rates; }
 
 uint8_t* IWLCachedScan::getRates() {
-  check_packet()
+  check_ie()
 
       return this->rates;
 }
 
 uint8_t* IWLCachedScan::getExtRates() {
-  check_packet()
+  check_ie()
 
       return this->ext_rates;
 }
 
 uint8_t* IWLCachedScan::getBasicRates() {
-  check_packet()
+  check_ie()
 
       return this->basic_rates;
 }
 
 uint8_t* IWLCachedScan::getHWRates() {
-  check_packet()
+  check_ie()
 
       return this->hw_rates;
 }
 
 void* IWLCachedScan::getIE() {
-  check_packet()
+  check_ie()
 
       return (void*)ie;  // NOLINT(readability/casting)
 }
@@ -343,11 +356,11 @@ void* IWLCachedScan::getIE() {
 uint32_t IWLCachedScan::getIELen() { return ie_len; }
 
 apple80211_scan_result*
-IWLCachedScan::getNativeType() {  // be sure to free this too
-  check_packet()
+IWLCachedScan::getNativeType() {  // owned by the entry, refilled each call
+  check_ie()
 
-      result = reinterpret_cast<apple80211_scan_result*>(
-          kzalloc(sizeof(apple80211_scan_result)));
+      if (!result) result = reinterpret_cast<apple80211_scan_result*>(
+                       kzalloc(sizeof(apple80211_scan_result)));
 
   if (result == NULL) return NULL;
 
@@ -406,19 +419,9 @@ IWLCachedScan::getNativeType() {  // be sure to free this too
 
   result->asr_ssid_len = this->getSSIDLen();
 
-  if (this->getSSIDLen() != 0) {
-    const char* ssid = this->getSSID();
-
-    if (ssid) {
-      memcpy(&result->asr_ssid, ssid, this->getSSIDLen() + 1);
-      // clang-format off
-      IOFree((void*)ssid, this->getSSIDLen() + 1);  // NOLINT(readability/casting)
-      // clang-format on
-    }
-  }
+  bzero(&result->asr_ssid, sizeof(result->asr_ssid));
+  if (ie[0] == 0x00) memcpy(&result->asr_ssid, &ie[2], result->asr_ssid_len);
 
   // result->asr_age = le32toh(this->phy_info.system_timestamp);
   return result;
 }
-
-mbuf_t IWLCachedScan::getMbuf() { return buf; }
@@ -16,6 +16,31 @@
 #include "compat/openbsd/net80211/ieee80211.h"
 #include "fw/api/rx.h"
 
+/*
+ * Scan arena
+ *
+ * The IEs of the cached scans are copied into fixed-size chunks owned by
+ * the scan cache, one after another. Each entry holds a reference on the
+ * chunk its IEs live in, and the cache holds one on the chunk it is
+ * filling, so a chunk goes away in one piece once the cache has moved on
+ * (it filled up or the cache was flushed) and its last entry is freed.
+ *
+ * Chunks are kept small so that a single long-lived entry (the AP we are
+ * associated to, say) pins a couple of beacons' worth of memory at most.
+ * IEs that do not fit an empty chunk get a chunk of their own, sized to
+ * them, which the cache never fills.
+ */
+#define IWL_SCAN_ARENA_SIZE 2048
+
+struct iwl_scan_arena {
+  volatile SInt32 refcount;
+  uint32_t size;  // of the whole allocation, for IOFree
+  uint32_t used;
+  uint8_t data[];
+};
+
+void iwl_scan_arena_put(struct iwl_scan_arena* arena);
+
 SInt32 orderCachedScans(const OSMetaClassBase* obj1,
                         const OSMetaClassBase* obj2, void* context);
 
@@ -23,8 +48,11 @@ class IWLCachedScan : public OSObject {
   OSDeclareDefaultStructors(IWLCachedScan);
 
  public:
-  bool init(mbuf_t mbuf, int offset, int whOffset, iwl_rx_phy_info* phy_info,
-            int rssi, int noise);
+  // copies what it needs out of the frame, the IEs into *arena; elems is
+  // scratch space for indexing them
+  bool init(struct iwl_scan_arena** arena, struct ieee80211_elem_index* elems,
+            const ieee80211_frame* wh, uint32_t len,
+            iwl_rx_phy_info* phy_info, int rssi, int noise);
   bool update(iwl_rx_phy_info* phy_info, int rssi, int noise);
   void free() override;
 
@@ -35,6 +63,7 @@ class IWLCachedScan : public OSObject {
 
   const char* getSSID();
   uint32_t getSSIDLen();
+  bool matchesSSID(const uint8_t* ssid, uint32_t ssid_len);
   uint32_t getRSSI();
   uint32_t getNoise();
   uint16_t getCapabilities();
@@ -55,6 +84,12 @@ class IWLCachedScan : public OSObject {
 
   inline bool getHTSupported() { return this->ht_supported; }
 
+  // HT Capabilities Info field, 0 if the beacon had no HT Capabilities IE
+  inline uint16_t getHTCaps() { return this->ht_caps; }
+
+  // A-MPDU Parameters of the HT Capabilities IE
+  inline uint8_t getAMPDUParams() { return this->ampdu_params; }
+
   inline iwl_rx_phy_info* getPhyInfo() { return &this->phy_info; }
 
   void* getIE();
@@ -62,14 +97,28 @@ class IWLCachedScan : public OSObject {
 
   apple80211_scan_result* getNativeType();
 
-  mbuf_t getMbuf();
-
  private:
+  friend class IWL80211Device;
+  template <class T>
+  friend struct iwl_scan_index;
+
+  // scan cache index, maintained by IWL80211Device under the cache lock
+  IWLCachedScan* hash_next;
+  IWLCachedScan* lru_prev;  // towards the least recently seen
+  IWLCachedScan* lru_next;
+  bool pending;            // changed since the upper layer last got it
+  uint32_t reported_rssi;  // RSSI when it was last handed out
+
+  uint8_t bssid[IEEE80211_ADDR_LEN];
+  uint16_t capabilities;
   uint16_t beacon_interval;
-  uint8_t* ie;
+  uint8_t* ie;  // in arena
   int16_t ie_len;
+  struct iwl_scan_arena* arena;
   bool vht_supported;
   bool ht_supported;
+  uint16_t ht_caps;
+  uint8_t ampdu_params;
 
   uint8_t basic_rates[8];
   uint8_t rates[8];
@@ -89,11 +138,8 @@ class IWLCachedScan : public OSObject {
 
   apple80211_scan_result*
       result;  // probably will get upset if we don't store this
-  ieee80211_frame* wh;
 
   struct iwl_rx_phy_info phy_info;
-  struct iwl_rx_packet* packet;  // as long buf is valid, this is also valid
-  mbuf_t buf;                    // copied in from the ISR
 };
 
 #endif  // APPLEINTELWIFIADAPTER_IWLCACHEDSCAN_HPP_
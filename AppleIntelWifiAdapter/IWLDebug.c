@@ -8,6 +8,66 @@
 
 #include "IWLDebug.h"
 
+#include <kern/clock.h>
+#include <pexpert/pexpert.h>
+#include <stdarg.h>
+
+#include "IWLTraceRing.h"
+
+volatile UInt32 iwl_log_mask = IWL_DL_DEFAULT;
+volatile UInt32 iwl_trace_mask = 0;
+
+/*
+ * iwl_log_init - pick up the masks from the boot arguments
+ *
+ * iwl_log=<mask> and iwl_trace=<mask> override the defaults, using the
+ * IWL_DL_* bits.
+ */
+void iwl_log_init(void) {
+  UInt32 mask;
+
+  if (PE_parse_boot_argn("iwl_log", &mask, sizeof(mask))) iwl_log_mask = mask;
+  if (PE_parse_boot_argn("iwl_trace", &mask, sizeof(mask)))
+    iwl_trace_mask = mask;
+}
+
+#define IWL_TRACE_ENTRIES 512 /* power of 2 */
+
+static struct iwl_trace_entry iwl_trace_entries[IWL_TRACE_ENTRIES];
+static struct iwl_trace_ring iwl_trace_ring = {
+    .entries = iwl_trace_entries,
+    .size = IWL_TRACE_ENTRIES,
+};
+
+void iwl_trace_printf(const char *fmt, ...) {
+  char msg[IWL_TRACE_MSG_LEN];
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+  iwl_trace_ring_write(&iwl_trace_ring, mach_absolute_time(), msg);
+}
+
+/*
+ * iwl_trace_dump - print the records still in the ring, oldest first
+ *
+ * Safe against concurrent writers: records overwritten or still being
+ * written while they are copied out are skipped.
+ */
+void iwl_trace_dump(void) {
+  char msg[IWL_TRACE_MSG_LEN];
+  UInt32 i, head;
+  UInt64 time;
+
+  iwl_trace_ring_span(&iwl_trace_ring, &i, &head);
+  IOLog("AppleIntelWifiAdapter TRACE: dump of %u records\n", head - i);
+  for (; i != head; i++) {
+    if (!iwl_trace_ring_read(&iwl_trace_ring, i, &time, msg)) continue;
+    IOLog("AppleIntelWifiAdapter TRACE [%llu] %s", time, msg);
+  }
+}
+
 /*
  * Base64 encoding/decoding (RFC1341)
  * Copyright (c) 2005-2011, Jouni Malinen <j@w1.fi>
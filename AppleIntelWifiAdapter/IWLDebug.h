@@ -26,24 +26,87 @@
 #define TraceLog(args...) IOLog(args)
 #endif
 
-#define __iwl_warn(args...)                        \
-  do {                                             \
-    TraceLog("AppleIntelWifiAdapter WARN: " args); \
-  } while (0)
+/*
+ * Log levels, a message is only built in if its level is at most
+ * IWL_LOG_LEVEL. Anything above is compiled out, arguments included.
+ */
+#define IWL_LOG_ERR 0
+#define IWL_LOG_WARN 1
+#define IWL_LOG_INFO 2
+#define IWL_LOG_DEBUG 3
+
+/*
+ * The hot path logs are built in but masked off at runtime by default,
+ * define IWL_LOG_LEVEL to IWL_LOG_INFO or lower to drop them entirely.
+ */
+#ifndef IWL_LOG_LEVEL
+#define IWL_LOG_LEVEL IWL_LOG_DEBUG
+#endif
+
+/*
+ * Modules for the runtime masks. iwl_log_mask selects what goes to the
+ * system log, iwl_trace_mask what goes to the in-memory trace ring. The
+ * per-packet and per-interrupt modules are off by default.
+ */
+#define IWL_DL_INFO 0x00000001
+#define IWL_DL_ISR 0x00000002
+#define IWL_DL_RX 0x00000004
+#define IWL_DL_TX 0x00000008
+#define IWL_DL_HCMD 0x00000010
+#define IWL_DL_SCAN 0x00000020
+#define IWL_DL_DEFAULT IWL_DL_INFO
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+extern volatile UInt32 iwl_log_mask;
+extern volatile UInt32 iwl_trace_mask;
+
+void iwl_log_init(void);
+void iwl_trace_printf(const char *fmt, ...) __printflike(1, 2);
+void iwl_trace_dump(void);
+#ifdef __cplusplus
+}
+#endif
 
-#define __iwl_info(args...)                        \
-  do {                                             \
-    TraceLog("AppleIntelWifiAdapter INFO: " args); \
+#define __iwl_log(level, mask, prefix, f, args...)                    \
+  do {                                                                \
+    if (IWL_LOG_LEVEL >= (level)) {                                   \
+      if (__builtin_expect(iwl_log_mask & (mask), 0))                 \
+        TraceLog("AppleIntelWifiAdapter " prefix f, ##args);          \
+      if (__builtin_expect(iwl_trace_mask & (mask), 0))               \
+        iwl_trace_printf(prefix f, ##args);                           \
+    }                                                                 \
   } while (0)
 
-#define __iwl_crit(args...)                        \
-  do {                                             \
-    TraceLog("AppleIntelWifiAdapter CRIT: " args); \
+/*
+ * Errors and warnings ignore iwl_log_mask, they always reach the system
+ * log, and go to the trace ring as well whenever it records anything.
+ */
+#define __iwl_log_always(level, prefix, f, args...)        \
+  do {                                                     \
+    if (IWL_LOG_LEVEL >= (level)) {                        \
+      TraceLog("AppleIntelWifiAdapter " prefix f, ##args); \
+      if (__builtin_expect(iwl_trace_mask != 0, 0))        \
+        iwl_trace_printf(prefix f, ##args);                \
+    }                                                      \
   } while (0)
 
-#define __iwl_err(rfkill_prefix, trace_only, args...)              \
-  do {                                                             \
-    if (!trace_only) TraceLog("AppleIntelWifiAdapter ERR: " args); \
+#define __iwl_warn(f, args...) \
+  __iwl_log_always(IWL_LOG_WARN, "WARN: ", f, ##args)
+
+#define __iwl_info(f, args...) \
+  __iwl_log(IWL_LOG_INFO, IWL_DL_INFO, "INFO: ", f, ##args)
+
+#define __iwl_crit(f, args...) \
+  __iwl_log_always(IWL_LOG_ERR, "CRIT: ", f, ##args)
+
+#define __iwl_err(rfkill_prefix, trace_only, f, args...) \
+  do {                                                   \
+    if (!(trace_only))                                   \
+      __iwl_log_always(IWL_LOG_ERR, "ERR: ", f, ##args); \
+    else if (__builtin_expect(iwl_trace_mask != 0, 0))   \
+      iwl_trace_printf("ERR: " f, ##args);               \
   } while (0)
 
 #define __iwl_dbg(args...)                          \
@@ -87,6 +150,18 @@
   } while (0)
 #define IWL_DEBUG(m, f, args...) __IWL_DEBUG_DEV(level, f, ##args)
 
+/* hot path logging, disabled unless the module is set in a mask */
+#define IWL_DEBUG_ISR(m, f, a...) \
+  __iwl_log(IWL_LOG_DEBUG, IWL_DL_ISR, "ISR: ", f, ##a)
+#define IWL_DEBUG_RX(m, f, a...) \
+  __iwl_log(IWL_LOG_DEBUG, IWL_DL_RX, "RX: ", f, ##a)
+#define IWL_DEBUG_TX(m, f, a...) \
+  __iwl_log(IWL_LOG_DEBUG, IWL_DL_TX, "TX: ", f, ##a)
+#define IWL_DEBUG_HC(m, f, a...) \
+  __iwl_log(IWL_LOG_DEBUG, IWL_DL_HCMD, "HCMD: ", f, ##a)
+#define IWL_DEBUG_SCAN(m, f, a...) \
+  __iwl_log(IWL_LOG_DEBUG, IWL_DL_SCAN, "SCAN: ", f, ##a)
+
 #define IWL_DEBUG_BUF(b, s) \
   do {                      \
     __iwl_dbg_buf(b, s);    \
@@ -56,6 +56,7 @@ struct iwl_dma_ptr *allocate_dma_buf32(size_t size) {
   IOBufferMemoryDescriptor *bmd =
       IOBufferMemoryDescriptor::inTaskWithPhysicalMask(
           kernel_task, options, size, 0x00000000ffffffffULL);
+  if (!bmd) return NULL;
   bmd->prepare();
   IODMACommand *cmd = IODMACommand::withSpecification(
       kIODMACommandOutputHost32, 32, 0, IODMACommand::kMapped, 0, 1);
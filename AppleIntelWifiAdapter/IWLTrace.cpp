@@ -0,0 +1,161 @@
+//
+//  IWLTrace.cpp
+//  AppleIntelWifiAdapter
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+#include "IWLTrace.h"
+
+#include <kern/clock.h>
+#include <kern/cpu_number.h>
+#include <libkern/OSAtomic.h>
+#include <pexpert/pexpert.h>
+#include <libkern/c++/OSData.h>
+#include <sys/errno.h>
+
+/*
+ * One ring per CPU, CPUs past IWL_EVT_CPUS share a ring. A ring may
+ * still see writers from several threads (preemption, migration between
+ * reading the CPU number and claiming the slot), so slots are claimed
+ * atomically; on the owning CPU that increment is uncontended.
+ */
+#define IWL_EVT_CPUS 16       /* power of 2 */
+#define IWL_EVT_ENTRIES 512   /* per CPU, power of 2 */
+
+struct iwl_evt_ring {
+  volatile SInt32 head;
+  struct iwl_evt evt[IWL_EVT_ENTRIES];
+};
+
+volatile UInt32 iwl_evt_enabled;
+static struct iwl_evt_ring *iwl_evt_rings;
+
+static inline UInt64 iwl_evt_tsc(void) {
+  UInt32 lo, hi;
+
+  __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((UInt64)hi << 32) | lo;
+}
+
+/* iwl_evt=1 on the boot arguments starts recording at load */
+void iwl_evt_init(void) {
+  UInt32 on;
+
+  if (PE_parse_boot_argn("iwl_evt", &on, sizeof(on)) && on)
+    iwl_evt_enable(true);
+}
+
+/*
+ * iwl_evt_enable - start or stop recording
+ *
+ * The rings are allocated the first time recording is turned on and kept
+ * until iwl_evt_free(), so a writer never sees them go away.
+ */
+int iwl_evt_enable(bool on) {
+  struct iwl_evt_ring *rings;
+
+  if (on && !iwl_evt_rings) {
+    rings = (struct iwl_evt_ring *)IOMallocAligned(
+        sizeof(*rings) * IWL_EVT_CPUS, PAGE_SIZE);
+    if (!rings) return -ENOMEM;
+    bzero(rings, sizeof(*rings) * IWL_EVT_CPUS);
+    OSMemoryBarrier();
+    iwl_evt_rings = rings;
+  }
+  OSMemoryBarrier();
+  iwl_evt_enabled = on;
+  return 0;
+}
+
+/* only called once nothing can record any more */
+void iwl_evt_free(void) {
+  iwl_evt_enabled = 0;
+  if (!iwl_evt_rings) return;
+  IOFreeAligned(iwl_evt_rings, sizeof(*iwl_evt_rings) * IWL_EVT_CPUS);
+  iwl_evt_rings = NULL;
+}
+
+void __iwl_evt(UInt16 type, UInt32 a, UInt32 b, UInt32 c, UInt32 d) {
+  int cpu = cpu_number();
+  struct iwl_evt_ring *ring = &iwl_evt_rings[cpu & (IWL_EVT_CPUS - 1)];
+  UInt32 idx = (UInt32)OSIncrementAtomic(&ring->head);
+  struct iwl_evt *e = &ring->evt[idx & (IWL_EVT_ENTRIES - 1)];
+
+  e->seq = 0;
+  OSMemoryBarrier();
+  e->tsc = iwl_evt_tsc();
+  e->type = type;
+  e->cpu = (UInt16)cpu;
+  e->a = a;
+  e->b = b;
+  e->c = c;
+  e->d = d;
+  OSMemoryBarrier();
+  e->seq = idx + 1;
+}
+
+/*
+ * iwl_evt_snapshot - copy the rings out, see struct iwl_evt_snap_hdr
+ *
+ * Nothing is formatted here, a dump of every ring costs one copy. Records
+ * that are overwritten while they are copied are skipped: the sequence
+ * number has to be the same before and after. NULL if recording was never
+ * on or there is no memory.
+ */
+OSData *iwl_evt_snapshot(void) {
+  struct iwl_evt_ring *rings = iwl_evt_rings;
+  struct iwl_evt_snap_hdr hdr;
+  struct iwl_evt_snap_ring sr[IWL_EVT_CPUS];
+  OSData *recs, *data = NULL;
+  int cpu;
+
+  if (!rings) return NULL;
+
+  hdr.magic = IWL_EVT_SNAP_MAGIC;
+  hdr.version = IWL_EVT_SNAP_VERSION;
+  hdr.hdr_size = sizeof(hdr);
+  hdr.evt_size = sizeof(struct iwl_evt);
+  hdr.rings = IWL_EVT_CPUS;
+  hdr.entries = IWL_EVT_ENTRIES;
+  hdr.tsc = iwl_evt_tsc();
+  hdr.abs = mach_absolute_time();
+  bzero(sr, sizeof(sr));
+
+  /* the ring table goes first but is only known once the records are in */
+  recs = OSData::withCapacity(sizeof(struct iwl_evt) * IWL_EVT_ENTRIES);
+  if (!recs) return NULL;
+
+  for (cpu = 0; cpu < IWL_EVT_CPUS; cpu++) {
+    struct iwl_evt_ring *ring = &rings[cpu];
+    UInt32 head = (UInt32)ring->head;
+    UInt32 i = head > IWL_EVT_ENTRIES ? head - IWL_EVT_ENTRIES : 0;
+
+    sr[cpu].head = head;
+    for (; i != head; i++) {
+      struct iwl_evt *e = &ring->evt[i & (IWL_EVT_ENTRIES - 1)];
+      struct iwl_evt copy;
+
+      if (e->seq != i + 1) continue;
+      OSMemoryBarrier();
+      memcpy(&copy, e, sizeof(copy));
+      OSMemoryBarrier();
+      if (e->seq != i + 1) continue;
+
+      if (!recs->appendBytes(&copy, sizeof(copy))) goto out;
+      sr[cpu].count++;
+    }
+  }
+
+  data = OSData::withCapacity(sizeof(hdr) + sizeof(sr) + recs->getLength());
+  if (data && (!data->appendBytes(&hdr, sizeof(hdr)) ||
+               !data->appendBytes(sr, sizeof(sr)) ||
+               !data->appendBytes(recs))) {
+    data->release();
+    data = NULL;
+  }
+
+out:
+  recs->release();
+  return data;
+}
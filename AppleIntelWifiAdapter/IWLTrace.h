@@ -0,0 +1,93 @@
+//
+//  IWLTrace.h
+//  AppleIntelWifiAdapter
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+#ifndef APPLEINTELWIFIADAPTER_IWLTRACE_H_
+#define APPLEINTELWIFIADAPTER_IWLTRACE_H_
+
+#include <IOKit/IOLib.h>
+
+/*
+ * Binary event tracer
+ *
+ * Fixed-size records stamped with the raw TSC, written into one ring per
+ * CPU so that tracing the data path costs a few stores and no formatting.
+ * Recording is off by default, IWL_EVT() does not evaluate its arguments
+ * until it is turned on (iwl_evt=1 boot argument or the IWLEventTrace
+ * property). iwl_evt_snapshot() copies the rings out as they are, in
+ * binary, for scripts/iwl_evt_decode.py to merge and turn into latency
+ * histograms off the machine.
+ */
+enum iwl_evt_type {
+  IWL_EVT_HCMD_SEND = 1, /* a: cmd id, b: len, c: seq, d: flags */
+  IWL_EVT_HCMD_DONE,     /* a: cmd id, b: len, c: seq */
+  IWL_EVT_RX,            /* a: cmd id, b: len, c: rx queue, d: rb vid */
+  IWL_EVT_IRQ,           /* a: CSR_INT causes, b: interrupt mask */
+  IWL_EVT_RX_WRPTR,      /* a: rx queue, b: write pointer */
+  IWL_EVT_TX_WRPTR,      /* a: tx queue, b: write pointer, c: batched */
+  IWL_EVT_TX_RECLAIM,    /* a: tx queue, b: ssn, c: frames freed */
+};
+
+struct iwl_evt {
+  UInt64 tsc;
+  volatile UInt32 seq; /* claim index + 1 once complete, 0 while written */
+  UInt16 type;
+  UInt16 cpu;
+  UInt32 a;
+  UInt32 b;
+  UInt32 c;
+  UInt32 d;
+};
+
+/*
+ * Snapshot layout, all little endian: the header, then one
+ * struct iwl_evt_snap_ring per ring, then every ring's records in ring
+ * order, oldest first. Records that were being rewritten while they were
+ * copied are left out, head - count of a ring were overwritten before.
+ */
+#define IWL_EVT_SNAP_MAGIC 0x454c5749 /* "IWLE" */
+#define IWL_EVT_SNAP_VERSION 1
+
+struct iwl_evt_snap_hdr {
+  UInt32 magic;
+  UInt16 version;
+  UInt16 hdr_size;  /* sizeof(struct iwl_evt_snap_hdr) */
+  UInt16 evt_size;  /* sizeof(struct iwl_evt) */
+  UInt16 rings;
+  UInt32 entries;   /* per ring */
+  UInt64 tsc;       /* taken together with abs, to calibrate the TSC */
+  UInt64 abs;       /* mach_absolute_time(), nanoseconds on x86 */
+};
+
+struct iwl_evt_snap_ring {
+  UInt32 head;   /* records ever claimed on the ring */
+  UInt32 count;  /* records of the ring in the snapshot */
+};
+
+#ifdef __cplusplus
+class OSData;
+
+OSData *iwl_evt_snapshot(void);
+
+extern "C" {
+#endif
+extern volatile UInt32 iwl_evt_enabled;
+
+void iwl_evt_init(void);
+int iwl_evt_enable(bool on);
+void iwl_evt_free(void);
+void __iwl_evt(UInt16 type, UInt32 a, UInt32 b, UInt32 c, UInt32 d);
+#ifdef __cplusplus
+}
+#endif
+
+#define IWL_EVT(type, a, b, c, d)             \
+  do {                                        \
+    if (__builtin_expect(iwl_evt_enabled, 0)) \
+      __iwl_evt(type, a, b, c, d);            \
+  } while (0)
+
+#endif  // APPLEINTELWIFIADAPTER_IWLTRACE_H_
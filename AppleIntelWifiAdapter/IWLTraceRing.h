@@ -0,0 +1,103 @@
+//
+//  IWLTraceRing.h
+//  AppleIntelWifiAdapter
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+#ifndef APPLEINTELWIFIADAPTER_IWLTRACERING_H_
+#define APPLEINTELWIFIADAPTER_IWLTRACERING_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * In-memory trace ring
+ *
+ * Writers claim a record with a single atomic increment and never wait.
+ * A slot's sequence number is odd while a writer fills it and even once
+ * the record is complete, and it names the claim, so the reader can tell
+ * a complete record from one overwritten or still being written. When the
+ * ring wraps the oldest records are overwritten; a writer that laps one
+ * still filling its slot drops its record instead of writing over it.
+ * The record is copied in and out in words with relaxed atomics, so the
+ * reader may race the writers without either side tearing a word. Nothing
+ * here depends on IOKit so the ring builds on a host as well (see tests/).
+ */
+#define IWL_TRACE_MSG_LEN 112
+
+struct iwl_trace_entry {
+  uint32_t seq; /* 2 * claim + 1 while written, 2 * claim + 2 once done */
+  uint64_t time;
+  uint64_t msg[IWL_TRACE_MSG_LEN / 8];
+};
+
+/**
+ * struct iwl_trace_ring - ring of trace records
+ * @entries: ring storage
+ * @size: number of entries, a power of 2
+ * @head: claims so far, the next record's index
+ */
+struct iwl_trace_ring {
+  struct iwl_trace_entry *entries;
+  uint32_t size;
+  uint32_t head;
+};
+
+/* record @msg, a string of up to IWL_TRACE_MSG_LEN bytes; false if dropped */
+static inline bool iwl_trace_ring_write(struct iwl_trace_ring *ring,
+                                        uint64_t time, const char *msg) {
+  uint32_t idx = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+  struct iwl_trace_entry *e = &ring->entries[idx & (ring->size - 1)];
+  uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+  uint64_t w;
+
+  /* the odd sequence must be seen before any of the new record */
+  if ((seq & 1) ||
+      !__atomic_compare_exchange_n(&e->seq, &seq, 2 * idx + 1, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    return false;
+
+  __atomic_store_n(&e->time, time, __ATOMIC_RELAXED);
+  for (int i = 0; i < IWL_TRACE_MSG_LEN / 8; i++) {
+    __builtin_memcpy(&w, msg + 8 * i, 8);
+    __atomic_store_n(&e->msg[i], w, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&e->seq, 2 * idx + 2, __ATOMIC_RELEASE);
+  return true;
+}
+
+/* the records that may still be in the ring are [*first, *head) */
+static inline void iwl_trace_ring_span(struct iwl_trace_ring *ring,
+                                       uint32_t *first, uint32_t *head) {
+  *head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  *first = *head > ring->size ? *head - ring->size : 0;
+}
+
+/*
+ * iwl_trace_ring_read - copy record @idx out into @time and @msg, a
+ * buffer of IWL_TRACE_MSG_LEN bytes
+ *
+ * Returns false if the record was overwritten or is still being written.
+ */
+static inline bool iwl_trace_ring_read(struct iwl_trace_ring *ring,
+                                       uint32_t idx, uint64_t *time,
+                                       char *msg) {
+  struct iwl_trace_entry *e = &ring->entries[idx & (ring->size - 1)];
+  uint64_t w;
+
+  if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != 2 * idx + 2) return false;
+  *time = __atomic_load_n(&e->time, __ATOMIC_RELAXED);
+  for (int i = 0; i < IWL_TRACE_MSG_LEN / 8; i++) {
+    w = __atomic_load_n(&e->msg[i], __ATOMIC_RELAXED);
+    __builtin_memcpy(msg + 8 * i, &w, 8);
+  }
+  /* the copy must be done before the sequence is checked again */
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != 2 * idx + 2) return false;
+
+  msg[IWL_TRACE_MSG_LEN - 1] = '\0';
+  return true;
+}
+
+#endif  // APPLEINTELWIFIADAPTER_IWLTRACERING_H_
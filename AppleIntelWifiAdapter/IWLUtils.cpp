@@ -62,6 +62,21 @@ int IWLMvmDriver::sendCmdPduStatus(u32 id, u16 len, const void *data,
 
   return sendCmdStatus(&cmd, status);
 }
+
+int IWLMvmDriver::sendCmdPduBatch(struct iwl_hcmd_batch *batch, u32 id,
+                                  u16 len, const void *data, u32 status_mask,
+                                  u32 status_ok) {
+  struct iwl_host_cmd cmd = {
+    .id = id,
+    .len = {
+      len,
+    },
+    .data = {
+      data,
+  }};
+
+  return iwl_hcmd_batch_send(batch, &cmd, status_mask, status_ok);
+}
 // clang-format on
 
 int IWLMvmDriver::sendCmdStatus(struct iwl_host_cmd *cmd, u32 *status) {
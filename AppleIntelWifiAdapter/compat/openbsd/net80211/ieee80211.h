@@ -450,6 +450,8 @@ enum {
 	/* 222-255 reserved */
 };
 
+#include <net80211/ieee80211_elem.h>
+
 /*
  * Action field category values (see 802.11-2012 8.4.1.11 Table 8-38).
  */
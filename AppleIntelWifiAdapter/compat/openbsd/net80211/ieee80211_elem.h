@@ -0,0 +1,106 @@
+/*-
+ * Copyright (c) 2020 IntelWifi for MacOS authors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _NET80211_IEEE80211_ELEM_H_
+#define _NET80211_IEEE80211_ELEM_H_
+
+/*
+ * Index of the information elements of a frame.  This only needs
+ * <sys/types.h>, so that it builds on a host as well (see tests/);
+ * ieee80211.h includes it after the element IDs.
+ */
+
+#include <sys/types.h>
+
+#ifndef _NET80211_IEEE80211_H_
+#define IEEE80211_ELEMID_VENDOR	221
+#endif
+
+/*
+ * Built in one pass by ieee80211_elem_index(): where the last element
+ * of each ID is, as the per-element loops it replaces would have kept,
+ * and where the first vendor element is; those are told apart by their
+ * OUI, so there can be any number of them and
+ * ieee80211_elem_next_vendor() walks them all.  At over 500 bytes the
+ * index is no stack variable: callers keep one around and reuse it.
+ */
+struct ieee80211_elem_index {
+	const u_int8_t	*base;
+	u_int8_t	present[256 / 8];	/* bit per element ID */
+	u_int16_t	off[256];	/* valid if the ID's bit is set */
+	u_int16_t	vendor;		/* first vendor element */
+	u_int16_t	end;		/* past the last whole element */
+};
+
+/*
+ * Walk the information elements in [frm, efrm) once and index them.
+ * Returns 0, or 1 if the last element runs past the end; the elements
+ * before it are indexed all the same.
+ */
+static __inline int
+ieee80211_elem_index(const u_int8_t *frm, const u_int8_t *efrm,
+    struct ieee80211_elem_index *idx)
+{
+	const u_int8_t *base = frm;
+	u_int8_t id;
+
+	idx->base = base;
+	idx->end = 0;
+	__builtin_memset(idx->present, 0, sizeof(idx->present));
+
+	while (frm + 2 <= efrm) {
+		if (frm + 2 + frm[1] > efrm)
+			return 1;
+		id = frm[0];
+		if (id == IEEE80211_ELEMID_VENDOR &&
+		    !(idx->present[id >> 3] & (1 << (id & 7))))
+			idx->vendor = frm - base;
+		idx->present[id >> 3] |= 1 << (id & 7);
+		idx->off[id] = frm - base;
+		frm += 2 + frm[1];
+		idx->end = frm - base;
+	}
+	return 0;
+}
+
+static __inline const u_int8_t *
+ieee80211_elem_find(const struct ieee80211_elem_index *idx, u_int8_t id)
+{
+	if (!(idx->present[id >> 3] & (1 << (id & 7))))
+		return NULL;
+	return idx->base + idx->off[id];
+}
+
+/* the vendor element after prev, or the first one if prev is NULL */
+static __inline const u_int8_t *
+ieee80211_elem_next_vendor(const struct ieee80211_elem_index *idx,
+    const u_int8_t *prev)
+{
+	const u_int8_t *frm, *efrm = idx->base + idx->end;
+
+	if (prev == NULL) {
+		if (ieee80211_elem_find(idx, IEEE80211_ELEMID_VENDOR) == NULL)
+			return NULL;
+		return idx->base + idx->vendor;
+	}
+	for (frm = prev + 2 + prev[1]; frm < efrm; frm += 2 + frm[1]) {
+		if (frm[0] == IEEE80211_ELEMID_VENDOR)
+			return frm;
+	}
+	return NULL;
+}
+
+#endif /* _NET80211_IEEE80211_ELEM_H_ */
@@ -1374,6 +1374,7 @@ ieee80211_recv_probe_resp(struct ieee80211com *ic, mbuf_t m,
 	const u_int8_t *rsnie, *wpaie, *htcaps, *htop;
 	u_int16_t capinfo, bintval;
 	u_int8_t chan, bchan, erp, dtim_count, dtim_period;
+	struct ieee80211_elem_index *elems = &ic->ic_elems;
 	int is_new;
 
 	/*
@@ -1411,74 +1412,50 @@ ieee80211_recv_probe_resp(struct ieee80211com *ic, mbuf_t m,
 	bintval = LE_READ_2(frm); frm += 2;
 	capinfo = LE_READ_2(frm); frm += 2;
 
-	ssid = rates = xrates = edcaie = wmmie = rsnie = wpaie = NULL;
-	htcaps = htop = NULL;
+	wmmie = wpaie = NULL;
 	bchan = ieee80211_chan2ieee(ic, ic->ic_bss->ni_chan);
 	chan = bchan;
 	erp = 0;
 	dtim_count = dtim_period = 0;
-	while (frm + 2 <= efrm) {
-		if (frm + 2 + frm[1] > efrm) {
+	if (ieee80211_elem_index(frm, efrm, elems))
+		ic->ic_stats.is_rx_elem_toosmall++;
+	ssid = ieee80211_elem_find(elems, IEEE80211_ELEMID_SSID);
+	rates = ieee80211_elem_find(elems, IEEE80211_ELEMID_RATES);
+	xrates = ieee80211_elem_find(elems, IEEE80211_ELEMID_XRATES);
+	rsnie = ieee80211_elem_find(elems, IEEE80211_ELEMID_RSN);
+	edcaie = ieee80211_elem_find(elems, IEEE80211_ELEMID_EDCAPARMS);
+	htcaps = ieee80211_elem_find(elems, IEEE80211_ELEMID_HTCAPS);
+	htop = ieee80211_elem_find(elems, IEEE80211_ELEMID_HTOP);
+	if ((frm = ieee80211_elem_find(elems, IEEE80211_ELEMID_DSPARMS))) {
+		if (frm[1] < 1)
 			ic->ic_stats.is_rx_elem_toosmall++;
-			break;
-		}
-		switch (frm[0]) {
-		case IEEE80211_ELEMID_SSID:
-			ssid = frm;
-			break;
-		case IEEE80211_ELEMID_RATES:
-			rates = frm;
-			break;
-		case IEEE80211_ELEMID_DSPARMS:
-			if (frm[1] < 1) {
-				ic->ic_stats.is_rx_elem_toosmall++;
-				break;
-			}
+		else
 			chan = frm[2];
-			break;
-		case IEEE80211_ELEMID_XRATES:
-			xrates = frm;
-			break;
-		case IEEE80211_ELEMID_ERP:
-			if (frm[1] < 1) {
-				ic->ic_stats.is_rx_elem_toosmall++;
-				break;
-			}
+	}
+	if ((frm = ieee80211_elem_find(elems, IEEE80211_ELEMID_ERP))) {
+		if (frm[1] < 1)
+			ic->ic_stats.is_rx_elem_toosmall++;
+		else
 			erp = frm[2];
-			break;
-		case IEEE80211_ELEMID_RSN:
-			rsnie = frm;
-			break;
-		case IEEE80211_ELEMID_EDCAPARMS:
-			edcaie = frm;
-			break;
-		case IEEE80211_ELEMID_HTCAPS:
-			htcaps = frm;
-			break;
-		case IEEE80211_ELEMID_HTOP:
-			htop = frm;
-			break;
-		case IEEE80211_ELEMID_TIM:
-			if (frm[1] > 3) {
-				dtim_count = frm[2];
-				dtim_period = frm[3];
-			}
-			break;
-		case IEEE80211_ELEMID_VENDOR:
-			if (frm[1] < 4) {
-				ic->ic_stats.is_rx_elem_toosmall++;
-				break;
-			}
-			if (memcmp(frm + 2, MICROSOFT_OUI, 3) == 0) {
-				if (frm[5] == 1)
-					wpaie = frm;
-				else if (frm[1] >= 5 &&
-				    frm[5] == 2 && frm[6] == 1)
-					wmmie = frm;
-			}
-			break;
+	}
+	if ((frm = ieee80211_elem_find(elems, IEEE80211_ELEMID_TIM)) &&
+	    frm[1] > 3) {
+		dtim_count = frm[2];
+		dtim_period = frm[3];
+	}
+	for (frm = ieee80211_elem_next_vendor(elems, NULL); frm != NULL;
+	    frm = ieee80211_elem_next_vendor(elems, frm)) {
+		if (frm[1] < 4) {
+			ic->ic_stats.is_rx_elem_toosmall++;
+			continue;
+		}
+		if (memcmp(frm + 2, MICROSOFT_OUI, 3) == 0) {
+			if (frm[5] == 1)
+				wpaie = frm;
+			else if (frm[1] >= 5 &&
+			    frm[5] == 2 && frm[6] == 1)
+				wmmie = frm;
 		}
-		frm += 2 + frm[1];
 	}
 	/* supported rates element is mandatory */
 	if (rates == NULL || rates[1] > IEEE80211_RATE_MAXSIZE) {
@@ -451,6 +451,7 @@ struct ieee80211com {
 	int			ic_igtk_kid;	/* IGTK key index */
 	u_int32_t		ic_iv;		/* initial vector for wep */
 	struct ieee80211_stats	ic_stats;	/* statistics */
+	struct ieee80211_elem_index ic_elems;	/* for beacon parsing */
 	struct timeval		ic_last_merge_print;	/* for rate-limiting
 							 * IBSS merge print-outs
 							 */
@@ -116,6 +116,11 @@ struct fw_desc {
     const void *data;    /* vmalloc'ed data */
     u32 len;        /* size in bytes */
     u32 offset;        /* offset in the device */
+    /* set when data itself is a 32-bit DMA block, loaded in place */
+    struct iwl_dma_ptr *buf;
+    /* else a DMA-ready copy in FH_MEM_TB_MAX_LENGTH chunks, see transport */
+    struct iwl_dma_ptr **dma;
+    int num_dma;
 };
 
 struct fw_img {
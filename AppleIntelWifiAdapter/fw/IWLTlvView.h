@@ -0,0 +1,145 @@
+//
+//  IWLTlvView.h
+//  AppleIntelWifiAdapter
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+#ifndef APPLEINTELWIFIADAPTER_FW_IWLTLVVIEW_H_
+#define APPLEINTELWIFIADAPTER_FW_IWLTLVVIEW_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * TLV ucode file views
+ *
+ * The walk over a TLV style ucode file, without anything from IOKit or
+ * the compat headers so that it builds on a host as well (see tests/).
+ * Nothing is copied: the file header and every TLV come back as views,
+ * a length and a pointer into the file, which has to outlive them. The
+ * only copy of a section is the one into DMA memory when it is loaded.
+ *
+ * The layouts are those of struct iwl_tlv_ucode_header, struct
+ * iwl_ucode_tlv and struct fw_sec_parsing in FWFile.h and FWImg.h, all
+ * little endian; the parser checks the sizes against them.
+ */
+#define IWL_TLV_VIEW_MAGIC 0x0a4c5749
+#define IWL_TLV_VIEW_HDR_LEN 88
+#define IWL_TLV_VIEW_NAME_LEN 64
+#define IWL_TLV_VIEW_TLV_LEN 8
+
+enum iwl_tlv_view_err {
+    IWL_TLV_VIEW_OK,
+    IWL_TLV_VIEW_ERR_SHORT,     /* smaller than the file header */
+    IWL_TLV_VIEW_ERR_MAGIC,     /* not a TLV file */
+    IWL_TLV_VIEW_ERR_LEN,       /* a TLV runs past the end of the file */
+    IWL_TLV_VIEW_ERR_TRAILING,  /* bytes left that make no TLV header */
+};
+
+/* the file header, human_readable is not NUL terminated */
+struct iwl_tlv_file_view {
+    const uint8_t *human_readable;
+    uint32_t ver;
+    uint32_t build;
+};
+
+struct iwl_tlv_view {
+    uint32_t type;
+    uint32_t len;
+    const uint8_t *data;
+};
+
+/* where the walk is, err is set once it stopped on a bad file */
+struct iwl_tlv_iter {
+    const uint8_t *pos;
+    size_t left;
+    enum iwl_tlv_view_err err;
+};
+
+static inline uint32_t iwl_tlv_get_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+        (uint32_t)p[3] << 24;
+}
+
+/*
+ * iwl_tlv_file_open - check the file header and start the walk
+ *
+ * Returns IWL_TLV_VIEW_OK and fills @hdr and @it, or the reason the file
+ * is no TLV file.
+ */
+static inline enum iwl_tlv_view_err
+iwl_tlv_file_open(const void *raw, size_t len, struct iwl_tlv_file_view *hdr,
+                  struct iwl_tlv_iter *it)
+{
+    const uint8_t *p = (const uint8_t *)raw;
+
+    if (len < IWL_TLV_VIEW_HDR_LEN)
+        return IWL_TLV_VIEW_ERR_SHORT;
+    if (iwl_tlv_get_le32(p + 4) != IWL_TLV_VIEW_MAGIC)
+        return IWL_TLV_VIEW_ERR_MAGIC;
+
+    hdr->human_readable = p + 8;
+    hdr->ver = iwl_tlv_get_le32(p + 8 + IWL_TLV_VIEW_NAME_LEN);
+    hdr->build = iwl_tlv_get_le32(p + 12 + IWL_TLV_VIEW_NAME_LEN);
+
+    it->pos = p + IWL_TLV_VIEW_HDR_LEN;
+    it->left = len - IWL_TLV_VIEW_HDR_LEN;
+    it->err = IWL_TLV_VIEW_OK;
+    return IWL_TLV_VIEW_OK;
+}
+
+/*
+ * iwl_tlv_next - the next TLV of the file
+ *
+ * Returns 1 with @tlv filled in, 0 at the end of the file or on a TLV
+ * that does not fit, it->err tells which. TLVs are padded to 4 bytes,
+ * the last one may lack its padding.
+ */
+static inline int iwl_tlv_next(struct iwl_tlv_iter *it,
+                               struct iwl_tlv_view *tlv)
+{
+    size_t padded;
+
+    if (it->err != IWL_TLV_VIEW_OK)
+        return 0;
+    if (it->left < IWL_TLV_VIEW_TLV_LEN) {
+        if (it->left)
+            it->err = IWL_TLV_VIEW_ERR_TRAILING;
+        return 0;
+    }
+
+    tlv->type = iwl_tlv_get_le32(it->pos);
+    tlv->len = iwl_tlv_get_le32(it->pos + 4);
+    tlv->data = it->pos + IWL_TLV_VIEW_TLV_LEN;
+    if (it->left - IWL_TLV_VIEW_TLV_LEN < tlv->len) {
+        it->err = IWL_TLV_VIEW_ERR_LEN;
+        return 0;
+    }
+
+    padded = IWL_TLV_VIEW_TLV_LEN + (((size_t)tlv->len + 3) & ~(size_t)3);
+    if (padded > it->left)
+        padded = it->left;
+    it->pos += padded;
+    it->left -= padded;
+    return 1;
+}
+
+/*
+ * iwl_tlv_sec_view - split a section TLV (SEC_RT and friends) into its
+ * device offset and the code, 0 if it is too short to hold the offset
+ */
+static inline int iwl_tlv_sec_view(const uint8_t *data, uint32_t len,
+                                   uint32_t *offset, const uint8_t **code,
+                                   uint32_t *size)
+{
+    if (len < 4)
+        return 0;
+    *offset = iwl_tlv_get_le32(data);
+    *code = data + 4;
+    *size = len - 4;
+    return 1;
+}
+
+#endif  // APPLEINTELWIFIADAPTER_FW_IWLTLVVIEW_H_
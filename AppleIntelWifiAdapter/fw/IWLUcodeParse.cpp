@@ -8,6 +8,7 @@
 
 #include "IWLUcodeParse.hpp"
 #include "FWFile.h"
+#include "IWLTlvView.h"
 #include <linux/types.h>
 
 IWLUcodeParse::IWLUcodeParse(IWLDevice *drv)
@@ -133,9 +134,9 @@ bool IWLUcodeParse::parseV1V2Firmware(const void *raw, size_t len, struct iwl_fw
 
 bool IWLUcodeParse::parseTLVFirmware(const void *raw, size_t len, struct iwl_fw *fw, struct iwl_firmware_pieces *pieces)
 {
-    struct iwl_tlv_ucode_header *ucode = (struct iwl_tlv_ucode_header *)raw;
-    struct iwl_ucode_tlv *tlv;
-    const u8 *data;
+    struct iwl_tlv_file_view hdr;
+    struct iwl_tlv_iter it;
+    struct iwl_tlv_view tlv;
     u32 tlv_len;
     u32 usniffer_img;
     enum iwl_ucode_tlv_type tlv_type;
@@ -147,21 +148,27 @@ bool IWLUcodeParse::parseTLVFirmware(const void *raw, size_t len, struct iwl_fw
     iwl_ucode_capabilities *capa = &fw->ucode_capa;
     
     
-    if (len < sizeof(*ucode)) {
-        IWL_ERR(0, "uCode has invalid length: %zd\n", len);
-        return false;
-    }
+    static_assert(sizeof(struct iwl_tlv_ucode_header) == IWL_TLV_VIEW_HDR_LEN,
+                  "TLV file header layout");
+    static_assert(sizeof(struct iwl_ucode_tlv) == IWL_TLV_VIEW_TLV_LEN,
+                  "TLV header layout");
     
-    if (ucode->magic != cpu_to_le32(IWL_TLV_UCODE_MAGIC)) {
-        IWL_ERR(0, "invalid uCode magic: 0X%x\n",
-                le32_to_cpu(ucode->magic));
-        return false;
+    switch (iwl_tlv_file_open(raw, len, &hdr, &it)) {
+        case IWL_TLV_VIEW_OK:
+            break;
+        case IWL_TLV_VIEW_ERR_SHORT:
+            IWL_ERR(0, "uCode has invalid length: %zd\n", len);
+            return false;
+        default:
+            IWL_ERR(0, "invalid uCode magic: 0X%x\n",
+                    iwl_tlv_get_le32((const u8 *)raw + 4));
+            return false;
     }
     
-    fw->ucode_ver = le32_to_cpu(ucode->ver);
-    memcpy(fw->human_readable, ucode->human_readable,
+    fw->ucode_ver = hdr.ver;
+    memcpy(fw->human_readable, hdr.human_readable,
            sizeof(fw->human_readable));
-    build = le32_to_cpu(ucode->build);
+    build = hdr.build;
     
     if (build)
         snprintf(buildstr, sizeof(buildstr), " build %u", build);
@@ -177,25 +184,11 @@ bool IWLUcodeParse::parseTLVFirmware(const void *raw, size_t len, struct iwl_fw
              IWL_UCODE_SERIAL(fw->ucode_ver),
              buildstr, reducedFWName(drv->name));
     
-    data = ucode->data;
-    
-    len -= sizeof(*ucode);
-    
-    while (len >= sizeof(*tlv)) {
-        len -= sizeof(*tlv);
-        tlv = (iwl_ucode_tlv *)data;
-        
-        tlv_len = le32_to_cpu(tlv->length);
-        tlv_type = (enum iwl_ucode_tlv_type)le32_to_cpu(tlv->type);
-        tlv_data = tlv->data;
-        
-        if (len < tlv_len) {
-            IWL_ERR(0, "invalid TLV len: %zd/%u\n",
-                    len, tlv_len);
-            return false;
-        }
-        len -= _ALIGN(tlv_len, 4);
-        data += sizeof(*tlv) + _ALIGN(tlv_len, 4);
+    /* every TLV is a view into raw, sections are copied only to DMA */
+    while (iwl_tlv_next(&it, &tlv)) {
+        tlv_len = tlv.len;
+        tlv_type = (enum iwl_ucode_tlv_type)tlv.type;
+        tlv_data = tlv.data;
         
         switch (tlv_type) {
             case IWL_UCODE_TLV_INST:
@@ -754,8 +747,13 @@ bool IWLUcodeParse::parseTLVFirmware(const void *raw, size_t len, struct iwl_fw
         return false;
     }
     
-    if (len) {
-        IWL_ERR(0, "invalid TLV after parsing: %zd\n", len);
+    if (it.err == IWL_TLV_VIEW_ERR_LEN) {
+        IWL_ERR(0, "invalid TLV len: %zd/%u\n",
+                it.left - IWL_TLV_VIEW_TLV_LEN, tlv.len);
+        return false;
+    }
+    if (it.err) {
+        IWL_ERR(0, "invalid TLV after parsing: %zd\n", it.left);
         goto tlv_error;
     }
     
@@ -787,8 +785,12 @@ void IWLUcodeParse::alloccSecData(struct iwl_firmware_pieces *pieces, enum iwl_u
     if (!sec_memory)
         return;
     
-    memcpy((void *)sec_memory, (void *)img->sec, sizeof(*img->sec) * sec);
-    IOFree((void *)img->sec, sizeof(*img->sec) * sec);
+    bzero(sec_memory, alloc_size);
+    if (img->sec) {
+        memcpy((void *)sec_memory, (void *)img->sec,
+               sizeof(*img->sec) * img->sec_counter);
+        IOFree((void *)img->sec, sizeof(*img->sec) * img->sec_counter);
+    }
     
     img->sec = sec_memory;
     img->sec_counter = size;
@@ -824,12 +826,15 @@ int IWLUcodeParse::storeUcodeSec(struct iwl_firmware_pieces *pieces, const void
 {
     struct fw_img_parsing *img;
     struct fw_sec *sec;
-    struct fw_sec_parsing *sec_parse;
+    const u8 *code;
+    u32 offset, code_size;
     size_t alloc_size;
     if (WARN_ON(!pieces || !data || type >= IWL_UCODE_TYPE_MAX))
         return -1;
     
-    sec_parse = (struct fw_sec_parsing *)data;
+    if (size < 0 ||
+        !iwl_tlv_sec_view((const u8 *)data, size, &offset, &code, &code_size))
+        return -EINVAL;
     
     img = &pieces->img[type];
     
@@ -847,9 +852,9 @@ int IWLUcodeParse::storeUcodeSec(struct iwl_firmware_pieces *pieces, const void
     
     sec = &img->sec[img->sec_counter];
     
-    sec->offset = le32_to_cpu(sec_parse->offset);
-    sec->data = sec_parse->data;
-    sec->size = size - sizeof(sec_parse->offset);
+    sec->offset = offset;
+    sec->data = code;
+    sec->size = code_size;
     
     ++img->sec_counter;
     return 0;
@@ -966,13 +971,25 @@ int IWLUcodeParse::allocFWDesc(struct fw_desc *desc, struct fw_sec *sec)
     void *data;
     
     desc->data = NULL;
+    desc->buf = NULL;
     
     if (!sec || !sec->size)
         return -EINVAL;
     
-    data = IOMalloc(sec->size);
-    if (!data)
-        return -ENOMEM;
+    /*
+     * sec->data still points into the firmware file, this is the only
+     * copy. Make it straight into memory the device can DMA from when
+     * that much is available in one block, so that loading it needs no
+     * other copy.
+     */
+    desc->buf = allocate_dma_buf32(sec->size);
+    if (desc->buf) {
+        data = desc->buf->addr;
+    } else {
+        data = IOMalloc(sec->size);
+        if (!data)
+            return -ENOMEM;
+    }
     
     desc->len = sec->size;
     desc->offset = sec->offset;
@@ -982,9 +999,30 @@ int IWLUcodeParse::allocFWDesc(struct fw_desc *desc, struct fw_sec *sec)
     return 0;
 }
 
+/*
+ * The fw_sec entries are only views into the firmware file, which is gone
+ * once the resource request returns.
+ */
+void IWLUcodeParse::freeSecViews(struct iwl_firmware_pieces *pieces)
+{
+    for (int i = 0; i < IWL_UCODE_TYPE_MAX; i++) {
+        struct fw_img_parsing *img = &pieces->img[i];
+        
+        if (img->sec)
+            IOFree((void *)img->sec, sizeof(*img->sec) * img->sec_counter);
+        img->sec = NULL;
+        img->sec_counter = 0;
+    }
+}
+
 void IWLUcodeParse::freeFWDesc(struct fw_desc *desc)
 {
-    IOFree((void *)desc->data, desc->len);
+    if (desc->buf) {
+        free_dma_buf(desc->buf);
+        desc->buf = NULL;
+    } else if (desc->data) {
+        IOFree((void *)desc->data, desc->len);
+    }
     desc->data = NULL;
     desc->len = 0;
 }
@@ -994,7 +1032,9 @@ void IWLUcodeParse::freeFWImg(struct fw_img *img)
     int i;
     for (i = 0; i < img->num_sec; i++)
         freeFWDesc(&img->sec[i]);
-    IOFree(img->sec, sizeof(fw_desc));
+    IOFree(img->sec, sizeof(*img->sec) * img->num_sec);
+    img->sec = NULL;
+    img->num_sec = 0;
 }
 
 void IWLUcodeParse::deAllocUcode()
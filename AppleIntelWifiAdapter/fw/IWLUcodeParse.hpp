@@ -60,6 +60,8 @@ public:
     
     int allocFWDesc(struct fw_desc *desc, struct fw_sec *sec);
     
+    void freeSecViews(struct iwl_firmware_pieces *pieces);
+    
     void freeFWDesc(struct fw_desc *desc);
     
     void freeFWImg(struct fw_img *img);
@@ -14,6 +14,7 @@ void iwl_notification_wait_init(struct iwl_notif_wait_data *notif_wait)
     notif_wait->notif_wait_lock = IOSimpleLockAlloc();
     STAILQ_INIT(&notif_wait->notif_waits);
     notif_wait->notif_waitq = IOLockAlloc();
+    memset((void *)notif_wait->n_waiters, 0, sizeof(notif_wait->n_waiters));
 }
 
 bool iwl_notification_wait(struct iwl_notif_wait_data *notif_wait, struct iwl_rx_packet *pkt)
@@ -95,13 +96,20 @@ iwl_init_notification_wait(struct iwl_notif_wait_data *notif_wait, struct iwl_no
     //IOSimpleLockLock(notif_wait->notif_wait_lock);
     STAILQ_INSERT_HEAD(&notif_wait->notif_waits, wait_entry, list);
     //IOSimpleLockUnlock(notif_wait->notif_wait_lock);
+
+    /* the entry is on the list before the Rx path may look for it */
+    for (int i = 0; i < n_cmds; i++)
+        OSIncrementAtomic16(&notif_wait->n_waiters[iwl_cmd_opcode(cmds[i])]);
 }
 
 void iwl_remove_notification(struct iwl_notif_wait_data *notif_wait,
                  struct iwl_notification_wait *wait_entry)
 {
+    for (int i = 0; i < wait_entry->n_cmds; i++)
+        OSDecrementAtomic16(&notif_wait->n_waiters[iwl_cmd_opcode(wait_entry->cmds[i])]);
+
     //IOSimpleLockLock(notif_wait->notif_wait_lock);
-    STAILQ_REMOVE_HEAD(&notif_wait->notif_waits, list);
+    STAILQ_REMOVE(&notif_wait->notif_waits, wait_entry, iwl_notification_wait, list);
     //IOSimpleLockUnlock(notif_wait->notif_wait_lock);
 }
 
@@ -58,6 +58,8 @@ struct iwl_notif_wait_data {
     STAILQ_HEAD(, iwl_notification_wait) notif_waits;
     IOSimpleLock *notif_wait_lock;
     IOLock *notif_waitq;
+    /* number of waiters per opcode, whatever the group */
+    volatile SInt16 n_waiters[256];
 };
 
 /* caller functions */
@@ -75,10 +77,24 @@ iwl_notification_notify(struct iwl_notif_wait_data *notif_data)
     IOLockUnlock(notif_data->notif_waitq);
 }
 
+/*
+ * Cheap filter for the Rx path: only walk the waiters when somebody waits
+ * for this opcode at all.
+ */
+static inline bool
+iwl_notification_has_waiters(struct iwl_notif_wait_data *notif_data,
+                 struct iwl_rx_packet *pkt)
+{
+    return notif_data->n_waiters[pkt->hdr.cmd] != 0;
+}
+
 static inline void
 iwl_notification_wait_notify(struct iwl_notif_wait_data *notif_data,
                  struct iwl_rx_packet *pkt)
 {
+    if (!iwl_notification_has_waiters(notif_data, pkt))
+        return;
+
     if (iwl_notification_wait(notif_data, pkt)) {
         iwl_notification_notify(notif_data);
     }
@@ -0,0 +1,84 @@
+//
+//  IWLAmsdu.h
+//  AppleIntelWifiAdapter
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+#ifndef APPLEINTELWIFIADAPTER_MVM_IWLAMSDU_H_
+#define APPLEINTELWIFIADAPTER_MVM_IWLAMSDU_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Software A-MSDU
+ *
+ * Consecutive frames of an AC to the same destination, each at most
+ * IWL_MVM_TX_AMSDU_MSDU_MAX bytes, go out as the subframes of one QoS data
+ * frame, up to IWL_MVM_TX_AMSDU_MAX_SUBFRAMES of them and the peer's
+ * maximum A-MSDU length. While the queue still has frames in flight a
+ * backlog that could take more subframes is held back for up to
+ * IWL_MVM_TX_AMSDU_HOLD_US; an idle queue never waits.
+ *
+ * The framing below works on plain buffers, the mbuf handling stays in
+ * IWLMvmTx.cpp, so it builds on a host as well (see tests/).
+ */
+#define IWL_MVM_TX_AMSDU_MSDU_MAX 512
+#define IWL_MVM_TX_AMSDU_MAX_SUBFRAMES 8
+#define IWL_MVM_TX_AMSDU_HOLD_US 200
+
+#define IWL_AMSDU_ETH_HLEN 14 /* DA, SA, EtherType */
+/* DA, SA, length of what follows, then LLC/SNAP and the EtherType */
+#define IWL_AMSDU_SUBFRAME_HLEN 22
+
+static const uint8_t iwl_mvm_tx_llc_snap[6] = {0xaa, 0xaa, 0x03,
+                                               0x00, 0x00, 0x00};
+
+/* the subframe of an Ethernet frame of @msdu_len bytes, unpadded */
+static inline uint32_t iwl_amsdu_subframe_len(uint32_t msdu_len) {
+  return msdu_len + IWL_AMSDU_SUBFRAME_HLEN - IWL_AMSDU_ETH_HLEN;
+}
+
+/* every subframe but the last is padded to 4 bytes */
+static inline uint32_t iwl_amsdu_pad(uint32_t sub_len) {
+  return (4 - (sub_len & 3)) & 3;
+}
+
+/*
+ * iwl_amsdu_add - whether an Ethernet frame of @msdu_len bytes still goes
+ * into an A-MSDU of @n subframes, @len bytes so far, and at most @max
+ * bytes in all. If it does, @len grows by its padded subframe.
+ */
+static inline bool iwl_amsdu_add(uint32_t *len, int n, size_t msdu_len,
+                                 uint32_t max) {
+  uint32_t sub_len;
+
+  if (n == IWL_MVM_TX_AMSDU_MAX_SUBFRAMES ||
+      msdu_len > IWL_MVM_TX_AMSDU_MSDU_MAX || msdu_len < IWL_AMSDU_ETH_HLEN)
+    return false;
+
+  sub_len = iwl_amsdu_subframe_len((uint32_t)msdu_len);
+  if (*len + sub_len > max) return false;
+  *len += sub_len + iwl_amsdu_pad(sub_len);
+  return true;
+}
+
+/*
+ * iwl_amsdu_subframe_hdr - the header of a subframe of @sub_len bytes
+ * made of the Ethernet frame with header @eh; it takes the place of @eh
+ * and the 8 bytes in front of it
+ */
+static inline void iwl_amsdu_subframe_hdr(uint8_t *hdr, const uint8_t *eh,
+                                          uint32_t sub_len) {
+  uint32_t len = sub_len - IWL_AMSDU_ETH_HLEN;
+
+  __builtin_memcpy(hdr, eh, 12);
+  hdr[12] = (uint8_t)(len >> 8);
+  hdr[13] = (uint8_t)len;
+  __builtin_memcpy(hdr + 14, iwl_mvm_tx_llc_snap, sizeof(iwl_mvm_tx_llc_snap));
+  __builtin_memcpy(hdr + 20, eh + 12, 2);
+}
+
+#endif  // APPLEINTELWIFIADAPTER_MVM_IWLAMSDU_H_
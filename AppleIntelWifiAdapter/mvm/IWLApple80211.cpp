@@ -14,7 +14,17 @@ bool IWL80211Device::init(IWLMvmDriver* drv) {
   fDrv = drv;
 
   scanCacheLock = IOLockAlloc();
-  scanCache = OSOrderedSet::withCapacity(50);
+  scanCache = OSOrderedSet::withCapacity(IWL_SCAN_CACHE_SIZE);
+  scanIndex.clear();
+  scanArena = NULL;
+  scanBacklogLock = IOSimpleLockAlloc();
+  scanBacklogHead = scanBacklogTail = 0;
+  scanPending = 0;
+  scanStreaming = false;
+  scanStreamPosted = 0;
+  scanResults = NULL;
+  scanResultCount = scanResultSize = 0;
+  streamedScan = NULL;
 
   iface = fDrv->controller->getNetworkInterface();
 
@@ -25,6 +35,16 @@ bool IWL80211Device::init(IWLMvmDriver* drv) {
 }
 
 bool IWL80211Device::release() {
+  releaseScanResults();
+  holdStreamedScan(NULL);
+
+  if (scanBacklogLock) {
+    for (; scanBacklogHead != scanBacklogTail; scanBacklogHead++)
+      mbuf_free(scanBacklog[scanBacklogHead & (IWL_SCAN_BACKLOG - 1)].m);
+    IOSimpleLockFree(scanBacklogLock);
+    scanBacklogLock = NULL;
+  }
+
   if (scanCacheLock) {
     IOLockFree(scanCacheLock);
     scanCacheLock = NULL;
@@ -35,9 +55,288 @@ bool IWL80211Device::release() {
     scanCache = NULL;
   }
 
+  if (scanArena) {
+    iwl_scan_arena_put(scanArena);
+    scanArena = NULL;
+  }
+
   return true;
 }
 
+/*
+ * Beacon backlog
+ *
+ * The Rx path cannot wait for the scan cache while getSCAN_RESULT or an
+ * association walks it, so a beacon that finds the cache locked is parked
+ * here with a slice of its Rx packet, and whoever holds the lock feeds
+ * the backlog into the cache before letting go (and right after taking
+ * it, for beacons parked in between). A beacon parked just as the holder
+ * lets go would wait for the next one, so the holder looks at the backlog
+ * again after unlocking and the Rx path tries the lock again after
+ * parking: one of the two sees the other and drains it. Only a full
+ * backlog drops beacons.
+ */
+void IWL80211Device::deferBeacon(mbuf_t m, uint32_t wh_offset, uint32_t len,
+                                 iwl_rx_phy_info* phy_info, int rssi,
+                                 int noise) {
+  struct iwl_scan_backlog_ent* ent;
+
+  if (!m) return;
+
+  IOSimpleLockLock(scanBacklogLock);
+  if (scanBacklogTail - scanBacklogHead == IWL_SCAN_BACKLOG) {
+    IOSimpleLockUnlock(scanBacklogLock);
+    IWL_DEBUG_SCAN(0, "Dropped beacon, scan backlog is full\n");
+    mbuf_free(m);
+    return;
+  }
+  ent = &scanBacklog[scanBacklogTail & (IWL_SCAN_BACKLOG - 1)];
+  ent->m = m;
+  ent->wh_offset = wh_offset;
+  ent->len = len;
+  ent->rssi = rssi;
+  ent->noise = noise;
+  memcpy(&ent->phy_info, phy_info, sizeof(ent->phy_info));
+  scanBacklogTail++;
+  IOSimpleLockUnlock(scanBacklogLock);
+
+  OSMemoryBarrier();
+  if (lockScanCache()) unlockScanCache();
+}
+
+void IWL80211Device::drainScanBacklog() {
+  struct iwl_scan_backlog_ent ent;
+
+  for (;;) {
+    IOSimpleLockLock(scanBacklogLock);
+    if (scanBacklogHead == scanBacklogTail) {
+      IOSimpleLockUnlock(scanBacklogLock);
+      return;
+    }
+    ent = scanBacklog[scanBacklogHead & (IWL_SCAN_BACKLOG - 1)];
+    scanBacklogHead++;
+    IOSimpleLockUnlock(scanBacklogLock);
+
+    iwl_rx_packet* packet = reinterpret_cast<iwl_rx_packet*>(mbuf_data(ent.m));
+    ingestBeacon(
+        reinterpret_cast<ieee80211_frame*>(packet->data + ent.wh_offset),
+        ent.len, &ent.phy_info, ent.rssi, ent.noise);
+    mbuf_free(ent.m);
+  }
+}
+
+/* a beacon for the cache, a new entry or an update of a known one */
+void IWL80211Device::ingestBeacon(const ieee80211_frame* wh, uint32_t len,
+                                  iwl_rx_phy_info* phy_info, int rssi,
+                                  int noise) {
+  // TODO: how do we identify same BSS but diff channel?
+  IWLCachedScan* scan = findScan(&wh->i_addr3[0], le16toh(phy_info->channel));
+
+  if (scan) {
+    IWL_DEBUG_SCAN(0, "Updating old entry\n");
+
+    scan->update(phy_info, rssi, noise);
+    touchScan(scan);
+    updatedScan(scan);
+    return;
+  }
+
+  IWL_DEBUG_SCAN(0, "Adding new object to scan cache\n");
+
+  scan = new IWLCachedScan();
+  if (!scan->init(&scanArena, &scanElems, wh, len, phy_info, rssi, noise)) {
+    scan->release();
+    IWL_ERR(0, "failed to init new cached scan object\n");
+    return;
+  }
+
+  // evicts the least recently seen entry when full
+  addScan(scan);
+  scan->release();
+}
+
+IWLCachedScan* IWL80211Device::findScan(const uint8_t* bssid,
+                                        uint32_t channel) {
+  return scanIndex.find(bssid, channel);
+}
+
+/*
+ * Adds a new entry to the cache, which takes its own reference. At
+ * capacity the least recently seen entry is evicted first.
+ */
+void IWL80211Device::addScan(IWLCachedScan* scan) {
+  if (scanCache->getCount() >= IWL_SCAN_CACHE_SIZE && scanIndex.lru_head)
+    removeScan(scanIndex.lru_head);
+
+  scanIndex.insert(scan);
+  scan->pending = true;
+  scan->reported_rssi = scan->rssi;
+  scanPending++;
+  scanCache->setObject(scan);
+}
+
+void IWL80211Device::removeScan(IWLCachedScan* scan) {
+  scanIndex.remove(scan);
+  if (scan->pending) scanPending--;
+  scanCache->removeObject(scan);
+}
+
+/* the entry was just seen again */
+void IWL80211Device::touchScan(IWLCachedScan* scan) {
+  scanIndex.touch(scan);
+}
+
+void IWL80211Device::flushScanCache() {
+  scanIndex.clear();
+  scanPending = 0;
+  scanCache->flushCollection();
+  // the next generation starts on a fresh chunk, the old ones go away
+  // with their last entry
+  if (scanArena) {
+    iwl_scan_arena_put(scanArena);
+    scanArena = NULL;
+  }
+}
+
+/*
+ * Streaming scan results
+ *
+ * With streaming on, the upper layer is told about results while the
+ * sweep is still running: SCAN_DONE is posted at most every
+ * IWL_SCAN_STREAM_INTERVAL_MS while entries are pending, and
+ * getSCAN_RESULT then only hands out the pending entries, the ones that
+ * are new or whose RSSI moved by IWL_SCAN_STREAM_RSSI_DELTA since they
+ * were last handed out. Entries not heard for IWL_SCAN_EXPIRE_MS are
+ * dropped from the cache. The SCAN_DONE at the end of the sweep still
+ * hands out the whole cache, so the upper layer ends up with the full
+ * picture either way.
+ */
+
+/* the entry was just updated from a beacon */
+void IWL80211Device::updatedScan(IWLCachedScan* scan) {
+  int32_t delta = (int32_t)scan->rssi - (int32_t)scan->reported_rssi;
+
+  if (scan->pending) return;
+  if (delta < IWL_SCAN_STREAM_RSSI_DELTA && delta > -IWL_SCAN_STREAM_RSSI_DELTA)
+    return;
+  scan->pending = true;
+  scanPending++;
+}
+
+void IWL80211Device::expireScans() {
+  uint64_t now = mach_absolute_time(), age;
+  IWLCachedScan* oldest;
+
+  while ((oldest = scanIndex.lru_head)) {
+    absolutetime_to_nanoseconds(now - oldest->absolute_time, &age);
+    if (age < IWL_SCAN_EXPIRE_MS * 1000000ULL) break;
+    removeScan(oldest);
+  }
+}
+
+/*
+ * Called for every beacon while scanning, returns true when SCAN_DONE
+ * should be posted for the pending entries.
+ */
+bool IWL80211Device::streamScan() {
+  uint64_t now, elapsed;
+
+  if (!scanStreaming) return false;
+
+  expireScans();
+  if (!scanPending) return false;
+
+  now = mach_absolute_time();
+  absolutetime_to_nanoseconds(now - scanStreamPosted, &elapsed);
+  if (elapsed < IWL_SCAN_STREAM_INTERVAL_MS * 1000000ULL) return false;
+  scanStreamPosted = now;
+  return true;
+}
+
+/* hands out the next pending entry, NULL once there are none */
+IWLCachedScan* IWL80211Device::nextPendingScan() {
+  IWLCachedScan* scan;
+
+  if (!scanPending) return NULL;
+  for (scan = scanIndex.lru_tail; scan; scan = scan->lru_prev) {
+    if (!scan->pending) continue;
+    scan->pending = false;
+    scan->reported_rssi = scan->rssi;
+    scanPending--;
+    return scan;
+  }
+  return NULL;
+}
+
+/*
+ * keeps @scan, the entry whose result was just handed out mid-sweep, alive
+ * until the next getSCAN_RESULT call, drops the previous one
+ */
+void IWL80211Device::holdStreamedScan(IWLCachedScan* scan) {
+  if (scan) scan->retain();
+  if (streamedScan) streamedScan->release();
+  streamedScan = scan;
+}
+
+/* the whole cache is about to be handed out */
+void IWL80211Device::clearPendingScans() {
+  IWLCachedScan* scan;
+
+  for (scan = scanIndex.lru_head; scan; scan = scan->lru_next) {
+    scan->pending = false;
+    scan->reported_rssi = scan->rssi;
+  }
+  scanPending = 0;
+}
+
+/*
+ * Builds the list getSCAN_RESULT walks with the scan index: the entries
+ * that pass the request's SSID and channel filters, strongest first. The
+ * channel filter becomes a bitmap so each entry costs one bit test.
+ */
+bool IWL80211Device::prepareScanResults(apple80211_scan_data* sd,
+                                        apple80211_scan_multiple_data* sdm) {
+  apple80211_channel* channels = sd ? sd->channels : sdm->channels;
+  uint32_t num_channels = sd ? sd->num_channels : sdm->num_channels;
+  struct iwl_scan_chan_map chan_map = {};
+  uint32_t count = scanCache->getCount();
+  IWLCachedScan* scan;
+
+  releaseScanResults();
+  if (!count) return true;
+
+  scanResults = reinterpret_cast<IWLCachedScan**>(
+      IOMalloc(count * sizeof(*scanResults)));
+  if (!scanResults) return false;
+  scanResultSize = count;
+
+  for (uint32_t i = 0; i < num_channels; i++)
+    iwl_scan_chan_map_set(&chan_map, channels[i].channel);
+
+  for (scan = scanIndex.lru_head; scan; scan = scan->lru_next) {
+    if (num_channels &&
+        !iwl_scan_chan_map_test(&chan_map, scan->channel.channel))
+      continue;
+    if (sd && sd->ssid_len && !scan->matchesSSID(sd->ssid, sd->ssid_len))
+      continue;
+    scan->retain();
+    iwl_scan_results_insert(scanResults, &scanResultCount, scan);
+  }
+  return true;
+}
+
+IWLCachedScan* IWL80211Device::nextScanResult() {
+  if (scan_index >= scanResultCount) return NULL;
+  return scanResults[scan_index++];
+}
+
+void IWL80211Device::releaseScanResults() {
+  for (uint32_t i = 0; i < scanResultCount; i++) scanResults[i]->release();
+  if (scanResults) IOFree(scanResults, scanResultSize * sizeof(*scanResults));
+  scanResults = NULL;
+  scanResultCount = scanResultSize = 0;
+}
+
 bool IWL80211Device::scanDone() {
   if (iface != NULL) {
     // fDrv->m_pDevice->interface->postMessage(APPLE80211_M_SCAN_DONE);
@@ -9,9 +9,31 @@
 #ifndef APPLEINTELWIFIADAPTER_MVM_IWLAPPLE80211_HPP_
 #define APPLEINTELWIFIADAPTER_MVM_IWLAPPLE80211_HPP_
 
+#include <libkern/OSAtomic.h>
+
 #include "IWLCachedScan.hpp"
 #include "IWLMvmDriver.hpp"
 #include "IWLNode.hpp"
+#include "IWLScanIndex.h"
+
+#define IWL_SCAN_CACHE_SIZE 50
+
+// streaming scan results, see IWL80211Device::streamScan()
+#define IWL_SCAN_STREAM_INTERVAL_MS 250
+#define IWL_SCAN_STREAM_RSSI_DELTA 5
+#define IWL_SCAN_EXPIRE_MS 60000
+
+// beacons held back while the scan cache is locked, see deferBeacon()
+#define IWL_SCAN_BACKLOG 32  // power of 2
+
+struct iwl_scan_backlog_ent {
+  mbuf_t m;  // slice of the Rx packet, holds its page until drained
+  uint32_t wh_offset;
+  uint32_t len;
+  int rssi;
+  int noise;
+  struct iwl_rx_phy_info phy_info;
+};
 
 class IWL80211Device {
  public:
@@ -134,18 +156,51 @@ class IWL80211Device {
     if (!IOLockTryLock(this->scanCacheLock)) return false;
 
     this->scanCache->retain();
+    if (this->scanBacklogTail != this->scanBacklogHead) drainScanBacklog();
     return true;
   }
   inline bool unlockScanCache() {
     if (this->scanCacheLock == NULL) return false;
 
-    IOLockUnlock(this->scanCacheLock);
+    do {
+      if (this->scanBacklogTail != this->scanBacklogHead) drainScanBacklog();
+      IOLockUnlock(this->scanCacheLock);
+      // a beacon parked since the drain is ours if the lock is still free,
+      // deferBeacon() does the same check the other way around
+      OSMemoryBarrier();
+    } while (this->scanBacklogTail != this->scanBacklogHead &&
+             IOLockTryLock(this->scanCacheLock));
 
     this->scanCache->release();
 
     return true;
   }
 
+  // never blocks, takes m; drains the backlog if the lock came free
+  void deferBeacon(mbuf_t m, uint32_t wh_offset, uint32_t len,
+                   iwl_rx_phy_info* phy_info, int rssi, int noise);
+
+  // scan cache index, all of these need the scan cache lock
+  void ingestBeacon(const ieee80211_frame* wh, uint32_t len,
+                    iwl_rx_phy_info* phy_info, int rssi, int noise);
+  IWLCachedScan* findScan(const uint8_t* bssid, uint32_t channel);
+  void addScan(IWLCachedScan* scan);
+  void touchScan(IWLCachedScan* scan);
+  void flushScanCache();
+  void updatedScan(IWLCachedScan* scan);
+  void expireScans();
+  bool streamScan();
+  IWLCachedScan* nextPendingScan();
+  void holdStreamedScan(IWLCachedScan* scan);
+  void clearPendingScans();
+  bool prepareScanResults(apple80211_scan_data* sd,
+                          apple80211_scan_multiple_data* sdm);
+  IWLCachedScan* nextScanResult();
+  void releaseScanResults();
+
+  inline bool getScanStreaming() { return this->scanStreaming; }
+  inline void setScanStreaming(bool on) { this->scanStreaming = on; }
+
   inline void resetScanIndex() { this->scan_index = 0; }
 
   inline uint32_t getScanIndex() { return this->scan_index; }
@@ -222,6 +277,8 @@ class IWL80211Device {
 
   inline IO80211Interface* getInterface() { return iface; }
 
+  inline IWLMvmDriver* getDriver() { return fDrv; }
+
   void inputFrame(mbuf_t m);
 
  private:
@@ -260,6 +317,32 @@ class IWL80211Device {
 
   OSOrderedSet* scanCache;
   IOLock* scanCacheLock;
+  // BSSID+channel hash over scanCache, and its entries from the least to
+  // the most recently seen for eviction
+  struct iwl_scan_index<IWLCachedScan> scanIndex;
+  struct iwl_scan_arena* scanArena;
+  struct ieee80211_elem_index scanElems;  // for ingestBeacon()
+  uint32_t scanPending;  // entries not handed out since they changed
+  bool scanStreaming;
+  uint64_t scanStreamPosted;  // absolute time of the last streamed SCAN_DONE
+  // beacons that came in while the cache was locked, drained by whoever
+  // holds the lock before it lets go
+  IOSimpleLock* scanBacklogLock;
+  struct iwl_scan_backlog_ent scanBacklog[IWL_SCAN_BACKLOG];
+  volatile uint32_t scanBacklogHead;
+  volatile uint32_t scanBacklogTail;
+
+  void removeScan(IWLCachedScan* scan);
+  void drainScanBacklog();
+
+  // the results getSCAN_RESULT hands out, filtered and sorted once per
+  // drain, with a reference on each
+  IWLCachedScan** scanResults;
+  uint32_t scanResultCount;
+  uint32_t scanResultSize;
+  // the entry last handed out mid-sweep, referenced so eviction or expiry
+  // cannot free its result under the upper layer
+  IWLCachedScan* streamedScan;
 
   apple80211_key* key;
   uint8_t rsn_ie[APPLE80211_MAX_RSN_IE_LEN];
@@ -28,6 +28,7 @@ bool IWLMvmDriver::init(IOPCIDevice *pciDevice) {
     return false;
   }
   this->fwLoadLock = IOLockAlloc();
+  bzero(&this->tx, sizeof(this->tx));
 
   /*
   if(pciDevice) {
@@ -57,8 +58,12 @@ bool IWLMvmDriver::init(IOPCIDevice *pciDevice) {
   return true;
 }
 
+bool free_paging(IWLMvmDriver *drv);
+
 void IWLMvmDriver::release() {
   ieee80211Release();
+  txFlush();
+  if (this->m_pDevice) free_paging(this);
   if (this->fwLoadLock) {
     IOLockFree(this->fwLoadLock);
     this->fwLoadLock = NULL;
@@ -275,6 +280,8 @@ bool IWLMvmDriver::start() {
     return false;
   }
   IWL_INFO(0, "HW Rev: %0x\n", m_pDevice->hw_rev);
+  /* the parsed image outlives restarts, there is nothing to reload */
+  if (m_pDevice->firmwareLoadToBuf) return true;
   snprintf(tag, sizeof(tag), "%d", m_pDevice->cfg->ucode_api_max);
   snprintf(firmware_name, sizeof(firmware_name), "%s%s.ucode",
            m_pDevice->cfg->fw_name_pre, tag);
@@ -338,6 +345,7 @@ void IWLMvmDriver::reqFWCallback(OSKextRequestTag requestTag, OSReturn result,
       break;
     }
   }
+  parser.freeSecViews(pieces);
 
   if (isAllocErr) {
     IOLockWakeup(that->fwLoadLock, that, true);
@@ -420,10 +428,11 @@ bool IWLMvmDriver::drvStart() {
       trans->rx_buf_size = IWL_AMSDU_4K;
       break;
     case IWL_AMSDU_8K:
-      trans->rx_buf_size = IWL_AMSDU_8K;
-      break;
     case IWL_AMSDU_12K:
-      trans->rx_buf_size = IWL_AMSDU_12K;
+      /* Rx pages are single mbuf clusters, see iwl_pcie_rx_page_bytes() */
+      IWL_WARN(0, "amsdu_size %d needs RBs larger than a page, using 4K\n",
+               m_pDevice->iwlwifi_mod_params.amsdu_size);
+      trans->rx_buf_size = IWL_AMSDU_4K;
       break;
     default:
       IWL_INFO(0, "Unsupported amsdu_size: %d\n",
@@ -628,14 +637,15 @@ fail:
   return false;
 }
 
-bool free_paging(IWLMvmDriver *drv);
-
+/*
+ * The paging blocks are kept across stop/start like the firmware image
+ * itself, save_paging() only refills them. They go in release().
+ */
 void IWLMvmDriver::stopDevice() {
   clear_bit(IWL_MVM_STATUS_FIRMWARE_RUNNING, &trans->m_pDevice->status);
+  txFlush();
   trans_ops->stopDevice();
 
-  free_paging(this);
-
   // TODO xvt fw paging mode
   //    iwl_free_fw_paging(&mvm->fwrt);
 }
@@ -654,13 +664,14 @@ int IWLMvmDriver::irqHandler(int irq, void *dev_id) {
   //
   u32 inta = trans->iwlRead32(CSR_INT);
   inta &= trans_ops->trans->inta_mask;
+  IWL_EVT(IWL_EVT_IRQ, inta, trans->inta_mask, 0, 0);
   /*
    * Ignore interrupt if there's nothing in NIC to service.
    * This may be due to IRQ shared with another device,
    * or due to sporadic interrupts thrown from our NIC.
    */
   if (unlikely(!inta)) {
-    IWL_INFO(0, "Ignore interrupt, inta == 0\n");
+    IWL_DEBUG_ISR(0, "Ignore interrupt, inta == 0\n");
     /*
      * Re-enable interrupts here since we don't
      * have anything to service
@@ -702,7 +713,7 @@ int IWLMvmDriver::irqHandler(int irq, void *dev_id) {
   }
   /* NIC fires this, but we don't use it, redundant with WAKEUP */
   if (inta & CSR_INT_BIT_SCD) {
-    IWL_INFO(trans, "Scheduler finished to transmit the frame/frames.\n");
+    IWL_DEBUG_ISR(trans, "Scheduler finished to transmit the frame/frames.\n");
     isr_stats->sch++;
   }
   /* Alive notification via Rx interrupt will do the real work */
@@ -762,7 +773,7 @@ int IWLMvmDriver::irqHandler(int irq, void *dev_id) {
    * notifications from uCode come through here*/
   if (inta &
       (CSR_INT_BIT_FH_RX | CSR_INT_BIT_SW_RX | CSR_INT_BIT_RX_PERIODIC)) {
-    IWL_INFO(trans, "Rx interrupt\n");
+    IWL_DEBUG_ISR(trans, "Rx interrupt\n");
     if (inta & (CSR_INT_BIT_FH_RX | CSR_INT_BIT_SW_RX)) {
       handled |= (CSR_INT_BIT_FH_RX | CSR_INT_BIT_SW_RX);
       trans->iwlWrite32(CSR_FH_INT_STATUS, CSR_FH_INT_RX_MASK);
@@ -798,7 +809,8 @@ int IWLMvmDriver::irqHandler(int irq, void *dev_id) {
     isr_stats->rx++;
 
     local_bh_disable();
-    trans->handleRx(0);
+    if (trans->handleRx(0, IWL_RX_POLL_BUDGET))
+      trans->rx_poll_scheduled = true;
     local_bh_enable();
   }
 
@@ -827,6 +839,22 @@ int IWLMvmDriver::irqHandler(int irq, void *dev_id) {
              inta & ~trans->inta_mask);
   }
 
+  /*
+   * Keep the interrupt masked until rxPoll() has drained the ring, it
+   * re-enables what this irq would have
+   */
+  if (trans->rx_poll_scheduled) {
+    trans->rx_poll_handled = handled;
+    return 0;
+  }
+
+  reenableIntr(handled);
+out:
+
+  return 0;
+}
+
+void IWLMvmDriver::reenableIntr(u32 handled) {
   /* only Re-enable all interrupt if disabled by irq */
   if (test_bit(STATUS_INT_ENABLED, &trans->status)) trans->enableIntrDirectly();
   /* we are loading the firmware, enable FH_TX interrupt only */
@@ -838,9 +866,23 @@ int IWLMvmDriver::irqHandler(int irq, void *dev_id) {
   /* Re-enable the ALIVE / Rx interrupt if it occurred */
   else if (handled & (CSR_INT_BIT_ALIVE | CSR_INT_BIT_FH_RX))
     trans->iwl_enable_fw_load_int_ctx_info();
-out:
+}
 
-  return 0;
+bool IWLMvmDriver::rxPoll() {
+  if (!trans->rx_poll_scheduled) return false;
+
+  /* The device went down while a pass was pending, nothing left to drain */
+  if (!test_bit(STATUS_DEVICE_ENABLED, &trans->status)) {
+    trans->rx_poll_scheduled = false;
+    return false;
+  }
+
+  trans->isr_stats.rx_poll++;
+  if (trans->handleRx(0, IWL_RX_POLL_BUDGET)) return true;
+
+  trans->rx_poll_scheduled = false;
+  reenableIntr(trans->rx_poll_handled);
+  return false;
 }
 
 int IWLMvmDriver::sendPowerStatus() {
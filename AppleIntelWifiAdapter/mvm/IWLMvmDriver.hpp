@@ -16,6 +16,7 @@
 #include "../fw/IWLUcodeParse.hpp"
 #include "IWLNvmParser.hpp"
 #include "IWLPhyDb.hpp"
+#include "IWLMvmTx.hpp"
 #include "IWLTransOps.h"
 #include "IWMHdr.h"
 
@@ -44,8 +45,32 @@ class IWLMvmDriver : public OSObject {
 
   int irqHandler(int irq, void *dev_id);
 
+  /*
+   * Runs one budgeted pass over the default RX queue while the interrupt is
+   * masked. Returns true if the caller should schedule another pass.
+   */
+  bool rxPoll();
+
   void stopDevice();  // iwl_mvm_stop_device
 
+  /*
+   * Data path Tx. txEnqueue() takes a frame from the network stack on any
+   * thread, it returns < 0 if the frame was dropped and > 0 if the workloop
+   * has to be kicked to run txPoll(), which hands the pending frames to
+   * the Tx queues and returns the microseconds after which it wants to run
+   * again for a held A-MSDU or a Block Ack agreement being set up, 0 if it
+   * does not. txFlush() drops everything not on a queue yet and ends the
+   * agreements, it must not run concurrently with txPoll(). rxBaAction()
+   * takes the Block Ack action frames of the BSS from the workloop.
+   */
+  int txEnqueue(mbuf_t m);
+
+  u32 txPoll();
+
+  void txFlush();
+
+  void rxBaAction(const struct ieee80211_mgmt *mgmt, size_t len);
+
   // fw
 
   /**
@@ -93,6 +118,9 @@ class IWLMvmDriver : public OSObject {
 
   int sendCmdPduStatus(u32 id, u16 len, const void *data, u32 *status);
 
+  int sendCmdPduBatch(struct iwl_hcmd_batch *batch, u32 id, u16 len,
+                      const void *data, u32 status_mask, u32 status_ok);
+
   int sendPowerStatus();
 
   // MARK: scanning
@@ -128,6 +156,8 @@ class IWLMvmDriver : public OSObject {
 
   IWLTransOps *trans_ops;
 
+  struct iwl_mvm_tx tx;
+
   /* MARK: Rx handlers */
   static void btCoexNotif(struct iwl_mvm *mvm, struct iwl_rx_cmd_buffer *rxb);
   static void rxFwErrorNotif(struct iwl_mvm *mvm,
@@ -135,6 +165,9 @@ class IWLMvmDriver : public OSObject {
   static void rxMfuartNotif(struct iwl_mvm *mvm, struct iwl_rx_cmd_buffer *rxb);
 
  private:
+  // re-enable the interrupts an irq with the INTA bits @handled masked
+  void reenableIntr(u32 handled);
+
   IOLock *fwLoadLock;
 
   struct iwl_phy_db phy_db;
@@ -1139,7 +1139,12 @@ if (ic->ic_flags & IEEE80211_F_USEPROT)
   cmd->filter_flags = htole32(MAC_FILTER_ACCEPT_GRP);
 }
 
-int iwl_mac_ctxt_cmd(IWLMvmDriver* drv, uint32_t action, int assoc) {
+/*
+ * The association commands below take an optional batch, with one they
+ * are only queued and the batch reports the errors.
+ */
+int iwl_mac_ctxt_cmd(IWLMvmDriver* drv, uint32_t action, int assoc,
+                     struct iwl_hcmd_batch* batch) {
   struct iwl_mac_ctx_cmd cmd;
 
   memset(&cmd, 0, sizeof(cmd));
@@ -1151,10 +1156,14 @@ int iwl_mac_ctxt_cmd(IWLMvmDriver* drv, uint32_t action, int assoc) {
     // foo
   }
 
+  if (batch)
+    return drv->sendCmdPduBatch(batch, MAC_CONTEXT_CMD, sizeof(cmd), &cmd, 0,
+                                0);
   return drv->sendCmdPdu(MAC_CONTEXT_CMD, 0, sizeof(cmd), &cmd);
 }
 
-int iwl_binding_cmd(IWLMvmDriver* drv, uint32_t action) {
+int iwl_binding_cmd(IWLMvmDriver* drv, uint32_t action,
+                    struct iwl_hcmd_batch* batch) {
   IWLNode* node = drv->m_pDevice->ie_dev->getBSS();
   if (!node) return 1;
 
@@ -1176,6 +1185,10 @@ int iwl_binding_cmd(IWLMvmDriver* drv, uint32_t action) {
   for (int i = 1; i < MAX_MACS_IN_BINDING; i++)
     cmd.macs[i] = htole32(FW_CTXT_INVALID);
 
+  if (batch)
+    return drv->sendCmdPduBatch(batch, BINDING_CONTEXT_CMD, sizeof(cmd), &cmd,
+                                0xffffffff, 0);
+
   u32 status = 0;
   int err =
       drv->sendCmdPduStatus(BINDING_CONTEXT_CMD, sizeof(cmd), &cmd, &status);
@@ -1186,7 +1199,7 @@ int iwl_binding_cmd(IWLMvmDriver* drv, uint32_t action) {
 }
 
 void iwl_protect_session(IWLMvmDriver* drv, uint32_t duration,
-                         uint32_t max_delay) {
+                         uint32_t max_delay, struct iwl_hcmd_batch* batch) {
   IWLNode* node = drv->m_pDevice->ie_dev->getBSS();
   if (!node) return;
 
@@ -1217,5 +1230,9 @@ void iwl_protect_session(IWLMvmDriver* drv, uint32_t duration,
       htole16(TE_V2_NOTIF_HOST_EVENT_START | TE_V2_NOTIF_HOST_EVENT_END |
               TE_V2_START_IMMEDIATELY);
 
-  drv->sendCmdPdu(TIME_EVENT_CMD, 0, sizeof(time_cmd), &time_cmd);
+  if (batch)
+    drv->sendCmdPduBatch(batch, TIME_EVENT_CMD, sizeof(time_cmd), &time_cmd, 0,
+                         0);
+  else
+    drv->sendCmdPdu(TIME_EVENT_CMD, 0, sizeof(time_cmd), &time_cmd);
 }
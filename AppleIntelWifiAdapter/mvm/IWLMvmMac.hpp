@@ -17,10 +17,12 @@ int iwl_umac_scan(IWLMvmDriver* drv);
 int iwl_lmac_scan(IWLMvmDriver* drv, apple80211_scan_data* req);
 int iwl_enable_beacon_filter(IWLMvmDriver* drv);
 int iwl_disable_beacon_filter(IWLMvmDriver* drv);
-int iwl_mac_ctxt_cmd(IWLMvmDriver* drv, uint32_t action, int assoc);
-int iwl_binding_cmd(IWLMvmDriver* drv, uint32_t action);
+int iwl_mac_ctxt_cmd(IWLMvmDriver* drv, uint32_t action, int assoc,
+                     struct iwl_hcmd_batch* batch);
+int iwl_binding_cmd(IWLMvmDriver* drv, uint32_t action,
+                    struct iwl_hcmd_batch* batch);
 
 void iwl_protect_session(IWLMvmDriver* drv, uint32_t duration,
-                         uint32_t max_delay);
+                         uint32_t max_delay, struct iwl_hcmd_batch* batch);
 
 #endif  // APPLEINTELWIFIADAPTER_MVM_IWLMVMMAC_HPP_
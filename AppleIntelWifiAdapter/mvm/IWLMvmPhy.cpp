@@ -59,21 +59,23 @@ int iwl_phy_ctxt_add(IWLMvmDriver *drv, struct iwl_phy_ctx *ctxt,
   ctxt->channel = chan;
 
   return iwl_phy_ctxt_apply(drv, ctxt, chains_static, chains_dynamic,
-                            FW_CTXT_ACTION_ADD, 0);
+                            FW_CTXT_ACTION_ADD, 0, NULL);
 }
 
 int iwl_phy_ctxt_changed(IWLMvmDriver *drv, struct iwl_phy_ctx *ctxt,
                          struct apple80211_channel *chan, uint8_t chains_static,
-                         uint8_t chains_dynamic) {
+                         uint8_t chains_dynamic, struct iwl_hcmd_batch *batch) {
   ctxt->channel = chan;
 
   return iwl_phy_ctxt_apply(drv, ctxt, chains_static, chains_dynamic,
-                            FW_CTXT_ACTION_MODIFY, 0);
+                            FW_CTXT_ACTION_MODIFY, 0, batch);
 }
 
+/* with a batch the command is only queued, see iwl_hcmd_batch_send() */
 int iwl_phy_ctxt_apply(IWLMvmDriver *drv, struct iwl_phy_ctx *ctxt,
                        uint8_t chains_static, uint8_t chains_dynamic,
-                       uint32_t action, uint32_t apply_time) {
+                       uint32_t action, uint32_t apply_time,
+                       struct iwl_hcmd_batch *batch) {
   struct iwl_phy_context_cmd cmd;
   int ret;
 
@@ -84,7 +86,10 @@ int iwl_phy_ctxt_apply(IWLMvmDriver *drv, struct iwl_phy_ctx *ctxt,
   iwl_phy_ctxt_cmd_data(drv, &cmd, ctxt->channel, chains_static,
                         chains_dynamic);
 
-  ret = drv->sendCmdPdu(PHY_CONTEXT_CMD, 0, len, &cmd);
+  if (batch)
+    ret = drv->sendCmdPduBatch(batch, PHY_CONTEXT_CMD, len, &cmd, 0, 0);
+  else
+    ret = drv->sendCmdPdu(PHY_CONTEXT_CMD, 0, len, &cmd);
   if (ret) IWL_ERR(0, "Could not send phy context?\n");
 
   return ret;
@@ -17,11 +17,12 @@ int iwl_phy_ctxt_add(IWLMvmDriver *drv, struct iwl_phy_ctx *ctxt,
 
 int iwl_phy_ctxt_changed(IWLMvmDriver *drv, struct iwl_phy_ctx *ctxt,
                          struct apple80211_channel *chan, uint8_t chains_static,
-                         uint8_t chains_dynamic);
+                         uint8_t chains_dynamic, struct iwl_hcmd_batch *batch);
 
 int iwl_phy_ctxt_apply(IWLMvmDriver *drv, struct iwl_phy_ctx *ctxt,
                        uint8_t chains_static, uint8_t chains_dynamic,
-                       uint32_t action, uint32_t apply_time);
+                       uint32_t action, uint32_t apply_time,
+                       struct iwl_hcmd_batch *batch);
 
 void iwl_phy_ctxt_cmd_data(IWLMvmDriver *drv, struct iwl_phy_context_cmd *cmd,
                            struct apple80211_channel *chan,
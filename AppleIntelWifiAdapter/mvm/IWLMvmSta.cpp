@@ -8,6 +8,7 @@
 
 #include "IWLMvmSta.hpp"
 
+#include "../fw/api/rs.h"
 #include "../trans/IWLSCD.h"
 #include "IWLApple80211.hpp"
 #include "IWLCachedScan.hpp"
@@ -97,6 +98,80 @@ int iwl_enable_txq(IWLMvmDriver *drv, int sta_id, int qid, int fifo) {
   return err;
 }
 
+/*
+ * turn the data queue @qid into the aggregation queue of @sta_id/@tid
+ * starting at @ssn, which has to be the queue's write pointer. With DQA
+ * the firmware owns the scheduler setup of the queue, so SCD_QUEUE_CFG is
+ * all it takes and the ring pointers stay as they are; the transport only
+ * learns that BA notifications are now expected on the queue. The
+ * firmware command is sent async, this runs from the Rx path.
+ */
+int iwl_enable_agg_txq(IWLMvmDriver *drv, int sta_id, int tid, int qid,
+                       int fifo, u16 ssn, int window) {
+  struct iwl_scd_txq_cfg_cmd cmd = {
+      .sta_id = (u8)sta_id,
+      .tid = (u8)tid,
+      .scd_queue = (u8)qid,
+      .action = 1,
+      .aggregate = 1,
+      .tx_fifo = (u8)fifo,
+      .window = (u8)window,
+      .ssn = cpu_to_le16(ssn),
+  };
+
+  drv->trans->txq[qid]->ampdu = true;
+
+  IWL_INFO(0, "aggregating tid %d on txq %d, window %d ssn %u\n", tid, qid,
+           window, ssn);
+
+  return drv->sendCmdPdu(SCD_QUEUE_CFG, CMD_ASYNC, sizeof(cmd), &cmd);
+}
+
+/* aggregation defaults of the LQ table, as the Linux rate scaling has them */
+#define LINK_QUAL_AGG_TIME_LIMIT_DEF 4000
+#define LINK_QUAL_AGG_DISABLE_START_DEF 3
+#define LINK_QUAL_AGG_FRAME_LIMIT_DEF 63
+
+/*
+ * send the station's rate table: with an HT BSS, SISO MCS 7 down to MCS 0,
+ * two tries each, which data frames use from then on (TX_CMD_FLG_STA_RATE)
+ * and which Block Ack agreements wait for. There is no rate scaling, the
+ * firmware only walks down the table on retries. Nothing is sent for a
+ * legacy BSS, its frames keep the fixed rate of their TX command.
+ */
+int iwl_mvm_sta_send_lq(IWLMvmDriver *drv, struct iwl_hcmd_batch *batch) {
+  IWLNode *bss = drv->m_pDevice->ie_dev->getBSS();
+  IWLCachedScan *beacon = bss ? bss->getBeacon() : NULL;
+  u8 valid = iwl_mvm_get_valid_tx_ant(drv->m_pDevice);
+  u8 ant = valid & -valid;
+  struct iwl_lq_cmd lq = {
+      .sta_id = IWM_STATION_ID,
+      .single_stream_ant_msk = ant,
+      .dual_stream_ant_msk = valid,
+      .agg_time_limit = cpu_to_le16(LINK_QUAL_AGG_TIME_LIMIT_DEF),
+      .agg_disable_start_th = LINK_QUAL_AGG_DISABLE_START_DEF,
+      .agg_frame_cnt_limit = LINK_QUAL_AGG_FRAME_LIMIT_DEF,
+  };
+  int i, err;
+
+  drv->tx.lq_ht = false;
+  if (!beacon) return -EINVAL;
+  if (!beacon->getHTSupported()) return 0;
+
+  /* MCS 0-7 are mandatory for an HT AP */
+  for (i = 0; i < LQ_MAX_RETRY_NUM; i++)
+    lq.rs_table[i] = cpu_to_le32(RATE_MCS_HT_MSK |
+                                 (IWL_RATE_HT_SISO_MCS_7_PLCP - i / 2) |
+                                 ((u32)ant << RATE_MCS_ANT_POS));
+
+  if (batch)
+    err = drv->sendCmdPduBatch(batch, LQ_CMD, sizeof(lq), &lq, 0, 0);
+  else
+    err = drv->sendCmdPdu(LQ_CMD, 0, sizeof(lq), &lq);
+  if (!err) drv->tx.lq_ht = true;
+  return err;
+}
+
 int iwl_mvm_add_aux_sta(IWLMvmDriver *drv) {
   iwl_mvm_add_sta_cmd cmd;
 
@@ -119,8 +194,13 @@ int iwl_mvm_add_aux_sta(IWLMvmDriver *drv) {
   return err;
 }
 
-/* send station add/update command to firmware */
-int iwl_mvm_sta_send_to_fw(IWLMvmDriver *drv, bool update, unsigned int flags) {
+/*
+ * send station add/update command to firmware, with a batch it is only
+ * queued and the batch checks the status. With CMD_ASYNC in @flags the
+ * status is not waited for, as needed from the Rx path.
+ */
+int iwl_mvm_sta_send_to_fw(IWLMvmDriver *drv, bool update, unsigned int flags,
+                           struct iwl_hcmd_batch *batch) {
   IWLNode *bss = drv->m_pDevice->ie_dev->getBSS();
 
   if (!bss) {
@@ -147,14 +227,22 @@ int iwl_mvm_sta_send_to_fw(IWLMvmDriver *drv, bool update, unsigned int flags) {
       .mac_id_n_color =
           cpu_to_le32(FW_CMD_ID_AND_COLOR(bss->getID(), bss->getColor())),
       .add_modify = update ? 1 : 0,
-      .tid_disable_tx = cpu_to_le16(0xffff),
+      /* A-MPDUs only on the TIDs with a Block Ack agreement */
+      .tid_disable_tx = cpu_to_le16(~drv->tx.ba_tids),
   };
   add_sta_cmd.station_flags_msk |=
-      cpu_to_le32(STA_FLG_FAT_EN_MSK | STA_FLG_MIMO_EN_MSK);
+      cpu_to_le32(STA_FLG_FAT_EN_MSK | STA_FLG_MIMO_EN_MSK |
+                  STA_FLG_MAX_AGG_SIZE_MSK | STA_FLG_AGG_MPDU_DENS_MSK);
   int ret;
   u32 status;
   u32 agg_size = 0, mpdu_dens = 0;
 
+  if (beacon->getHTSupported()) {
+    agg_size = beacon->getAMPDUParams() & IEEE80211_HT_AMPDU_PARM_FACTOR;
+    mpdu_dens = (beacon->getAMPDUParams() & IEEE80211_HT_AMPDU_PARM_DENSITY) >>
+                IEEE80211_HT_AMPDU_PARM_DENSITY_SHIFT;
+  }
+
   if (!update) {
     IEEE80211_ADDR_COPY(&add_sta_cmd.addr, beacon->getBSSID());
 
@@ -164,6 +252,8 @@ int iwl_mvm_sta_send_to_fw(IWLMvmDriver *drv, bool update, unsigned int flags) {
     }
 
     // add_sta_cmd.modify_mask |= STA_MODIFY_QUEUES;
+  } else {
+    add_sta_cmd.modify_mask |= STA_MODIFY_TID_DISABLE_TX;
   }
 
   add_sta_cmd.station_flags |= htole32(agg_size << STA_FLG_MAX_AGG_SIZE_SHIFT);
@@ -175,6 +265,17 @@ int iwl_mvm_sta_send_to_fw(IWLMvmDriver *drv, bool update, unsigned int flags) {
     cpu_to_le32(STA_FLG_FAT_EN_20MHZ);
    */
 
+  if (batch)
+    return drv->sendCmdPduBatch(batch, ADD_STA,
+                                iwl_mvm_add_sta_cmd_size(drv->m_pDevice),
+                                &add_sta_cmd, IWL_ADD_STA_STATUS_MASK,
+                                ADD_STA_SUCCESS);
+
+  if (flags & CMD_ASYNC)
+    return drv->sendCmdPdu(ADD_STA, flags,
+                           iwl_mvm_add_sta_cmd_size(drv->m_pDevice),
+                           &add_sta_cmd);
+
   status = ADD_STA_SUCCESS;
   ret = drv->sendCmdPduStatus(ADD_STA, iwl_mvm_add_sta_cmd_size(drv->m_pDevice),
                               &add_sta_cmd, &status);
@@ -19,6 +19,10 @@
  */
 
 int iwl_enable_txq(IWLMvmDriver* drv, int sta_id, int qid, int fifo);
+
+int iwl_enable_agg_txq(IWLMvmDriver* drv, int sta_id, int tid, int qid,
+                       int fifo, u16 ssn, int window);
+
 static inline int iwl_mvm_add_sta_cmd_size(IWLDevice* mvm) {
   if (iwl_mvm_has_new_rx_api(mvm) ||
       fw_has_api(&mvm->fw.ucode_capa, IWL_UCODE_TLV_API_STA_TYPE))
@@ -31,6 +35,9 @@ int iwl_mvm_add_sta(IWLMvmDriver* drv, int update);
 
 int iwl_mvm_add_aux_sta(IWLMvmDriver* drv);
 
-int iwl_mvm_sta_send_to_fw(IWLMvmDriver* drv, bool update, unsigned int flags);
+int iwl_mvm_sta_send_to_fw(IWLMvmDriver* drv, bool update, unsigned int flags,
+                           struct iwl_hcmd_batch* batch);
+
+int iwl_mvm_sta_send_lq(IWLMvmDriver* drv, struct iwl_hcmd_batch* batch);
 
 #endif  // APPLEINTELWIFIADAPTER_MVM_IWLMVMSTA_HPP_
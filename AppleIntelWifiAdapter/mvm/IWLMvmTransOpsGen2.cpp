@@ -40,6 +40,7 @@ int IWLMvmTransOpsGen2::nicInit() {
 int IWLMvmTransOpsGen2::rxInit() {
   /* Set interrupt coalescing timer to default (2048 usecs) */
   trans->iwlWrite8(CSR_INT_COALESCING, IWL_HOST_INT_TIMEOUT_DEF);
+  trans->int_mit.timeout = IWL_HOST_INT_TIMEOUT_DEF;
   return trans->rxInit();
 }
 
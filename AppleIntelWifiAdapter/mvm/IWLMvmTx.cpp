@@ -0,0 +1,652 @@
+//
+//  IWLMvmTx.cpp
+//  AppleIntelWifiAdapter
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+#include "IWLMvmTx.hpp"
+
+#include <kern/clock.h>
+#include <libkern/OSAtomic.h>
+#include <linux/ieee80211.h>
+#include <net/ethernet.h>
+
+#include "IWLApple80211.hpp"
+#include "IWLMvmDriver.hpp"
+#include "IWLMvmSta.hpp"
+
+/* TID of the QoS data frames of each AC */
+static const u8 iwl_mvm_tx_ac_to_tid[IWL_MVM_TX_NUM_ACS] = {6, 5, 0, 1};
+
+static int iwl_mvm_tx_ac(mbuf_t m) {
+  switch (mbuf_get_service_class(m)) {
+    case MBUF_SC_BK_SYS:
+    case MBUF_SC_BK:
+      return IWL_MVM_TX_AC_BK;
+    case MBUF_SC_AV:
+    case MBUF_SC_RV:
+    case MBUF_SC_VI:
+      return IWL_MVM_TX_AC_VI;
+    case MBUF_SC_VO:
+    case MBUF_SC_CTL:
+      return IWL_MVM_TX_AC_VO;
+    default:
+      return IWL_MVM_TX_AC_BE;
+  }
+}
+
+/*
+ * the lowest mandatory rate of the band, for the frames that do not use
+ * the station's LQ table
+ */
+static __le32 iwl_mvm_tx_rate(IWLMvmDriver *drv, IWLCachedScan *beacon) {
+  u8 valid = iwl_mvm_get_valid_tx_ant(drv->m_pDevice);
+  u32 ant = (u32)(valid & -valid) << RATE_MCS_ANT_POS;
+
+  if (beacon->getChannel().flags & APPLE80211_C_FLAG_2GHZ)
+    return cpu_to_le32(IWL_RATE_1M_PLCP | RATE_MCS_CCK_MSK | ant);
+  return cpu_to_le32(IWL_RATE_6M_PLCP | ant);
+}
+
+/*
+ * iwl_mvm_tx_cmd_init - the TX command fields of every frame to the BSS,
+ * @len is the frame's length including the 802.11 header
+ */
+static void iwl_mvm_tx_cmd_init(IWLMvmDriver *drv, IWLCachedScan *beacon,
+                                struct iwl_device_tx_cmd *dev_cmd, u8 tid,
+                                u16 len, u32 flags, u8 retry) {
+  struct iwl_tx_cmd *tx_cmd = (struct iwl_tx_cmd *)dev_cmd->payload;
+
+  dev_cmd->hdr.cmd = TX_CMD;
+  tx_cmd->len = cpu_to_le16(len);
+  tx_cmd->tx_flags = cpu_to_le32(flags);
+  if (!(flags & TX_CMD_FLG_STA_RATE))
+    tx_cmd->rate_n_flags = iwl_mvm_tx_rate(drv, beacon);
+  tx_cmd->sta_id = IWM_STATION_ID;
+  tx_cmd->tid_tspec = tid;
+  tx_cmd->life_time = cpu_to_le32(TX_CMD_LIFE_TIME_INFINITE);
+  tx_cmd->data_retry_limit = retry;
+  tx_cmd->rts_retry_limit = retry;
+  tx_cmd->pm_frame_timeout = cpu_to_le16(PM_FRAME_NONE);
+}
+
+static void iwl_mvm_tx_wait(u64 *wait, u64 delay) {
+  if (!*wait || delay < *wait) *wait = delay;
+}
+
+/*
+ * iwl_mvm_tx_amsdu_max - largest A-MSDU the BSS takes, 0 if none
+ *
+ * A-MSDUs need QoS data, so an HT BSS; its HT capabilities tell whether
+ * it takes 7935 or only 3839 bytes.
+ */
+static u32 iwl_mvm_tx_amsdu_max(IWLMvmDriver *drv) {
+  IWL80211Device *dev = drv->m_pDevice->ie_dev;
+  IWLNode *bss = dev->getBSS();
+  IWLCachedScan *beacon;
+
+  if (dev->getState() != APPLE80211_S_RUN || !bss || !bss->getBeacon())
+    return 0;
+  beacon = bss->getBeacon();
+  if (!beacon->getHTSupported()) return 0;
+
+  return (beacon->getHTCaps() & IEEE80211_HTCAP_AMSDU7935) ? 7935 : 3839;
+}
+
+/*
+ * iwl_mvm_tx_amsdu_count - frames at the head of the backlog of @ac that
+ * fit into one A-MSDU of at most @max bytes
+ *
+ * @open is set if the backlog ran out before anything else ended the
+ * A-MSDU, more frames arriving could still be added then.
+ */
+static int iwl_mvm_tx_amsdu_count(struct iwl_mvm_tx *tx, int ac, u32 max,
+                                  bool *open) {
+  u8 da[ETH_ALEN], first_da[ETH_ALEN];
+  u32 len = 0;
+  int n = 0;
+  mbuf_t m;
+
+  *open = false;
+  for (m = tx->backlog[ac]; m; m = mbuf_nextpkt(m), n++) {
+    if (!iwl_amsdu_add(&len, n, mbuf_pkthdr_len(m), max)) return n;
+
+    mbuf_copydata(m, 0, ETH_ALEN, n ? da : first_da);
+    if (n && memcmp(da, first_da, ETH_ALEN)) return n;
+  }
+
+  *open = true;
+  return n;
+}
+
+/*
+ * iwl_mvm_tx_amsdu_subframe - turn an Ethernet frame into an A-MSDU
+ * subframe in place, @pad it to 4 bytes unless it is the last one
+ *
+ * Growing the frame can fail after freeing it, *@mp is NULL then.
+ */
+static int iwl_mvm_tx_amsdu_subframe(mbuf_t *mp, bool pad) {
+  static const u8 zero[3] = {};
+  u8 eh[IWL_AMSDU_ETH_HLEN], hdr[IWL_AMSDU_SUBFRAME_HLEN];
+  u32 len;
+
+  mbuf_copydata(*mp, 0, sizeof(eh), eh);
+  if (mbuf_prepend(mp, sizeof(hdr) - sizeof(eh), MBUF_DONTWAIT))
+    return -ENOMEM;
+  len = (u32)mbuf_pkthdr_len(*mp);
+
+  iwl_amsdu_subframe_hdr(hdr, eh, len);
+  if (mbuf_copyback(*mp, 0, sizeof(hdr), hdr, MBUF_DONTWAIT)) return -ENOMEM;
+
+  if (pad && iwl_amsdu_pad(len) &&
+      mbuf_copyback(*mp, len, iwl_amsdu_pad(len), zero, MBUF_DONTWAIT))
+    return -ENOMEM;
+  return 0;
+}
+
+/*
+ * iwl_mvm_tx_amsdu - take @n frames off the backlog of @ac and chain them
+ * into the body of one A-MSDU
+ *
+ * The subframes keep their own mbufs, linked one after the other behind
+ * the first frame's packet header, so txFrame() maps them without a copy;
+ * the others lose theirs once their length is added to it.
+ * A frame that cannot be converted is dropped, NULL is returned if none
+ * could be.
+ */
+static mbuf_t iwl_mvm_tx_amsdu(IWLMvmDriver *drv, int ac, int n) {
+  struct iwl_mvm_tx *tx = &drv->tx;
+  mbuf_t head = NULL, tail = NULL, m;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    m = tx->backlog[ac];
+    tx->backlog[ac] = mbuf_nextpkt(m);
+    mbuf_setnextpkt(m, NULL);
+    OSDecrementAtomic(&tx->npending);
+
+    if (iwl_mvm_tx_amsdu_subframe(&m, i != n - 1)) {
+      OSIncrementAtomic(&tx->drops);
+      if (m) mbuf_freem(m);
+      continue;
+    }
+
+    if (!head) {
+      head = m;
+    } else {
+      mbuf_setnext(tail, m);
+      mbuf_pkthdr_setlen(head, mbuf_pkthdr_len(head) + mbuf_pkthdr_len(m));
+      /* only the head of a chain may carry a packet header */
+      mbuf_setflags_mask(m, 0, MBUF_PKTHDR);
+    }
+    tail = m;
+    while (mbuf_next(tail)) tail = mbuf_next(tail);
+    tx->amsdu_frames++;
+  }
+
+  return head;
+}
+
+/*
+ * iwl_mvm_tx - turn an Ethernet frame, or the body of an A-MSDU, into a
+ * data frame to the BSS and queue it on the Tx queue of its AC
+ *
+ * The 802.11 header goes into the TX command, the mbuf keeps the body: the
+ * Ethernet header is trimmed down to an LLC/SNAP header in place. On error
+ * the caller still owns @m. @more is passed on to txFrame().
+ */
+static int iwl_mvm_tx(IWLMvmDriver *drv, mbuf_t m, int ac, bool amsdu,
+                      bool more) {
+  IWL80211Device *dev = drv->m_pDevice->ie_dev;
+  IWLNode *bss = dev->getBSS();
+  IWLCachedScan *beacon;
+  u8 buf[sizeof(struct iwl_cmd_header) + sizeof(struct iwl_tx_cmd) +
+         sizeof(struct ieee80211_qos_hdr)] __aligned(4);
+  struct iwl_device_tx_cmd *dev_cmd = (struct iwl_device_tx_cmd *)buf;
+  struct iwl_tx_cmd *tx_cmd = (struct iwl_tx_cmd *)dev_cmd->payload;
+  struct ieee80211_qos_hdr *wh = (struct ieee80211_qos_hdr *)tx_cmd->hdr;
+  struct ether_header eh;
+  bool qos;
+  u16 hdr_len;
+  u8 tid;
+  int err;
+
+  if (dev->getState() != APPLE80211_S_RUN || !bss || !bss->getBeacon())
+    return -ENOTCONN;
+  beacon = bss->getBeacon();
+
+  /* an HT BSS does WMM, send QoS data to it */
+  qos = beacon->getHTSupported();
+  if (WARN_ON(amsdu && !qos)) return -EINVAL;
+  tid = qos ? iwl_mvm_tx_ac_to_tid[ac] : IWL_TID_NON_QOS;
+
+  if (amsdu) {
+    /* the subframe headers carry DA and SA, addr3 is the BSSID */
+    memcpy(eh.ether_dhost, beacon->getBSSID(), ETH_ALEN);
+  } else {
+    if (mbuf_pkthdr_len(m) < sizeof(eh)) return -EINVAL;
+    mbuf_copydata(m, 0, sizeof(eh), &eh);
+
+    /* the EtherType stays where it is, right behind the SNAP header */
+    mbuf_adj(m, sizeof(eh) - sizeof(iwl_mvm_tx_llc_snap) -
+                    sizeof(eh.ether_type));
+    if (mbuf_copyback(m, 0, sizeof(iwl_mvm_tx_llc_snap), iwl_mvm_tx_llc_snap,
+                      MBUF_DONTWAIT))
+      return -ENOMEM;
+  }
+
+  bzero(buf, sizeof(buf));
+  wh->frame_control = cpu_to_le16(
+      IEEE80211_FTYPE_DATA | IEEE80211_FCTL_TODS |
+      (qos ? IEEE80211_STYPE_QOS_DATA : IEEE80211_STYPE_DATA));
+  memcpy(wh->addr1, beacon->getBSSID(), ETH_ALEN);
+  memcpy(wh->addr2, dev->getMAC(), ETH_ALEN);
+  memcpy(wh->addr3, eh.ether_dhost, ETH_ALEN);
+  if (qos) {
+    wh->seq_ctrl = cpu_to_le16(drv->tx.seq[tid] << 4);
+    wh->qos_ctrl = cpu_to_le16(
+        tid | (amsdu ? IEEE80211_QOS_CTL_A_MSDU_PRESENT : 0));
+    hdr_len = sizeof(struct ieee80211_qos_hdr);
+  } else {
+    hdr_len = sizeof(struct ieee80211_hdr_3addr);
+  }
+
+  /* the firmware numbers the non-QoS frames */
+  iwl_mvm_tx_cmd_init(drv, beacon, dev_cmd, tid, hdr_len + mbuf_pkthdr_len(m),
+                      TX_CMD_FLG_ACK | (qos ? 0 : TX_CMD_FLG_SEQ_CTL) |
+                          (drv->tx.lq_ht ? TX_CMD_FLG_STA_RATE : 0),
+                      IWL_DEFAULT_TX_RETRY);
+
+  err = drv->trans->txFrame(m, dev_cmd, IWL_MVM_DQA_MIN_MGMT_QUEUE + ac, more);
+  if (err || !qos) return err;
+
+  /*
+   * an aggregation queue needs the sequence numbers to follow its write
+   * pointer, so they only advance for frames that made it onto the queue
+   */
+  drv->tx.seq[tid] = (drv->tx.seq[tid] + 1) & 0xfff;
+  if (drv->tx.ba[ac].state == IWL_MVM_TX_BA_OFF) drv->tx.ba[ac].frames++;
+  return 0;
+}
+
+/*
+ * iwl_mvm_tx_addba_req - ask the BSS for a Block Ack agreement on the TID
+ * of @ac, as a management frame on the VO queue the firmware numbers
+ */
+static int iwl_mvm_tx_addba_req(IWLMvmDriver *drv, int ac) {
+  IWL80211Device *dev = drv->m_pDevice->ie_dev;
+  IWLNode *bss = dev->getBSS();
+  IWLCachedScan *beacon;
+  struct iwl_mvm_tx_ba *ba = &drv->tx.ba[ac];
+  u8 buf[sizeof(struct iwl_cmd_header) + sizeof(struct iwl_tx_cmd) +
+         sizeof(struct ieee80211_hdr_3addr)] __aligned(4);
+  struct iwl_device_tx_cmd *dev_cmd = (struct iwl_device_tx_cmd *)buf;
+  struct iwl_tx_cmd *tx_cmd = (struct iwl_tx_cmd *)dev_cmd->payload;
+  struct ieee80211_hdr_3addr *wh = (struct ieee80211_hdr_3addr *)tx_cmd->hdr;
+  struct ieee80211_mgmt mgmt;
+  /* category and the ADDBA request, the header goes into the TX command */
+  const size_t len = IEEE80211_MIN_ACTION_SIZE -
+                     offsetof(struct ieee80211_mgmt, u) +
+                     sizeof(mgmt.u.action.u.addba_req);
+  u8 tid = iwl_mvm_tx_ac_to_tid[ac];
+  mbuf_t m;
+  int err;
+
+  if (dev->getState() != APPLE80211_S_RUN || !bss || !bss->getBeacon())
+    return -ENOTCONN;
+  beacon = bss->getBeacon();
+
+  bzero(&mgmt, sizeof(mgmt));
+  mgmt.u.action.category = WLAN_CATEGORY_BACK;
+  mgmt.u.action.u.addba_req.action_code = WLAN_ACTION_ADDBA_REQ;
+  mgmt.u.action.u.addba_req.dialog_token = ba->token;
+  mgmt.u.action.u.addba_req.capab = cpu_to_le16(
+      IEEE80211_MAX_AMPDU_BUF_HT << 6 | tid << 2 |
+      IEEE80211_ADDBA_PARAM_POLICY_MASK);
+  mgmt.u.action.u.addba_req.start_seq_num =
+      cpu_to_le16(IEEE80211_SN_TO_SEQ(ba->ssn));
+
+  if (mbuf_allocpacket(MBUF_DONTWAIT, len, NULL, &m)) return -ENOMEM;
+  if (mbuf_copyback(m, 0, len, &mgmt.u.action, MBUF_DONTWAIT)) {
+    mbuf_freem(m);
+    return -ENOMEM;
+  }
+
+  bzero(buf, sizeof(buf));
+  wh->frame_control =
+      cpu_to_le16(IEEE80211_FTYPE_MGMT | IEEE80211_STYPE_ACTION);
+  memcpy(wh->addr1, beacon->getBSSID(), ETH_ALEN);
+  memcpy(wh->addr2, dev->getMAC(), ETH_ALEN);
+  memcpy(wh->addr3, beacon->getBSSID(), ETH_ALEN);
+
+  iwl_mvm_tx_cmd_init(drv, beacon, dev_cmd, IWL_TID_NON_QOS,
+                      sizeof(*wh) + len, TX_CMD_FLG_ACK | TX_CMD_FLG_SEQ_CTL,
+                      IWL_MGMT_DFAULT_RETRY_LIMIT);
+
+  err = drv->trans->txFrame(m, dev_cmd,
+                            IWL_MVM_DQA_MIN_MGMT_QUEUE + IWL_MVM_TX_AC_VO,
+                            false);
+  if (err) mbuf_freem(m);
+  return err;
+}
+
+static void iwl_mvm_tx_ba_refuse(struct iwl_mvm_tx_ba *ba, u64 now) {
+  u64 delay;
+
+  nanoseconds_to_absolutetime(IWL_MVM_TX_BA_RETRY_MS * 1000000ULL, &delay);
+  ba->state = IWL_MVM_TX_BA_REFUSED;
+  ba->deadline = now + delay;
+}
+
+/*
+ * iwl_mvm_tx_ba_hold - move the Block Ack agreement of @ac along, true if
+ * its backlog has to wait meanwhile, @wait is set to when to look again
+ */
+static bool iwl_mvm_tx_ba_hold(IWLMvmDriver *drv, int ac, u64 now,
+                               u64 *wait) {
+  struct iwl_mvm_tx_ba *ba = &drv->tx.ba[ac];
+  struct iwl_txq *txq = drv->trans->txq[IWL_MVM_DQA_MIN_MGMT_QUEUE + ac];
+  u8 tid = iwl_mvm_tx_ac_to_tid[ac];
+  u16 *seq = &drv->tx.seq[tid];
+  u64 delay;
+  int err;
+
+  switch (ba->state) {
+    case IWL_MVM_TX_BA_OFF:
+      /* A-MPDUs of legacy rate frames would gain nothing */
+      if (ac == IWL_MVM_TX_AC_VO || !drv->tx.lq_ht ||
+          ba->frames < IWL_MVM_TX_BA_START_FRAMES)
+        return false;
+      ba->state = IWL_MVM_TX_BA_EMPTYING;
+      /* fall through */
+    case IWL_MVM_TX_BA_EMPTYING:
+      /* only the workloop adds to the queue, an unlocked look will do */
+      if (txq->read_ptr != txq->write_ptr) {
+        nanoseconds_to_absolutetime(IWL_MVM_TX_BA_POLL_US * 1000ULL, &delay);
+        iwl_mvm_tx_wait(wait, delay);
+        return true;
+      }
+
+      /* the scheduler expects the low byte of the SSN at the write pointer */
+      *seq = (*seq + ((txq->write_ptr - *seq) & 0xff)) & 0xfff;
+      ba->ssn = *seq;
+      ba->token = ++drv->tx.ba_token;
+      err = iwl_mvm_tx_addba_req(drv, ac);
+      if (err) {
+        IWL_ERR(0, "failed to send ADDBA request for tid %u: %d\n", tid, err);
+        iwl_mvm_tx_ba_refuse(ba, now);
+        return false;
+      }
+
+      IWL_DEBUG_TX(0, "ADDBA request for tid %u, ssn %u\n", tid, ba->ssn);
+      nanoseconds_to_absolutetime(IWL_MVM_TX_BA_RESP_TIMEOUT_MS * 1000000ULL,
+                                  &delay);
+      ba->state = IWL_MVM_TX_BA_REQUESTED;
+      ba->deadline = now + delay;
+      iwl_mvm_tx_wait(wait, delay);
+      return true;
+    case IWL_MVM_TX_BA_REQUESTED:
+      if (now < ba->deadline) {
+        iwl_mvm_tx_wait(wait, ba->deadline - now);
+        return true;
+      }
+      IWL_INFO(0, "no ADDBA response for tid %u\n", tid);
+      iwl_mvm_tx_ba_refuse(ba, now);
+      return false;
+    case IWL_MVM_TX_BA_REFUSED:
+      if (now >= ba->deadline) {
+        ba->state = IWL_MVM_TX_BA_OFF;
+        ba->frames = 0;
+      }
+      return false;
+    default:
+      return false;
+  }
+}
+
+/*
+ * iwl_mvm_tx_ba_start - the BSS took the agreement, make the queue of @ac
+ * an aggregation queue and let the firmware send A-MPDUs on the TID
+ */
+static void iwl_mvm_tx_ba_start(IWLMvmDriver *drv, int ac, u16 winsize) {
+  struct iwl_mvm_tx_ba *ba = &drv->tx.ba[ac];
+  u8 tid = iwl_mvm_tx_ac_to_tid[ac];
+  int err;
+
+  if (!winsize || winsize > IEEE80211_MAX_AMPDU_BUF_HT)
+    winsize = IEEE80211_MAX_AMPDU_BUF_HT;
+  ba->winsize = winsize;
+
+  err = iwl_enable_agg_txq(drv, IWM_STATION_ID, tid,
+                           IWL_MVM_DQA_MIN_MGMT_QUEUE + ac,
+                           iwl_mvm_ac_to_tx_fifo[ac], ba->ssn, winsize);
+  if (!err) {
+    drv->tx.ba_tids |= BIT(tid);
+    err = iwl_mvm_sta_send_to_fw(drv, true, CMD_ASYNC, NULL);
+  }
+  if (err) {
+    IWL_ERR(0, "failed to start aggregation on tid %u: %d\n", tid, err);
+    drv->tx.ba_tids &= ~BIT(tid);
+    iwl_mvm_tx_ba_refuse(ba, mach_absolute_time());
+    return;
+  }
+
+  IWL_INFO(0, "Block Ack agreement on tid %u, window %u\n", tid, winsize);
+  ba->state = IWL_MVM_TX_BA_ON;
+}
+
+/*
+ * iwl_mvm_tx_ba_stop - the BSS ended the agreement of @ac, the queue keeps
+ * its aggregation setup but the firmware stops sending A-MPDUs on the TID
+ */
+static void iwl_mvm_tx_ba_stop(IWLMvmDriver *drv, int ac) {
+  struct iwl_mvm_tx_ba *ba = &drv->tx.ba[ac];
+  u8 tid = iwl_mvm_tx_ac_to_tid[ac];
+
+  IWL_INFO(0, "Block Ack agreement on tid %u ended\n", tid);
+  drv->tx.ba_tids &= ~BIT(tid);
+  iwl_mvm_sta_send_to_fw(drv, true, CMD_ASYNC, NULL);
+  ba->state = IWL_MVM_TX_BA_OFF;
+  ba->frames = 0;
+}
+
+void IWLMvmDriver::rxBaAction(const struct ieee80211_mgmt *mgmt, size_t len) {
+  IWLNode *bss = m_pDevice->ie_dev->getBSS();
+  struct iwl_mvm_tx_ba *ba;
+  u16 params;
+  u8 action, tid;
+  int ac;
+
+  if (len < IEEE80211_MIN_ACTION_SIZE + 1 ||
+      mgmt->u.action.category != WLAN_CATEGORY_BACK)
+    return;
+  if (!bss || !bss->getBeacon() ||
+      memcmp(mgmt->sa, bss->getBeacon()->getBSSID(), ETH_ALEN))
+    return;
+
+  /* the action code comes first in every Block Ack frame */
+  action = mgmt->u.action.u.addba_resp.action_code;
+  switch (action) {
+    case WLAN_ACTION_ADDBA_RESP:
+      if (len < IEEE80211_MIN_ACTION_SIZE +
+                    sizeof(mgmt->u.action.u.addba_resp))
+        return;
+      params = le16_to_cpu(mgmt->u.action.u.addba_resp.capab);
+      tid = (params & IEEE80211_ADDBA_PARAM_TID_MASK) >> 2;
+      break;
+    case WLAN_ACTION_DELBA:
+      if (len < IEEE80211_MIN_ACTION_SIZE + sizeof(mgmt->u.action.u.delba))
+        return;
+      params = le16_to_cpu(mgmt->u.action.u.delba.params);
+      /* the BSS ending its own Tx agreement is not ours to handle */
+      if (params & IEEE80211_DELBA_PARAM_INITIATOR_MASK) return;
+      tid = (params & IEEE80211_DELBA_PARAM_TID_MASK) >> 12;
+      break;
+    default:
+      return;
+  }
+
+  for (ac = 0; ac < IWL_MVM_TX_NUM_ACS; ac++)
+    if (iwl_mvm_tx_ac_to_tid[ac] == tid) break;
+  if (ac == IWL_MVM_TX_NUM_ACS) return;
+  ba = &tx.ba[ac];
+
+  if (action == WLAN_ACTION_DELBA) {
+    if (ba->state == IWL_MVM_TX_BA_ON) iwl_mvm_tx_ba_stop(this, ac);
+    return;
+  }
+
+  if (ba->state != IWL_MVM_TX_BA_REQUESTED ||
+      mgmt->u.action.u.addba_resp.dialog_token != ba->token)
+    return;
+
+  if (le16_to_cpu(mgmt->u.action.u.addba_resp.status) != WLAN_STATUS_SUCCESS) {
+    IWL_INFO(0, "ADDBA request for tid %u refused: %u\n", tid,
+             le16_to_cpu(mgmt->u.action.u.addba_resp.status));
+    iwl_mvm_tx_ba_refuse(ba, mach_absolute_time());
+  } else {
+    iwl_mvm_tx_ba_start(this, ac,
+                        (params & IEEE80211_ADDBA_PARAM_BUF_SIZE_MASK) >> 6);
+  }
+
+  /* the held backlog may go now */
+  trans->tx_wake = true;
+}
+
+int IWLMvmDriver::txEnqueue(mbuf_t m) {
+  void *head;
+
+  if (OSIncrementAtomic(&tx.npending) >= IWL_MVM_TX_PENDING_MAX) {
+    OSDecrementAtomic(&tx.npending);
+    OSIncrementAtomic(&tx.drops);
+    mbuf_freem(m);
+    return -ENOBUFS;
+  }
+
+  do {
+    head = tx.pending;
+    mbuf_setnextpkt(m, (mbuf_t)head);
+  } while (!OSCompareAndSwapPtr(head, m, &tx.pending));
+
+  return head == NULL;
+}
+
+u32 IWLMvmDriver::txPoll() {
+  mbuf_t m, next, list = NULL;
+  void *head;
+  u64 now, hold, wait = 0;
+  u32 amsdu_max;
+  bool amsdu, open;
+  int ac, n, err;
+
+  /* take everything pushed so far, newest first, and restore the order */
+  do {
+    head = tx.pending;
+  } while (!OSCompareAndSwapPtr(head, NULL, &tx.pending));
+  for (m = (mbuf_t)head; m; m = next) {
+    next = mbuf_nextpkt(m);
+    mbuf_setnextpkt(m, list);
+    list = m;
+  }
+
+  for (m = list; m; m = next) {
+    next = mbuf_nextpkt(m);
+    mbuf_setnextpkt(m, NULL);
+    ac = iwl_mvm_tx_ac(m);
+    if (tx.backlog[ac])
+      mbuf_setnextpkt(tx.backlog_tail[ac], m);
+    else
+      tx.backlog[ac] = m;
+    tx.backlog_tail[ac] = m;
+  }
+
+  trans->tx_wake = false;
+  amsdu_max = iwl_mvm_tx_amsdu_max(this);
+  now = mach_absolute_time();
+
+  /*
+   * highest priority first, a stopped queue keeps its backlog. Each
+   * backlog goes out as one burst, the doorbell rings once at its end.
+   */
+  for (ac = 0; ac < IWL_MVM_TX_NUM_ACS; ac++) {
+    int qid = IWL_MVM_DQA_MIN_MGMT_QUEUE + ac;
+    struct iwl_txq *txq = trans->txq[qid];
+
+    if (iwl_mvm_tx_ba_hold(this, ac, now, &wait)) continue;
+
+    while ((m = tx.backlog[ac]) && !test_bit(qid, trans->queue_stopped)) {
+      n = amsdu_max ? iwl_mvm_tx_amsdu_count(&tx, ac, amsdu_max, &open) : 0;
+
+      /*
+       * room for more subframes: wait for them while the queue is busy
+       * anyway, the unlocked look at its pointers is only a hint
+       */
+      if (n && open && n < IWL_MVM_TX_AMSDU_MAX_SUBFRAMES &&
+          txq->read_ptr != txq->write_ptr) {
+        if (!tx.hold_until[ac]) {
+          nanoseconds_to_absolutetime(IWL_MVM_TX_AMSDU_HOLD_US * 1000ULL,
+                                      &hold);
+          tx.hold_until[ac] = now + hold;
+        }
+        if (now < tx.hold_until[ac]) {
+          iwl_mvm_tx_wait(&wait, tx.hold_until[ac] - now);
+          break;
+        }
+      }
+      tx.hold_until[ac] = 0;
+
+      amsdu = n > 1;
+      if (amsdu) {
+        m = iwl_mvm_tx_amsdu(this, ac, n);
+        if (!m) continue;
+        tx.amsdus++;
+      } else {
+        tx.backlog[ac] = mbuf_nextpkt(m);
+        mbuf_setnextpkt(m, NULL);
+        OSDecrementAtomic(&tx.npending);
+      }
+
+      err = iwl_mvm_tx(this, m, ac, amsdu, tx.backlog[ac] != NULL);
+      if (err) {
+        IWL_DEBUG_TX(0, "dropping frame on queue %d: %d\n", qid, err);
+        OSIncrementAtomic(&tx.drops);
+        mbuf_freem(m);
+      }
+    }
+    /* the last frame of the burst may have been dropped */
+    trans->txKick(qid);
+  }
+
+  if (!wait) return 0;
+  absolutetime_to_nanoseconds(wait, &wait);
+  return (u32)(wait / 1000) + 1;
+}
+
+void IWLMvmDriver::txFlush() {
+  mbuf_t list;
+  void *head;
+  int ac;
+
+  IWL_DEBUG_TX(0, "tx: %d drops, %u A-MSDUs of %u frames, BA tids 0x%x\n",
+               tx.drops, tx.amsdus, tx.amsdu_frames, tx.ba_tids);
+
+  do {
+    head = tx.pending;
+  } while (!OSCompareAndSwapPtr(head, NULL, &tx.pending));
+  if (head) mbuf_freem_list((mbuf_t)head);
+
+  for (ac = 0; ac < IWL_MVM_TX_NUM_ACS; ac++) {
+    list = tx.backlog[ac];
+    tx.backlog[ac] = NULL;
+    if (list) mbuf_freem_list(list);
+  }
+  tx.npending = 0;
+  bzero(tx.seq, sizeof(tx.seq));
+  bzero(tx.hold_until, sizeof(tx.hold_until));
+
+  /* the association and with it the agreements are gone */
+  bzero(tx.ba, sizeof(tx.ba));
+  tx.ba_tids = 0;
+  tx.lq_ht = false;
+}
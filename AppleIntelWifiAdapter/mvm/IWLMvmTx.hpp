@@ -0,0 +1,115 @@
+//
+//  IWLMvmTx.hpp
+//  AppleIntelWifiAdapter
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+#ifndef APPLEINTELWIFIADAPTER_MVM_IWLMVMTX_HPP_
+#define APPLEINTELWIFIADAPTER_MVM_IWLMVMTX_HPP_
+
+#include <sys/kpi_mbuf.h>
+
+#include "../trans/TransHdr.h"
+#include "IWLAmsdu.h"
+
+/* frames waiting for a Tx queue, beyond this the stack's are dropped */
+#define IWL_MVM_TX_PENDING_MAX 1024
+
+/*
+ * Tx Block Ack sessions
+ *
+ * Once IWL_MVM_TX_BA_START_FRAMES QoS data frames of an AC went to an HT
+ * BSS at HT rates, its TID asks for a Block Ack agreement. The backlog is
+ * held until the queue drained, polled every IWL_MVM_TX_BA_POLL_US, so the
+ * starting sequence number can be lined up with the queue's write pointer
+ * as the scheduler requires of an aggregation queue, then an ADDBA request
+ * goes out. Without a response within IWL_MVM_TX_BA_RESP_TIMEOUT_MS, or
+ * with a refusal, the TID sends single frames again for
+ * IWL_MVM_TX_BA_RETRY_MS. VO is never aggregated, it is
+ * latency bound and carries the ADDBA frames themselves.
+ */
+#define IWL_MVM_TX_BA_START_FRAMES 32
+#define IWL_MVM_TX_BA_POLL_US 1000
+#define IWL_MVM_TX_BA_RESP_TIMEOUT_MS 1000
+#define IWL_MVM_TX_BA_RETRY_MS 10000
+
+enum iwl_mvm_tx_ba_state {
+  IWL_MVM_TX_BA_OFF,
+  IWL_MVM_TX_BA_EMPTYING,   /* waiting for the queue to drain */
+  IWL_MVM_TX_BA_REQUESTED,  /* ADDBA request sent */
+  IWL_MVM_TX_BA_ON,
+  IWL_MVM_TX_BA_REFUSED,  /* no retry before the deadline */
+};
+
+/**
+ * struct iwl_mvm_tx_ba - Block Ack agreement of an AC's TID
+ * @state: &enum iwl_mvm_tx_ba_state
+ * @token: dialog token of the ADDBA request
+ * @ssn: starting sequence number of the agreement
+ * @winsize: frames the recipient buffers
+ * @frames: QoS data frames sent while @state is OFF
+ * @deadline: absolute time the response is waited or the retry held for
+ */
+struct iwl_mvm_tx_ba {
+  u8 state;
+  u8 token;
+  u16 ssn;
+  u16 winsize;
+  u32 frames;
+  u64 deadline;
+};
+
+/*
+ * Access categories in the order of iwl_mvm_ac_to_tx_fifo, the data queue
+ * of an AC is IWL_MVM_DQA_MIN_MGMT_QUEUE + ac.
+ */
+enum iwl_mvm_tx_ac {
+  IWL_MVM_TX_AC_VO,
+  IWL_MVM_TX_AC_VI,
+  IWL_MVM_TX_AC_BE,
+  IWL_MVM_TX_AC_BK,
+  IWL_MVM_TX_NUM_ACS,
+};
+
+/**
+ * struct iwl_mvm_tx - data frames on their way to the Tx queues
+ * @pending: frames pushed by the network stack, newest first, linked
+ *    through their nextpkt
+ * @npending: frames on @pending and in the backlogs
+ * @backlog: per-AC frames in arrival order, only touched from the workloop
+ * @backlog_tail: last frame of each backlog
+ * @seq: next sequence number of each TID, QoS data only
+ * @hold_until: per-AC absolute time the backlog is held for an A-MSDU
+ *    until, 0 if it is not held
+ * @drops: frames dropped before reaching a Tx queue
+ * @amsdus: A-MSDUs sent
+ * @amsdu_frames: frames sent as A-MSDU subframes
+ * @ba: per-AC Block Ack agreement
+ * @ba_tids: TIDs whose agreement is on, they may be sent as A-MPDUs
+ * @ba_token: last dialog token used
+ * @lq_ht: the station's LQ table holds HT rates, data frames are sent
+ *    from it and may start Block Ack agreements
+ *
+ * The stack can send from any thread. It pushes onto @pending with a
+ * compare-and-swap and only the push that finds @pending empty kicks the
+ * workloop. The workloop takes the whole list in one swap and sorts it
+ * into the backlogs, which drain while their Tx queue is not stopped.
+ */
+struct iwl_mvm_tx {
+  void *volatile pending;
+  volatile SInt32 npending;
+  mbuf_t backlog[IWL_MVM_TX_NUM_ACS];
+  mbuf_t backlog_tail[IWL_MVM_TX_NUM_ACS];
+  u16 seq[IWL_MAX_TID_COUNT];
+  u64 hold_until[IWL_MVM_TX_NUM_ACS];
+  volatile SInt32 drops;
+  u32 amsdus;
+  u32 amsdu_frames;
+  struct iwl_mvm_tx_ba ba[IWL_MVM_TX_NUM_ACS];
+  u16 ba_tids;
+  u8 ba_token;
+  bool lq_ht;
+};
+
+#endif  // APPLEINTELWIFIADAPTER_MVM_IWLMVMTX_HPP_
@@ -0,0 +1,140 @@
+//
+//  IWLScanIndex.h
+//  AppleIntelWifiAdapter
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+#ifndef APPLEINTELWIFIADAPTER_MVM_IWLSCANINDEX_H_
+#define APPLEINTELWIFIADAPTER_MVM_IWLSCANINDEX_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define IWL_SCAN_HASH_SIZE 64  // power of 2
+
+static inline uint32_t iwl_scan_hash(const uint8_t* bssid, uint32_t channel) {
+  uint32_t h = channel;
+
+  for (int i = 0; i < 6; i++) h = h * 31 + bssid[i];
+  return h & (IWL_SCAN_HASH_SIZE - 1);
+}
+
+/*
+ * Scan cache index
+ *
+ * A hash on BSSID and channel, chained through the entries, and a list of
+ * the entries from the least to the most recently seen, for eviction and
+ * expiry. The entries carry the links (hash_next, lru_prev, lru_next) and
+ * their key (getBSSID(), channel.channel); the index owns nothing and
+ * takes no references. Kept apart from IWLCachedScan so it builds on a
+ * host as well (see tests/). IWL80211Device runs it under the scan cache
+ * lock.
+ */
+template <class T>
+struct iwl_scan_index {
+  T* hash[IWL_SCAN_HASH_SIZE];
+  T* lru_head;  // least recently seen
+  T* lru_tail;
+
+  void clear() {
+    for (int i = 0; i < IWL_SCAN_HASH_SIZE; i++) hash[i] = NULL;
+    lru_head = lru_tail = NULL;
+  }
+
+  T* find(const uint8_t* bssid, uint32_t channel) const {
+    T* scan = hash[iwl_scan_hash(bssid, channel)];
+
+    for (; scan; scan = scan->hash_next) {
+      if (scan->channel.channel == channel &&
+          __builtin_memcmp(scan->getBSSID(), bssid, 6) == 0)
+        return scan;
+    }
+    return NULL;
+  }
+
+  // @scan becomes the most recently seen entry
+  void insert(T* scan) {
+    T** head = &hash[iwl_scan_hash(scan->getBSSID(), scan->channel.channel)];
+
+    scan->hash_next = *head;
+    *head = scan;
+    lruAppend(scan);
+  }
+
+  void remove(T* scan) {
+    T** pp = &hash[iwl_scan_hash(scan->getBSSID(), scan->channel.channel)];
+
+    while (*pp != scan) pp = &(*pp)->hash_next;
+    *pp = scan->hash_next;
+    scan->hash_next = NULL;
+    lruUnlink(scan);
+  }
+
+  // the entry was just seen again
+  void touch(T* scan) {
+    if (scan == lru_tail) return;
+    lruUnlink(scan);
+    lruAppend(scan);
+  }
+
+ private:
+  void lruAppend(T* scan) {
+    scan->lru_prev = lru_tail;
+    scan->lru_next = NULL;
+    if (lru_tail)
+      lru_tail->lru_next = scan;
+    else
+      lru_head = scan;
+    lru_tail = scan;
+  }
+
+  void lruUnlink(T* scan) {
+    if (scan->lru_prev)
+      scan->lru_prev->lru_next = scan->lru_next;
+    else
+      lru_head = scan->lru_next;
+    if (scan->lru_next)
+      scan->lru_next->lru_prev = scan->lru_prev;
+    else
+      lru_tail = scan->lru_prev;
+    scan->lru_prev = scan->lru_next = NULL;
+  }
+};
+
+/*
+ * The channels a scan result request asks for, one bit per channel
+ * number. Channels from 256 up never match.
+ */
+struct iwl_scan_chan_map {
+  uint32_t bits[256 / 32];
+};
+
+static inline void iwl_scan_chan_map_set(struct iwl_scan_chan_map* map,
+                                         uint32_t ch) {
+  if (ch < 256) map->bits[ch / 32] |= 1U << (ch % 32);
+}
+
+static inline bool iwl_scan_chan_map_test(const struct iwl_scan_chan_map* map,
+                                          uint32_t ch) {
+  return ch < 256 && (map->bits[ch / 32] & (1U << (ch % 32)));
+}
+
+/*
+ * Adds @scan to the @count results, which are kept strongest first; of
+ * equal RSSIs the one added first stays first. The cache holds at most a
+ * few hundred entries, an insertion sort is plenty.
+ */
+template <class T>
+static inline void iwl_scan_results_insert(T** results, uint32_t* count,
+                                           T* scan) {
+  uint32_t i = (*count)++;
+  int32_t rssi = (int32_t)scan->getRSSI();
+
+  for (; i && (int32_t)results[i - 1]->getRSSI() < rssi; i--)
+    results[i] = results[i - 1];
+  results[i] = scan;
+}
+
+#endif  // APPLEINTELWIFIADAPTER_MVM_IWLSCANINDEX_H_
@@ -8,16 +8,11 @@
 
 #include "IWLApple80211.hpp"
 #include "IWLMvmDriver.hpp"
-
-/* Default NVM size to read */
-#define IWL_NVM_DEFAULT_CHUNK_SIZE (2 * 1024)
+#include "IWLNvmChunk.h"
 
 #define NVM_WRITE_OPCODE 1
 #define NVM_READ_OPCODE 0
 
-/* load nvm chunk response */
-enum { READ_NVM_CHUNK_SUCCEED = 0, READ_NVM_CHUNK_NOT_VALID_ADDRESS = 1 };
-
 struct iwl_nvm_data *IWLMvmDriver::getNvm(IWLTransport *trans,
                                           const struct iwl_fw *fw) {
   struct iwl_nvm_get_info cmd = {};
@@ -310,6 +305,252 @@ static int iwl_nvm_read_section(IWLMvmDriver *mvm, u16 section, u8 *data,
   return offset;
 }
 
+/* chunk reads kept in flight at once by iwl_nvm_read_section_pipelined() */
+#define IWL_NVM_READ_PIPELINE 4
+
+/*
+ * The responses land here and not straight in the caller's buffer: a
+ * response may still come after the caller gave up waiting, so every
+ * command in flight holds a reference.
+ */
+struct iwl_nvm_chunk_read {
+  struct iwl_nvm_read_pipe *pipe;
+  struct iwl_nvm_access_cmd cmd;
+  u16 offset;
+  int ret; /* bytes read or -errno, as iwl_nvm_read_chunk() returns */
+  u8 data[IWL_NVM_DEFAULT_CHUNK_SIZE];
+};
+
+struct iwl_nvm_read_pipe {
+  volatile SInt32 refcount;
+  struct iwl_nvm_chunk_read rd[IWL_NVM_READ_PIPELINE];
+};
+
+static void iwl_nvm_read_pipe_put(struct iwl_nvm_read_pipe *pipe) {
+  if (OSDecrementAtomic(&pipe->refcount) == 1) iwh_free(pipe);
+}
+
+static void iwl_nvm_read_chunk_done(void *ctx, struct iwl_rx_packet *pkt) {
+  struct iwl_nvm_chunk_read *rd = (struct iwl_nvm_chunk_read *)ctx;
+  struct iwl_nvm_access_resp *nvm_resp;
+
+  if (!pkt) goto out;
+
+  nvm_resp = (struct iwl_nvm_access_resp *)pkt->data;
+  rd->ret = iwl_nvm_chunk_result(
+      rd->offset, le16_to_cpu(nvm_resp->status),
+      le16_to_cpu(nvm_resp->offset), le16_to_cpu(nvm_resp->length),
+      sizeof(rd->data));
+  if (rd->ret > 0) memcpy(rd->data, nvm_resp->data, rd->ret);
+out:
+  iwl_nvm_read_pipe_put(rd->pipe);
+}
+
+/*
+ * Reads an NVM section like iwl_nvm_read_section() but with several chunk
+ * reads in flight. The reads past the end of the section that this
+ * issues come back empty or invalid and are dropped, the section ends at
+ * the first short chunk as before.
+ */
+static int iwl_nvm_read_section_pipelined(IWLMvmDriver *mvm, u16 section,
+                                          u8 *data, u32 size_read) {
+  u32 eeprom_size = mvm->m_pDevice->cfg->trans.base_params->eeprom_size;
+  struct iwl_nvm_read_pipe *pipe;
+  u32 offset = 0;
+  int i, n, ret;
+
+  pipe = (struct iwl_nvm_read_pipe *)iwh_zalloc(sizeof(*pipe));
+  if (!pipe) return iwl_nvm_read_section(mvm, section, data, size_read);
+  pipe->refcount = 1;
+
+  while (true) {
+    struct iwl_hcmd_batch *batch = iwl_hcmd_batch_alloc(mvm->trans);
+
+    if (!batch) {
+      ret = -ENOMEM;
+      goto out;
+    }
+
+    for (n = 0; n < IWL_NVM_READ_PIPELINE; n++) {
+      struct iwl_nvm_chunk_read *rd = &pipe->rd[n];
+      u16 chunk_offset = offset + n * IWL_NVM_DEFAULT_CHUNK_SIZE;
+      struct iwl_host_cmd cmd = {
+          .data = {&rd->cmd},
+          .flags = CMD_SEND_IN_RFKILL,
+          .id = NVM_ACCESS_CMD,
+          .len = {sizeof(rd->cmd)},
+          .callback = iwl_nvm_read_chunk_done,
+          .cb_ctx = rd,
+      };
+
+      if (size_read + chunk_offset + IWL_NVM_DEFAULT_CHUNK_SIZE > eeprom_size)
+        break;
+
+      rd->pipe = pipe;
+      rd->offset = chunk_offset;
+      rd->ret = -EIO;
+      rd->cmd.offset = cpu_to_le16(chunk_offset);
+      rd->cmd.length = cpu_to_le16(IWL_NVM_DEFAULT_CHUNK_SIZE);
+      rd->cmd.type = cpu_to_le16(section);
+      rd->cmd.op_code = NVM_READ_OPCODE;
+
+      OSIncrementAtomic(&pipe->refcount);
+      if (iwl_hcmd_batch_send(batch, &cmd, 0, 0)) {
+        iwl_nvm_read_pipe_put(pipe);
+        break;
+      }
+    }
+
+    ret = iwl_hcmd_batch_wait(batch);
+    iwl_hcmd_batch_put(batch);
+    if (!ret && !n) {
+      IWL_ERR(mvm, "EEPROM size is too small for NVM\n");
+      ret = -ENOBUFS;
+    }
+    if (ret) goto out;
+
+    for (i = 0; i < n; i++) {
+      struct iwl_nvm_chunk_read *rd = &pipe->rd[i];
+
+      if (rd->ret < 0) {
+        IWL_INFO(mvm, "Cannot read NVM from section %d offset %d\n", section,
+                 rd->offset);
+        ret = rd->ret;
+        goto out;
+      }
+      if (!iwl_nvm_chunk_take(data, &offset, eeprom_size - size_read,
+                              rd->offset, rd->data, rd->ret)) {
+        IWL_ERR(mvm, "NVM section %d chunk at %d out of place\n", section,
+                rd->offset);
+        ret = -EINVAL;
+        goto out;
+      }
+      if (rd->ret != IWL_NVM_DEFAULT_CHUNK_SIZE) goto done;
+    }
+  }
+
+done:
+  iwl_nvm_fixups(mvm->m_pDevice->hw_id, section, data, offset);
+
+  IWL_INFO(mvm, "NVM section %d read completed\n", section);
+  ret = offset;
+out:
+  iwl_nvm_read_pipe_put(pipe);
+  return ret;
+}
+
+/*
+ * NVM snapshot
+ *
+ * The raw sections are kept as a property of the PCI device, which
+ * outlives the driver. A reload of the driver parses them again instead
+ * of reading the NVM from the firmware. The header makes sure they came
+ * from this very card.
+ */
+#define IWL_NVM_SNAPSHOT_KEY "IWLNvmSnapshot"
+#define IWL_NVM_SNAPSHOT_MAGIC 0x314d564e /* "NVM1" */
+
+struct iwl_nvm_snapshot_hdr {
+  u32 magic;
+  u16 device_id;
+  u16 subsystem_id;
+  u32 hw_rev;
+  u32 n_sections;
+};
+
+struct iwl_nvm_snapshot_sec {
+  u16 section;
+  u16 length;
+  u8 data[];
+};
+
+static void iwl_nvm_free_sections(IWLMvmDriver *mvm) {
+  struct iwl_nvm_section *sections = mvm->m_pDevice->nvm_sections;
+
+  for (int i = 0; i < NVM_MAX_NUM_SECTIONS; i++) {
+    if (sections[i].data) IOFree((void *)sections[i].data, sections[i].length);
+    sections[i].data = NULL;
+    sections[i].length = 0;
+  }
+}
+
+static bool iwl_nvm_snapshot_load(IWLMvmDriver *mvm) {
+  IWLDevice *dev = mvm->m_pDevice;
+  OSData *snap =
+      OSDynamicCast(OSData, dev->pciDevice->getProperty(IWL_NVM_SNAPSHOT_KEY));
+  const struct iwl_nvm_snapshot_hdr *hdr;
+  const u8 *p, *end;
+  u32 i;
+
+  if (!snap || snap->getLength() < sizeof(*hdr)) return false;
+  hdr = (const struct iwl_nvm_snapshot_hdr *)snap->getBytesNoCopy();
+  if (hdr->magic != IWL_NVM_SNAPSHOT_MAGIC || hdr->device_id != dev->deviceID ||
+      hdr->subsystem_id != dev->subSystemDeviceID ||
+      hdr->hw_rev != dev->hw_rev)
+    return false;
+
+  p = (const u8 *)(hdr + 1);
+  end = (const u8 *)hdr + snap->getLength();
+  for (i = 0; i < hdr->n_sections; i++) {
+    const struct iwl_nvm_snapshot_sec *sec =
+        (const struct iwl_nvm_snapshot_sec *)p;
+    u8 *data;
+
+    if (end - p < (long)sizeof(*sec) ||
+        end - p < (long)(sizeof(*sec) + sec->length) ||
+        sec->section >= NVM_MAX_NUM_SECTIONS || !sec->length ||
+        dev->nvm_sections[sec->section].data)
+      goto err;
+    data = reinterpret_cast<u8 *>(kmemdup(sec->data, sec->length));
+    if (!data) goto err;
+    dev->nvm_sections[sec->section].data = data;
+    dev->nvm_sections[sec->section].length = sec->length;
+    p += sizeof(*sec) + sec->length;
+  }
+  return true;
+
+err:
+  IWL_WARN(0, "Dropping bad NVM snapshot\n");
+  iwl_nvm_free_sections(mvm);
+  dev->pciDevice->removeProperty(IWL_NVM_SNAPSHOT_KEY);
+  return false;
+}
+
+static void iwl_nvm_snapshot_save(IWLMvmDriver *mvm) {
+  IWLDevice *dev = mvm->m_pDevice;
+  struct iwl_nvm_snapshot_hdr hdr = {
+      .magic = IWL_NVM_SNAPSHOT_MAGIC,
+      .device_id = dev->deviceID,
+      .subsystem_id = dev->subSystemDeviceID,
+      .hw_rev = dev->hw_rev,
+  };
+  unsigned int size = sizeof(hdr);
+  OSData *snap;
+  int i;
+
+  for (i = 0; i < NVM_MAX_NUM_SECTIONS; i++) {
+    if (!dev->nvm_sections[i].length) continue;
+    size += sizeof(struct iwl_nvm_snapshot_sec) + dev->nvm_sections[i].length;
+    hdr.n_sections++;
+  }
+
+  snap = OSData::withCapacity(size);
+  if (!snap) return;
+  snap->appendBytes(&hdr, sizeof(hdr));
+  for (i = 0; i < NVM_MAX_NUM_SECTIONS; i++) {
+    struct iwl_nvm_snapshot_sec sec = {
+        .section = (u16)i,
+        .length = dev->nvm_sections[i].length,
+    };
+
+    if (!sec.length) continue;
+    snap->appendBytes(&sec, sizeof(sec));
+    snap->appendBytes(dev->nvm_sections[i].data, sec.length);
+  }
+  dev->pciDevice->setProperty(IWL_NVM_SNAPSHOT_KEY, snap);
+  snap->release();
+}
+
 static struct iwl_nvm_data *iwl_parse_nvm_sections(IWLMvmDriver *mvm) {
   struct iwl_nvm_section *sections = mvm->m_pDevice->nvm_sections;
   const __be16 *hw;
@@ -368,14 +609,12 @@ static struct iwl_nvm_data *iwl_parse_nvm_sections(IWLMvmDriver *mvm) {
       mvm->m_pDevice->fw.valid_rx_ant);
 }
 
-int IWLMvmDriver::nvmInit() {
+static int iwl_nvm_read_sections(IWLMvmDriver *mvm) {
+  IWLDevice *m_pDevice = mvm->m_pDevice;
   int ret = 0, section;
   u32 size_read = 0;
   u8 *nvm_buffer, *temp;
-  const char *nvm_file_C = m_pDevice->cfg->default_nvm_file_C_step;
 
-  if (WARN_ON_ONCE(m_pDevice->cfg->nvm_hw_section_num >= NVM_MAX_NUM_SECTIONS))
-    return -EINVAL;
   /* load NVM values from nic */
   /* Read From FW NVM */
   IWL_INFO(0, "Read from NVM\n");
@@ -385,7 +624,7 @@ int IWLMvmDriver::nvmInit() {
   for (section = 0; section < NVM_MAX_NUM_SECTIONS; section++) {
     /* we override the constness for initial read */
     IWL_INFO(0, "Parsing section %d\n", section);
-    ret = iwl_nvm_read_section(this, section, nvm_buffer, size_read);
+    ret = iwl_nvm_read_section_pipelined(mvm, section, nvm_buffer, size_read);
     IWL_INFO(0, "ret: %d\n", ret);
     if (ret == -ENODATA) {
       ret = 0;
@@ -411,6 +650,22 @@ int IWLMvmDriver::nvmInit() {
   }
   if (!size_read) IWL_ERR(mvm, "OTP is blank\n");
   IOFree(nvm_buffer, m_pDevice->cfg->trans.base_params->eeprom_size);
+  return ret;
+}
+
+int IWLMvmDriver::nvmInit() {
+  int ret = 0;
+  bool from_snapshot;
+  const char *nvm_file_C = m_pDevice->cfg->default_nvm_file_C_step;
+
+  if (WARN_ON_ONCE(m_pDevice->cfg->nvm_hw_section_num >= NVM_MAX_NUM_SECTIONS))
+    return -EINVAL;
+
+  from_snapshot = iwl_nvm_snapshot_load(this);
+  if (from_snapshot)
+    IWL_INFO(0, "NVM sections restored from snapshot\n");
+  else
+    ret = iwl_nvm_read_sections(this);
   //    /* Only if PNVM selected in the mod param - load external NVM  */
   //    if (mvm->nvm_file_name) {
   //        /* read External NVM file from the mod param */
@@ -435,7 +690,16 @@ int IWLMvmDriver::nvmInit() {
 
   /* parse the relevant nvm sections */
   m_pDevice->nvm_data = iwl_parse_nvm_sections(this);
+  if (!m_pDevice->nvm_data && from_snapshot) {
+    IWL_WARN(0, "NVM snapshot doesn't parse, reading the NVM\n");
+    m_pDevice->pciDevice->removeProperty(IWL_NVM_SNAPSHOT_KEY);
+    iwl_nvm_free_sections(this);
+    from_snapshot = false;
+    ret = iwl_nvm_read_sections(this);
+    m_pDevice->nvm_data = iwl_parse_nvm_sections(this);
+  }
   if (!m_pDevice->nvm_data) return -ENODATA;
+  if (!from_snapshot && ret >= 0) iwl_nvm_snapshot_save(this);
   IWL_INFO(0, "nvm version = %x\n", m_pDevice->nvm_data->nvm_version);
 
   u8 *hw_addr = m_pDevice->nvm_data->hw_addr;
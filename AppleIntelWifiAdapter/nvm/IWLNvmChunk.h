@@ -0,0 +1,68 @@
+//
+//  IWLNvmChunk.h
+//  AppleIntelWifiAdapter
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+#ifndef APPLEINTELWIFIADAPTER_NVM_IWLNVMCHUNK_H_
+#define APPLEINTELWIFIADAPTER_NVM_IWLNVMCHUNK_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/errno.h>
+
+/*
+ * NVM sections are read in chunks of IWL_NVM_DEFAULT_CHUNK_SIZE; the
+ * first chunk that comes back short ends the section. What a response
+ * means and how the chunks go together is kept here, apart from the
+ * commands, so it builds on a host as well (see tests/).
+ */
+#define IWL_NVM_DEFAULT_CHUNK_SIZE (2 * 1024)
+
+/* load nvm chunk response */
+enum { READ_NVM_CHUNK_SUCCEED = 0, READ_NVM_CHUNK_NOT_VALID_ADDRESS = 1 };
+
+/*
+ * iwl_nvm_chunk_result - what the response to a read of @offset says
+ * @status, @offset_read, @bytes_read: the fields of the response
+ * @max: room for the data of one chunk
+ *
+ * Returns the number of bytes read, or 0 at the end of a section whose
+ * size is a multiple of the chunk size: the firmware then fails the read
+ * of the address just past it with NOT_VALID_ADDRESS. Returns -ENODATA if
+ * the read failed and -EINVAL if the response is not for @offset or has
+ * more data than asked for.
+ */
+static inline int iwl_nvm_chunk_result(uint16_t offset, uint16_t status,
+                                       uint16_t offset_read,
+                                       uint16_t bytes_read, uint16_t max) {
+  if (status) {
+    if (offset && status == READ_NVM_CHUNK_NOT_VALID_ADDRESS) return 0;
+    return -ENODATA;
+  }
+  if (offset_read != offset || bytes_read > max) return -EINVAL;
+  return bytes_read;
+}
+
+/*
+ * iwl_nvm_chunk_take - append a chunk to the section read so far
+ * @data: the section, @size bytes of room
+ * @len: bytes of the section read so far, advanced past the chunk
+ * @offset: where the chunk was read from
+ * @chunk, @n: the chunk, as iwl_nvm_chunk_result() counted it
+ *
+ * Chunks read in parallel are taken in order of their offsets. Returns
+ * false, leaving @data alone, if the chunk does not follow the ones taken
+ * before or does not fit.
+ */
+static inline bool iwl_nvm_chunk_take(uint8_t *data, uint32_t *len,
+                                      uint32_t size, uint32_t offset,
+                                      const uint8_t *chunk, uint32_t n) {
+  if (offset != *len || n > size - *len) return false;
+  __builtin_memcpy(data + offset, chunk, n);
+  *len += n;
+  return true;
+}
+
+#endif  // APPLEINTELWIFIADAPTER_NVM_IWLNVMCHUNK_H_
@@ -0,0 +1,89 @@
+//
+//  IWLHcmdSlab.h
+//  AppleIntelWifiAdapter
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+#ifndef APPLEINTELWIFIADAPTER_TRANS_IWLHCMDSLAB_H_
+#define APPLEINTELWIFIADAPTER_TRANS_IWLHCMDSLAB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct iwl_dma_ptr;
+
+/*
+ * Size classes of the host command buffer pool (struct iwl_hcmd_pool),
+ * smallest first, 240KB of DMA memory in all; the 2KB class takes the body
+ * of a data frame that could not be mapped. The bookkeeping of the classes
+ * is kept apart from the DMA memory so it builds on a host as well (see
+ * tests/).
+ */
+#define IWL_HCMD_POOL_CLASSES 4
+
+static const struct {
+  uint32_t obj_size;
+  uint32_t count;
+} iwl_hcmd_pool_classes[IWL_HCMD_POOL_CLASSES] = {
+    {256, 64},
+    {1024, 32},
+    {2048, 64},
+    {4096, 16},
+};
+
+/**
+ * struct iwl_hcmd_slab - one size class of the command buffer pool
+ * @obj_size: size of every buffer of the class
+ * @count: number of buffers
+ * @region: the DMA memory the buffers are carved from
+ * @objs: one descriptor per buffer, pointing into @region
+ * @free: stack of the indexes of the free buffers
+ * @free_count: number of entries on @free
+ * @hits: requests served by this class
+ * @in_use_max: high-water mark of buffers in use
+ */
+struct iwl_hcmd_slab {
+  uint32_t obj_size;
+  uint32_t count;
+  struct iwl_dma_ptr *region;
+  struct iwl_dma_ptr *objs;
+  uint16_t *free;
+  uint32_t free_count;
+  uint32_t hits;
+  uint32_t in_use_max;
+};
+
+/* every buffer of @slab is free */
+static inline void iwl_hcmd_slab_reset(struct iwl_hcmd_slab *slab) {
+  for (uint32_t i = 0; i < slab->count; i++) slab->free[i] = (uint16_t)i;
+  slab->free_count = slab->count;
+}
+
+/*
+ * iwl_hcmd_slab_get - take a buffer of at least @size bytes off the
+ * smallest of the @n classes that fits and still has one
+ *
+ * Returns the class and sets *@obj to the buffer's index within it, or
+ * returns -1 if no class can serve @size.
+ */
+static inline int iwl_hcmd_slab_get(struct iwl_hcmd_slab *slab, int n,
+                                    size_t size, uint32_t *obj) {
+  for (int i = 0; i < n; i++, slab++) {
+    if (size > slab->obj_size || !slab->free_count) continue;
+    *obj = slab->free[--slab->free_count];
+    slab->hits++;
+    if (slab->count - slab->free_count > slab->in_use_max)
+      slab->in_use_max = slab->count - slab->free_count;
+    return i;
+  }
+  return -1;
+}
+
+/* give buffer @obj of iwl_hcmd_slab_get() back to its class */
+static inline void iwl_hcmd_slab_put(struct iwl_hcmd_slab *slab,
+                                     uint32_t obj) {
+  slab->free[slab->free_count++] = (uint16_t)obj;
+}
+
+#endif  // APPLEINTELWIFIADAPTER_TRANS_IWLHCMDSLAB_H_
@@ -0,0 +1,69 @@
+//
+//  IWLRbdRing.h
+//  AppleIntelWifiAdapter
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+#ifndef APPLEINTELWIFIADAPTER_TRANS_IWLRBDRING_H_
+#define APPLEINTELWIFIADAPTER_TRANS_IWLRBDRING_H_
+
+#include <stdint.h>
+
+struct iwl_rx_mem_buffer;
+
+/**
+ * struct iwl_rbd_ring - single-producer/single-consumer ring of RBDs
+ * @entries: ring storage
+ * @size: number of entries, a power of 2
+ * @head: next entry to consume, only written by the consumer
+ * @tail: next entry to produce, only written by the producer
+ *
+ * Hands RBDs between an Rx queue and the Rx allocator, which runs on its
+ * own workloop, without a lock: each side only writes its own index, so
+ * neither has to disable interrupts. The index of the other side is read
+ * with acquire and the own one published with release, which orders the
+ * entry itself (and the RBD it points to) with the index. Nothing here
+ * depends on IOKit so the ring builds on a host as well (see tests/).
+ */
+struct iwl_rbd_ring {
+  struct iwl_rx_mem_buffer **entries;
+  uint32_t size;
+  uint32_t head;
+  uint32_t tail;
+};
+
+static inline uint32_t iwl_rbd_ring_count(const struct iwl_rbd_ring *ring) {
+  return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) -
+         __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+static inline bool iwl_rbd_ring_push(struct iwl_rbd_ring *ring,
+                                     struct iwl_rx_mem_buffer *rxb) {
+  uint32_t tail = ring->tail;
+
+  /* the consumer is done with the slot once it moved head past it */
+  if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->size)
+    return false;
+
+  ring->entries[tail & (ring->size - 1)] = rxb;
+  /* the entry must be visible before the consumer sees the new tail */
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+static inline struct iwl_rx_mem_buffer *iwl_rbd_ring_pop(
+    struct iwl_rbd_ring *ring) {
+  uint32_t head = ring->head;
+  struct iwl_rx_mem_buffer *rxb;
+
+  /* don't read the entry before the tail that published it */
+  if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) return NULL;
+
+  rxb = ring->entries[head & (ring->size - 1)];
+  /* and don't hand the slot back before the entry is read */
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  return rxb;
+}
+
+#endif  // APPLEINTELWIFIADAPTER_TRANS_IWLRBDRING_H_
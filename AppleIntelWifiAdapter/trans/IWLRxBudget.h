@@ -0,0 +1,36 @@
+//
+//  IWLRxBudget.h
+//  AppleIntelWifiAdapter
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+#ifndef APPLEINTELWIFIADAPTER_TRANS_IWLRXBUDGET_H_
+#define APPLEINTELWIFIADAPTER_TRANS_IWLRXBUDGET_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * iwl_rx_budget_stop - where a budgeted pass over an Rx ring stops
+ * @read: next RB the driver handles
+ * @closed: first RB the firmware has not closed yet
+ * @size: number of RBs in the ring, a power of 2
+ * @budget: RBs the pass may still handle
+ * @more: set if the pass leaves closed RBs behind for the next one
+ *
+ * The pass handles the RBs from @read up to, not including, the returned
+ * index: @closed if all of them fit in @budget, else the first RB past
+ * the budget. handleRx() asks again after every emergency restart, with
+ * what is left of its budget.
+ */
+static inline uint32_t iwl_rx_budget_stop(uint32_t read, uint32_t closed,
+                                          uint32_t size, uint32_t budget,
+                                          bool *more) {
+  uint32_t pending = (closed - read) & (size - 1);
+
+  *more = pending > budget;
+  return *more ? (read + budget) & (size - 1) : closed;
+}
+
+#endif  // APPLEINTELWIFIADAPTER_TRANS_IWLRXBUDGET_H_
@@ -0,0 +1,90 @@
+//
+//  IWLRxHandlers.h
+//  AppleIntelWifiAdapter
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+#ifndef APPLEINTELWIFIADAPTER_TRANS_IWLRXHANDLERS_H_
+#define APPLEINTELWIFIADAPTER_TRANS_IWLRXHANDLERS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+class IWLTransport;
+struct iwl_rx_cmd_buffer;
+
+/*
+ * Rx dispatch table
+ *
+ * Indexed by group id, then by opcode, the two halves of a wide command
+ * ID. A group's opcode array only exists once something in the group is
+ * registered. Looking an ID up is two loads, whatever the ID. Nothing
+ * here depends on IOKit so the table builds on a host as well (see
+ * tests/).
+ */
+#define IWL_RX_HANDLER_GROUPS 16  // group ids are 4 bits wide
+#define IWL_RX_HANDLER_OPCODES 256
+
+typedef void (*iwl_rx_handler_fn)(IWLTransport *trans,
+                                  struct iwl_rx_cmd_buffer *rxcb);
+
+/**
+ * struct iwl_rx_handler - Rx dispatch table entry
+ * @fn: handler of the notification, NULL if nothing handles it
+ * @no_reclaim: the ID never completes a host command, even if the firmware
+ *    didn't set SEQ_RX_FRAME in its sequence
+ */
+struct iwl_rx_handler {
+  iwl_rx_handler_fn fn;
+  bool no_reclaim;
+};
+
+/**
+ * struct iwl_rx_handler_def - what the driver registers for an ID
+ * @cmd_id: wide command ID, group id in the high byte
+ * @fn: handler, NULL to leave the one of another definition
+ * @no_reclaim: ORed into the entry
+ */
+struct iwl_rx_handler_def {
+  uint16_t cmd_id;
+  iwl_rx_handler_fn fn;
+  bool no_reclaim;
+};
+
+/* entry of every ID nothing is registered for */
+static const struct iwl_rx_handler iwl_rx_no_handler = {};
+
+/*
+ * iwl_rx_handlers_add - merge @def into @table
+ *
+ * @alloc_group returns a zeroed array of IWL_RX_HANDLER_OPCODES entries
+ * for a group seen the first time. Returns false if the group id is out
+ * of range or the array could not be allocated.
+ */
+static inline bool iwl_rx_handlers_add(
+    struct iwl_rx_handler **table, const struct iwl_rx_handler_def *def,
+    struct iwl_rx_handler *(*alloc_group)(void)) {
+  uint8_t group_id = def->cmd_id >> 8;
+  struct iwl_rx_handler *handler;
+
+  if (group_id >= IWL_RX_HANDLER_GROUPS) return false;
+  if (!table[group_id]) {
+    table[group_id] = alloc_group();
+    if (!table[group_id]) return false;
+  }
+
+  handler = &table[group_id][def->cmd_id & 0xff];
+  if (def->fn) handler->fn = def->fn;
+  handler->no_reclaim |= def->no_reclaim;
+  return true;
+}
+
+static inline const struct iwl_rx_handler *iwl_rx_handlers_get(
+    struct iwl_rx_handler *const *table, uint8_t group_id, uint8_t opcode) {
+  if (group_id >= IWL_RX_HANDLER_GROUPS || !table[group_id])
+    return &iwl_rx_no_handler;
+  return &table[group_id][opcode];
+}
+
+#endif  // APPLEINTELWIFIADAPTER_TRANS_IWLRXHANDLERS_H_
@@ -20,11 +20,11 @@ static inline void iwl_scd_txq_enable_agg(IWLTransport *trans, u16 txq_id) {
 }
 
 static inline void iwl_scd_txq_disable_agg(IWLTransport *trans, u16 txq_id) {
-  trans->iwlSetBitsPRPH(SCD_AGGR_SEL, BIT(txq_id));
+  trans->iwlClearBitsPRPH(SCD_AGGR_SEL, BIT(txq_id));
 }
 
 static inline void iwl_scd_disable_agg(IWLTransport *trans) {
-  trans->iwlSetBitsPRPH(SCD_AGGR_SEL, 0);
+  trans->iwlWritePRPH(SCD_AGGR_SEL, 0);
 }
 
 static inline void iwl_scd_activate_fifos(IWLTransport *trans) {
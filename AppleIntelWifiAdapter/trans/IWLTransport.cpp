@@ -8,6 +8,8 @@
 
 #include "IWLTransport.hpp"
 
+#include <kern/clock.h>
+
 #include "../fw/api/tx.h"
 #include "IWLDebug.h"
 #include "IWLFH.h"
@@ -87,7 +89,21 @@ bool IWLTransport::init(IWLDevice *device) {
   // waitlocks
   this->ucode_write_waitq = IOLockAlloc();
   this->wait_command_queue = IOLockAlloc();
+  bzero(this->fw_load_buf, sizeof(this->fw_load_buf));
   this->def_rx_queue = 0;
+  this->rx_poll_scheduled = false;
+  this->rx_poll_handled = 0;
+  bzero(&this->tx_stats, sizeof(this->tx_stats));
+  this->tx_wake = false;
+  this->tx_cursor = NULL;
+  this->rx_page_pool = NULL;
+  bzero(&this->int_mit, sizeof(this->int_mit));
+  this->int_mit.adaptive = true;
+  this->int_mit.timeout = IWL_HOST_INT_TIMEOUT_DEF;
+  if (iwl_pcie_rx_init_handlers(this)) {
+    IOLog("IWLTransport rx handlers fail\n");
+    return false;
+  }
   int addr_size;
   if (m_pDevice->cfg->trans.use_tfh) {
     addr_size = 64;
@@ -187,16 +203,15 @@ bool IWLTransport::finishNicInit() {
 }
 
 void IWLTransport::release() {
+  rxFree();
+  freeFWLoadBufs();
+  freeFWImageCache();
+
   if (this->rba.alloc_wq) {
     this->rba.alloc_wq->release();
     this->rba.alloc_wq = NULL;
   }
 
-  if (this->rba.lock) {
-    IOSimpleLockFree(this->rba.lock);
-    this->rba.lock = NULL;
-  }
-
   if (this->irq_lock) {
     IOSimpleLockFree(this->irq_lock);
     this->irq_lock = NULL;
@@ -405,10 +420,13 @@ void IWLTransport::loadFWChunkFh(u32 dst_addr, dma_addr_t phy_addr,
                        FH_TCSR_TX_CONFIG_REG_VAL_CIRQ_HOST_ENDTFD);
 }
 
+/* starts the DMA of a chunk, waitFWChunk() waits for it to finish */
 int IWLTransport::loadFWChunk(u32 dst_addr, dma_addr_t phy_addr, u32 byte_cnt) {
   IOInterruptState flags;
-  int ret = 0;
+
+  IOLockLock(this->ucode_write_waitq);
   this->ucode_write_complete = false;
+  IOLockUnlock(this->ucode_write_waitq);
 
   if (!this->grabNICAccess(&flags)) {
     return -EIO;
@@ -416,53 +434,142 @@ int IWLTransport::loadFWChunk(u32 dst_addr, dma_addr_t phy_addr, u32 byte_cnt) {
 
   loadFWChunkFh(dst_addr, phy_addr, byte_cnt);
   this->releaseNICAccess(&flags);
-  IOLockLock(this->ucode_write_waitq);
+
+  return 0;
+}
+
+int IWLTransport::waitFWChunk() {
   AbsoluteTime deadline;
+  int ret = THREAD_AWAKENED;
+
   clock_interval_to_deadline(5, kSecondScale,
                              reinterpret_cast<UInt64 *>(&deadline));
-  ret =
-      IOLockSleepDeadline(this->ucode_write_waitq, &this->ucode_write_complete,
-                          deadline, THREAD_INTERRUPTIBLE);
+  IOLockLock(this->ucode_write_waitq);
+  /* the interrupt may well have come already */
+  while (!this->ucode_write_complete && ret == THREAD_AWAKENED)
+    ret = IOLockSleepDeadline(this->ucode_write_waitq,
+                              &this->ucode_write_complete, deadline,
+                              THREAD_INTERRUPTIBLE);
+  ret = this->ucode_write_complete ? 0 : -ETIMEDOUT;
   IOLockUnlock(this->ucode_write_waitq);
-  IWL_INFO(0, "loadFWChunk wakeup\n");
-  if (ret == -1) {
-    IWL_ERR(0, "Failed to load firmware chunk!\n");
-    return -ETIMEDOUT;
+  if (ret) IWL_ERR(0, "Failed to load firmware chunk!\n");
+
+  return ret;
+}
+
+/*
+ * The bounce buffers are a full FH_MEM_TB_MAX_LENGTH chunk each, or a
+ * page if that much contiguous memory can't be found.
+ */
+bool IWLTransport::allocFWLoadBufs() {
+  u32 size = FH_MEM_TB_MAX_LENGTH;
+  int i;
+
+  if (this->fw_load_buf[0]) return true;
+
+  while (true) {
+    for (i = 0; i < IWL_FW_LOAD_BUFS; i++) {
+      this->fw_load_buf[i] = allocate_dma_buf32(size);
+      if (!this->fw_load_buf[i]) break;
+    }
+    if (i == IWL_FW_LOAD_BUFS) break;
+
+    freeFWLoadBufs();
+    if (size == PAGE_SIZE) return false;
+    size = PAGE_SIZE;
   }
+  this->fw_load_buf_size = size;
 
-  return 0;
+  return true;
+}
+
+void IWLTransport::freeFWLoadBufs() {
+  for (int i = 0; i < IWL_FW_LOAD_BUFS; i++) {
+    if (this->fw_load_buf[i]) free_dma_buf(this->fw_load_buf[i]);
+    this->fw_load_buf[i] = NULL;
+  }
 }
 
 /* extended range in FW SRAM */
 #define IWL_FW_MEM_EXTENDED_START 0x40000
 #define IWL_FW_MEM_EXTENDED_END 0x57FFF
 
-int IWLTransport::loadSection(u8 section_num, const struct fw_desc *section) {
-  u32 offset, chunk_sz = min_t(u32, FH_MEM_TB_MAX_LENGTH, section->len);
-  int ret = 0;
-  IWL_INFO(0, "[%d] uCode section being loaded...\n", section_num);
-  IOBufferMemoryDescriptor *bmd =
-      IOBufferMemoryDescriptor::inTaskWithPhysicalMask(
-          kernel_task, 0, section->len, 0x00000000ffffffffULL);
-  bmd->prepare();
-  IODMACommand *cmd = IODMACommand::withSpecification(
-      kIODMACommandOutputHost32, 32, 0, IODMACommand::kMapped, 0, 1);
-  cmd->setMemoryDescriptor(bmd);
-  cmd->prepare();
-  IODMACommand::Segment32 seg;
-  UInt64 ofs = 0;
-  UInt32 numSegs = 1;
-  if (cmd->gen32IOVMSegments(&ofs, &seg, &numSegs) != kIOReturnSuccess) {
-    IWL_ERR(0, "咋了？？\n");
-    return -1;
-  }
-  for (offset = 0; offset < section->len; offset += chunk_sz) {
+/*
+ * Keeps a DMA-ready copy of a firmware section so that restarts and
+ * resume only have to program the DMA. Fails without side effects.
+ */
+bool IWLTransport::cacheFWSection(struct fw_desc *section) {
+  int i, n = DIV_ROUND_UP(section->len, FH_MEM_TB_MAX_LENGTH);
+  struct iwl_dma_ptr **chunks;
+
+  chunks = (struct iwl_dma_ptr **)iwh_zalloc(n * sizeof(*chunks));
+  if (!chunks) return false;
+
+  for (i = 0; i < n; i++) {
+    u32 offset = i * FH_MEM_TB_MAX_LENGTH;
+    u32 len = min_t(u32, FH_MEM_TB_MAX_LENGTH, section->len - offset);
+
+    chunks[i] = allocate_dma_buf32(len);
+    if (!chunks[i]) {
+      while (--i >= 0) free_dma_buf(chunks[i]);
+      iwh_free(chunks);
+      return false;
+    }
+    memcpy(chunks[i]->addr, (const u8 *)section->data + offset, len);
+  }
+  section->dma = chunks;
+  section->num_dma = n;
+
+  return true;
+}
+
+void IWLTransport::freeFWImageCache() {
+  struct iwl_fw *fw = &m_pDevice->fw;
+
+  for (int type = 0; type < IWL_UCODE_TYPE_MAX; type++) {
+    for (int i = 0; i < fw->img[type].num_sec; i++) {
+      struct fw_desc *sec = &fw->img[type].sec[i];
+
+      if (!sec->dma) continue;
+      for (int j = 0; j < sec->num_dma; j++) free_dma_buf(sec->dma[j]);
+      iwh_free(sec->dma);
+      sec->dma = NULL;
+      sec->num_dma = 0;
+    }
+  }
+}
+
+/*
+ * Loads a section chunk by chunk. A section the parser put in DMA-able
+ * memory is loaded in place. Otherwise the first load makes a DMA-ready
+ * copy of the section that later loads reuse as is, and without one the
+ * chunks go through the two bounce buffers: the next chunk is copied into
+ * one while the other is DMAed to the device.
+ */
+int IWLTransport::loadSection(u8 section_num, struct fw_desc *section) {
+  const u8 *data = (const u8 *)section->data;  // NOLINT(readability/casting)
+  bool cached = section->buf || section->dma || cacheFWSection(section);
+  u32 offset, chunk_sz;
+  u64 start = mach_absolute_time(), ns;
+  int n, ret = 0;
+
+  if (cached) {
+    chunk_sz = min_t(u32, FH_MEM_TB_MAX_LENGTH, section->len);
+  } else if (allocFWLoadBufs()) {
+    chunk_sz = min_t(u32, this->fw_load_buf_size, section->len);
+    memcpy(this->fw_load_buf[0]->addr, data, chunk_sz);
+  } else {
+    IWL_ERR(0, "Could not allocate the firmware load buffers\n");
+    return -ENOMEM;
+  }
+
+  for (offset = 0, n = 0; offset < section->len; offset += chunk_sz, n++) {
+    struct iwl_dma_ptr *buf = NULL, *next = NULL;
+    dma_addr_t phys;
     u32 copy_size, dst_addr;
     bool extended_addr = false;
 
-    copy_size = min(
-        chunk_sz,
-        (u32)(section->len - offset));  // NOLINT(build/include_what_you_use)
+    copy_size = min_t(u32, chunk_sz, section->len - offset);
     dst_addr = section->offset + offset;
 
     if (dst_addr >= IWL_FW_MEM_EXTENDED_START &&
@@ -472,24 +579,38 @@ int IWLTransport::loadSection(u8 section_num, const struct fw_desc *section) {
     if (extended_addr)
       this->iwlSetBitsPRPH(LMPM_CHICK, LMPM_CHICK_EXTENDED_ADDR_SPACE);
 
-    // clang-format off
-    cmd->writeBytes(0, (u8 *)section->data + offset, copy_size);  // NOLINT(readability/casting)
-    // clang-format on
-    ret = loadFWChunk(dst_addr, seg.fIOVMAddr, copy_size);
+    if (section->buf) {
+      phys = section->buf->dma + offset;
+    } else if (cached) {
+      phys = section->dma[n]->dma;
+    } else {
+      buf = this->fw_load_buf[n % IWL_FW_LOAD_BUFS];
+      next = this->fw_load_buf[(n + 1) % IWL_FW_LOAD_BUFS];
+      phys = buf->dma;
+    }
+
+    ret = loadFWChunk(dst_addr, phys, copy_size);
+    if (!ret) {
+      /* stage the next chunk while this one is in flight */
+      if (next && offset + chunk_sz < section->len)
+        memcpy(next->addr, data + offset + chunk_sz,
+               min_t(u32, chunk_sz, section->len - offset - chunk_sz));
+      ret = waitFWChunk();
+    }
 
     if (extended_addr)
       this->iwlClearBitsPRPH(LMPM_CHICK, LMPM_CHICK_EXTENDED_ADDR_SPACE);
 
     if (ret) {
       IWL_ERR(trans, "Could not load the [%d] uCode section\n", section_num);
-      break;
+      return ret;
     }
   }
-  IWL_INFO(0, "write ucode complete\n");
-  cmd->complete();
-  cmd->clearMemoryDescriptor();
-  cmd->release();
-  return ret;
+
+  absolutetime_to_nanoseconds(mach_absolute_time() - start, &ns);
+  IWL_INFO(0, "[%d] uCode section loaded: %u bytes in %llu us%s\n",
+           section_num, section->len, ns / 1000, cached ? " (cached)" : "");
+  return 0;
 }
 
 int IWLTransport::loadCPUSections8000(const struct fw_img *image, int cpu,
@@ -775,11 +896,9 @@ void IWLTransport::apmLpXtalEnable() {
 
 void IWLTransport::freeResp(struct iwl_host_cmd *cmd) {
   if (cmd->resp_pkt) {
-    // IOFree(cmd->resp_pkt, cmd->resp_pkt_len);
-    IWL_WARN(0, "LEAKING PAGE\n");
-
-    // maybe this doesn't actually leak the page?
-    // this->m_pDevice->controller->freePacket((mbuf_t)cmd->resp_pkt);
+    /* hand the stolen Rx page back to the page pool */
+    iwl_pcie_rx_page_put(reinterpret_cast<iwl_rx_page *>(cmd->_rx_page_addr));
+    cmd->_rx_page_addr = 0;
   }
   cmd->resp_pkt = NULL;
 }
@@ -795,7 +914,7 @@ int IWLTransport::sendCmd(iwl_host_cmd *cmd) {
     return -EIO;
   }
   if (WARN_ON((cmd->flags & CMD_WANT_ASYNC_CALLBACK) &&
-              !(cmd->flags & CMD_ASYNC)))
+              (!(cmd->flags & CMD_ASYNC) || !cmd->callback)))
     return -EINVAL;
   if (this->wide_cmd_header && !iwl_cmd_groupid(cmd->id))
     cmd->id = DEF_ID(cmd->id);
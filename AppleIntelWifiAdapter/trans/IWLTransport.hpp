@@ -14,6 +14,7 @@
 #include "../IWLCtxtInfo.hpp"
 #include "../IWLDevice.hpp"
 #include "../IWLInternal.hpp"
+#include "../IWLTrace.h"
 #include "IWLIO.hpp"
 #include "TransHdr.h"
 
@@ -80,7 +81,17 @@ class IWLTransport : public IWLIO {
 
   int loadFWChunk(u32 dst_addr, dma_addr_t phy_addr, u32 byte_cnt);
 
-  int loadSection(u8 section_num, const struct fw_desc *section);
+  int waitFWChunk();
+
+  bool allocFWLoadBufs();
+
+  void freeFWLoadBufs();
+
+  bool cacheFWSection(struct fw_desc *section);
+
+  void freeFWImageCache();
+
+  int loadSection(u8 section_num, struct fw_desc *section);
 
   int loadCPUSections8000(const struct fw_img *image, int cpu,
                           int *first_ucode_section);
@@ -122,7 +133,19 @@ class IWLTransport : public IWLIO {
 
   void rxqRestok(struct iwl_rxq *rxq);
 
-  void handleRx(int queue);  // iwl_pcie_rx_handle
+  /*
+   * Handles at most budget RBs from the given queue. Returns true if the
+   * ring was not drained and another poll pass is needed.
+   */
+  bool handleRx(int queue, int budget);  // iwl_pcie_rx_handle
+
+  // adaptive interrupt moderation, see struct iwl_int_mit
+  void intMitSetAdaptive(bool adaptive);
+  void intMitIrq();
+  void intMitWindow(u64 now, u64 elapsed);
+  bool intMitArmIdle();
+  bool intMitIdle();
+  void intMitDump();
 
   void restockBd(struct iwl_rxq *rxq,
                  struct iwl_rx_mem_buffer *rxb);  // iwl_pcie_restock_bd
@@ -164,6 +187,13 @@ class IWLTransport : public IWLIO {
 
   void txqCheckWrPtrs();  // iwl_pcie_txq_check_wrptrs
 
+  int txFrame(mbuf_t m, struct iwl_device_tx_cmd *dev_cmd, int txq_id,
+              bool more);  // iwl_trans_pcie_tx
+
+  void txKick(int txq_id);
+
+  void txReclaim(int txq_id, int ssn);  // iwl_trans_pcie_reclaim
+
   void syncNmi();
 
   // cmd
@@ -185,6 +215,10 @@ class IWLTransport : public IWLIO {
   enum iwl_trans_state state;
   bool ucode_write_complete;  // indicates that the ucode has been copied.
   IOLock *ucode_write_waitq;  // wait queue for uCode load
+  // bounce buffers for the fw sections, one is filled while the other is
+  // being DMAed, kept from the first load until release
+  struct iwl_dma_ptr *fw_load_buf[IWL_FW_LOAD_BUFS];
+  u32 fw_load_buf_size;
   IOLock *wait_command_queue;
   union {
     struct iwl_context_info *ctxt_info;
@@ -224,6 +258,9 @@ class IWLTransport : public IWLIO {
   unsigned long queue_stopped[BITS_TO_LONGS(IWL_MAX_TVQM_QUEUES)];  // NOLINT(runtime/int)
   // clang-format on
   unsigned int cmd_q_wdg_timeout;
+  struct iwl_tx_stats tx_stats;
+  IOMbufNaturalMemoryCursor *tx_cursor;  // maps data frame bodies to TBs
+  bool tx_wake;  // a stopped data queue has room again
 
   // rx
   int num_rx_queues;
@@ -235,7 +272,12 @@ class IWLTransport : public IWLIO {
   struct iwl_rx_mem_buffer *rx_pool;
   struct iwl_rx_mem_buffer **global_table;
   struct iwl_rb_allocator rba;
+  struct iwl_rx_page_pool *rx_page_pool;
+  struct iwl_hcmd_pool hcmd_pool;
   struct isr_statistics isr_stats;
+  struct iwl_int_mit int_mit;
+  bool rx_poll_scheduled;  // rx interrupt stays masked until the ring drains
+  u32 rx_poll_handled;     // INTA bits of the irq that deferred to rxPoll()
 
   struct iwl_rx_phy_info last_phy_info;
 
@@ -261,7 +303,8 @@ class IWLTransport : public IWLIO {
   u32 scd_base_addr;         // scheduler sram base address in SRAM
   iwl_dma_ptr *scd_bc_tbls;  // pointer to the byte count table of the scheduler
   iwl_dma_ptr *kw;           // keep warm address
-  u8 no_reclaim_cmds[1];
+  // Rx dispatch table, by group id then opcode
+  struct iwl_rx_handler *rx_handlers[IWL_RX_HANDLER_GROUPS];
 
   intptr_t trans_ops;
 
@@ -282,8 +325,18 @@ class IWLTransport : public IWLIO {
 
 void iwl_pcie_tfd_unmap(IWLTransport *trans, struct iwl_cmd_meta *meta,
                         struct iwl_txq *txq, int index);
+void iwl_pcie_hcmd_pool_reap(IWLTransport *trans);
 const char *iwl_get_cmd_string(IWLTransport *trans, u32 id);
 void iwl_pcie_clear_cmd_in_flight(IWLTransport *trans);
+void iwl_pcie_rx_page_put(struct iwl_rx_page *rxp);
+int iwl_pcie_rx_init_handlers(IWLTransport *trans);
+mbuf_t iwl_pcie_rx_slice(struct iwl_rx_cmd_buffer *rxcb);
+struct iwl_hcmd_batch *iwl_hcmd_batch_alloc(IWLTransport *trans);
+void iwl_hcmd_batch_put(struct iwl_hcmd_batch *batch);
+int iwl_hcmd_batch_send(struct iwl_hcmd_batch *batch,
+                        struct iwl_host_cmd *cmd, u32 status_mask,
+                        u32 status_ok);
+int iwl_hcmd_batch_wait(struct iwl_hcmd_batch *batch);
 
 static inline void *rxb_addr(struct iwl_rx_cmd_buffer *r) {
   mbuf_t page = (mbuf_t)r->_page;
@@ -304,8 +357,13 @@ static inline void *rxb_addr(struct iwl_rx_cmd_buffer *r) {
 
 static inline int rxb_offset(struct iwl_rx_cmd_buffer *r) { return r->_offset; }
 
+/*
+ * The thief gets its own reference on the page and must drop it with
+ * iwl_pcie_rx_page_put() once done, the page then goes back to the pool.
+ */
 static inline mbuf_t rxb_steal_page(struct iwl_rx_cmd_buffer *r) {
   r->_page_stolen = true;
+  OSIncrementAtomic(&r->_rx_page->refcount);
   return (mbuf_t)r->_page;
 }
 
@@ -7,8 +7,11 @@
 //
 
 #include <IOKit/IOLocks.h>
+#include <IOKit/IOTimerEventSource.h>
+#include <kern/clock.h>
 
 #include "IWLApple80211.hpp"
+#include "IWLRxBudget.h"
 #include "IWLTransport.hpp"
 #include "TransHdr.h"
 
@@ -18,51 +21,74 @@
 #define ICT_COUNT (ICT_SIZE / sizeof(u32))
 
 /*
- * iwl_rxq_space - Return number of free slots available in queue.
+ * move_to_allocator - hand the queue's used RBDs over to the allocator
+ *
+ * The ring is sized for the whole RBD pool, so it never fills up.
  */
+static void move_to_allocator(struct iwl_rxq *rxq) {
+  struct iwl_rx_mem_buffer *rxb;
 
-void move_to_allocator(iwl_rb_allocator *rba, iwl_rxq *rxq) {
-  if (!TAILQ_EMPTY(&rxq->rx_used)) {
-    TAILQ_CONCAT(&rba->rbd_empty, &rxq->rx_used, list);
-    TAILQ_INIT(&rxq->rx_used);
+  while ((rxb = TAILQ_FIRST(&rxq->rx_used)) != NULL) {
+    /* the allocator owns the list linkage as soon as it is pushed */
+    TAILQ_REMOVE(&rxq->rx_used, rxb, list);
+    if (WARN_ON(!iwl_rbd_ring_push(&rxq->rbd_empty, rxb))) {
+      TAILQ_INSERT_HEAD(&rxq->rx_used, rxb, list);
+      return;
+    }
   }
 }
 
 static void iwl_pcie_rx_allocator_get(IWLTransport *trans,
                                       struct iwl_rxq *rxq) {
-  // struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
-  struct iwl_rb_allocator *rba = &trans->rba;
   int i;
 
   /*
-   * atomic_dec_if_positive returns req_ready - 1 for any scenario.
-   * If req_ready is 0 atomic_dec_if_positive will return -1 and this
-   * function will return early, as there are no ready requests.
-   * atomic_dec_if_positive will perofrm the *actual* decrement only if
-   * req_ready > 0, i.e. - there are ready requests and the function
-   * hands one request to the caller.
+   * Emulates atomic_dec_if_positive: only consume a request if the
+   * allocator has honored one, otherwise undo the decrement and return
+   * early, as there are no ready requests.
    */
-  if (OSDecrementAtomic(&rba->req_ready) < 0) {
-    rba->req_ready = 0;
+  if (OSDecrementAtomic(&rxq->req_ready) <= 0) {
+    OSIncrementAtomic(&rxq->req_ready);
     return;
   }
 
-  IOSimpleLockLock(rba->lock);
   for (i = 0; i < RX_CLAIM_REQ_ALLOC; i++) {
-    /* Get next free Rx buffer, remove it from free list */
+    /* Get next allocated Rx buffer, move it to the free list */
+    struct iwl_rx_mem_buffer *rxb = iwl_rbd_ring_pop(&rxq->rbd_allocated);
+    if (!rxb) break;
 
-    struct iwl_rx_mem_buffer *rxb = TAILQ_FIRST(&rba->rbd_allocated);
-    if (!rxb) continue;
-
-    TAILQ_REMOVE(&rba->rbd_allocated, rxb, list);
     TAILQ_INSERT_TAIL(&rxq->rx_free, rxb, list);
   }
-  IOSimpleLockUnlock(rba->lock);
 
-  rxq->used_count -= RX_CLAIM_REQ_ALLOC;
-  rxq->free_count += RX_CLAIM_REQ_ALLOC;
+  rxq->used_count -= i;
+  rxq->free_count += i;
 }
 
+static int iwl_pcie_rbd_ring_alloc(struct iwl_rbd_ring *ring, u32 entries) {
+  u32 size = 1;
+
+  while (size < entries) size <<= 1;
+
+  ring->entries = reinterpret_cast<iwl_rx_mem_buffer **>(
+      iwh_zalloc(size * sizeof(struct iwl_rx_mem_buffer *)));
+  if (!ring->entries) return -ENOMEM;
+
+  ring->size = size;
+  ring->head = 0;
+  ring->tail = 0;
+  return 0;
+}
+
+static void iwl_pcie_rbd_ring_free(struct iwl_rbd_ring *ring) {
+  iwh_free(ring->entries);
+  ring->entries = NULL;
+  ring->size = 0;
+}
+
+/*
+ * iwl_rxq_space - Return number of free slots available in queue.
+ */
+
 static int iwl_rxq_space(const struct iwl_rxq *rxq) {
   /* Make sure rx queue size is a power of 2 */
   WARN_ON(rxq->queue_size & (rxq->queue_size - 1));
@@ -193,7 +219,6 @@ err:
 }
 
 static int iwl_pcie_rx_alloc(IWLTransport *trans_pcie) {
-  struct iwl_rb_allocator *rba = &trans_pcie->rba;
   int i, ret;
 
   int free_size = trans_pcie->m_pDevice->cfg->trans.mq_rx_supported
@@ -221,8 +246,6 @@ static int iwl_pcie_rx_alloc(IWLTransport *trans_pcie) {
     goto err;
   }
 
-  rba->lock = IOSimpleLockAlloc();
-
   /*
    * Allocate the driver's pointer to receive buffer status.
    * Allocate for all queues continuously (HW requirement).
@@ -276,6 +299,13 @@ static int iwl_pcie_rx_alloc(IWLTransport *trans_pcie) {
     if (!rxq->rb_stts) {
       goto err;
     }
+
+    /* Every RBD in the pool may be parked on either ring at once */
+    if (iwl_pcie_rbd_ring_alloc(&rxq->rbd_empty,
+                                RX_POOL_SIZE(trans_pcie->num_rx_bufs)) ||
+        iwl_pcie_rbd_ring_alloc(&rxq->rbd_allocated,
+                                RX_POOL_SIZE(trans_pcie->num_rx_bufs)))
+      goto err;
   }
   return 0;
 
@@ -300,6 +330,9 @@ err:
 
     rxq->used_bd_dma = 0;
     rxq->used_bd = NULL;
+
+    iwl_pcie_rbd_ring_free(&rxq->rbd_empty);
+    iwl_pcie_rbd_ring_free(&rxq->rbd_allocated);
   }
   iwh_free(trans_pcie->rxq);
   return -ENOMEM;
@@ -308,10 +341,10 @@ err:
 static void iwl_pcie_free_rbs_pool(IWLTransport *trans) {
   int i;
   for (i = 0; i < RX_POOL_SIZE(trans->num_rx_bufs); i++) {
-    if (!trans->rx_pool[i].page) continue;
-    //        dma_unmap_page(trans->dev, trans_pcie->rx_pool[i].page_dma,
-    //                   trans_pcie->rx_buf_bytes, DMA_FROM_DEVICE);
-    mbuf_freem(trans->rx_pool[i].page);
+    if (!trans->rx_pool[i].rx_page) continue;
+    /* the page stays mapped, it just goes back to the page pool */
+    iwl_pcie_rx_page_put(trans->rx_pool[i].rx_page);
+    trans->rx_pool[i].rx_page = NULL;
     trans->rx_pool[i].page = NULL;
   }
 }
@@ -320,7 +353,7 @@ static void iwl_pcie_free_rbs_pool(IWLTransport *trans) {
  * iwl_pcie_rx_alloc_page - allocates and returns a page.
  *
  */
-static mbuf_t iwl_pcie_rx_alloc_page(IWLTransport *trans, u32 *offset) {
+static mbuf_t iwl_pcie_rx_alloc_page(IWLTransport *trans, u32 page_bytes) {
   mbuf_t m;
   unsigned int size;
   if (!trans->m_pDevice) {
@@ -338,7 +371,7 @@ static mbuf_t iwl_pcie_rx_alloc_page(IWLTransport *trans, u32 *offset) {
     // bmd = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task,
     // options, PAGE_SIZE, 0);
 
-    error = mbuf_allocpacket(MBUF_DONTWAIT, PAGE_SIZE, &size, &m);
+    error = mbuf_allocpacket(MBUF_DONTWAIT, page_bytes, &size, &m);
     // mbuf_
     // IOByteCount count;
     // addr64_t ad = bmd->getPhysicalSegment(0, &count);
@@ -353,7 +386,7 @@ static mbuf_t iwl_pcie_rx_alloc_page(IWLTransport *trans, u32 *offset) {
     return 0;
   }
 
-  m = trans->m_pDevice->controller->allocatePacket(PAGE_SIZE);
+  m = trans->m_pDevice->controller->allocatePacket(page_bytes);
   if (m == 0) IWL_WARN(0, "allocatePacket failed!\n");
 
   // IWL_WARN(0, "allocated the normal way\n");
@@ -361,6 +394,250 @@ static mbuf_t iwl_pcie_rx_alloc_page(IWLTransport *trans, u32 *offset) {
   return m;
 }
 
+/*
+ * iwl_pcie_rx_page_bytes - size of the pages of the Rx page pool
+ *
+ * Pages are mbuf clusters mapped through a one segment cursor, which are
+ * physically contiguous up to a page only. RBs past that would need DMA
+ * memory of their own under the mbufs, so they are refused: 0 for those.
+ * A 2K RB takes a page of its own.
+ */
+static u32 iwl_pcie_rx_page_bytes(IWLTransport *trans) {
+  if (iwl_trans_get_rb_size_order((iwl_amsdu_size)trans->rx_buf_size) > 0)
+    return 0;
+  return PAGE_SIZE;
+}
+
+/*
+ * iwl_pcie_rx_page_fill - allocate and map the page of a page pool entry
+ */
+static int iwl_pcie_rx_page_fill(IWLTransport *trans,
+                                 struct iwl_rx_page_pool *pool,
+                                 struct iwl_rx_page *rxp) {
+  IOMemoryCursor::PhysicalSegment vec;
+
+  rxp->page = iwl_pcie_rx_alloc_page(trans, pool->page_bytes);
+  if (!rxp->page) return -ENOMEM;
+
+  if (pool->cursor->getPhysicalSegments(rxp->page, &vec, 1) == 0) {
+    IWL_ERR(0, "could not get physical segment\n");
+    mbuf_freem(rxp->page);
+    rxp->page = NULL;
+    return -ENOMEM;
+  }
+  rxp->page_dma = vec.location;
+  rxp->refcount = 0;
+  rxp->pool = pool;
+  return 0;
+}
+
+/*
+ * iwl_pcie_rx_page_pool_init - allocate and map the Rx page pool
+ *
+ * One page per RBD and a few spare ones, each as big as an Rx buffer. Pages
+ * that fail to allocate are simply left out, the pool then misses earlier.
+ */
+static void iwl_pcie_rx_page_pool_release(struct iwl_rx_page_pool *pool) {
+  /* OSDecrementAtomic returns the old value */
+  if (OSDecrementAtomic(&pool->refcount) != 1) return;
+
+  /* detached, so every page's mbuf is gone already */
+  OSSafeReleaseNULL(pool->cursor);
+  IOSimpleLockFree(pool->lock);
+  iwh_free(pool->pages);
+  iwh_free(pool);
+}
+
+static int iwl_pcie_rx_page_pool_init(IWLTransport *trans, u32 size) {
+  struct iwl_rx_page_pool *pool;
+  u32 i;
+
+  if (!iwl_pcie_rx_page_bytes(trans)) {
+    IWL_ERR(0, "RB size %d is larger than a page, not supported\n",
+            trans->rx_buf_size);
+    return -EINVAL;
+  }
+
+  pool = reinterpret_cast<iwl_rx_page_pool *>(
+      iwh_zalloc(sizeof(struct iwl_rx_page_pool)));
+  if (!pool) return -ENOMEM;
+
+  pool->page_bytes = iwl_pcie_rx_page_bytes(trans);
+  pool->pages = reinterpret_cast<iwl_rx_page *>(
+      iwh_zalloc(size * sizeof(struct iwl_rx_page)));
+  pool->cursor =
+      IOMbufNaturalMemoryCursor::withSpecification(pool->page_bytes, 1);
+  pool->lock = IOSimpleLockAlloc();
+  if (!pool->pages || !pool->cursor || !pool->lock) {
+    if (pool->pages) iwh_free(pool->pages);
+    OSSafeReleaseNULL(pool->cursor);
+    if (pool->lock) IOSimpleLockFree(pool->lock);
+    iwh_free(pool);
+    return -ENOMEM;
+  }
+
+  TAILQ_INIT(&pool->free);
+  pool->refcount = 1;
+
+  for (i = 0; i < size; i++) {
+    struct iwl_rx_page *rxp = &pool->pages[i];
+
+    if (iwl_pcie_rx_page_fill(trans, pool, rxp)) break;
+    rxp->pooled = true;
+    TAILQ_INSERT_TAIL(&pool->free, rxp, list);
+    pool->free_count++;
+  }
+  pool->size = i;
+
+  if (pool->size < size)
+    IWL_WARN(0, "Rx page pool short: %u of %u pages\n", pool->size, size);
+  IWL_INFO(0, "Rx page pool: %u pages of %u bytes\n", pool->size,
+           pool->page_bytes);
+  trans->rx_page_pool = pool;
+  return 0;
+}
+
+/*
+ * iwl_pcie_rx_page_pool_free - let go of the transport's Rx page pool
+ *
+ * The unreferenced pages are freed right away. Pages still held by slices
+ * are freed with their last reference, the pool itself with the last page.
+ */
+static void iwl_pcie_rx_page_pool_free(IWLTransport *trans) {
+  struct iwl_rx_page_pool *pool = trans->rx_page_pool;
+  struct iwl_rx_page *rxp;
+
+  if (!pool) return;
+  trans->rx_page_pool = NULL;
+
+  IWL_INFO(0, "Rx page pool: %u hits, %u misses\n", pool->hits, pool->misses);
+
+  IOSimpleLockLock(pool->lock);
+  pool->detached = true;
+  IOSimpleLockUnlock(pool->lock);
+
+  /* nobody puts pages onto @free anymore */
+  if (pool->free_count != pool->size)
+    IWL_INFO(0, "Rx page pool: %u pages still in use\n",
+             pool->size - pool->free_count);
+  while ((rxp = TAILQ_FIRST(&pool->free)) != NULL) {
+    TAILQ_REMOVE(&pool->free, rxp, list);
+    mbuf_freem(rxp->page);
+    rxp->page = NULL;
+  }
+  pool->free_count = 0;
+
+  iwl_pcie_rx_page_pool_release(pool);
+}
+
+/*
+ * iwl_pcie_rx_page_get - take an unreferenced page
+ *
+ * Served from the pool whenever possible. When the pool ran dry a page is
+ * allocated and mapped on the spot and freed again with its last reference.
+ */
+static struct iwl_rx_page *iwl_pcie_rx_page_get(IWLTransport *trans) {
+  struct iwl_rx_page_pool *pool = trans->rx_page_pool;
+  struct iwl_rx_page *rxp;
+
+  IOSimpleLockLock(pool->lock);
+  rxp = TAILQ_FIRST(&pool->free);
+  if (likely(rxp)) {
+    TAILQ_REMOVE(&pool->free, rxp, list);
+    pool->free_count--;
+    pool->hits++;
+    OSIncrementAtomic(&pool->refcount);
+  } else {
+    pool->misses++;
+  }
+  IOSimpleLockUnlock(pool->lock);
+
+  if (unlikely(!rxp)) {
+    rxp = reinterpret_cast<iwl_rx_page *>(
+        iwh_zalloc(sizeof(struct iwl_rx_page)));
+    if (!rxp) return NULL;
+    if (iwl_pcie_rx_page_fill(trans, pool, rxp)) {
+      iwh_free(rxp);
+      return NULL;
+    }
+    rxp->pooled = false;
+  }
+
+  rxp->refcount = 1;
+  return rxp;
+}
+
+void iwl_pcie_rx_page_put(struct iwl_rx_page *rxp) {
+  struct iwl_rx_page_pool *pool = rxp->pool;
+
+  /* OSDecrementAtomic returns the old value */
+  if (OSDecrementAtomic(&rxp->refcount) != 1) return;
+
+  if (unlikely(!rxp->pooled)) {
+    mbuf_freem(rxp->page);
+    iwh_free(rxp);
+    return;
+  }
+
+  /* LIFO, the page we just dropped is the most likely to be cache hot */
+  IOSimpleLockLock(pool->lock);
+  if (likely(!pool->detached)) {
+    TAILQ_INSERT_HEAD(&pool->free, rxp, list);
+    pool->free_count++;
+    IOSimpleLockUnlock(pool->lock);
+  } else {
+    IOSimpleLockUnlock(pool->lock);
+    mbuf_freem(rxp->page);
+    rxp->page = NULL;
+  }
+
+  iwl_pcie_rx_page_pool_release(pool);
+}
+
+static void iwl_pcie_rx_slice_free(caddr_t buf, u_int size, caddr_t arg) {
+  iwl_pcie_rx_page_put(reinterpret_cast<iwl_rx_page *>(arg));
+}
+
+/*
+ * iwl_pcie_rx_slice - zero-copy mbuf for the packet the buffer points at
+ *
+ * The mbuf maps the packet in place and holds a reference on the Rx page
+ * until it is freed, so each packet of an RB can be handed out on its own.
+ * The page goes back to the pool once the RB and its last slice let go.
+ */
+mbuf_t iwl_pcie_rx_slice(struct iwl_rx_cmd_buffer *rxcb) {
+  struct iwl_rx_packet *pkt = (struct iwl_rx_packet *)rxb_addr(rxcb);
+  size_t len = min_t(size_t, iwl_rx_packet_len(pkt) + sizeof(u32),
+                     rxcb->truesize - rxcb->_offset);
+  mbuf_t m;
+
+  if (mbuf_gethdr(MBUF_DONTWAIT, MBUF_TYPE_DATA, &m)) return NULL;
+
+  OSIncrementAtomic(&rxcb->_rx_page->refcount);
+  if (mbuf_attachcluster(MBUF_DONTWAIT, MBUF_TYPE_DATA, &m,
+                         reinterpret_cast<caddr_t>(pkt),
+                         iwl_pcie_rx_slice_free, len,
+                         reinterpret_cast<caddr_t>(rxcb->_rx_page))) {
+    iwl_pcie_rx_page_put(rxcb->_rx_page);
+    mbuf_free(m);
+    return NULL;
+  }
+  mbuf_setlen(m, len);
+  mbuf_pkthdr_setlen(m, len);
+
+  /* the RB must not recycle the page in place anymore */
+  rxcb->_page_stolen = true;
+  return m;
+}
+
+static void iwl_pcie_rx_attach_page(struct iwl_rx_mem_buffer *rxb,
+                                    struct iwl_rx_page *rxp) {
+  rxb->rx_page = rxp;
+  rxb->page = rxp->page;
+  rxb->page_dma = rxp->page_dma;
+  rxb->offset = 0;
+}
+
 /*
  * iwl_pcie_rxq_alloc_rbs - allocate a page for each used RBD
  *
@@ -372,11 +649,9 @@ static mbuf_t iwl_pcie_rx_alloc_page(IWLTransport *trans, u32 *offset) {
  */
 void iwl_pcie_rxq_alloc_rbs(IWLTransport *trans, struct iwl_rxq *rxq) {
   struct iwl_rx_mem_buffer *rxb;
-  mbuf_t page;
+  struct iwl_rx_page *rxp;
 
   while (1) {
-    unsigned int offset;
-
     // IWL_INFO(0, "Locking rxq\n");
     IOSimpleLockLock(rxq->lock);
     if (TAILQ_EMPTY(&rxq->rx_used)) {
@@ -386,9 +661,8 @@ void iwl_pcie_rxq_alloc_rbs(IWLTransport *trans, struct iwl_rxq *rxq) {
     }
     IOSimpleLockUnlock(rxq->lock);
 
-    // IWL_INFO(0, "Allocating rx page\n");
-    page = iwl_pcie_rx_alloc_page(trans, &offset);
-    if (page == 0) {
+    rxp = iwl_pcie_rx_page_get(trans);
+    if (!rxp) {
       IWL_ERR(0, "iwl_pcie_rxq_alloc_rbs alloc page failed\n");
       return;
     }
@@ -399,35 +673,16 @@ void iwl_pcie_rxq_alloc_rbs(IWLTransport *trans, struct iwl_rxq *rxq) {
     if (TAILQ_EMPTY(&rxq->rx_used)) {
       IOSimpleLockUnlock(rxq->lock);
       IWL_INFO(0, "rx_used empty");
-      // mbuf_freem(page);
+      iwl_pcie_rx_page_put(rxp);
       return;
     }
     rxb = TAILQ_FIRST(&rxq->rx_used);
     TAILQ_REMOVE(&rxq->rx_used, rxb, list);
     IOSimpleLockUnlock(rxq->lock);
 
-    // IWL_INFO(0, "Getting physical rep of memory\n");
-    rxb->page = page;
-    rxb->offset = offset;
-    rxb->cursor = IOMbufNaturalMemoryCursor::withSpecification(PAGE_SIZE, 1);
-
-    // IWL_INFO(0, "Physical addr: %x\n",  mbuf_data_to_physical(page));
-    /* Get physical address of the RB */
+    /* The page is already mapped, no need to resolve the RB address */
+    iwl_pcie_rx_attach_page(rxb, rxp);
 
-    int ret = rxb->cursor->getPhysicalSegments(page, &rxb->vec, 1);
-    if (ret == 0) {
-      IWL_INFO(0, "could not get physical segment\n");
-      rxb->page = NULL;
-      IOSimpleLockLock(rxq->lock);
-      TAILQ_INSERT_HEAD(&rxq->rx_used, rxb, list);
-      IOSimpleLockUnlock(rxq->lock);
-      mbuf_freem(page);
-      return;
-    }
-
-    rxb->page_dma = rxb->vec.location;
-
-    // rxb->page_dma = mbuf_data_to_physical(page);
     // IWL_INFO(0, "Locking rxq for the final time\n");
     IOSimpleLockLock(rxq->lock);
 
@@ -447,6 +702,10 @@ void iwl_pcie_rx_init_rxb_lists(struct iwl_rxq *rxq) {
   rxq->used_count = 0;
 }
 
+static void iwl_pcie_rx_allocator_work(OSObject *owner,
+                                       IOTimerEventSource *sender);
+static void iwl_pcie_rx_allocator_stop(struct iwl_rb_allocator *rba);
+
 int IWLTransport::rxInit() {
   struct iwl_rxq *def_rxq;
   struct iwl_rb_allocator *rba = &this->rba;
@@ -461,17 +720,45 @@ int IWLTransport::rxInit() {
   }
   def_rxq = this->rxq;
 
-  IOSimpleLockLock(rba->lock);
-  rba->req_pending = 0;
-  rba->req_ready = 0;
-  TAILQ_INIT(&rba->rbd_allocated);
+  if (!rba->alloc_wq) {
+    rba->alloc_wq = IOWorkLoop::workLoop();
+    if (!rba->alloc_wq) return -ENOMEM;
+  }
+  if (!rba->alloc_work) {
+    rba->alloc_work = IOTimerEventSource::timerEventSource(
+        rba->alloc_wq, &iwl_pcie_rx_allocator_work);
+    if (!rba->alloc_work) return -ENOMEM;
+    rba->alloc_work->setRefcon(this);
+    if (rba->alloc_wq->addEventSource(rba->alloc_work) != kIOReturnSuccess) {
+      rba->alloc_work->release();
+      rba->alloc_work = NULL;
+      return -ENOMEM;
+    }
+  }
+  /* we might be reconfigured, nothing may be in flight from before */
+  iwl_pcie_rx_allocator_stop(rba);
   TAILQ_INIT(&rba->rbd_empty);
-  IOSimpleLockUnlock(rba->lock);
-  rba->alloc_wq = IOWorkLoop::workLoop();
 
   /* free all first - we might be reconfigured for a different size */
   iwl_pcie_free_rbs_pool(this);
 
+  queue_size = m_pDevice->cfg->trans.mq_rx_supported ? this->num_rx_bufs - 1
+                                                     : RX_QUEUE_SIZE;
+  allocator_pool_size =
+      this->num_rx_queues * (RX_CLAIM_REQ_ALLOC - RX_POST_REQ_ALLOC);
+  num_alloc = queue_size + allocator_pool_size;
+
+  if (this->rx_page_pool &&
+      this->rx_page_pool->page_bytes != iwl_pcie_rx_page_bytes(this))
+    iwl_pcie_rx_page_pool_free(this);
+  if (!this->rx_page_pool) {
+    err = iwl_pcie_rx_page_pool_init(this, num_alloc + IWL_RX_PAGE_POOL_SPARE);
+    if (err) {
+      IWL_ERR(0, "iwl_pcie_rx_page_pool_init failed\n");
+      return err;
+    }
+  }
+
   for (i = 0; i < RX_QUEUE_SIZE; i++) def_rxq->queue[i] = NULL;
 
   for (i = 0; i < this->num_rx_queues; i++) {
@@ -493,15 +780,16 @@ int IWLTransport::rxInit() {
 
     iwl_pcie_rx_init_rxb_lists(rxq);
 
+    /* Nothing is in flight to or from the allocator at this point */
+    rxq->rbd_empty.head = rxq->rbd_empty.tail = 0;
+    rxq->rbd_allocated.head = rxq->rbd_allocated.tail = 0;
+    rxq->req_pending = 0;
+    rxq->req_ready = 0;
+
     IOSimpleLockUnlock(rxq->lock);
   }
 
   /* move the pool to the default queue and allocator ownerships */
-  queue_size = m_pDevice->cfg->trans.mq_rx_supported ? this->num_rx_bufs - 1
-                                                     : RX_QUEUE_SIZE;
-  allocator_pool_size =
-      this->num_rx_queues * (RX_CLAIM_REQ_ALLOC - RX_POST_REQ_ALLOC);
-  num_alloc = queue_size + allocator_pool_size;
   for (i = 0; i < num_alloc; i++) {
     struct iwl_rx_mem_buffer *rxb = &this->rx_pool[i];
 
@@ -518,6 +806,7 @@ int IWLTransport::rxInit() {
   this->global_table_array_size = num_alloc;
 
   iwl_pcie_rxq_alloc_rbs(this, def_rxq);
+  rba->alloc_work->enable();
 
   IWL_INFO(0, "rxInit init done\n");
 
@@ -582,6 +871,7 @@ void IWLTransport::rxHWInit(struct iwl_rxq *rxq) {
 
   /* Set interrupt coalescing timer to default (2048 usecs) */
   iwlWrite8(CSR_INT_COALESCING, IWL_HOST_INT_TIMEOUT_DEF);
+  int_mit.timeout = IWL_HOST_INT_TIMEOUT_DEF;
 
   /* W/A for interrupt coalescing bug in 7260 and 3160 */
   if (m_pDevice->cfg->host_interrupt_operation_mode)
@@ -669,6 +959,7 @@ void IWLTransport::rxMqHWInit() {
 
   /* Set interrupt coalescing timer to default (2048 usecs) */
   iwlWrite8(CSR_INT_COALESCING, IWL_HOST_INT_TIMEOUT_DEF);
+  int_mit.timeout = IWL_HOST_INT_TIMEOUT_DEF;
 
   for (i = 0; i < this->num_rx_queues; i++) {
     iwlWrite32(RFH_Q_FRBDCB_WIDX_TRG(this->rxq[i].id),
@@ -758,8 +1049,8 @@ void IWLTransport::rxSqRestock(struct iwl_rxq *_rxq) {
 
   // IOSimpleLockLock(_rxq->lock);
 
-  IWL_INFO(0, "restocking (space: %d, free: %d, used: %d)\n",
-           iwl_rxq_space(_rxq), _rxq->free_count, _rxq->used_count);
+  IWL_DEBUG_RX(0, "restocking (space: %d, free: %d, used: %d)\n",
+               iwl_rxq_space(_rxq), _rxq->free_count, _rxq->used_count);
   while ((iwl_rxq_space(_rxq) > 0) && (_rxq->free_count)) {
     __le32 *bd = reinterpret_cast<__le32 *>(_rxq->bd);
     /* The overwritten rxb must be a used one */
@@ -809,8 +1100,8 @@ void IWLTransport::restockBd(struct iwl_rxq *rxq,
     bd[rxq->write] = cpu_to_le64(rxb->page_dma | rxb->vid);
   }
 
-  IWL_INFO(0, "Assigned virtual RB ID %u to queue %d index %d\n", (u32)rxb->vid,
-           rxq->id, rxq->write);
+  IWL_DEBUG_RX(0, "Assigned virtual RB ID %u to queue %d index %d\n",
+               (u32)rxb->vid, rxq->id, rxq->write);
 }
 
 /*
@@ -837,6 +1128,7 @@ void IWLTransport::rxqIncWrPtr(struct iwl_rxq *rxq) {
   }
 
   rxq->write_actual = round_down(rxq->write, 8);
+  IWL_EVT(IWL_EVT_RX_WRPTR, rxq->id, rxq->write_actual, 0, 0);
   if (m_pDevice->cfg->trans.mq_rx_supported)
     iwlWrite32(RFH_Q_FRBDCB_WIDX_TRG(rxq->id), rxq->write_actual);
   else
@@ -850,9 +1142,35 @@ void IWLTransport::irqHandleError() {
   }
   clear_bit(STATUS_SYNC_HCMD_ACTIVE, &this->status);
   IOLockWakeup(this->wait_command_queue, this, true);
+
+  /* what led up to the error is the interesting part of the trace */
+  if (iwl_trace_mask) iwl_trace_dump();
 }
 
-void IWLTransport::rxFree() { IWL_INFO(0, "rx free\n"); }
+static void iwl_pcie_rx_free_handlers(IWLTransport *trans);
+
+void IWLTransport::rxFree() {
+  IWL_INFO(0, "rx free\n");
+
+  if (this->rba.alloc_work) {
+    iwl_pcie_rx_allocator_stop(&this->rba);
+    this->rba.alloc_wq->removeEventSource(this->rba.alloc_work);
+    this->rba.alloc_work->release();
+    this->rba.alloc_work = NULL;
+  }
+
+  iwl_pcie_rx_free_handlers(this);
+
+  /* rxInit() reuses the queues and their rings, they go only here */
+  for (int i = 0; this->rxq && i < this->num_rx_queues; i++) {
+    iwl_pcie_rbd_ring_free(&this->rxq[i].rbd_empty);
+    iwl_pcie_rbd_ring_free(&this->rxq[i].rbd_allocated);
+  }
+
+  if (this->rx_pool) iwl_pcie_free_rbs_pool(this);
+  /* slices still out keep the pool alive until they are freed */
+  iwl_pcie_rx_page_pool_free(this);
+}
 
 int IWLTransport::allocICT() {
   this->ict_tbl_ptr = allocate_dma_buf(ICT_SIZE, this->dma_mask);
@@ -908,7 +1226,7 @@ u32 IWLTransport::intrCauseICT() {
    */
   do {
     val |= read;
-    IWL_INFO(0, "ICT index %d value 0x%08X\n", this->ict_index, read);
+    IWL_DEBUG_RX(0, "ICT index %d value 0x%08X\n", this->ict_index, read);
     this->ict_tbl[this->ict_index] = 0;
     this->ict_index = ((this->ict_index + 1) & (ICT_COUNT - 1));
 
@@ -1014,8 +1332,8 @@ void iwl_pcie_cmdq_reclaim(IWLTransport *trans, int txq_id, int idx) {
     return;
   }
 
-  IWL_INFO(0, "cmd queue reclaim (idx: %d, r: %d, rd: %d, wr: %d)\n", idx, r,
-           txq->read_ptr, txq->write_ptr);
+  IWL_DEBUG_HC(0, "cmd queue reclaim (idx: %d, r: %d, rd: %d, wr: %d)\n",
+               idx, r, txq->read_ptr, txq->write_ptr);
   for (idx = iwl_queue_inc_wrap(idx); r != idx; r = iwl_queue_inc_wrap(r)) {
     txq->read_ptr = iwl_queue_inc_wrap(txq->read_ptr);
 
@@ -1024,7 +1342,7 @@ void iwl_pcie_cmdq_reclaim(IWLTransport *trans, int txq_id, int idx) {
               txq->read_ptr);
       // iwl_force_nmi(trans);
     } else {
-      IWL_INFO(0, "incremented read ptr (ptr: %d)\n", txq->read_ptr);
+      IWL_DEBUG_HC(0, "incremented read ptr (ptr: %d)\n", txq->read_ptr);
     }
   }
 
@@ -1048,6 +1366,8 @@ void iwl_pcie_hcmd_complete(IWLTransport *trans,
   int cmd_index;
   struct iwl_device_cmd *cmd;
   struct iwl_cmd_meta *meta;
+  iwl_hcmd_callback_t callback;
+  void *cb_ctx;
   IWLTransport *trans_pcie = trans;
   struct iwl_txq *txq = trans_pcie->txq[trans_pcie->cmd_queue];
 
@@ -1072,21 +1392,25 @@ void iwl_pcie_hcmd_complete(IWLTransport *trans,
   meta = &txq->entries[cmd_index].meta;
   group_id = cmd->hdr.group_id;
   cmd_id = iwl_cmd_id(cmd->hdr.cmd, group_id, 0);
+  IWL_EVT(IWL_EVT_HCMD_DONE, cmd_id, iwl_rx_packet_payload_len(pkt), sequence,
+          0);
 
   iwl_pcie_tfd_unmap(trans, meta, txq, index);
 
   /* Input error checking is done when commands are added to queue. */
   if (meta->flags & CMD_WANT_SKB) {
-    mbuf_t p = rxb_steal_page(rxb);
+    rxb_steal_page(rxb);
 
     meta->source->resp_pkt = pkt;
-    meta->source->_rx_page_addr = (unsigned long)p;  // NOLINT
+    meta->source->_rx_page_addr = (unsigned long)rxb->_rx_page;  // NOLINT
     meta->source->_rx_page_order =
         iwl_trans_get_rb_size_order((iwl_amsdu_size)trans->rx_buf_size);
   }
 
-  // if (meta->flags & CMD_WANT_ASYNC_CALLBACK)
-  // iwl_op_mode_async_cb(trans->op_mode, cmd);
+  /* run the callback once the queue lock is dropped */
+  callback = meta->callback;
+  cb_ctx = meta->cb_ctx;
+  meta->callback = NULL;
 
   iwl_pcie_cmdq_reclaim(trans, txq_id, index);
 
@@ -1096,8 +1420,8 @@ void iwl_pcie_hcmd_complete(IWLTransport *trans,
                iwl_get_cmd_string(trans, cmd_id));
     }
     clear_bit(STATUS_SYNC_HCMD_ACTIVE, &trans->status);
-    IWL_INFO(trans, "Clearing HCMD_ACTIVE for command %s\n",
-             iwl_get_cmd_string(trans, cmd_id));
+    IWL_DEBUG_HC(trans, "Clearing HCMD_ACTIVE for command %s\n",
+                 iwl_get_cmd_string(trans, cmd_id));
 
     // IOLockLock(trans_pcie->wait_command_queue);
     IOLockWakeup(trans_pcie->wait_command_queue, &trans->status, true);
@@ -1105,15 +1429,15 @@ void iwl_pcie_hcmd_complete(IWLTransport *trans,
   }
 
   if (meta->flags & CMD_MAKE_TRANS_IDLE) {
-    IWL_INFO(trans, "complete %s - mark trans as idle\n",
-             iwl_get_cmd_string(trans, cmd->hdr.cmd));
+    IWL_DEBUG_HC(trans, "complete %s - mark trans as idle\n",
+                 iwl_get_cmd_string(trans, cmd->hdr.cmd));
     set_bit(STATUS_TRANS_IDLE, &trans->status);
     // wake_up(&trans_pcie->d0i3_waitq);
   }
 
   if (meta->flags & CMD_WAKE_UP_TRANS) {
-    IWL_INFO(trans, "complete %s - clear trans idle flag\n",
-             iwl_get_cmd_string(trans, cmd->hdr.cmd));
+    IWL_DEBUG_HC(trans, "complete %s - clear trans idle flag\n",
+                 iwl_get_cmd_string(trans, cmd->hdr.cmd));
     clear_bit(STATUS_TRANS_IDLE, &trans->status);
     // wake_up(&trans_pcie->d0i3_waitq);
   }
@@ -1122,91 +1446,88 @@ void iwl_pcie_hcmd_complete(IWLTransport *trans,
 
   // spin_unlock_bh(&txq->lock);
   IOSimpleLockUnlock(txq->lock);
-}
-
-int allocate_rxb(OSObject *target, void *arg0, void *arg1, void *arg2,
-                 void *arg3) {
-  iwl_rb_allocator *rba = reinterpret_cast<iwl_rb_allocator *>(arg0);
-  IWLTransport *trans = reinterpret_cast<IWLTransport *>(arg1);
-  TAILQ_HEAD(, iwl_rx_mem_buffer) local_empty;
-  TAILQ_INIT(&local_empty);
-
-  TAILQ_HEAD(, iwl_rx_mem_buffer) local_allocated;
-  int pending = rba->req_pending;
 
-  IOSimpleLockLock(rba->lock);
-  TAILQ_CONCAT(&local_empty, &rba->rbd_empty, list);
-  TAILQ_INIT(&rba->rbd_empty);
-  IOSimpleLockUnlock(rba->lock);
+  /* a fragment that missed the pool could not be freed under the lock */
+  iwl_pcie_hcmd_pool_reap(trans);
 
-  while (pending) {
-    TAILQ_INIT(&local_allocated);
-    for (int i = 0; i < RX_CLAIM_REQ_ALLOC;) {
-      struct iwl_rx_mem_buffer *rxb;
-      mbuf_t page;
+  if (callback) callback(cb_ctx, pkt);
+}
 
-      WARN_ON(TAILQ_EMPTY(&local_empty));
-      rxb = TAILQ_FIRST(&local_empty);
+/*
+ * iwl_pcie_rx_allocator_work - Rx allocator work
+ *
+ * Runs on rba->alloc_wq, apart from the Rx path that arms it. Collects the
+ * RBDs every queue handed over, attaches a mapped page to them and hands
+ * them back in batches of RX_CLAIM_REQ_ALLOC, one per pending request.
+ * The rbd_empty list is private to this function, the queues are only ever
+ * touched through their lock-free rings.
+ */
+static void iwl_pcie_rx_allocator_work(OSObject *owner,
+                                       IOTimerEventSource *sender) {
+  IWLTransport *trans = reinterpret_cast<IWLTransport *>(sender->getRefcon());
+  struct iwl_rb_allocator *rba = &trans->rba;
 
-      if (!rxb) {
-        IWL_ERR(0, "rxb == null\n");
-        continue;
-      }
+  for (int q = 0; q < trans->num_rx_queues; q++) {
+    struct iwl_rxq *rxq = &trans->rxq[q];
+    struct iwl_rx_mem_buffer *rxb;
 
-      if (rxb->page) IWL_ERR(0, "page isn't null\n");
+    while ((rxb = iwl_rbd_ring_pop(&rxq->rbd_empty)) != NULL)
+      TAILQ_INSERT_TAIL(&rba->rbd_empty, rxb, list);
 
-      page = iwl_pcie_rx_alloc_page(trans, &rxb->offset);
+    while (rxq->req_pending > 0) {
+      int i;
 
-      if (!page) continue;
-      rxb->page = page;
+      for (i = 0; i < RX_CLAIM_REQ_ALLOC; i++) {
+        struct iwl_rx_page *rxp;
 
-      IOMbufNaturalMemoryCursor *cursor =
-          IOMbufNaturalMemoryCursor::withSpecification(PAGE_SIZE, 1);
-      int err = cursor->getPhysicalSegments(rxb->page, &rxb->vec, 1);
-      if (err == 0) {
-        rxb->page = NULL;
-        IWL_ERR(0, "Unable to map\n");
-        continue;
-      }
+        rxb = TAILQ_FIRST(&rba->rbd_empty);
+        if (!rxb) break;
 
-      rxb->page_dma = rxb->vec.location;
+        if (rxb->page) IWL_ERR(0, "page isn't null\n");
 
-      TAILQ_REMOVE(&local_empty, rxb, list);
+        rxp = iwl_pcie_rx_page_get(trans);
+        if (!rxp) break;
+        iwl_pcie_rx_attach_page(rxb, rxp);
 
-      TAILQ_INSERT_TAIL(&local_allocated, rxb, list);
-      i++;
-    }
+        TAILQ_REMOVE(&rba->rbd_empty, rxb, list);
+        WARN_ON(!iwl_rbd_ring_push(&rxq->rbd_allocated, rxb));
+      }
 
-    OSDecrementAtomic(&rba->req_pending);
-    pending--;
-    if (!pending) {
-      pending = rba->req_pending;
-      if (pending) IWL_INFO(0, "Got more pending\n");
-    }
+      /*
+       * Leave the request pending, the next run picks it up once the
+       * queue handed back more RBDs. Whatever was already pushed is
+       * claimed together with the next batch.
+       */
+      if (i < RX_CLAIM_REQ_ALLOC) {
+        IWL_ERR(0, "Rx allocator short of RBDs (got %d)\n", i);
+        break;
+      }
 
-    IOSimpleLockLock(rba->lock);
-    if (!TAILQ_EMPTY(&local_allocated)) {
-      TAILQ_CONCAT(&rba->rbd_allocated, &local_allocated, list);
-    } else {
-      IWL_ERR(0, "local_allocated should not be null\n");
+      OSDecrementAtomic(&rxq->req_pending);
+      OSIncrementAtomic(&rxq->req_ready);
     }
+  }
+}
 
-    if (!TAILQ_EMPTY(&rba->rbd_empty)) {
-      TAILQ_CONCAT(&local_empty, &rba->rbd_empty, list);
-      TAILQ_INIT(&rba->rbd_empty);
-    }
-    IOSimpleLockUnlock(rba->lock);
+static IOReturn iwl_pcie_rx_allocator_sync(OSObject *target, void *arg0,
+                                           void *arg1, void *arg2,
+                                           void *arg3) {
+  return kIOReturnSuccess;
+}
 
-    OSIncrementAtomic(&rba->req_ready);
-    // rba->req_ready++;
-  }
-  IOSimpleLockLock(rba->lock);
-  if (!TAILQ_EMPTY(&local_empty)) {
-    TAILQ_CONCAT(&rba->rbd_empty, &local_empty, list);
-  }
-  IOSimpleLockUnlock(rba->lock);
+/*
+ * iwl_pcie_rx_allocator_stop - cancel_work_sync() for the allocator
+ *
+ * The work runs with the gate of alloc_wq held and checks that it is still
+ * enabled first, so once an empty action got through the gate it neither
+ * runs nor is about to.
+ */
+static void iwl_pcie_rx_allocator_stop(struct iwl_rb_allocator *rba) {
+  if (!rba->alloc_work) return;
 
-  return 0;
+  rba->alloc_work->disable();
+  rba->alloc_work->cancelTimeout();
+  rba->alloc_wq->runAction(&iwl_pcie_rx_allocator_sync, NULL);
 }
 
 static void iwl_pcie_rx_reuse_rbd(IWLTransport *trans,
@@ -1221,26 +1542,224 @@ static void iwl_pcie_rx_reuse_rbd(IWLTransport *trans,
   rxq->used_count++;
 
   if ((rxq->used_count % RX_CLAIM_REQ_ALLOC) == RX_POST_REQ_ALLOC) {
-    move_to_allocator(rba, rxq);
-    OSIncrementAtomic(&rba->req_pending);
-    // rba->req_pending++;
-    // OSIncrementAtomic(&rba->req_pending);
+    move_to_allocator(rxq);
+    OSIncrementAtomic(&rxq->req_pending);
 
-    rba->alloc_wq->runAction(&allocate_rxb, NULL, rba, trans);
+    /* setting it again while it is armed still runs the work once */
+    rba->alloc_work->setTimeoutUS(0);
   }
 }
 
 #include "IWLTransOps.h"
 
+static void iwl_pcie_rx_dts(IWLTransport *trans,
+                            struct iwl_rx_cmd_buffer *rxcb) {
+  struct iwl_rx_packet *pkt = (struct iwl_rx_packet *)rxb_addr(rxcb);
+  struct iwl_dts_measurement_notif_v1 *notif1;
+  struct iwl_dts_measurement_notif_v2 *notif2;
+
+  if (iwl_rx_packet_payload_len(pkt) == sizeof(*notif1)) {
+    notif1 = reinterpret_cast<iwl_dts_measurement_notif_v1 *>(pkt->data);
+    IWL_INFO(0, "DTS temp=%d C\n", notif1->temp);
+    return;
+  }
+  if (iwl_rx_packet_payload_len(pkt) == sizeof(*notif2)) {
+    notif2 = reinterpret_cast<iwl_dts_measurement_notif_v2 *>(pkt->data);
+    IWL_INFO(0, "DTS temp=%d C\n", notif2->temp);
+  }
+}
+
+static void iwl_pcie_rx_phy(IWLTransport *trans,
+                            struct iwl_rx_cmd_buffer *rxcb) {
+  IWLTransOps *ops = reinterpret_cast<IWLTransOps *>(trans->trans_ops);
+
+  ops->rxPhy((struct iwl_rx_packet *)rxb_addr(rxcb));
+}
+
+static void iwl_pcie_rx_mpdu(IWLTransport *trans,
+                             struct iwl_rx_cmd_buffer *rxcb) {
+  IWLTransOps *ops = reinterpret_cast<IWLTransOps *>(trans->trans_ops);
+
+  ops->rxMpdu(rxcb);
+}
+
+static void iwl_pcie_rx_bt_profile(IWLTransport *trans,
+                                   struct iwl_rx_cmd_buffer *rxcb) {
+  IWL_INFO(0, "BT Profile Notification");
+}
+
+/*
+ * TX response of a data frame, the frames up to the scheduler's SSN that
+ * follows the status array are done. The response to an A-MPDU only tells
+ * which frames went out, they are done once its Block Ack came in.
+ */
+static void iwl_pcie_rx_tx_cmd(IWLTransport *trans,
+                               struct iwl_rx_cmd_buffer *rxcb) {
+  struct iwl_rx_packet *pkt = (struct iwl_rx_packet *)rxb_addr(rxcb);
+  struct iwl_mvm_tx_resp_v3 *tx_resp =
+      reinterpret_cast<iwl_mvm_tx_resp_v3 *>(pkt->data);
+  int txq_id = SEQ_TO_QUEUE(le16_to_cpu(pkt->hdr.sequence));
+  __le32 scd_ssn;
+  u32 status;
+
+  /* only gen1 queues carry data frames */
+  if (iwl_mvm_has_new_tx_api(trans->m_pDevice)) return;
+
+  if (iwl_rx_packet_payload_len(pkt) <
+      sizeof(*tx_resp) + tx_resp->frame_count * sizeof(struct agg_tx_status) +
+          sizeof(scd_ssn)) {
+    IWL_ERR(trans, "TX response too short: %u\n",
+            iwl_rx_packet_payload_len(pkt));
+    return;
+  }
+
+  if (tx_resp->frame_count > 1) {
+    trans->tx_stats.ampdus++;
+    IWL_DEBUG_TX(trans, "Q %d: A-MPDU of %u frames\n", txq_id,
+                 tx_resp->frame_count);
+    return;
+  }
+
+  status = le16_to_cpu(tx_resp->status[0].status) & TX_STATUS_MSK;
+  if (status == TX_STATUS_SUCCESS || status == TX_STATUS_DIRECT_DONE) {
+    trans->tx_stats.ok++;
+  } else {
+    trans->tx_stats.failed++;
+    IWL_DEBUG_TX(trans, "Q %d: tx failed, status 0x%x, %u tries\n", txq_id,
+                 status, tx_resp->failure_frame + 1);
+  }
+
+  memcpy(&scd_ssn, &tx_resp->status[tx_resp->frame_count], sizeof(scd_ssn));
+  trans->txReclaim(txq_id, le32_to_cpu(scd_ssn) & 0xffff);
+}
+
+/*
+ * Block Ack of an A-MPDU, the frames of its queue up to the scheduler's SSN
+ * are done
+ */
+static void iwl_pcie_rx_ba_notif(IWLTransport *trans,
+                                 struct iwl_rx_cmd_buffer *rxcb) {
+  struct iwl_rx_packet *pkt = (struct iwl_rx_packet *)rxb_addr(rxcb);
+  struct iwl_mvm_ba_notif *ba_notif =
+      reinterpret_cast<iwl_mvm_ba_notif *>(pkt->data);
+  int txq_id;
+
+  if (iwl_mvm_has_new_tx_api(trans->m_pDevice)) return;
+
+  if (iwl_rx_packet_payload_len(pkt) < sizeof(*ba_notif)) {
+    IWL_ERR(trans, "BA notification too short: %u\n",
+            iwl_rx_packet_payload_len(pkt));
+    return;
+  }
+
+  txq_id = le16_to_cpu(ba_notif->scd_flow);
+  if (txq_id >= trans->m_pDevice->cfg->trans.base_params->num_of_queues ||
+      !trans->txq[txq_id] || !trans->txq[txq_id]->ampdu) {
+    IWL_ERR(trans, "BA notification for queue %d without A-MPDUs\n",
+            txq_id);
+    return;
+  }
+
+  trans->tx_stats.ok += ba_notif->txed_2_done;
+  if (ba_notif->txed > ba_notif->txed_2_done)
+    trans->tx_stats.failed += ba_notif->txed - ba_notif->txed_2_done;
+
+  IWL_DEBUG_TX(trans, "Q %d: BA tid %u ssn %u, %u of %u acked\n", txq_id,
+               ba_notif->tid, le16_to_cpu(ba_notif->scd_ssn),
+               ba_notif->txed_2_done, ba_notif->txed);
+
+  trans->txReclaim(txq_id, le16_to_cpu(ba_notif->scd_ssn));
+}
+
+static void iwl_pcie_rx_scan_complete(IWLTransport *trans,
+                                      struct iwl_rx_cmd_buffer *rxcb) {
+  if (!trans->m_pDevice->ie_dev->getScanning()) return;
+
+  trans->m_pDevice->last_ebs_successful = true;
+  trans->m_pDevice->ie_dev->setScanning(false);
+  trans->m_pDevice->ie_dev->setPublished(true);
+  if (!trans->m_pDevice->ie_dev->lockScanCache()) {
+    IWL_ERR(0, "Failed to lock mutex\n");
+    return;
+  }
+
+  trans->m_pDevice->ie_dev->resetScanIndex();
+  trans->m_pDevice->ie_dev->clearPendingScans();
+
+  // IOSleep(100);
+  trans->m_pDevice->ie_dev->restoreState();
+
+  trans->m_pDevice->ie_dev->unlockScanCache();
+
+  if (trans->m_pDevice->ie_dev->scanDone()) {
+    IWL_INFO(0, "posted results\n");
+  } else {
+    IWL_ERR(0, "Interface was null?\n");
+  }
+}
+
+#define RX_HANDLER(_cmd_id, _fn) \
+  { .cmd_id = _cmd_id, .fn = _fn, .no_reclaim = false }
+#define RX_NO_RECLAIM(_cmd_id) \
+  { .cmd_id = _cmd_id, .fn = NULL, .no_reclaim = true }
+
+/*
+ * Handlers of the notifications the driver cares about. Responses that
+ * never complete a host command are marked as such here, so the Rx path
+ * doesn't have to scan for them.
+ */
+static const struct iwl_rx_handler_def iwl_pcie_rx_handlers[] = {
+    RX_HANDLER(DTS_MEASUREMENT_NOTIFICATION, iwl_pcie_rx_dts),
+    RX_HANDLER(WIDE_ID(PHY_OPS_GROUP, DTS_MEASUREMENT_NOTIF_WIDE),
+               iwl_pcie_rx_dts),
+    RX_HANDLER(REPLY_RX_PHY_CMD, iwl_pcie_rx_phy),
+    RX_HANDLER(REPLY_RX_MPDU_CMD, iwl_pcie_rx_mpdu),
+    RX_HANDLER(BT_PROFILE_NOTIFICATION, iwl_pcie_rx_bt_profile),
+    RX_HANDLER(SCAN_ITERATION_COMPLETE_UMAC, iwl_pcie_rx_scan_complete),
+    RX_HANDLER(SCAN_COMPLETE_UMAC, iwl_pcie_rx_scan_complete),
+    RX_HANDLER(TX_CMD, iwl_pcie_rx_tx_cmd),
+    RX_NO_RECLAIM(TX_CMD),
+    RX_HANDLER(BA_NOTIF, iwl_pcie_rx_ba_notif),
+    RX_NO_RECLAIM(BA_NOTIF),
+};
+
+static struct iwl_rx_handler *iwl_pcie_rx_alloc_handler_group(void) {
+  return reinterpret_cast<iwl_rx_handler *>(
+      iwh_zalloc(IWL_RX_HANDLER_OPCODES * sizeof(struct iwl_rx_handler)));
+}
+
+/* iwl_pcie_rx_init_handlers - build the table of IWLRxHandlers.h */
+int iwl_pcie_rx_init_handlers(IWLTransport *trans) {
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(iwl_pcie_rx_handlers); i++) {
+    const struct iwl_rx_handler_def *def = &iwl_pcie_rx_handlers[i];
+
+    if (WARN_ON(iwl_cmd_groupid(def->cmd_id) >= IWL_RX_HANDLER_GROUPS))
+      continue;
+    if (!iwl_rx_handlers_add(trans->rx_handlers, def,
+                             iwl_pcie_rx_alloc_handler_group))
+      return -ENOMEM;
+  }
+
+  return 0;
+}
+
+static void iwl_pcie_rx_free_handlers(IWLTransport *trans) {
+  int i;
+
+  for (i = 0; i < IWL_RX_HANDLER_GROUPS; i++) {
+    if (!trans->rx_handlers[i]) continue;
+    iwh_free(trans->rx_handlers[i]);
+    trans->rx_handlers[i] = NULL;
+  }
+}
+
 static void iwl_pcie_rx_handle_rb(IWLTransport *trans, struct iwl_rxq *rxq,
                                   struct iwl_rx_mem_buffer *rxb,
                                   bool emergency) {
-  IWLTransOps *ops = reinterpret_cast<IWLTransOps *>(trans->trans_ops);
-  IWLTransport *trans_pcie = trans;
-  struct iwl_txq *txq = trans->txq[trans->cmd_queue];
   bool page_stolen = false;
-  unsigned int max_len = PAGE_SIZE << iwl_trans_get_rb_size_order(
-                             (iwl_amsdu_size)trans->rx_buf_size);
+  unsigned int max_len = iwl_pcie_rx_page_bytes(trans);
   u32 offset = 0;
 
   if (WARN_ON(!rxb)) {
@@ -1250,9 +1769,9 @@ static void iwl_pcie_rx_handle_rb(IWLTransport *trans, struct iwl_rxq *rxq,
 
   while (offset + sizeof(u32) + sizeof(struct iwl_cmd_header) < max_len) {
     struct iwl_rx_packet *pkt;
-    u16 sequence;
+    const struct iwl_rx_handler *handler;
     bool reclaim;
-    int index, cmd_index, len;
+    int len;
 
     struct iwl_rx_cmd_buffer rxcb = {
         ._offset = (int)offset,  // NOLINT(readability/casting)
@@ -1261,12 +1780,14 @@ static void iwl_pcie_rx_handle_rb(IWLTransport *trans, struct iwl_rxq *rxq,
         ._page = reinterpret_cast<page *>(rxb->page),
         ._page_stolen = false,
         .truesize = max_len,
+        ._rx_page = rxb->rx_page,
     };
 
     pkt = (struct iwl_rx_packet *)rxb_addr(&rxcb);
 
     if (pkt->len_n_flags == cpu_to_le32(FH_RSCSR_FRAME_INVALID)) {
-      IWL_INFO(trans, "Q %d: RB end marker at offset %d\n", rxq->id, offset);
+      IWL_DEBUG_RX(trans, "Q %d: RB end marker at offset %d\n", rxq->id,
+                   offset);
       break;
     }
 
@@ -1274,114 +1795,41 @@ static void iwl_pcie_rx_handle_rb(IWLTransport *trans, struct iwl_rxq *rxq,
         (le32_to_cpu(pkt->len_n_flags) & FH_RSCSR_RXQ_MASK) >> FH_RSCSR_RXQ_POS;
 
     if (frame_queue != rxq->id) {
-      IWL_INFO(trans, "frame on invalid queue - is on %d and indicates %d\n",
-               rxq->id, frame_queue);
+      IWL_DEBUG_RX(trans,
+                   "frame on invalid queue - is on %d and indicates %d\n",
+                   rxq->id, frame_queue);
     }
 
-    IWL_INFO(trans, "Q %d: cmd at offset %d: %s (%.2x.%2x, seq 0x%x)\n",
-             rxq->id, offset,
-             iwl_get_cmd_string(trans,
-                                iwl_cmd_id(pkt->hdr.cmd, pkt->hdr.group_id, 0)),
-             pkt->hdr.group_id, pkt->hdr.cmd, le16_to_cpu(pkt->hdr.sequence));
+    /* the name is only resolved when Rx logging is enabled */
+    IWL_DEBUG_RX(
+        trans, "Q %d: cmd at offset %d: %s (%.2x.%2x, seq 0x%x)\n", rxq->id,
+        offset,
+        iwl_get_cmd_string(trans,
+                           iwl_cmd_id(pkt->hdr.cmd, pkt->hdr.group_id, 0)),
+        pkt->hdr.group_id, pkt->hdr.cmd, le16_to_cpu(pkt->hdr.sequence));
 
     len = iwl_rx_packet_len(pkt);
     len += sizeof(u32); /* account for status word */
 
-    //        trace_iwlwifi_dev_rx(trans->dev, trans, pkt, len);
-    //        trace_iwlwifi_dev_rx_data(trans->dev, trans, pkt, len);
+    IWL_EVT(IWL_EVT_RX, iwl_cmd_id(pkt->hdr.cmd, pkt->hdr.group_id, 0), len,
+            rxq->id, rxb->vid);
+
+    handler = iwl_rx_handlers_get(trans->rx_handlers, pkt->hdr.group_id,
+                                  pkt->hdr.cmd);
 
     /* Reclaim a command buffer only if this packet is a response
      *   to a (driver-originated) command.
      * If the packet (e.g. Rx frame) originated from uCode,
      *   there is no command buffer to reclaim.
      * Ucode should set SEQ_RX_FRAME bit if ucode-originated,
-     *   but apparently a few don't get set; catch them here. */
-    reclaim = !(pkt->hdr.sequence & SEQ_RX_FRAME);
-    if (reclaim && !pkt->hdr.group_id) {
-      int i;
-
-      trans->no_reclaim_cmds[0] = TX_CMD;
-      for (i = 0; i < ARRAY_SIZE(trans_pcie->no_reclaim_cmds); i++) {
-        if (trans_pcie->no_reclaim_cmds[i] == pkt->hdr.cmd) {
-          reclaim = false;
-          break;
-        }
-      }
-    }
-
-    sequence = le16_to_cpu(pkt->hdr.sequence);
-    index = SEQ_TO_INDEX(sequence);
-    cmd_index = iwl_pcie_get_cmd_index(txq, index);
+     *   but apparently a few don't get set; those are registered as
+     *   no_reclaim in the dispatch table. */
+    reclaim = !(pkt->hdr.sequence & SEQ_RX_FRAME) && !handler->no_reclaim;
 
     if (rxq->id == 0)
       iwl_notification_wait_notify(&trans->m_pDevice->notif_wait, pkt);
 
-    u32 cmd_id = iwl_cmd_id(pkt->hdr.cmd, pkt->hdr.group_id, 0);
-
-    switch (cmd_id) {
-      case MVM_ALIVE:
-        break;
-
-      case DTS_MEASUREMENT_NOTIFICATION:
-      case WIDE_ID(PHY_OPS_GROUP, DTS_MEASUREMENT_NOTIF_WIDE): {
-        struct iwl_dts_measurement_notif_v1 *notif1;
-        struct iwl_dts_measurement_notif_v2 *notif2;
-
-        if (iwl_rx_packet_payload_len(pkt) == sizeof(*notif1)) {
-          notif1 = reinterpret_cast<iwl_dts_measurement_notif_v1 *>(pkt->data);
-          IWL_INFO(0, "DTS temp=%d C\n", notif1->temp);
-          break;
-        }
-        if (iwl_rx_packet_payload_len(pkt) == sizeof(*notif2)) {
-          notif2 = reinterpret_cast<iwl_dts_measurement_notif_v2 *>(pkt->data);
-          IWL_INFO(0, "DTS temp=%d C\n", notif2->temp);
-          break;
-        }
-        break;
-      }
-
-      case REPLY_RX_PHY_CMD:
-        ops->rxPhy(pkt);
-        break;
-
-      case REPLY_RX_MPDU_CMD:
-        ops->rxMpdu(&rxcb);
-        break;
-
-      case BT_PROFILE_NOTIFICATION:
-        IWL_INFO(0, "BT Profile Notification");
-        break;
-
-      case SCAN_ITERATION_COMPLETE_UMAC:
-      case SCAN_COMPLETE_UMAC: {
-        if (trans->m_pDevice->ie_dev->getScanning()) {
-          trans->m_pDevice->last_ebs_successful = true;
-          trans->m_pDevice->ie_dev->setScanning(false);
-          trans->m_pDevice->ie_dev->setPublished(true);
-          if (!trans->m_pDevice->ie_dev->lockScanCache()) {
-            IWL_ERR(0, "Failed to lock mutex\n");
-            break;
-          }
-
-          trans->m_pDevice->ie_dev->resetScanIndex();
-
-          // IOSleep(100);
-          trans->m_pDevice->ie_dev->restoreState();
-
-          trans->m_pDevice->ie_dev->unlockScanCache();
-
-          if (trans->m_pDevice->ie_dev->scanDone()) {
-            IWL_INFO(0, "posted results\n");
-          } else {
-            IWL_ERR(0, "Interface was null?\n");
-          }
-        }
-        break;
-      }
-
-      default:
-        break;
-    }
+    if (handler->fn) handler->fn(trans, &rxcb);
 
     // opmode->rx(NULL, NULL, &rxcb);
 
@@ -1391,13 +1839,6 @@ static void iwl_pcie_rx_handle_rb(IWLTransport *trans, struct iwl_rxq *rxq,
     // else
     //    iwl_op_mode_rx_rss(trans->op_mode, &rxq->napi, &rxcb, rxq->id);
 
-    if (reclaim) {
-      // clang-format off
-      iwh_free((void *)txq->entries[cmd_index].free_buf);  // NOLINT(readability/casting)
-      txq->entries[cmd_index].free_buf = NULL;
-      // clang-format on
-    }
-
     /*
      * After here, we should always check rxcb._page_stolen,
      * if it is true then one of the handlers took the page.
@@ -1418,36 +1859,31 @@ static void iwl_pcie_rx_handle_rb(IWLTransport *trans, struct iwl_rxq *rxq,
     offset += LNX_ALIGN(len, FH_RSCSR_FRAME_ALIGN);
   }
 
+  /*
+   * Slices and thieves hold their own references, drop the RBD's one and
+   * let the allocator attach a fresh page from the pool.
+   */
   if (page_stolen) {
-    IWL_ERR(0, "page stolen, free here\n");
-    mbuf_freem(rxb->page);
+    iwl_pcie_rx_page_put(rxb->rx_page);
+    rxb->rx_page = NULL;
     rxb->page = NULL;
   }
 
+  /* Reuse the page if possible, it is still mapped at rxb->page_dma */
   if (rxb->page != NULL) {
-    IWL_ERR(0, "rx passed, but page not freed\n");
-    IOMbufNaturalMemoryCursor *cursor =
-        IOMbufNaturalMemoryCursor::withSpecification(PAGE_SIZE, 1);
-    int err = cursor->getPhysicalSegments(rxb->page, &rxb->vec, 1);
-
-    if (err == 0) {
-      IWL_ERR(0, "LEAK PAGE\n");
-      rxb->page = NULL;
-      iwl_pcie_rx_reuse_rbd(trans, rxb, rxq, emergency);
-    } else {
-      rxb->page_dma = rxb->vec.location;
-      TAILQ_INSERT_TAIL(&rxq->rx_free, rxb, list);
-      rxq->free_count++;
-    }
+    TAILQ_INSERT_TAIL(&rxq->rx_free, rxb, list);
+    rxq->free_count++;
   } else {
     iwl_pcie_rx_reuse_rbd(trans, rxb, rxq, emergency);
   }
 }
 
-void IWLTransport::handleRx(int queue) {
+bool IWLTransport::handleRx(int queue, int budget) {
   struct iwl_rxq *_rxq = &this->rxq[queue];
-  u32 r, i, count = 0;
+  u32 r, i, stop, count = 0;
   bool emergency = false;
+  bool more = false;
+  int handled = 0;
 
 restart:
   r = le16_to_cpu(_rxq->rb_stts->closed_rb_num) & 0x0FFF;
@@ -1458,14 +1894,18 @@ restart:
 
   /* Rx interrupt, but nothing sent from uCode */
   if (i == r)
-    IWL_INFO(trans, "Q %d: HW = SW = %d (nothing was sent??) \n", _rxq->id, r);
+    IWL_DEBUG_RX(trans, "Q %d: HW = SW = %d (nothing was sent??) \n",
+                 _rxq->id, r);
 
-  while (i != r) {
+  /* Leave what does not fit the budget to the next poll pass */
+  stop = iwl_rx_budget_stop(i, r, _rxq->queue_size, budget - handled, &more);
+
+  while (i != stop) {
     struct iwl_rx_mem_buffer *rxb;
 
-    u32 rb_pending_alloc = rba.req_pending * RX_CLAIM_REQ_ALLOC;
+    u32 rb_pending_alloc = _rxq->req_pending * RX_CLAIM_REQ_ALLOC;
     if (unlikely(rb_pending_alloc >= _rxq->queue_size / 2 && !emergency)) {
-      move_to_allocator(&rba, _rxq);
+      move_to_allocator(_rxq);
       emergency = true;
       IWL_ERR(0, "RX path is in emergency. Pending allocs: %d\n",
               rb_pending_alloc);
@@ -1481,6 +1921,8 @@ restart:
 
       if ((!vid || vid > this->global_table_array_size)) {
         IWL_ERR(0, "Invalid rxb from hw %u\n", (u32)vid);
+        /* polling again would only hit it again */
+        more = false;
         goto out;
       }
 
@@ -1488,36 +1930,32 @@ restart:
       if (rxb->invalid) {
         IWL_ERR(0, "Invalid rxb from hw (invalid) %u\n", (u32)vid);
         iwlForceNmi();
+        more = false;
         goto out;
       }
       rxb->invalid = true;
     } else {
       rxb = _rxq->queue[i];
 
-      IWL_INFO(0, "Queue: %x\n", rxb);
+      IWL_DEBUG_RX(0, "Queue: %x\n", rxb);
       _rxq->queue[i] = NULL;
     }
 
     iwl_pcie_rx_handle_rb(this, _rxq, rxb, emergency);
+    handled++;
 
-    IWL_INFO(trans, "Q %d: HW = %d, SW = %d (total: %d, used: %d, free: %d)\n",
-             _rxq->id, r, i, _rxq->queue_size, _rxq->used_count,
-             _rxq->free_count);
+    IWL_DEBUG_RX(trans,
+                 "Q %d: HW = %d, SW = %d (total: %d, used: %d, free: %d)\n",
+                 _rxq->id, r, i, _rxq->queue_size, _rxq->used_count,
+                 _rxq->free_count);
 
     i = (i + 1) & (_rxq->queue_size - 1);
     if (_rxq->used_count >= RX_CLAIM_REQ_ALLOC)
       iwl_pcie_rx_allocator_get(this, _rxq);
 
     if (_rxq->used_count % RX_CLAIM_REQ_ALLOC == 0 && !emergency) {
-      struct iwl_rb_allocator *rba = &this->rba;
-
       /* Add the remaining empty RBDs for allocator use */
-      IOInterruptState state = IOSimpleLockLockDisableInterrupt(rba->lock);
-      if (!TAILQ_EMPTY(&_rxq->rx_used)) {
-        TAILQ_CONCAT(&rba->rbd_empty, &_rxq->rx_used, list);
-        TAILQ_INIT(&_rxq->rx_used);
-      }
-      IOSimpleLockUnlockEnableInterrupt(rba->lock, state);
+      move_to_allocator(_rxq);
     } else if (emergency) {
       IWL_INFO(0, "EMERGENCY!\n");
       count++;
@@ -1556,4 +1994,113 @@ out:
   if (unlikely(emergency && count)) iwl_pcie_rxq_alloc_rbs(this, _rxq);
 
   rxqRestok(_rxq);
+  int_mit.window_rbs += handled;
+
+  return more;
+}
+
+void IWLTransport::intMitSetAdaptive(bool adaptive) {
+  int_mit.adaptive = adaptive;
+  if (adaptive || int_mit.timeout == IWL_HOST_INT_TIMEOUT_DEF) return;
+
+  int_mit.timeout = IWL_HOST_INT_TIMEOUT_DEF;
+  if (test_bit(STATUS_DEVICE_ENABLED, &status))
+    iwlWrite8(CSR_INT_COALESCING, int_mit.timeout);
+}
+
+/*
+ * Called for each interrupt before it is handled: samples the filter to
+ * handler latency, and at the end of a window works out the rates and
+ * retunes the coalescing timer.
+ */
+void IWLTransport::intMitIrq() {
+  u64 now = mach_absolute_time();
+  u64 stamp = int_mit.irq_stamp;
+  u64 elapsed;
+
+  if (stamp && now > stamp) {
+    int_mit.latency_sum += now - stamp;
+    if (now - stamp > int_mit.latency_max) int_mit.latency_max = now - stamp;
+    int_mit.latency_count++;
+  }
+  int_mit.window_irqs++;
+
+  if (!int_mit.window_start) int_mit.window_start = now;
+  absolutetime_to_nanoseconds(now - int_mit.window_start, &elapsed);
+  if (elapsed < IWL_INT_MIT_WINDOW_MS * NSEC_PER_MSEC) return;
+
+  intMitWindow(now, elapsed);
+}
+
+/* closes the window that started @elapsed ns before @now */
+void IWLTransport::intMitWindow(u64 now, u64 elapsed) {
+  u8 timeout;
+
+  int_mit.irq_rate = (u32)(int_mit.window_irqs * NSEC_PER_SEC / elapsed);
+  int_mit.rb_rate = (u32)(int_mit.window_rbs * NSEC_PER_SEC / elapsed);
+  int_mit.window_irqs = int_mit.window_rbs = 0;
+  int_mit.window_start = now;
+
+  /* the NIC init paths program the default again */
+  if (!int_mit.adaptive || !test_bit(STATUS_DEVICE_ENABLED, &status)) return;
+
+  timeout = int_mit.timeout;
+  if (int_mit.rb_rate < IWL_INT_MIT_LOW_RATE)
+    timeout = IWL_INT_MIT_TIMEOUT_LOW;
+  else if (int_mit.rb_rate > IWL_INT_MIT_HIGH_RATE)
+    timeout = IWL_HOST_INT_TIMEOUT_DEF;
+  if (timeout == int_mit.timeout) return;
+
+  IWL_DEBUG_ISR(0, "int mit: %u RBs/s, %u irqs/s, timeout %u -> %u\n",
+                int_mit.rb_rate, int_mit.irq_rate, int_mit.timeout, timeout);
+  int_mit.timeout = timeout;
+  iwlWrite8(CSR_INT_COALESCING, timeout);
+}
+
+/*
+ * Whether the interrupt handler has to arm the idle check: the timer is
+ * above the quiet value and no check is pending yet.
+ */
+bool IWLTransport::intMitArmIdle() {
+  if (!int_mit.adaptive || int_mit.idle_armed ||
+      int_mit.timeout == IWL_INT_MIT_TIMEOUT_LOW)
+    return false;
+  int_mit.idle_armed = true;
+  return true;
+}
+
+/*
+ * The idle check, every IWL_INT_MIT_WINDOW_MS while the timer is up: if
+ * no interrupt closed a window since, the rate has dropped and the window
+ * is closed here. Returns whether to check again.
+ */
+bool IWLTransport::intMitIdle() {
+  u64 now = mach_absolute_time();
+  u64 elapsed;
+
+  if (int_mit.window_start) {
+    absolutetime_to_nanoseconds(now - int_mit.window_start, &elapsed);
+    if (elapsed >= IWL_INT_MIT_WINDOW_MS * NSEC_PER_MSEC)
+      intMitWindow(now, elapsed);
+  }
+  if (int_mit.adaptive && int_mit.timeout != IWL_INT_MIT_TIMEOUT_LOW &&
+      test_bit(STATUS_DEVICE_ENABLED, &status))
+    return true;
+  int_mit.idle_armed = false;
+  return false;
+}
+
+void IWLTransport::intMitDump() {
+  u64 avg = 0, max;
+
+  if (int_mit.latency_count)
+    absolutetime_to_nanoseconds(int_mit.latency_sum / int_mit.latency_count,
+                                &avg);
+  absolutetime_to_nanoseconds(int_mit.latency_max, &max);
+  IWL_INFO(0,
+           "int mit: %s, timeout %u usec, %u irqs/s, %u RBs/s, "
+           "latency avg %llu max %llu usec\n",
+           int_mit.adaptive ? "adaptive" : "fixed", int_mit.timeout * 32,
+           int_mit.irq_rate, int_mit.rb_rate, avg / NSEC_PER_USEC,
+           max / NSEC_PER_USEC);
 }
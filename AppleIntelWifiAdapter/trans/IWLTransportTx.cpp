@@ -44,8 +44,8 @@ static int iwl_queue_space(const struct iwl_txq *q) {
    * modulo by TFD_QUEUE_SIZE_MAX and is well defined.
    */
   used = (q->write_ptr - q->read_ptr) & (TFD_QUEUE_SIZE_MAX - 1);
-  IWL_INFO(0, "QID %d (wrptr: %d, rdptr: %d, used: %d, max: %d)\n", q->id,
-           q->write_ptr, q->read_ptr, used, max);
+  IWL_DEBUG_TX(0, "QID %d (wrptr: %d, rdptr: %d, used: %d, max: %d)\n",
+               q->id, q->write_ptr, q->read_ptr, used, max);
   if (WARN_ON(used > max)) return 0;
 
   return max - used;
@@ -93,6 +93,161 @@ void iwl_pcie_free_dma_ptr(IWLTransport *trans, struct iwl_dma_ptr *ptr) {
   // memset(ptr, 0, sizeof(*ptr));
 }
 
+/*
+ * iwl_pcie_hcmd_pool_reap - free the misses iwl_pcie_hcmd_buf_put() could
+ * not free, call it with no spinlock held
+ */
+void iwl_pcie_hcmd_pool_reap(IWLTransport *trans) {
+  struct iwl_hcmd_pool *pool = &trans->hcmd_pool;
+  struct iwl_dma_ptr *dma;
+
+  if (unlikely(!pool->lock)) return;
+
+  /* misses are rare, one at a time keeps the lock hold short */
+  for (;;) {
+    IOSimpleLockLock(pool->lock);
+    dma = pool->deferred_count ? pool->deferred[--pool->deferred_count]
+                               : NULL;
+    IOSimpleLockUnlock(pool->lock);
+    if (!dma) break;
+    free_dma_buf(dma);
+  }
+}
+
+static void iwl_pcie_hcmd_pool_free(IWLTransport *trans) {
+  struct iwl_hcmd_pool *pool = &trans->hcmd_pool;
+  int i;
+
+  iwl_pcie_hcmd_pool_reap(trans);
+  for (i = 0; i < IWL_HCMD_POOL_CLASSES; i++) {
+    struct iwl_hcmd_slab *slab = &pool->slab[i];
+
+    if (!slab->region) continue;
+    WARN_ON(slab->free_count != slab->count);
+    IWL_INFO(trans, "hcmd pool %u: %u hits, %u of %u used at most\n",
+             slab->obj_size, slab->hits, slab->in_use_max, slab->count);
+    free_dma_buf(slab->region);
+    iwh_free(slab->objs);
+    iwh_free(slab->free);
+  }
+  if (pool->lock) {
+    IWL_INFO(trans, "hcmd pool: %u misses\n", pool->misses);
+    IOSimpleLockFree(pool->lock);
+  }
+  bzero(pool, sizeof(*pool));
+}
+
+static int iwl_pcie_hcmd_pool_init(IWLTransport *trans) {
+  struct iwl_hcmd_pool *pool = &trans->hcmd_pool;
+  u32 i, j;
+
+  bzero(pool, sizeof(*pool));
+  pool->lock = IOSimpleLockAlloc();
+  if (!pool->lock) return -ENOMEM;
+
+  for (i = 0; i < IWL_HCMD_POOL_CLASSES; i++) {
+    struct iwl_hcmd_slab *slab = &pool->slab[i];
+
+    slab->obj_size = iwl_hcmd_pool_classes[i].obj_size;
+    slab->count = iwl_hcmd_pool_classes[i].count;
+    slab->region =
+        allocate_dma_buf(slab->obj_size * slab->count, trans->dma_mask);
+    slab->objs = (struct iwl_dma_ptr *)iwh_zalloc(sizeof(*slab->objs) *
+                                                  slab->count);
+    slab->free = (u16 *)iwh_zalloc(sizeof(*slab->free) * slab->count);
+    if (!slab->region || !slab->objs || !slab->free) goto err;
+
+    /* bmd and cmd stay NULL, which marks the buffer as pooled */
+    for (j = 0; j < slab->count; j++) {
+      slab->objs[j].addr = (u8 *)slab->region->addr + j * slab->obj_size;
+      slab->objs[j].dma = slab->region->dma + j * slab->obj_size;
+      slab->objs[j].size = slab->obj_size;
+    }
+    iwl_hcmd_slab_reset(slab);
+  }
+  return 0;
+
+err:
+  iwl_pcie_hcmd_pool_free(trans);
+  return -ENOMEM;
+}
+
+/*
+ * iwl_pcie_hcmd_pool_get - pool buffer of at least @size bytes, or NULL
+ *
+ * Served from the smallest class that fits and still has a free buffer.
+ * Putting it back never frees memory, so it can be done under a spinlock.
+ */
+static struct iwl_dma_ptr *iwl_pcie_hcmd_pool_get(IWLTransport *trans,
+                                                  size_t size) {
+  struct iwl_hcmd_pool *pool = &trans->hcmd_pool;
+  struct iwl_dma_ptr *dma = NULL;
+  u32 obj;
+  int i;
+
+  if (unlikely(!pool->lock)) return NULL;
+
+  IOSimpleLockLock(pool->lock);
+  i = iwl_hcmd_slab_get(pool->slab, IWL_HCMD_POOL_CLASSES, size, &obj);
+  if (i >= 0)
+    dma = &pool->slab[i].objs[obj];
+  else
+    pool->misses++;
+  IOSimpleLockUnlock(pool->lock);
+  return dma;
+}
+
+/*
+ * iwl_pcie_hcmd_buf_get - DMA buffer for a command fragment
+ *
+ * From the pool if it can, else a one-off allocation. Release with
+ * iwl_pcie_hcmd_buf_put(). Can block, so it also frees what earlier misses
+ * left on the pool.
+ */
+static struct iwl_dma_ptr *iwl_pcie_hcmd_buf_get(IWLTransport *trans,
+                                                 size_t size) {
+  struct iwl_dma_ptr *dma = iwl_pcie_hcmd_pool_get(trans, size);
+
+  if (dma) return dma;
+  iwl_pcie_hcmd_pool_reap(trans);
+  return allocate_dma_buf(size, trans->dma_mask);
+}
+
+/*
+ * iwl_pcie_hcmd_buf_put - release a buffer of iwl_pcie_hcmd_buf_get()
+ *
+ * Safe under a spinlock: pool buffers go back on their free stack and
+ * one-off allocations are only freed by iwl_pcie_hcmd_pool_reap().
+ */
+static void iwl_pcie_hcmd_buf_put(IWLTransport *trans,
+                                  struct iwl_dma_ptr *dma) {
+  struct iwl_hcmd_pool *pool = &trans->hcmd_pool;
+  int i;
+
+  /* no pool, no spinlock either: the queues are set up or torn down */
+  if (unlikely(!pool->lock)) {
+    free_dma_buf(dma);
+    return;
+  }
+
+  IOSimpleLockLock(pool->lock);
+  if (dma->bmd) {
+    /* can't overflow, but leaking beats freeing under a spinlock */
+    if (!WARN_ON(pool->deferred_count == IWL_HCMD_POOL_DEFERRED))
+      pool->deferred[pool->deferred_count++] = dma;
+    IOSimpleLockUnlock(pool->lock);
+    return;
+  }
+  for (i = 0; i < IWL_HCMD_POOL_CLASSES; i++) {
+    struct iwl_hcmd_slab *slab = &pool->slab[i];
+
+    if (dma < slab->objs || dma >= slab->objs + slab->count) continue;
+    iwl_hcmd_slab_put(slab, (u32)(dma - slab->objs));
+    break;
+  }
+  IOSimpleLockUnlock(pool->lock);
+}
+
 static int iwl_pcie_txq_alloc(IWLTransport *trans, struct iwl_txq *txq,
                               int slots_num, bool cmd_queue) {
   IWLTransport *trans_pcie = trans;
@@ -102,6 +257,7 @@ static int iwl_pcie_txq_alloc(IWLTransport *trans, struct iwl_txq *txq,
   int ret;
   struct iwl_dma_ptr *tfds_dma = NULL;
   struct iwl_dma_ptr *first_tb_bufs_dma = NULL;
+  struct iwl_dma_ptr *tb1_bufs_dma = NULL;
 
   if (WARN_ON(txq->entries || txq->tfds)) return -EINVAL;
 
@@ -147,7 +303,22 @@ static int iwl_pcie_txq_alloc(IWLTransport *trans, struct iwl_txq *txq,
   txq->first_tb_bufs = (struct iwl_pcie_first_tb_buf *)first_tb_bufs_dma->addr;
   txq->first_tb_dma = first_tb_bufs_dma->dma;
 
+  /* data frames build TB1 in place, nothing is allocated per frame */
+  if (!cmd_queue) {
+    ret = iwl_pcie_alloc_dma_ptr(trans, &tb1_bufs_dma,
+                                 sizeof(*txq->tb1_bufs) * slots_num);
+    if (ret) goto err_free_first_tb;
+
+    txq->tb1_dma_ptr = tb1_bufs_dma;
+    txq->tb1_bufs = (struct iwl_pcie_tx_tb1_buf *)tb1_bufs_dma->addr;
+    txq->tb1_dma = tb1_bufs_dma->dma;
+  }
+
   return 0;
+err_free_first_tb:
+  free_dma_buf(txq->first_tb_dma_ptr);
+  txq->first_tb_dma_ptr = NULL;
+  txq->first_tb_bufs = NULL;
 err_free_tfds:
   free_dma_buf(txq->tfds_dma);
 error:
@@ -174,6 +345,8 @@ int iwl_pcie_txq_init(IWLTransport *trans, struct iwl_txq *txq, int slots_num,
       trans->m_pDevice->cfg->trans.base_params->max_tfd_queue_size;
 
   txq->need_update = false;
+  txq->db_pending = 0;
+  txq->ampdu = false;
 
   /* max_tfd_queue_size must be power-of-two size, otherwise
    * iwl_queue_inc_wrap and iwl_queue_dec_wrap are broken. */
@@ -222,7 +395,7 @@ void iwl_pcie_tfd_unmap(IWLTransport *trans, struct iwl_cmd_meta *meta,
 
   for (i = 0; i < ARRAY_SIZE(meta->dma); ++i) {
     if (meta->dma[i]) {
-      free_dma_buf(meta->dma[i]);
+      iwl_pcie_hcmd_buf_put(trans, meta->dma[i]);
     }
     meta->dma[i] = NULL;
   }
@@ -268,17 +441,14 @@ void iwl_pcie_txq_free_tfd(IWLTransport *trans, struct iwl_txq *txq) {
 
   /* free SKB */
   if (txq->entries) {
-    sk_buff *skb;
-
-    skb = reinterpret_cast<sk_buff *>(txq->entries[idx].skb);
+    mbuf_t skb = txq->entries[idx].skb;
 
-    /* Can be called from irqs-disabled context
+    /*
      * If skb is not NULL, it means that the whole queue is being
      * freed and that the queue is not empty - free the skb
      */
     if (skb) {
-      // TODO: Implement
-      // iwl_op_mode_free_skb(trans->op_mode, skb);
+      mbuf_freem(skb);
       txq->entries[idx].skb = NULL;
     }
   }
@@ -300,6 +470,18 @@ static void iwl_pcie_txq_unmap(IWLTransport *trans, int txq_id) {
 
       // TODO: Implement
       // iwl_pcie_free_tso_page(trans_pcie, skb);
+    } else {
+      /* the command queue has n_window entries, not one per TFD */
+      int idx = iwl_pcie_get_cmd_index(txq, txq->read_ptr);
+      struct iwl_cmd_meta *meta = &txq->entries[idx].meta;
+
+      /* the response will never come, let the sender know */
+      if (meta->callback) {
+        iwl_hcmd_callback_t callback = meta->callback;
+
+        meta->callback = NULL;
+        callback(meta->cb_ctx, NULL);
+      }
     }
     iwl_pcie_txq_free_tfd(trans, txq);
     txq->read_ptr = iwl_queue_inc_wrap(txq->read_ptr);
@@ -327,6 +509,7 @@ static void iwl_pcie_txq_unmap(IWLTransport *trans, int txq_id) {
   //    }
 
   // spin_unlock_bh(&txq->lock);
+  iwl_pcie_hcmd_pool_reap(trans);
 
   /* just in case - this queue may have been stopped */
   // TODO: Implement
@@ -345,11 +528,7 @@ static void iwl_pcie_txq_free(IWLTransport *trans, int txq_id) {
 
   /* De-alloc array of command/tx buffers */
   if (txq_id == trans->cmd_queue) {
-    for (i = 0; i < txq->n_window; i++) {
-      iwh_free(txq->entries[i].cmd);
-      iwh_free(
-          (void *)txq->entries[i].free_buf);  // NOLINT(readability/casting)
-    }
+    for (i = 0; i < txq->n_window; i++) iwh_free(txq->entries[i].cmd);
   }
   /* De-alloc circular buffer of TFDs */
   if (txq->tfds) {
@@ -358,6 +537,7 @@ static void iwl_pcie_txq_free(IWLTransport *trans, int txq_id) {
     txq->tfds = NULL;
 
     free_dma_buf(txq->first_tb_dma_ptr);
+    if (txq->tb1_dma_ptr) free_dma_buf(txq->tb1_dma_ptr);
   }
 
   iwh_free(txq->entries);
@@ -387,6 +567,17 @@ void iwl_pcie_tx_free(IWLTransport *trans_pcie) {
   iwh_free(trans_pcie->txq_memory);
   trans_pcie->txq_memory = NULL;
 
+  IWL_INFO(trans_pcie,
+           "tx: %u frames (%u copied), %u doorbells, %u ok, %u failed, "
+           "%u queue stops, %u A-MPDUs\n",
+           trans_pcie->tx_stats.frames, trans_pcie->tx_stats.copied,
+           trans_pcie->tx_stats.doorbells, trans_pcie->tx_stats.ok,
+           trans_pcie->tx_stats.failed, trans_pcie->tx_stats.stopped,
+           trans_pcie->tx_stats.ampdus);
+
+  /* after the queues, unmapping them returns their buffers */
+  iwl_pcie_hcmd_pool_free(trans_pcie);
+  OSSafeReleaseNULL(trans_pcie->tx_cursor);
   iwl_pcie_free_dma_ptr(trans_pcie, trans_pcie->kw);
   iwl_pcie_free_dma_ptr(trans_pcie, trans_pcie->scd_bc_tbls);
 }
@@ -427,6 +618,20 @@ int iwl_pcie_tx_alloc(IWLTransport *trans_pcie) {
     goto error;
   }
 
+  ret = iwl_pcie_hcmd_pool_init(trans);
+  if (ret) {
+    IWL_ERR(trans, "Host command pool allocation failed\n");
+    goto error;
+  }
+
+  trans_pcie->tx_cursor = IOMbufNaturalMemoryCursor::withSpecification(
+      IWL_TX_TB_MAX_LEN, IWL_TX_SG_MAX_SEGS);
+  if (!trans_pcie->tx_cursor) {
+    IWL_ERR(trans, "Tx DMA cursor allocation failed\n");
+    ret = -ENOMEM;
+    goto error;
+  }
+
   trans_pcie->txq_memory = (struct iwl_txq *)iwh_zalloc(
       sizeof(struct iwl_txq) *
       trans->m_pDevice->cfg->trans.base_params->num_of_queues);
@@ -682,9 +887,13 @@ static void iwl_pcie_txq_inc_wr_ptr(IWLTransport *trans, struct iwl_txq *txq) {
    * if not in power-save mode, uCode will never sleep when we're
    * trying to tx (during RFKILL, we're not trying to tx).
    */
-  IWL_INFO(trans, "Q:%d WR: 0x%x\n", txq_id, txq->write_ptr);
-  if (!txq->block)
+  IWL_DEBUG_TX(trans, "Q:%d WR: 0x%x\n", txq_id, txq->write_ptr);
+  if (!txq->block) {
+    IWL_EVT(IWL_EVT_TX_WRPTR, txq_id, txq->write_ptr, txq->db_pending, 0);
     trans->iwlWrite32(HBUS_TARG_WRPTR, txq->write_ptr | (txq_id << 8));
+    if (txq_id != trans->cmd_queue) trans->tx_stats.doorbells++;
+    txq->db_pending = 0;
+  }
 }
 
 /*************** HOST COMMAND QUEUE FUNCTIONS   *****/
@@ -704,10 +913,9 @@ static int iwl_pcie_enqueue_hcmd(IWLTransport *trans,
   struct iwl_device_cmd *out_cmd;
   struct iwl_cmd_meta *out_meta;
   IOInterruptState flags;
-  void *dup_buf = NULL;
   int idx;
   u16 copy_size, cmd_size, tb0_size;
-  bool had_nocopy = false;
+  bool had_nocopy = false, had_dup = false;
   u8 group_id = iwl_cmd_groupid(cmd->id);
   int i, ret;
   u32 cmd_pos;
@@ -760,14 +968,16 @@ static int iwl_pcie_enqueue_hcmd(IWLTransport *trans,
       had_nocopy = true;
 
       /* only allowed once */
-      if (WARN_ON(dup_buf)) {
+      if (WARN_ON(had_dup)) {
         idx = -EINVAL;
         goto free_dup_buf;
       }
 
-      dup_buf = iwh_malloc(cmdlen[i]);
-      if (!dup_buf) return -ENOMEM;
-      memcpy(dup_buf, cmddata[i], cmdlen[i]);
+      /*
+       * The fragment gets its own DMA buffer below, copying it there is
+       * all DUP needs: no intermediate duplicate is kept.
+       */
+      had_dup = true;
     } else {
       /* NOCOPY must not be followed by normal! */
       if (WARN_ON(had_nocopy)) {
@@ -884,6 +1094,8 @@ static int iwl_pcie_enqueue_hcmd(IWLTransport *trans,
       iwl_get_cmd_string(trans, cmd->id), group_id, out_cmd->hdr.cmd,
       le16_to_cpu(out_cmd->hdr.sequence), cmd_size, txq->write_ptr, idx,
       trans->cmd_queue);
+  IWL_EVT(IWL_EVT_HCMD_SEND, cmd->id, cmd_size,
+          le16_to_cpu(out_cmd->hdr.sequence), cmd->flags);
 
   /* start the TFD with the minimum copy bytes */
   tb0_size = min_t(int, copy_size, IWL_FIRST_TB_SIZE);
@@ -894,7 +1106,7 @@ static int iwl_pcie_enqueue_hcmd(IWLTransport *trans,
   /* map first command fragment, if any remains */
   if (copy_size > tb0_size) {
     struct iwl_dma_ptr *dma =
-        allocate_dma_buf(copy_size - tb0_size, trans->dma_mask);
+        iwl_pcie_hcmd_buf_get(trans, copy_size - tb0_size);
     if (!dma) {
       iwl_pcie_tfd_unmap(trans, out_meta, txq, txq->write_ptr);
       idx = -ENOMEM;
@@ -914,9 +1126,8 @@ static int iwl_pcie_enqueue_hcmd(IWLTransport *trans,
     if (!cmdlen[i]) continue;
     if (!(cmd->dataflags[i] & (IWL_HCMD_DFL_NOCOPY | IWL_HCMD_DFL_DUP)))
       continue;
-    if (cmd->dataflags[i] & IWL_HCMD_DFL_DUP) data = dup_buf;
 
-    struct iwl_dma_ptr *dma = allocate_dma_buf(cmdlen[i], trans->dma_mask);
+    struct iwl_dma_ptr *dma = iwl_pcie_hcmd_buf_get(trans, cmdlen[i]);
     if (!dma) {
       iwl_pcie_tfd_unmap(trans, out_meta, txq, txq->write_ptr);
       idx = -ENOMEM;
@@ -929,14 +1140,12 @@ static int iwl_pcie_enqueue_hcmd(IWLTransport *trans,
 
   BUILD_BUG_ON(IWL_TFH_NUM_TBS > sizeof(out_meta->tbs) * BITS_PER_BYTE);
   out_meta->flags = cmd->flags;
-  if (txq->entries[idx].free_buf) {
-    IWL_INFO(trans, "txq->entries[%d].free_buf is not null", idx);
-    iwh_free(
-        (void *)txq->entries[idx].free_buf);  // NOLINT(readability/casting)
+  if (cmd->flags & CMD_WANT_ASYNC_CALLBACK) {
+    out_meta->callback = cmd->callback;
+    out_meta->cb_ctx = cmd->cb_ctx;
+  } else {
+    out_meta->callback = NULL;
   }
-
-  txq->entries[idx].free_buf = dup_buf;
-
   /* start timer if queue currently empty */
   // TODO timer
   //    if (txq->read_ptr == txq->write_ptr && txq->wd_timeout)
@@ -962,9 +1171,9 @@ static int iwl_pcie_enqueue_hcmd(IWLTransport *trans,
 out:
   // IOSimpleLockUnlock(txq->lock);
   //    spin_unlock_bh(&txq->lock);
+  /* the unmaps on the error paths leave misses for us to free */
+  if (idx < 0) iwl_pcie_hcmd_pool_reap(trans);
 free_dup_buf:
-  //    if (idx < 0)
-  //        kfree(dup_buf);
   return idx;
 }
 
@@ -1104,8 +1313,7 @@ cancel:
   if (cmd->resp_pkt) {
     IWL_INFO(0, "free resp pkt\n");
 
-    //        trans->freeResp(cmd);
-    cmd->resp_pkt = NULL;
+    trans->freeResp(cmd);
   }
 
   return ret;
@@ -1126,6 +1334,144 @@ static int iwl_pcie_send_hcmd_async(IWLTransport *trans,
   return 0;
 }
 
+static void iwl_hcmd_batch_done(void *ctx, struct iwl_rx_packet *pkt) {
+  struct iwl_hcmd_batch_slot *slot = (struct iwl_hcmd_batch_slot *)ctx;
+  struct iwl_hcmd_batch *batch = slot->batch;
+
+  if (slot->callback) slot->callback(slot->cb_ctx, pkt);
+  if (pkt) {
+    if (slot->status_mask &&
+        iwl_rx_packet_payload_len(pkt) == sizeof(struct iwl_cmd_response)) {
+      struct iwl_cmd_response *resp = (struct iwl_cmd_response *)pkt->data;
+
+      slot->status = le32_to_cpu(resp->status);
+    }
+    slot->done = true;
+  }
+
+  IOLockLock(batch->lock);
+  if (!--batch->pending) IOLockWakeup(batch->lock, &batch->pending, false);
+  IOLockUnlock(batch->lock);
+  iwl_hcmd_batch_put(batch);
+}
+
+struct iwl_hcmd_batch *iwl_hcmd_batch_alloc(IWLTransport *trans) {
+  struct iwl_hcmd_batch *batch =
+      (struct iwl_hcmd_batch *)iwh_zalloc(sizeof(*batch));
+
+  if (!batch) return NULL;
+  batch->lock = IOLockAlloc();
+  if (!batch->lock) {
+    iwh_free(batch);
+    return NULL;
+  }
+  batch->trans = trans;
+  batch->refcount = 1;
+  return batch;
+}
+
+void iwl_hcmd_batch_put(struct iwl_hcmd_batch *batch) {
+  if (OSDecrementAtomic(&batch->refcount) != 1) return;
+  IOLockFree(batch->lock);
+  iwh_free(batch);
+}
+
+/*
+ * iwl_hcmd_batch_send - queue a command of the batch and return at once
+ *
+ * If @status_mask is set the command must answer with a
+ * struct iwl_cmd_response whose masked status is @status_ok. A failure
+ * to queue is remembered and reported by iwl_hcmd_batch_wait() as well,
+ * so a sequence can be queued without checking every step. A callback
+ * already set in @cmd still gets the response, before the wait ends.
+ */
+int iwl_hcmd_batch_send(struct iwl_hcmd_batch *batch,
+                        struct iwl_host_cmd *cmd, u32 status_mask,
+                        u32 status_ok) {
+  struct iwl_hcmd_batch_slot *slot;
+  int ret;
+
+  if (WARN_ON(cmd->flags & CMD_WANT_SKB)) return -EINVAL;
+  if (batch->count == IWL_HCMD_BATCH_MAX) {
+    ret = -ENOSPC;
+    goto err;
+  }
+
+  slot = &batch->slot[batch->count++];
+  slot->batch = batch;
+  slot->id = cmd->id;
+  slot->status_mask = status_mask;
+  slot->status_ok = status_ok;
+  slot->callback = cmd->callback;
+  slot->cb_ctx = cmd->cb_ctx;
+
+  cmd->flags |= CMD_ASYNC | CMD_WANT_ASYNC_CALLBACK;
+  cmd->callback = iwl_hcmd_batch_done;
+  cmd->cb_ctx = slot;
+
+  /* the callback may run before sendCmd() returns */
+  OSIncrementAtomic(&batch->refcount);
+  IOLockLock(batch->lock);
+  batch->pending++;
+  IOLockUnlock(batch->lock);
+
+  ret = batch->trans->sendCmd(cmd);
+  if (!ret) return 0;
+
+  IOLockLock(batch->lock);
+  batch->pending--;
+  IOLockUnlock(batch->lock);
+  iwl_hcmd_batch_put(batch);
+err:
+  IWL_ERR(batch->trans, "Error queueing %s in batch: %d\n",
+          iwl_get_cmd_string(batch->trans, cmd->id), ret);
+  if (!batch->error) batch->error = ret;
+  return ret;
+}
+
+/*
+ * iwl_hcmd_batch_wait - wait for all the commands of the batch
+ *
+ * Returns the first error of the batch: a command that could not be
+ * queued, that was dropped, or that answered with a bad status.
+ */
+int iwl_hcmd_batch_wait(struct iwl_hcmd_batch *batch) {
+  IWLTransport *trans = batch->trans;
+  AbsoluteTime deadline;
+  int i, ret = 0;
+
+  clock_interval_to_deadline(HOST_COMPLETE_TIMEOUT * 2, kMillisecondScale,
+                             reinterpret_cast<UInt64 *>(&deadline));
+  IOLockLock(batch->lock);
+  while (batch->pending && ret != THREAD_TIMED_OUT)
+    ret = IOLockSleepDeadline(batch->lock, &batch->pending, deadline,
+                              THREAD_UNINT);
+  IOLockUnlock(batch->lock);
+
+  if (ret == THREAD_TIMED_OUT) {
+    IWL_ERR(trans, "Command batch timed out, %d commands pending\n",
+            batch->pending);
+    return -ETIMEDOUT;
+  }
+  if (batch->error) return batch->error;
+
+  for (i = 0; i < batch->count; i++) {
+    struct iwl_hcmd_batch_slot *slot = &batch->slot[i];
+
+    if (!slot->done) {
+      IWL_ERR(trans, "Command %s in batch was dropped\n",
+              iwl_get_cmd_string(trans, slot->id));
+      return -EIO;
+    }
+    if ((slot->status & slot->status_mask) != slot->status_ok) {
+      IWL_ERR(trans, "Command %s in batch failed: status 0x%x\n",
+              iwl_get_cmd_string(trans, slot->id), slot->status);
+      return -EIO;
+    }
+  }
+  return 0;
+}
+
 int IWLTransport::pcieSendHCmd(iwl_host_cmd *cmd) {
   /* Make sure the NIC is still alive in the bus */
   if (test_bit(STATUS_TRANS_DEAD, &this->status)) return -ENODEV;
@@ -1140,7 +1486,257 @@ int IWLTransport::pcieSendHCmd(iwl_host_cmd *cmd) {
   return iwl_pcie_send_hcmd_sync(this, cmd);
 }
 
-#define BUILD_RAxTID(sta_id, tid) (((sta_id) << 4) + (tid))
+/*************** DATA QUEUE FUNCTIONS   *****/
+
+#define IWL_TX_CRC_SIZE 4
+#define IWL_TX_DELIMITER_SIZE 4
+
+/*
+ * iwl_pcie_txq_update_byte_cnt_tbl - Set up entry in Tx byte-count array
+ *
+ * The scheduler reads the byte count of the frame at the write pointer from
+ * here. Gen1 devices count in dwords.
+ */
+static void iwl_pcie_txq_update_byte_cnt_tbl(IWLTransport *trans,
+                                             struct iwl_txq *txq, u16 byte_cnt,
+                                             const struct iwl_tx_cmd *tx_cmd) {
+  struct iwlagn_scd_bc_tbl *scd_bc_tbl =
+      (struct iwlagn_scd_bc_tbl *)trans->scd_bc_tbls->addr;
+  int write_ptr = txq->write_ptr;
+  int txq_id = txq->id;
+  u16 len = byte_cnt + IWL_TX_CRC_SIZE + IWL_TX_DELIMITER_SIZE;
+  __le16 bc_ent;
+
+  switch (tx_cmd->sec_ctl & TX_CMD_SEC_MSK) {
+    case TX_CMD_SEC_CCM:
+      len += IEEE80211_CCMP_MIC_LEN;
+      break;
+    case TX_CMD_SEC_TKIP:
+      len += IEEE80211_TKIP_ICV_LEN;
+      break;
+    case TX_CMD_SEC_WEP:
+      len += IEEE80211_WEP_IV_LEN + IEEE80211_WEP_ICV_LEN;
+      break;
+  }
+  len = DIV_ROUND_UP(len, 4);
+
+  if (WARN_ON(len > 0xFFF || write_ptr >= TFD_QUEUE_SIZE_MAX)) return;
+
+  bc_ent = cpu_to_le16(len | (tx_cmd->sta_id << 12));
+
+  scd_bc_tbl[txq_id].tfd_offset[write_ptr] = bc_ent;
+
+  if (write_ptr < TFD_QUEUE_SIZE_BC_DUP)
+    scd_bc_tbl[txq_id].tfd_offset[TFD_QUEUE_SIZE_MAX + write_ptr] = bc_ent;
+}
+
+static void iwl_pcie_txq_inval_byte_cnt_tbl(IWLTransport *trans,
+                                            struct iwl_txq *txq) {
+  struct iwlagn_scd_bc_tbl *scd_bc_tbl =
+      (struct iwlagn_scd_bc_tbl *)trans->scd_bc_tbls->addr;
+  int txq_id = txq->id;
+  int read_ptr = txq->read_ptr;
+  __le16 bc_ent;
+
+  /* keep the station of the entry, only the byte count goes */
+  bc_ent = cpu_to_le16(
+      1 | (le16_to_cpu(scd_bc_tbl[txq_id].tfd_offset[read_ptr]) & 0xf000));
+
+  scd_bc_tbl[txq_id].tfd_offset[read_ptr] = bc_ent;
+
+  if (read_ptr < TFD_QUEUE_SIZE_BC_DUP)
+    scd_bc_tbl[txq_id].tfd_offset[TFD_QUEUE_SIZE_MAX + read_ptr] = bc_ent;
+}
+
+/*
+ * txFrame - put a data frame on a Tx queue
+ * @m: the frame body, from the LLC header on
+ * @dev_cmd: TX_CMD with the 802.11 header, tx_cmd->len counts both
+ * @txq_id: the queue, enabled for data already
+ * @more: the caller queues another frame on @txq_id right after this one
+ *
+ * The first IWL_FIRST_TB_SIZE bytes of the command go to the entry's
+ * first TB buffer, the rest of it and the (padded) 802.11 header to the
+ * entry's TB1 buffer. The frame body is mapped segment by segment through
+ * tx_cursor, one TB each; a chain that needs more than IWL_TX_SG_MAX_SEGS
+ * TBs is copied into a pool buffer instead, and fails with -ENOMEM when
+ * the pool has none, since a one-off buffer would have to be freed under
+ * the queue lock on reclaim. On success the queue owns @m until the TX
+ * response reclaims it. Only gen1 TFDs are built here.
+ *
+ * With @more set the doorbell is held back until the burst ends, fills
+ * IWL_TX_DOORBELL_BATCH TFDs or stops the queue. A caller that ends up not
+ * sending the frame it announced must call txKick().
+ */
+int IWLTransport::txFrame(mbuf_t m, struct iwl_device_tx_cmd *dev_cmd,
+                          int txq_id, bool more) {
+  struct iwl_txq *txq = this->txq[txq_id];
+  struct iwl_tx_cmd *tx_cmd = (struct iwl_tx_cmd *)dev_cmd->payload;
+  struct iwl_cmd_meta *out_meta;
+  struct iwl_dma_ptr *dma = NULL;
+  IOMemoryCursor::PhysicalSegment segs[IWL_TX_SG_MAX_SEGS];
+  u16 byte_cnt = le16_to_cpu(tx_cmd->len);
+  size_t payload_len = mbuf_pkthdr_len(m);
+  u16 hdr_len, len, tb1_len;
+  UInt32 i, nsegs = 0;
+  bool copy;
+  int idx;
+
+  if (m_pDevice->cfg->trans.use_tfh) return -EOPNOTSUPP;
+  if (WARN_ON(txq_id == this->cmd_queue || !txq)) return -EINVAL;
+  if (WARN_ON(byte_cnt < payload_len)) return -EINVAL;
+
+  /* everything past TB0 of the command and the MAC header, dword aligned */
+  hdr_len = byte_cnt - payload_len;
+  len = sizeof(struct iwl_cmd_header) + sizeof(struct iwl_tx_cmd) + hdr_len -
+        IWL_FIRST_TB_SIZE;
+  tb1_len = LNX_ALIGN(len, 4);
+  if (WARN_ON(tb1_len > IWL_TX_TB1_SIZE)) return -EINVAL;
+  if (tb1_len != len) tx_cmd->tx_flags |= cpu_to_le32(TX_CMD_FLG_MH_PAD);
+
+  /* the mbuf stays put until reclaimed, its segments can be DMAed from */
+  if (payload_len)
+    nsegs = tx_cursor->getPhysicalSegments(m, segs, IWL_TX_SG_MAX_SEGS);
+  for (i = 0; i < nsegs; i++)
+    if (segs[i].location & ~IWL_TX_DMA_MASK) nsegs = 0;
+  copy = payload_len && !nsegs;
+
+  if (copy) {
+    dma = iwl_pcie_hcmd_pool_get(this, payload_len);
+    if (!dma) return -ENOMEM;
+  }
+
+  IOSimpleLockLock(txq->lock);
+
+  if (iwl_queue_space(txq) < 1) {
+    IOSimpleLockUnlock(txq->lock);
+    if (dma) iwl_pcie_hcmd_buf_put(this, dma);
+    return -ENOSPC;
+  }
+
+  idx = iwl_pcie_get_cmd_index(txq, txq->write_ptr);
+  dev_cmd->hdr.sequence =
+      cpu_to_le16(QUEUE_TO_SEQ(txq_id) | INDEX_TO_SEQ(txq->write_ptr));
+
+  txq->entries[idx].skb = m;
+  out_meta = &txq->entries[idx].meta;
+  memset(out_meta, 0, sizeof(*out_meta));
+  out_meta->dma[0] = dma;
+
+  memcpy(&txq->first_tb_bufs[idx], dev_cmd, IWL_FIRST_TB_SIZE);
+  memcpy(txq->tb1_bufs[idx].buf,
+         reinterpret_cast<u8 *>(dev_cmd) + IWL_FIRST_TB_SIZE, len);
+  if (tb1_len != len) bzero(txq->tb1_bufs[idx].buf + len, tb1_len - len);
+
+  iwl_pcie_txq_build_tfd(this, txq, iwl_pcie_get_first_tb_dma(txq, idx),
+                         IWL_FIRST_TB_SIZE, true);
+  iwl_pcie_txq_build_tfd(this, txq, iwl_pcie_get_tb1_dma(txq, idx), tb1_len,
+                         false);
+  if (copy) {
+    mbuf_copydata(m, 0, payload_len, dma->addr);
+    iwl_pcie_txq_build_tfd(this, txq, dma->dma, payload_len, false);
+    tx_stats.copied++;
+  }
+  for (i = 0; i < nsegs; i++)
+    iwl_pcie_txq_build_tfd(this, txq, segs[i].location, segs[i].length,
+                           false);
+
+  iwl_pcie_txq_update_byte_cnt_tbl(this, txq, byte_cnt, tx_cmd);
+
+  txq->write_ptr = iwl_queue_inc_wrap(txq->write_ptr);
+  txq->db_pending++;
+  tx_stats.frames++;
+
+  /*
+   * At this point the frame is "transmitted" successfully
+   * and we will get a TX status notification eventually.
+   */
+  if (iwl_queue_space(txq) < txq->high_mark) {
+    if (!test_and_set_bit(txq_id, this->queue_stopped)) tx_stats.stopped++;
+    more = false;
+  }
+
+  /* Tell device the write index *just past* this latest filled TFD */
+  if (!more || txq->db_pending >= IWL_TX_DOORBELL_BATCH)
+    iwl_pcie_txq_inc_wr_ptr(this, txq);
+
+  IOSimpleLockUnlock(txq->lock);
+  return 0;
+}
+
+/*
+ * txKick - send the write pointer of a burst cut short
+ */
+void IWLTransport::txKick(int txq_id) {
+  struct iwl_txq *txq = this->txq[txq_id];
+
+  if (WARN_ON(!txq)) return;
+
+  IOSimpleLockLock(txq->lock);
+  if (txq->db_pending) iwl_pcie_txq_inc_wr_ptr(this, txq);
+  IOSimpleLockUnlock(txq->lock);
+}
+
+/*
+ * txReclaim - free the frames of a data queue up to @ssn
+ *
+ * Frees every TFD from the read pointer up to, not including, @ssn along
+ * with its mbuf. A queue stopped at its high mark is restarted once more
+ * than its low mark is free again, tx_wake then tells the upper layer to
+ * resume sending.
+ */
+void IWLTransport::txReclaim(int txq_id, int ssn) {
+  struct iwl_txq *txq = this->txq[txq_id];
+  int tfd_num = ssn & (TFD_QUEUE_SIZE_MAX - 1);
+  mbuf_t done = NULL;
+  int freed = 0;
+
+  if (WARN_ON(txq_id == this->cmd_queue || !txq)) return;
+
+  IOSimpleLockLock(txq->lock);
+
+  if (txq->read_ptr == tfd_num) goto out;
+
+  /* ssn must be within the frames in flight */
+  if (((tfd_num - txq->read_ptr) & (TFD_QUEUE_SIZE_MAX - 1)) >
+      ((txq->write_ptr - txq->read_ptr) & (TFD_QUEUE_SIZE_MAX - 1))) {
+    IWL_ERR(this, "Q %d: ssn %d out of range (rd %d, wr %d)\n", txq_id,
+            tfd_num, txq->read_ptr, txq->write_ptr);
+    goto out;
+  }
+
+  IWL_DEBUG_TX(this, "Q %d: reclaim %d to %d\n", txq_id, txq->read_ptr,
+               tfd_num);
+
+  for (; txq->read_ptr != tfd_num;
+       txq->read_ptr = iwl_queue_inc_wrap(txq->read_ptr)) {
+    int idx = iwl_pcie_get_cmd_index(txq, txq->read_ptr);
+    mbuf_t skb = txq->entries[idx].skb;
+
+    /* the TFD and its buffers go either way */
+    if (!WARN_ON_ONCE(!skb)) {
+      /* freed after the lock is dropped */
+      txq->entries[idx].skb = NULL;
+      mbuf_setnextpkt(skb, done);
+      done = skb;
+      freed++;
+    }
+
+    iwl_pcie_txq_inval_byte_cnt_tbl(this, txq);
+    iwl_pcie_txq_free_tfd(this, txq);
+  }
+
+  if (test_bit(txq_id, this->queue_stopped) &&
+      iwl_queue_space(txq) > txq->low_mark) {
+    clear_bit(txq_id, this->queue_stopped);
+    this->tx_wake = true;
+  }
+
+out:
+  IOSimpleLockUnlock(txq->lock);
+  IWL_EVT(IWL_EVT_TX_RECLAIM, txq_id, ssn, freed, 0);
+  if (done) mbuf_freem_list(done);
+}
 
 bool iwl_trans_txq_enable_cfg(IWLTransport *trans, int queue, u16 ssn,
                               const struct iwl_trans_txq_scd_cfg *cfg,
@@ -1172,15 +1768,11 @@ bool iwl_trans_txq_enable_cfg(IWLTransport *trans, int queue, u16 ssn,
 
     /* Set this queue as a chain-building queue unless it is CMD */
     if (txq_id != trans->cmd_queue) iwl_scd_txq_set_chain(trans, txq_id);
-    if (cfg->aggregate) {
-      u16 ra_tid = BUILD_RAxTID(cfg->sta_id, cfg->tid);
-      IWL_WARN(0, "need to fix aggregate\n");
-      // iwl_pcie_txq_set_ratid_map(ra_tid, txq_id);
-      txq->ampdu = true;
-    } else {
-      iwl_scd_txq_disable_agg(trans, txq_id);
-      ssn = txq->read_ptr;
-    }
+
+    /* the firmware sets up aggregation queues, see iwl_enable_agg_txq() */
+    WARN_ON(cfg->aggregate);
+    iwl_scd_txq_disable_agg(trans, txq_id);
+    ssn = txq->read_ptr;
   } else {
     scd_bug = !trans->m_pDevice->cfg->trans.mq_rx_supported &&
               !((ssn - txq->write_ptr) & 0x3f) && (ssn != txq->write_ptr);
@@ -1232,7 +1824,22 @@ void iwl_trans_ac_txq_enable(IWLTransport *trans, int queue, int fifo,
   iwl_trans_txq_enable_cfg(trans, queue, 0, &cfg, queue_wdg_timeout);
 }
 
-void IWLTransport::txqCheckWrPtrs() {}
+void IWLTransport::txqCheckWrPtrs() {
+  int i;
+
+  for (i = 0; i < m_pDevice->cfg->trans.base_params->num_of_queues; i++) {
+    struct iwl_txq *txq = this->txq[i];
+
+    if (!test_bit(i, this->queue_used)) continue;
+
+    IOSimpleLockLock(txq->lock);
+    if (txq->need_update) {
+      iwl_pcie_txq_inc_wr_ptr(this, txq);
+      txq->need_update = false;
+    }
+    IOSimpleLockUnlock(txq->lock);
+  }
+}
 
 void IWLTransport::txStop() {
   IWL_INFO(0, "Stopping TX DMA channels\n");
@@ -1258,5 +1865,16 @@ void IWLTransport::txStop() {
 
 out:
   IOSimpleLockUnlock(irq_lock);
-  return;
+
+  /* no TX response comes for the data frames still queued, free them */
+  if (txq_memory) {
+    int txq_id;
+
+    for (txq_id = 0; txq_id < m_pDevice->cfg->trans.base_params->num_of_queues;
+         txq_id++) {
+      if (txq_id != cmd_queue) iwl_pcie_txq_unmap(this, txq_id);
+    }
+  }
+  memset(queue_stopped, 0, sizeof(queue_stopped));
+  tx_wake = false;
 }
@@ -11,6 +11,7 @@
 
 // clang-format off
 #include <linux/types.h>
+#include <libkern/OSAtomic.h>
 #include <sys/kernel_types.h>
 #include <sys/queue.h>
 #include <IOKit/network/IOMbufMemoryCursor.h>
@@ -18,6 +19,9 @@
 
 #include "../fw/api/cmdhdr.h"
 #include "IWLFH.h"
+#include "IWLHcmdSlab.h"
+#include "IWLRbdRing.h"
+#include "IWLRxHandlers.h"
 #include "IWLInternal.hpp"
 
 #define FH_RSCSR_FRAME_SIZE_MSK 0x00003FFF /* bits 0-13 */
@@ -42,10 +46,79 @@ struct isr_statistics {
   u32 ctkill;
   u32 wakeup;
   u32 rx;
+  u32 rx_poll;
   u32 tx;
   u32 unhandled;
 };
 
+/**
+ * struct iwl_tx_stats - data path Tx counters
+ * @frames: data frames handed to the Tx queues
+ * @copied: frames whose body needed more TBs than a TFD has and was copied
+ * @doorbells: write pointer updates (HBUS_TARG_WRPTR) of the data queues
+ * @ok: frames the firmware reported as sent
+ * @failed: frames the firmware gave up on
+ * @stopped: times a data queue filled up to its high mark
+ * @ampdus: A-MPDUs the firmware reported, their frames count once the
+ *    Block Ack (BA_NOTIF) came
+ */
+struct iwl_tx_stats {
+  u32 frames;
+  u32 copied;
+  u32 doorbells;
+  u32 ok;
+  u32 failed;
+  u32 stopped;
+  u32 ampdus;
+};
+
+/*
+ * Adaptive interrupt moderation
+ *
+ * Every IWL_INT_MIT_WINDOW_MS the interrupt coalescing timer
+ * (CSR_INT_COALESCING, 32 usec units) is retuned from the RBs handled
+ * in the window: short while the link is quiet so a lone frame is not
+ * held back, the iwlwifi default under bulk Rx so interrupts batch up.
+ * Between the two rates the timer stays where it is. Windows close on
+ * interrupts, so while the timer is up an idle check does it when they
+ * stop coming; otherwise the first frame after a burst would wait for
+ * the long timeout.
+ */
+#define IWL_INT_MIT_WINDOW_MS 100
+#define IWL_INT_MIT_LOW_RATE 500    /* RBs/sec */
+#define IWL_INT_MIT_HIGH_RATE 4000  /* RBs/sec */
+#define IWL_INT_MIT_TIMEOUT_LOW 0x02  /* 64 usec */
+
+/**
+ * struct iwl_int_mit - interrupt moderation state and counters
+ * @adaptive: retune the timer, otherwise it stays at the default
+ * @timeout: value programmed into CSR_INT_COALESCING
+ * @window_start: absolute time the current window started
+ * @window_irqs: interrupts in the current window
+ * @window_rbs: RBs handled in the current window
+ * @irq_rate: interrupts per second in the last window
+ * @rb_rate: RBs per second in the last window
+ * @irq_stamp: absolute time the interrupt filter last ran
+ * @latency_sum: filter to handler, absolute time, summed
+ * @latency_max: longest filter to handler
+ * @latency_count: samples in latency_sum
+ * @idle_armed: the idle check is pending, see IWLTransport::intMitIdle()
+ */
+struct iwl_int_mit {
+  bool adaptive;
+  u8 timeout;
+  u64 window_start;
+  u32 window_irqs;
+  u32 window_rbs;
+  u32 irq_rate;
+  u32 rb_rate;
+  volatile u64 irq_stamp;
+  u64 latency_sum;
+  u64 latency_max;
+  u32 latency_count;
+  bool idle_armed;
+};
+
 /**
  * enum iwl_trans_status: transport status flags
  * @STATUS_SYNC_HCMD_ACTIVE: a SYNC command is being processed
@@ -128,8 +201,8 @@ static inline u32 iwl_rx_packet_payload_len(const struct iwl_rx_packet *pkt) {
  * @CMD_ASYNC: Return right away and don't wait for the response
  * @CMD_WANT_SKB: Not valid with CMD_ASYNC. The caller needs the buffer of
  *    the response. The caller needs to call iwl_free_resp when done.
- * @CMD_WANT_ASYNC_CALLBACK: the op_mode's async callback function must be
- *    called after this command completes. Valid only with CMD_ASYNC.
+ * @CMD_WANT_ASYNC_CALLBACK: the command's callback must be called after
+ *    this command completes. Valid only with CMD_ASYNC.
  */
 enum CMD_MODE {
   CMD_ASYNC = BIT(0),
@@ -213,6 +286,14 @@ enum iwl_error_event_table_status {
   IWL_ERROR_EVENT_TABLE_UMAC = BIT(2),
 };
 
+/*
+ * Completion callback of an asynchronous command, called from the Rx path
+ * with the response, or with a NULL packet if the command was dropped.
+ * The packet is only valid during the call. It must not sleep for long
+ * nor send synchronous commands.
+ */
+typedef void (*iwl_hcmd_callback_t)(void *ctx, struct iwl_rx_packet *pkt);
+
 /**
  * struct iwl_host_cmd - Host command to the uCode
  *
@@ -225,6 +306,8 @@ enum iwl_error_event_table_status {
  * @dataflags: IWL_HCMD_DFL_*
  * @id: command id of the host command, for wide commands encoding the
  *    version and group as well
+ * @callback: called with the response, if %CMD_WANT_ASYNC_CALLBACK was set
+ * @cb_ctx: passed to @callback
  */
 struct iwl_host_cmd {
   const void *data[IWL_MAX_CMD_TBS_PER_TFD];
@@ -237,6 +320,42 @@ struct iwl_host_cmd {
   u32 id;
   u16 len[IWL_MAX_CMD_TBS_PER_TFD];
   u8 dataflags[IWL_MAX_CMD_TBS_PER_TFD];
+  iwl_hcmd_callback_t callback;
+  void *cb_ctx;
+};
+
+/*
+ * Command batches
+ *
+ * A batch sends a sequence of commands asynchronously, so that they are
+ * all in flight on the command queue at once, and then waits a single
+ * time for all the responses. Commands that answer with a
+ * struct iwl_cmd_response can have their status checked on completion,
+ * others can keep their own callback to look at the response.
+ * The batch is refcounted, a command still in flight after the waiter
+ * gave up keeps it alive.
+ */
+#define IWL_HCMD_BATCH_MAX 8
+
+struct iwl_hcmd_batch_slot {
+  struct iwl_hcmd_batch *batch;
+  u32 id;
+  u32 status_mask; /* 0: don't check the status */
+  u32 status_ok;
+  u32 status;
+  bool done;
+  iwl_hcmd_callback_t callback; /* the command's own, if any */
+  void *cb_ctx;
+};
+
+struct iwl_hcmd_batch {
+  class IWLTransport *trans;
+  IOLock *lock;
+  volatile SInt32 refcount;
+  int pending; /* protected by lock */
+  int count;
+  int error;
+  struct iwl_hcmd_batch_slot slot[IWL_HCMD_BATCH_MAX];
 };
 
 struct iwl_rx_cmd_buffer {
@@ -245,6 +364,7 @@ struct iwl_rx_cmd_buffer {
   bool _page_stolen;
   u32 _rx_page_order;
   unsigned int truesize;
+  struct iwl_rx_page *_rx_page;
 };
 
 /**
@@ -312,10 +432,68 @@ struct iwl_rx_completion_desc {
   u8 reserved2[25];
 } __packed;
 
+/**
+ * struct iwl_rx_page - DMA-mapped Rx page
+ * @page: the mbuf backing the page
+ * @page_dma: bus address of the page, resolved once when it is allocated
+ * @refcount: references on the page. The RBD it is attached to holds one,
+ *    every slice of it handed out and every handler that steals it holds
+ *    another one.
+ * @pooled: page belongs to the page pool, otherwise it was allocated on a
+ *    pool miss and is freed together with its last reference
+ * @pool: the pool the page is returned to, it outlives the page
+ * @list: entry in &iwl_rx_page_pool.free
+ */
+struct iwl_rx_page {
+  mbuf_t page;
+  dma_addr_t page_dma;
+  volatile SInt32 refcount;
+  bool pooled;
+  struct iwl_rx_page_pool *pool;
+  TAILQ_ENTRY(iwl_rx_page) list;
+};
+
+/**
+ * struct iwl_rx_page_pool - pre-mapped Rx pages
+ * @pages: the pool's pages
+ * @size: number of entries in @pages
+ * @page_bytes: size of every page, follows the Rx buffer size
+ * @free: unreferenced pages ready to be attached to an RBD
+ * @free_count: number of pages on @free
+ * @cursor: resolves the bus address of a newly allocated page
+ * @lock: protects @free and the counters, pages are released from the Rx
+ *    path, the Rx allocator and whoever held on to a response
+ * @hits: page requests served from @free
+ * @misses: page requests that found @free empty and had to allocate
+ * @refcount: the transport holds one reference, every page off @free
+ *    another one. The last one frees the pool.
+ * @detached: the transport let go of the pool, pages put back are freed
+ *    instead of recycled
+ *
+ * Pages are mapped once when the pool is filled and keep their bus address
+ * for as long as the pool exists, so recycling a page is a list operation.
+ * Slices of a page can be held by the stack past the transport's lifetime,
+ * hence the pool is allocated on its own.
+ */
+struct iwl_rx_page_pool {
+  struct iwl_rx_page *pages;
+  u32 size;
+  u32 page_bytes;
+  TAILQ_HEAD(, iwl_rx_page) free;
+  u32 free_count;
+  IOMbufNaturalMemoryCursor *cursor;
+  IOSimpleLock *lock;
+  u32 hits;
+  u32 misses;
+  volatile SInt32 refcount;
+  bool detached;
+};
+
 /**
  * struct iwl_rx_mem_buffer
  * @page_dma: bus address of rxb page
  * @page: driver's pointer to the rxb page
+ * @rx_page: page pool entry backing @page, the RBD holds a reference on it
  * @invalid: rxb is in driver ownership - not owned by HW
  * @vid: index of this rxb in the global table
  * @offset: indicates which offset of the page (in bytes)
@@ -324,12 +502,11 @@ struct iwl_rx_completion_desc {
 struct iwl_rx_mem_buffer {
   dma_addr_t page_dma;
   mbuf_t page;
+  struct iwl_rx_page *rx_page;
   u16 vid;
   bool invalid;
   TAILQ_ENTRY(iwl_rx_mem_buffer) list;
   u32 offset;
-  IOMbufNaturalMemoryCursor *cursor;
-  IOMemoryCursor::PhysicalSegment vec;
 };
 
 /**
@@ -352,6 +529,10 @@ struct iwl_rx_mem_buffer {
  * @write_actual:
  * @rx_free: list of RBDs with allocated RB ready for use
  * @rx_used: list of RBDs with no RB attached
+ * @rbd_empty: RBDs with no RB attached, handed to the allocator
+ * @rbd_allocated: RBDs the allocator attached a page to, to be claimed
+ * @req_pending: number of requests the allocator had not processed yet
+ * @req_ready: number of requests honored and ready for claiming
  * @need_update: flag to indicate we need to update read/write index
  * @rb_stts: driver's pointer to receive buffer status
  * @rb_stts_dma: bus address of receive buffer status
@@ -386,6 +567,10 @@ struct iwl_rxq {
   u32 queue_size;
   TAILQ_HEAD(, iwl_rx_mem_buffer) rx_free;
   TAILQ_HEAD(, iwl_rx_mem_buffer) rx_used;
+  struct iwl_rbd_ring rbd_empty;
+  struct iwl_rbd_ring rbd_allocated;
+  int req_pending;
+  int req_ready;
   bool need_update;
   iwl_rb_status *rb_stts;
   dma_addr_t rb_stts_dma;
@@ -399,10 +584,44 @@ struct iwl_cmd_meta {
   struct iwl_host_cmd *source;
   u32 flags;
   u32 tbs;
+  iwl_hcmd_callback_t callback; /* iff CMD_WANT_ASYNC_CALLBACK */
+  void *cb_ctx;
 
   struct iwl_dma_ptr *dma[IWL_MAX_CMD_TBS_PER_TFD + 1];
 };
 
+/* every buffer of every command queue entry, see iwl_hcmd_pool.deferred */
+#define IWL_HCMD_POOL_DEFERRED (32 * (IWL_MAX_CMD_TBS_PER_TFD + 1))
+
+#define IWL_FW_LOAD_BUFS 2
+
+/**
+ * struct iwl_hcmd_pool - DMA buffers for the host command fragments
+ * @slab: the size classes, smallest first
+ * @lock: protects the free stacks, @deferred and the counters
+ * @misses: requests too large for, or not served by, any class; those go
+ *    to allocate_dma_buf()
+ * @deferred: buffers of the misses that were put back. Commands are
+ *    unmapped with the queue lock held, where freeing DMA memory is not
+ *    allowed, so they wait here for iwl_pcie_hcmd_pool_reap(). The command
+ *    queue holds no more buffers than this at any time.
+ * @deferred_count: number of entries on @deferred
+ *
+ * Command fragments that are not copied into the command queue entry
+ * (the first one past IWL_FIRST_TB_SIZE and the NOCOPY/DUP ones) need DMA
+ * memory of their own. The pool keeps it mapped for the life of the
+ * command queue so sending and completing a command is two stack
+ * operations. Data frames copy their payload here when the mbuf chain is
+ * too fragmented to be mapped; the 2KB class is sized for that.
+ */
+struct iwl_hcmd_pool {
+  struct iwl_hcmd_slab slab[IWL_HCMD_POOL_CLASSES];
+  IOSimpleLock *lock;
+  u32 misses;
+  struct iwl_dma_ptr *deferred[IWL_HCMD_POOL_DEFERRED];
+  u32 deferred_count;
+};
+
 /*
  * The FH will write back to the first TB only, so we need to copy some data
  * into the buffer regardless of whether it should be mapped or not.
@@ -415,11 +634,28 @@ struct iwl_cmd_meta {
 #define IWL_FIRST_TB_SIZE 20
 #define IWL_FIRST_TB_SIZE_ALIGN LNX_ALIGN(IWL_FIRST_TB_SIZE, 64)
 
+/*
+ * TB1 of a data frame: the TX command past the first TB and the 802.11
+ * header, padded to a dword. A 4-address QoS header with HT control and a
+ * security header fits with room to spare.
+ */
+#define IWL_TX_TB1_SIZE 128
+
+/*
+ * A data frame queued with more to follow only bumps the write pointer in
+ * memory, the device is told once the burst ends. A burst longer than
+ * this rings the doorbell anyway so the device never idles behind it.
+ */
+#define IWL_TX_DOORBELL_BATCH 16
+
+/* TBs left for the body of a data frame, past TB0 and the TX command's */
+#define IWL_TX_SG_MAX_SEGS (IWL_NUM_OF_TBS - 2)
+/* the length field of a gen1 TB is 12 bits */
+#define IWL_TX_TB_MAX_LEN 0xfff
+
 struct iwl_pcie_txq_entry {
   void *cmd;
   mbuf_t skb;
-  /* buffer to free after command completes */
-  const void *free_buf;
   struct iwl_cmd_meta meta;
 };
 
@@ -427,6 +663,10 @@ struct iwl_pcie_first_tb_buf {
   u8 buf[IWL_FIRST_TB_SIZE_ALIGN];
 };
 
+struct iwl_pcie_tx_tb1_buf {
+  u8 buf[IWL_TX_TB1_SIZE];
+};
+
 /**
  * struct iwl_txq - Tx Queue for DMA
  * @q: generic Rx/Tx queue descriptor
@@ -435,11 +675,15 @@ struct iwl_pcie_first_tb_buf {
  *    the writeback -- this is DMA memory and an array holding one buffer
  *    for each command on the queue
  * @first_tb_dma: DMA address for the first_tb_bufs start
+ * @tb1_bufs: TB1 of each entry of a data queue, DMA memory like
+ *    first_tb_bufs; NULL on the command queue
+ * @tb1_dma: DMA address for the tb1_bufs start
  * @entries: transmit entries (driver state)
  * @lock: queue lock
  * @stuck_timer: timer that fires if queue gets stuck
  * @trans_pcie: pointer back to transport (for timer)
  * @need_update: indicates need to update read/write index
+ * @db_pending: TFDs written since the write pointer was last sent
  * @ampdu: true if this queue is an ampdu queue for an specific RA/TID
  * @wd_timeout: queue watchdog timeout (jiffies) - per queue
  * @frozen: tx stuck queue timer is frozen
@@ -476,12 +720,16 @@ struct iwl_txq {
   struct iwl_pcie_first_tb_buf *first_tb_bufs;
   dma_addr_t first_tb_dma;
   struct iwl_dma_ptr *first_tb_dma_ptr;
+  struct iwl_pcie_tx_tb1_buf *tb1_bufs;
+  dma_addr_t tb1_dma;
+  struct iwl_dma_ptr *tb1_dma_ptr;
   struct iwl_pcie_txq_entry *entries;
   IOSimpleLock *lock;
   unsigned long frozen_expiry_remainder;  // NOLINT(runtime/int)
   //    struct timer_list stuck_timer;
   struct iwl_trans_pcie *trans_pcie;
   bool need_update;
+  int db_pending;
   bool frozen;
   bool ampdu;
   int block;
@@ -542,23 +790,17 @@ struct iwl_self_init_dram {
 
 /**
  * struct iwl_rb_allocator - Rx allocator
- * @req_pending: number of requests the allcator had not processed yet
- * @req_ready: number of requests honored and ready for claiming
- * @rbd_allocated: RBDs with pages allocated and ready to be handled to
- *    the queue. This is a list of &struct iwl_rx_mem_buffer
- * @rbd_empty: RBDs with no page attached for allocator use. This is a list
- *    of &struct iwl_rx_mem_buffer
- * @lock: protects the rbd_allocated and rbd_empty lists
  * @alloc_wq: work queue for background calls
- * @rx_alloc: work struct for background calls
+ * @alloc_work: runs the allocator on @alloc_wq, armed by the Rx path
+ * @rbd_empty: RBDs with no page attached for allocator use. This is a list
+ *    of &struct iwl_rx_mem_buffer, only touched from the allocator work.
+ *    Queues hand RBDs over through their &iwl_rxq.rbd_empty ring and get
+ *    them back through &iwl_rxq.rbd_allocated.
  */
 struct iwl_rb_allocator {
   class IOWorkLoop *alloc_wq;
-  int req_pending;
-  int req_ready;
-  TAILQ_HEAD(, iwl_rx_mem_buffer) rbd_allocated;
+  class IOTimerEventSource *alloc_work;
   TAILQ_HEAD(, iwl_rx_mem_buffer) rbd_empty;
-  IOSimpleLock *lock;
 };
 
 /*
@@ -568,6 +810,17 @@ struct iwl_rb_allocator {
 #define RX_POST_REQ_ALLOC 2
 #define RX_CLAIM_REQ_ALLOC 8
 #define RX_PENDING_WATERMARK 16
+/*
+ * Pages the Rx page pool keeps on top of one per RBD, for pages that are
+ * still referenced by slices or responses while their RBD is already back
+ * in the ring.
+ */
+#define IWL_RX_PAGE_POOL_SPARE 64
+/*
+ * Maximum number of RBs handled in one pass of iwl_pcie_rx_handle before the
+ * rest of the ring is deferred to a poll pass on the workloop.
+ */
+#define IWL_RX_POLL_BUDGET 64
 #define FIRST_RX_QUEUE 512
 
 static inline dma_addr_t iwl_pcie_get_first_tb_dma(struct iwl_txq *txq,
@@ -575,6 +828,10 @@ static inline dma_addr_t iwl_pcie_get_first_tb_dma(struct iwl_txq *txq,
   return txq->first_tb_dma + sizeof(struct iwl_pcie_first_tb_buf) * idx;
 }
 
+static inline dma_addr_t iwl_pcie_get_tb1_dma(struct iwl_txq *txq, int idx) {
+  return txq->tb1_dma + sizeof(struct iwl_pcie_tx_tb1_buf) * idx;
+}
+
 struct iwl_trans_txq_scd_cfg {
   u8 fifo;
   u8 sta_id;
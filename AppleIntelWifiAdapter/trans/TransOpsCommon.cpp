@@ -247,9 +247,9 @@ void IWLTransOps::restartNIC(bool fw_error) {
 
 void IWLTransOps::rxPhy(iwl_rx_packet* packet) {
   iwl_rx_phy_info* info = reinterpret_cast<iwl_rx_phy_info*>(packet->data);
-  IWL_INFO(0, "received new phy info (timestamp: %lld, system: %ld)\n",
-           info->timestamp, info->system_timestamp);
-  IWL_INFO(0, "channel: %d\n", info->channel);
+  IWL_DEBUG_RX(0, "received new phy info (timestamp: %lld, system: %ld)\n",
+               info->timestamp, info->system_timestamp);
+  IWL_DEBUG_RX(0, "channel: %d\n", info->channel);
 
   memcpy(&trans->last_phy_info, info, sizeof(*info));
 }
@@ -272,8 +272,8 @@ int get_signal_strength(IWLTransport* trans) {
   max_energy = MAX(energy_a, energy_b);
   max_energy = MAX(max_energy, energy_c);
 
-  IWL_INFO(0, "energy In A %d B %d C %d, and max %d\n", energy_a, energy_b,
-           energy_c, max_energy);
+  IWL_DEBUG_RX(0, "energy In A %d B %d C %d, and max %d\n", energy_a,
+               energy_b, energy_c, max_energy);
 
   return max_energy;
 }
@@ -318,8 +318,8 @@ int calc_rssi(IWLTransport* trans) {
   rssi_b_dbm = rssi_b - IWL_RSSI_OFFSET - agc_b;
   max_rssi_dbm = MAX(rssi_a_dbm, rssi_b_dbm);
 
-  IWL_INFO(0, "Rssi In A %d B %d Max %d AGCA %d AGCB %d\n", rssi_a_dbm,
-           rssi_b_dbm, max_rssi_dbm, agc_a, agc_b);
+  IWL_DEBUG_RX(0, "Rssi In A %d B %d Max %d AGCA %d AGCB %d\n", rssi_a_dbm,
+               rssi_b_dbm, max_rssi_dbm, agc_a, agc_b);
 
   return max_rssi_dbm;
 }
@@ -328,7 +328,6 @@ int calc_rssi(IWLTransport* trans) {
 
 void IWLTransOps::rxMpdu(iwl_rx_cmd_buffer* rxcb) {
   iwl_rx_packet* packet = reinterpret_cast<iwl_rx_packet*>(rxb_addr(rxcb));
-  mbuf_t page = (mbuf_t)rxcb->_page;
 
   iwl_rx_phy_info* last_phy_info;
 
@@ -404,14 +403,12 @@ void IWLTransOps::rxMpdu(iwl_rx_cmd_buffer* rxcb) {
 
   if (!(packetStatus & RX_MPDU_RES_STATUS_CRC_OK) ||
       !(packetStatus & RX_MPDU_RES_STATUS_OVERRUN_OK)) {
-    IWL_ERR(0, "Bad CRC or FIFO: 0x%08X.\n", packetStatus);
+    IWL_DEBUG_RX(0, "Bad CRC or FIFO: 0x%08X.\n", packetStatus);
     return; /* drop */
   }
 
-  rxcb->_page_stolen = true;
-
   if (len <= sizeof(*wh)) {
-    IWL_INFO(0, "SKIPPING BEACON PACKET BECAUSE TOO SHORT\n");
+    IWL_DEBUG_RX(0, "SKIPPING BEACON PACKET BECAUSE TOO SHORT\n");
     return;
   }
 
@@ -427,89 +424,40 @@ void IWLTransOps::rxMpdu(iwl_rx_cmd_buffer* rxcb) {
         }
 
         if (!trans->m_pDevice->ie_dev->lockScanCache()) {
-          IWL_INFO(
-              0,
-              "Skipped beacon packet because scan cache is already locked\n");
-          // we CANNOT block.
-          return;
-        }
-
-        int indx = scanCache->getCount();
-
-        uint64_t oldest = UINT64_MAX;
-        OSObject* oldest_obj = NULL;
-        bool update_old_scan = false;
-
-        OSCollectionIterator* it =
-            OSCollectionIterator::withCollection(scanCache);
-
-        if (!it->isValid()) {
-          IWL_ERR(0, "Iterator not valid, not recreating\n");
+          // we CANNOT block, whoever holds the cache picks it up
+          trans->m_pDevice->ie_dev->deferBeacon(iwl_pcie_rx_slice(rxcb),
+                                                whOffset, len, last_phy_info,
+                                                rssi, -101);
           return;
         }
 
-        OSObject* obj = NULL;
-        while ((obj = it->getNextObject()) != NULL) {
-          if (obj == NULL) break;
-
-          IWLCachedScan* cachedScan = OSDynamicCast(IWLCachedScan, obj);
-
-          if (!cachedScan) continue;
-
-          if (cachedScan->getTimestamp() <=
-              oldest) {  // the smaller the timestamp, the older
-                         // absolute time only increments
-            oldest = cachedScan->getTimestamp();
-            oldest_obj = obj;
-          }
-
-          if (memcmp(cachedScan->getBSSID(), &wh->i_addr3[0], 6) == 0) {
-            if (cachedScan->getChannel().channel ==
-                last_phy_info->channel) {  // TODO: how do we identify same BSS
-                                           // but diff channel?
-              // existing entry, remove the old one and add in the new one
-              update_old_scan = true;
-              IWL_INFO(0, "Updating old entry\n");
-
-              cachedScan->update(last_phy_info, rssi, -101);
-              break;
-            }
-          }
-        }
-
-        if (scanCache->getCapacity() == indx && !update_old_scan) {
-          // purge the scan cache of the oldest object
-          IWL_INFO(0, "Purging oldest object because we are at capacity\n");
-
-          if (oldest_obj != NULL) scanCache->removeObject(oldest_obj);
-        }
-
-        if (!update_old_scan) {
-          IWL_INFO(0, "Adding new object to scan cache\n");
-
-          IWLCachedScan* scan = new IWLCachedScan();
-          if (!scan->init(page, rxcb->_offset, whOffset, last_phy_info, rssi,
-                          -101)) {
-            scan->free();
-            IWL_ERR(0, "failed to init new cached scan object\n");
-            trans->m_pDevice->ie_dev->unlockScanCache();
-            return;
-          }
-
-          scanCache->setObject(scan);  // new scanned object, add it to the list
-        }
-        it->release();
+        trans->m_pDevice->ie_dev->ingestBeacon(wh, len, last_phy_info, rssi,
+                                               -101);
+        bool post = trans->m_pDevice->ie_dev->getScanning() &&
+                    trans->m_pDevice->ie_dev->streamScan();
         trans->m_pDevice->ie_dev->unlockScanCache();
+        if (post) trans->m_pDevice->ie_dev->scanDone();
       }
     } else {
-      IWL_ERR(0, "ignoring packet since it's not a beacon frame\n");
+      IWL_DEBUG_RX(0, "ignoring packet since it's not a beacon frame\n");
     }
   } else {
-    IWL_ERR(0, "ignoring packet since we're not in scan\n");
+    IWL_DEBUG_RX(0, "ignoring packet since we're not in scan\n");
   }
 
-  mbuf_t inputToMac;
-  mbuf_dup(page, MBUF_WAITOK, &inputToMac);
+  /* ADDBA responses and DELBAs drive the Tx Block Ack agreements */
+  if (trans->m_pDevice->ie_dev->getState() == APPLE80211_S_RUN &&
+      ieee80211_is_action(wh->i_fc[0])) {
+    trans->m_pDevice->ie_dev->getDriver()->rxBaAction(
+        reinterpret_cast<ieee80211_mgmt*>(wh), len);
+  }
+
+  /* the stack gets a slice of the Rx page, no copy */
+  mbuf_t inputToMac = iwl_pcie_rx_slice(rxcb);
+  if (!inputToMac) {
+    IWL_ERR(0, "no mbuf for the rx slice, dropping\n");
+    return;
+  }
 
   trans->m_pDevice->controller->inputPacket(inputToMac);
 }
@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+"""Decode the binary event tracer rings of the driver.
+
+Turn recording on, run the workload, take a snapshot and read it out:
+
+    sudo ioio -s AppleIntelWifiAdapterV2 IWLEventTrace 1
+    sudo ioio -s AppleIntelWifiAdapterV2 IWLEventDump 1
+    ioreg -a -r -c AppleIntelWifiAdapterV2 -k IWLEventRecords > evt.plist
+    scripts/iwl_evt_decode.py evt.plist
+
+The records of all rings are merged on the TSC. The output is a
+histogram for each latency the events can pair up:
+
+  hcmd     HCMD_SEND to the HCMD_DONE with the same sequence number
+  irq-rx   IRQ to the first RX handled after it
+  irq-gap  from one IRQ to the next
+
+Times are in TSC cycles unless the TSC rate is known: pass --tsc-hz, or
+pass two snapshots taken some time apart and the rate is worked out from
+their TSC and mach_absolute_time() pairs. The layout is the one of
+struct iwl_evt_snap_hdr in AppleIntelWifiAdapter/IWLTrace.h.
+"""
+
+import argparse
+import plistlib
+import struct
+import sys
+
+SNAP_MAGIC = 0x454C5749  # "IWLE"
+SNAP_VERSION = 1
+HDR = struct.Struct("<IHHHHIQQ")
+RING = struct.Struct("<II")
+EVT = struct.Struct("<QIHHIIII")
+
+EVT_NAMES = {
+    1: "HCMD_SEND",
+    2: "HCMD_DONE",
+    3: "RX",
+    4: "IRQ",
+    5: "RX_WRPTR",
+    6: "TX_WRPTR",
+    7: "TX_RECLAIM",
+}
+HCMD_SEND, HCMD_DONE, RX, IRQ = 1, 2, 3, 4
+
+
+class Snapshot(object):
+    def __init__(self, blob):
+        if len(blob) < HDR.size:
+            raise ValueError("snapshot too short")
+        (magic, version, hdr_size, evt_size, rings, self.entries, self.tsc,
+         self.abs) = HDR.unpack_from(blob)
+        if magic != SNAP_MAGIC:
+            raise ValueError("not an event snapshot (magic %#x)" % magic)
+        if version != SNAP_VERSION or evt_size != EVT.size:
+            raise ValueError("snapshot version %d, record size %d unknown" %
+                             (version, evt_size))
+        pos = hdr_size
+        self.rings = []
+        for _ in range(rings):
+            self.rings.append(RING.unpack_from(blob, pos))
+            pos += RING.size
+        self.events = []
+        for head, count in self.rings:
+            for _ in range(count):
+                self.events.append(EVT.unpack_from(blob, pos))
+                pos += EVT.size
+        if pos != len(blob):
+            raise ValueError("%d bytes left over" % (len(blob) - pos))
+        # tsc, seq, type, cpu, a, b, c, d; one global order
+        self.events.sort(key=lambda e: e[0])
+
+    def lost(self):
+        return sum(head - count for head, count in self.rings)
+
+
+def find_records(obj):
+    """The IWLEventRecords data anywhere in an ioreg -a plist."""
+    if isinstance(obj, dict):
+        if isinstance(obj.get("IWLEventRecords"), bytes):
+            return obj["IWLEventRecords"]
+        children = obj.values()
+    elif isinstance(obj, list):
+        children = obj
+    else:
+        return None
+    for child in children:
+        found = find_records(child)
+        if found is not None:
+            return found
+    return None
+
+
+def load(path):
+    with (sys.stdin.buffer if path == "-" else open(path, "rb")) as f:
+        raw = f.read()
+    if raw.startswith(b"bplist") or raw.lstrip().startswith(b"<?xml"):
+        blob = find_records(plistlib.loads(raw))
+        if blob is None:
+            raise ValueError("%s: no IWLEventRecords property" % path)
+        return Snapshot(blob)
+    return Snapshot(raw)
+
+
+def latencies(events):
+    out = {"hcmd": [], "irq-rx": [], "irq-gap": []}
+    sent = {}
+    last_irq = None
+    pending_irq = None
+
+    for tsc, _, etype, _, _, _, c, _ in events:
+        if etype == HCMD_SEND:
+            sent[c] = tsc
+        elif etype == HCMD_DONE and c in sent:
+            out["hcmd"].append(tsc - sent.pop(c))
+        elif etype == IRQ:
+            if last_irq is not None:
+                out["irq-gap"].append(tsc - last_irq)
+            last_irq = pending_irq = tsc
+        elif etype == RX and pending_irq is not None:
+            out["irq-rx"].append(tsc - pending_irq)
+            pending_irq = None
+    return out
+
+
+def histogram(name, samples, scale, unit, out):
+    out.write("%s: %d samples\n" % (name, len(samples)))
+    if not samples:
+        return
+    values = sorted(s * scale for s in samples)
+    buckets = {}
+    for v in values:
+        b = 0
+        while (1 << (b + 1)) <= v:
+            b += 1
+        buckets[b] = buckets.get(b, 0) + 1
+    top = max(buckets.values())
+    for b in range(min(buckets), max(buckets) + 1):
+        n = buckets.get(b, 0)
+        out.write("  %10d .. %-10d %-3s %7d %s\n" %
+                  (1 << b if b else 0, (1 << (b + 1)) - 1, unit, n,
+                   "#" * ((n * 50 + top - 1) // top)))
+    pct = lambda p: values[min(len(values) - 1, int(len(values) * p))]
+    out.write("  min %d, p50 %d, p99 %d, max %d %s\n" %
+              (values[0], pct(0.50), pct(0.99), values[-1], unit))
+
+
+def main(argv):
+    ap = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    ap.add_argument("snapshot", nargs="+",
+                    help="ioreg -a output or a raw snapshot, - for stdin; "
+                    "the last one is decoded")
+    ap.add_argument("--tsc-hz", type=float, help="TSC rate")
+    ap.add_argument("--events", action="store_true",
+                    help="print the merged records as well")
+    args = ap.parse_args(argv)
+
+    snaps = [load(p) for p in args.snapshot]
+    snap = snaps[-1]
+    tsc_hz = args.tsc_hz
+    if tsc_hz is None and len(snaps) > 1 and snap.abs != snaps[0].abs:
+        tsc_hz = (snap.tsc - snaps[0].tsc) * 1e9 / (snap.abs - snaps[0].abs)
+    scale, unit = (1e6 / tsc_hz, "us") if tsc_hz else (1, "cyc")
+
+    out = sys.stdout
+    out.write("%d records, %d overwritten, TSC %s\n" %
+              (len(snap.events), snap.lost(),
+               "%.0f Hz" % tsc_hz if tsc_hz else "rate unknown"))
+    if args.events:
+        base = snap.events[0][0] if snap.events else 0
+        for tsc, seq, etype, cpu, a, b, c, d in snap.events:
+            out.write("%12.1f %2d %-10s %08x %08x %08x %08x\n" %
+                      ((tsc - base) * scale, cpu,
+                       EVT_NAMES.get(etype, str(etype)), a, b, c, d))
+    for name, samples in latencies(snap.events).items():
+        histogram(name, samples, scale, unit, out)
+    return 0
+
+
+if __name__ == "__main__":
+    try:
+        sys.exit(main(sys.argv[1:]))
+    except (OSError, ValueError) as e:
+        sys.stderr.write("iwl_evt_decode: %s\n" % e)
+        sys.exit(1)
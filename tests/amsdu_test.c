@@ -0,0 +1,170 @@
+//
+//  amsdu_test.c
+//  AppleIntelWifiAdapter host tests
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+/*
+ * mvm/IWLAmsdu.h: backlogs of random Ethernet frames, a few destinations
+ * and sizes around IWL_MVM_TX_AMSDU_MSDU_MAX, are cut into A-MSDUs the
+ * way txPoll() does it. The number of frames taken is checked against
+ * the decision iwl_mvm_tx_amsdu_count() had inline before. Each A-MSDU
+ * is then laid out as iwl_mvm_tx_amsdu() chains it and parsed back the
+ * way a receiver splits one (802.11-2016 9.3.2.2): the frames must come
+ * out as they went in, only the last subframe unpadded, and the whole
+ * no longer than the peer takes.
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "IWLAmsdu.h"
+#include "host_util.h"
+
+#define FRAME_MAX (IWL_MVM_TX_AMSDU_MSDU_MAX + 64)
+#define BACKLOG 32
+
+struct frame {
+  uint8_t data[FRAME_MAX];
+  uint32_t len;
+};
+
+/* iwl_mvm_tx_amsdu_count() before the helpers, @open left out */
+static int ref_count(const struct frame *f, int nf, uint32_t max) {
+  uint32_t len = 0, sub_len;
+  int n;
+
+  for (n = 0; n < nf; n++) {
+    if (n == IWL_MVM_TX_AMSDU_MAX_SUBFRAMES ||
+        f[n].len > IWL_MVM_TX_AMSDU_MSDU_MAX || f[n].len < 14)
+      return n;
+    if (n && memcmp(f[n].data, f[0].data, 6)) return n;
+    sub_len = f[n].len + 6 + 2;
+    if (len + sub_len > max) return n;
+    len += (sub_len + 3) & ~3U;
+  }
+  return n;
+}
+
+static int count(const struct frame *f, int nf, uint32_t max) {
+  uint32_t len = 0;
+  int n;
+
+  for (n = 0; n < nf; n++) {
+    if (!iwl_amsdu_add(&len, n, f[n].len, max)) return n;
+    if (n && memcmp(f[n].data, f[0].data, 6)) return n;
+  }
+  return n;
+}
+
+/* iwl_mvm_tx_amsdu_subframe() and the chaining, on a flat buffer */
+static uint32_t build(uint8_t *out, const struct frame *f, int n) {
+  uint32_t off = 0;
+
+  for (int i = 0; i < n; i++) {
+    uint32_t len = iwl_amsdu_subframe_len(f[i].len);
+
+    iwl_amsdu_subframe_hdr(out + off, f[i].data, len);
+    memcpy(out + off + IWL_AMSDU_SUBFRAME_HLEN, f[i].data + 14,
+           f[i].len - 14);
+    off += len;
+    if (i != n - 1) {
+      memset(out + off, 0, iwl_amsdu_pad(len));
+      off += iwl_amsdu_pad(len);
+    }
+  }
+  return off;
+}
+
+/* split @buf into its subframes and check them against @f */
+static void parse(const uint8_t *buf, uint32_t len, const struct frame *f,
+                  int n) {
+  uint32_t off = 0;
+  int i = 0;
+
+  while (off < len) {
+    uint32_t body;
+
+    CHECK(len - off >= 14);
+    if (i >= n || len - off < 14) return;
+    body = (uint32_t)buf[off + 12] << 8 | buf[off + 13];
+    CHECK(off + 14 + body <= len);
+    if (off + 14 + body > len) return;
+
+    /* DA and SA, then LLC/SNAP, the EtherType and the payload */
+    CHECK(body == f[i].len - 14 + 8);
+    CHECK(memcmp(buf + off, f[i].data, 12) == 0);
+    CHECK(memcmp(buf + off + 14, iwl_mvm_tx_llc_snap, 6) == 0);
+    CHECK(memcmp(buf + off + 20, f[i].data + 12, 2) == 0);
+    CHECK(memcmp(buf + off + 22, f[i].data + 14, f[i].len - 14) == 0);
+
+    off += 14 + body;
+    i++;
+    if (off < len) {
+      /* a subframe follows, this one is padded */
+      while (off % 4) CHECK(buf[off++] == 0);
+    }
+  }
+  CHECK(i == n);
+  /* the last subframe carries no padding */
+  CHECK(off == len);
+}
+
+static void fill(struct frame *f) {
+  static const uint8_t da[3][6] = {
+      {0x00, 0x1b, 0x2f, 0x00, 0x00, 0x01},
+      {0x00, 0x1b, 0x2f, 0x00, 0x00, 0x02},
+      {0x01, 0x00, 0x5e, 0x00, 0x00, 0xfb},
+  };
+
+  switch (rand() % 8) {
+    case 0:
+      f->len = rand() % FRAME_MAX;
+      break;
+    case 1:
+      f->len = IWL_MVM_TX_AMSDU_MSDU_MAX - 2 + rand() % 5;
+      break;
+    default:
+      f->len = 14 + rand() % (IWL_MVM_TX_AMSDU_MSDU_MAX - 13);
+      break;
+  }
+  for (uint32_t i = 0; i < f->len; i++) f->data[i] = (uint8_t)rand();
+  if (f->len >= 6) memcpy(f->data, da[rand() % 8 ? 0 : rand() % 3], 6);
+}
+
+static void test_random(int rounds) {
+  static struct frame f[BACKLOG];
+  static uint8_t buf[8192];
+  int amsdus = 0, full = 0;
+
+  for (int r = 0; r < rounds; r++) {
+    uint32_t max = rand() % 4 ? (rand() % 2 ? 7935 : 3839) : rand() % 2000;
+    int nf = 1 + rand() % BACKLOG, pos = 0;
+
+    for (int i = 0; i < nf; i++) fill(&f[i]);
+    while (pos < nf) {
+      int n = count(f + pos, nf - pos, max);
+      uint32_t len;
+
+      CHECK(n == ref_count(f + pos, nf - pos, max));
+      if (n < 2) {
+        /* goes out on its own, as txPoll() sends it */
+        pos++;
+        continue;
+      }
+      len = build(buf, f + pos, n);
+      CHECK(len <= max);
+      parse(buf, len, f + pos, n);
+      amsdus++;
+      full += n == IWL_MVM_TX_AMSDU_MAX_SUBFRAMES;
+      pos += n;
+    }
+  }
+  CHECK(amsdus > 0 && full > 0);
+}
+
+int main(void) {
+  srand(1);
+  test_random(20000);
+  return HOST_TEST_RESULT();
+}
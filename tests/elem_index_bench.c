@@ -0,0 +1,127 @@
+//
+//  elem_index_bench.c
+//  AppleIntelWifiAdapter host tests
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+/*
+ * Micro-benchmark of ieee80211_elem_index() on beacon shaped frames:
+ *
+ *   elem_index_bench [-n rounds]
+ *
+ * For each frame it prints the time to index the elements and look up
+ * the ones ieee80211_recv_probe_resp() wants. It also prints the time of
+ * the per-ID loop the index replaced: a walk for every element
+ * looked up.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <net80211/ieee80211_elem.h>
+
+static const uint8_t wanted[] = {0, 1, 3, 5, 42, 45, 48, 50, 61, 127};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static size_t put_elem(uint8_t *p, uint8_t id, uint8_t len) {
+  p[0] = id;
+  p[1] = len;
+  memset(p + 2, 0x5a, len);
+  if (id == IEEE80211_ELEMID_VENDOR && len >= 4) {
+    p[2] = 0x00;
+    p[3] = 0x50;
+    p[4] = 0xf2;
+  }
+  return 2 + (size_t)len;
+}
+
+/*
+ * A beacon body as APs send it: the elements listed, then @vendors
+ * vendor elements (WPA, WMM, WPS, P2P and friends).
+ */
+static size_t build_beacon(uint8_t *buf, int vendors) {
+  static const uint8_t body[][2] = {
+      {0, 10}, {1, 8},    {3, 1},  {5, 4},   {7, 6},   {42, 1},
+      {48, 20}, {50, 4},  {45, 26}, {61, 22}, {127, 8}, {191, 12},
+      {192, 5}, {70, 5},
+  };
+  size_t len = 0, i;
+  int v;
+
+  for (i = 0; i < sizeof(body) / sizeof(body[0]); i++)
+    len += put_elem(buf + len, body[i][0], body[i][1]);
+  for (v = 0; v < vendors; v++)
+    len += put_elem(buf + len, IEEE80211_ELEMID_VENDOR, 7 + v % 20);
+  return len;
+}
+
+static struct ieee80211_elem_index idx;
+
+static uintptr_t run_index(const uint8_t *frm, const uint8_t *efrm) {
+  uintptr_t sum = 0;
+  const uint8_t *v;
+  size_t i;
+
+  ieee80211_elem_index(frm, efrm, &idx);
+  for (i = 0; i < sizeof(wanted); i++)
+    sum += (uintptr_t)ieee80211_elem_find(&idx, wanted[i]);
+  for (v = ieee80211_elem_next_vendor(&idx, NULL); v != NULL;
+       v = ieee80211_elem_next_vendor(&idx, v))
+    sum += (uintptr_t)v;
+  return sum;
+}
+
+/* what the index replaced: every lookup walks the elements again */
+static uintptr_t run_walks(const uint8_t *frm, const uint8_t *efrm) {
+  uintptr_t sum = 0;
+  const uint8_t *p, *found;
+  size_t i;
+
+  for (i = 0; i < sizeof(wanted); i++) {
+    found = NULL;
+    for (p = frm; p + 2 <= efrm && p + 2 + p[1] <= efrm; p += 2 + p[1])
+      if (p[0] == wanted[i]) found = p;
+    sum += (uintptr_t)found;
+  }
+  for (p = frm; p + 2 <= efrm && p + 2 + p[1] <= efrm; p += 2 + p[1])
+    if (p[0] == IEEE80211_ELEMID_VENDOR) sum += (uintptr_t)p;
+  return sum;
+}
+
+int main(int argc, char **argv) {
+  static const int vendors[] = {0, 4, 16, 64};
+  static uint8_t buf[4096];
+  long rounds = 200000, r;
+  volatile uintptr_t sink = 0;
+  size_t i;
+
+  if (argc > 2 && !strcmp(argv[1], "-n")) rounds = atol(argv[2]);
+
+  for (i = 0; i < sizeof(vendors) / sizeof(vendors[0]); i++) {
+    size_t len = build_beacon(buf, vendors[i]);
+    uint64_t t0, t1, t2;
+
+    if (run_index(buf, buf + len) != run_walks(buf, buf + len)) {
+      fprintf(stderr, "index and walks disagree\n");
+      return 1;
+    }
+    t0 = now_ns();
+    for (r = 0; r < rounds; r++) sink += run_index(buf, buf + len);
+    t1 = now_ns();
+    for (r = 0; r < rounds; r++) sink += run_walks(buf, buf + len);
+    t2 = now_ns();
+    printf("%4zu bytes, %2d vendor IEs: index %7.1f ns, walks %7.1f ns\n",
+           len, vendors[i], rounds ? (double)(t1 - t0) / rounds : 0.0,
+           rounds ? (double)(t2 - t1) / rounds : 0.0);
+  }
+  return 0;
+}
@@ -0,0 +1,67 @@
+//
+//  elem_index_fuzz.c
+//  AppleIntelWifiAdapter host tests
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+/*
+ * Fuzz target for net80211/ieee80211_elem.h: the input is the element
+ * part of a beacon. The index is checked against a plain walk of the
+ * elements, and every element it hands out is read the way
+ * ieee80211_recv_probe_resp() reads it, so that an element past the end of
+ * the input becomes an ASan report.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <net80211/ieee80211_elem.h>
+
+static struct ieee80211_elem_index idx;
+
+static void touch(const uint8_t *p, size_t len) {
+  volatile uint8_t sum = 0;
+  size_t i;
+
+  for (i = 0; i < len; i++) sum ^= p[i];
+  (void)sum;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  const uint8_t *efrm = data + size, *frm, *last[256] = {NULL};
+  const uint8_t *vendor = NULL, *end = data;
+  int truncated = 0, id;
+
+  /* beacons are far below the 16-bit offsets of the index */
+  if (size > 2304) return 0;
+
+  /* the reference: one element at a time */
+  for (frm = data; frm + 2 <= efrm; frm += 2 + frm[1]) {
+    if (frm + 2 + frm[1] > efrm) {
+      truncated = 1;
+      break;
+    }
+    if (frm[0] == IEEE80211_ELEMID_VENDOR && vendor == NULL) vendor = frm;
+    last[frm[0]] = frm;
+    end = frm + 2 + frm[1];
+  }
+
+  if (ieee80211_elem_index(data, efrm, &idx) != truncated) abort();
+  if (idx.base + idx.end != end) abort();
+  for (id = 0; id < 256; id++) {
+    frm = ieee80211_elem_find(&idx, (uint8_t)id);
+    if (frm != last[id]) abort();
+    if (frm) touch(frm, 2 + frm[1]);
+  }
+
+  /* every vendor element, in order, and nothing else */
+  frm = ieee80211_elem_next_vendor(&idx, NULL);
+  if (frm != vendor) abort();
+  for (; frm != NULL; frm = ieee80211_elem_next_vendor(&idx, frm)) {
+    if (frm[0] != IEEE80211_ELEMID_VENDOR || frm + 2 + frm[1] > end) abort();
+    if (frm[1] >= 4) touch(frm + 2, frm[1]);
+  }
+  return 0;
+}
@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+"""scripts/iwl_evt_decode.py against a snapshot built here, laid out as
+iwl_evt_snapshot() in AppleIntelWifiAdapter/IWLTrace.cpp writes it, both
+raw and wrapped in ioreg -a style plist output."""
+
+import io
+import os
+import plistlib
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), "..", "scripts"))
+import iwl_evt_decode as dec  # noqa: E402
+
+failures = 0
+
+
+def check(cond, what):
+    global failures
+    if not cond:
+        sys.stderr.write("FAIL: %s\n" % what)
+        failures += 1
+
+
+def build(rings, tsc, abs_ns):
+    """rings: one list of (tsc, type, cpu, a, b, c, d) per ring"""
+    blob = dec.HDR.pack(dec.SNAP_MAGIC, dec.SNAP_VERSION, dec.HDR.size,
+                        dec.EVT.size, len(rings), 512, tsc, abs_ns)
+    for evts in rings:
+        blob += dec.RING.pack(len(evts) + 3 if evts else 0, len(evts))
+    for evts in rings:
+        for i, (t, etype, cpu, a, b, c, d) in enumerate(evts):
+            blob += dec.EVT.pack(t, i + 1, etype, cpu, a, b, c, d)
+    return blob
+
+
+# two rings written out of order, merged on the TSC
+ring0 = [(1000, dec.HCMD_SEND, 0, 0x88, 16, 7, 0),
+         (5000, dec.IRQ, 0, 1, 0, 0, 0),
+         (5400, dec.RX, 0, 0x88, 20, 0, 1)]
+ring1 = [(3000, dec.HCMD_DONE, 1, 0x88, 20, 7, 0),
+         (9000, dec.IRQ, 1, 1, 0, 0, 0),
+         (9100, dec.RX, 1, 0x1c, 40, 0, 2),
+         (9300, dec.RX, 1, 0x1c, 40, 0, 3)]
+first = build([ring0, ring1] + [[]] * 14, 10000, 1000)
+snap = dec.Snapshot(first)
+check(len(snap.events) == 7, "all records read")
+check([e[0] for e in snap.events] == sorted(e[0] for e in snap.events),
+      "records merged on the TSC")
+check(snap.lost() == 6, "overwritten records counted")
+lat = dec.latencies(snap.events)
+check(lat["hcmd"] == [2000], "hcmd paired on the sequence number")
+check(lat["irq-rx"] == [400, 100], "irq to first rx")
+check(lat["irq-gap"] == [4000], "irq gap")
+
+# ioreg -a output, and a second snapshot to calibrate a 2 GHz TSC
+second = build([[]] * 16, 10000 + 2 * 10**9, 1000 + 10**9)
+plist = plistlib.dumps([{"IORegistryEntryName": "AppleIntelWifiAdapterV2",
+                         "IWLEventRecords": first}])
+paths = []
+for i, data in enumerate((second, plist)):
+    path = os.path.join(os.environ.get("TMPDIR", "/tmp"),
+                        "iwl_evt_test_%d_%d" % (os.getpid(), i))
+    with open(path, "wb") as f:
+        f.write(data)
+    paths.append(path)
+out, sys.stdout = sys.stdout, io.StringIO()
+try:
+    rc = dec.main(paths)
+    text = sys.stdout.getvalue()
+finally:
+    sys.stdout = out
+    for path in paths:
+        os.unlink(path)
+check(rc == 0, "decoder exit status")
+check("TSC 2000000000 Hz" in text, "TSC calibrated from two snapshots")
+check("hcmd: 1 samples" in text and "irq-rx: 2 samples" in text,
+      "histograms printed")
+
+try:
+    dec.Snapshot(b"\0" * 64)
+    check(False, "bad magic refused")
+except ValueError:
+    pass
+
+sys.exit(1 if failures else 0)
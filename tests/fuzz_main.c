@@ -0,0 +1,145 @@
+//
+//  fuzz_main.c
+//  AppleIntelWifiAdapter host tests
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+/*
+ * Stand-in for libFuzzer's main when the fuzz targets are built without
+ * -fsanitize=fuzzer (gcc, or IWL_LIBFUZZER off): runs every file given,
+ * or every file of every directory given, through
+ * LLVMFuzzerTestOneInput(), then -runs=N random mutations of them with a
+ * fixed -seed so a failure replays. Built with the sanitizers the tests
+ * use, an out of bounds read still shows up; real coverage guided fuzzing
+ * needs clang and IWL_LIBFUZZER.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "host_util.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+struct fuzz_input {
+  unsigned char *data;
+  size_t len;
+};
+
+static struct fuzz_input *corpus;
+static int corpus_n;
+
+static void corpus_add(const char *path) {
+  struct fuzz_input *grown;
+  size_t len;
+  unsigned char *data = host_read_file(path, &len);
+
+  if (!data) {
+    fprintf(stderr, "cannot read %s\n", path);
+    return;
+  }
+  grown = (struct fuzz_input *)realloc(corpus, sizeof(*corpus) *
+                                                   (corpus_n + 1));
+  if (!grown) exit(1);
+  corpus = grown;
+  corpus[corpus_n].data = data;
+  corpus[corpus_n].len = len;
+  corpus_n++;
+}
+
+/* xorshift, so a seed gives the same inputs everywhere */
+static uint64_t rng_state;
+
+static uint32_t rng(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (uint32_t)rng_state;
+}
+
+/* one mutation of @in into a fresh, exactly sized buffer */
+static unsigned char *mutate(const struct fuzz_input *in, size_t *len) {
+  size_t n = in->len, i, pos;
+  unsigned char *out;
+
+  switch (rng() % 4) {
+    case 0:  // truncate
+      n = n ? rng() % (n + 1) : 0;
+      break;
+    case 1:  // grow by a few random bytes
+      n += 1 + rng() % 16;
+      break;
+    default:  // same size, bytes flipped below
+      break;
+  }
+  out = (unsigned char *)malloc(n ? n : 1);
+  if (!out) exit(1);
+  memcpy(out, in->data, n < in->len ? n : in->len);
+  for (i = in->len; i < n; i++) out[i] = (unsigned char)rng();
+  if (n) {
+    int flips = 1 + rng() % 8;
+
+    while (flips--) {
+      pos = rng() % n;
+      /* length fields are what matters, favour big and small values */
+      switch (rng() % 3) {
+        case 0:
+          out[pos] ^= (unsigned char)(1 << (rng() % 8));
+          break;
+        case 1:
+          out[pos] = 0xff;
+          break;
+        default:
+          out[pos] = (unsigned char)rng();
+          break;
+      }
+    }
+  }
+  *len = n;
+  return out;
+}
+
+int main(int argc, char **argv) {
+  long runs = 0, r;
+  int i, j;
+
+  rng_state = 0x9e3779b97f4a7c15ULL;
+  for (i = 1; i < argc; i++) {
+    struct stat st;
+
+    if (!strncmp(argv[i], "-runs=", 6)) {
+      runs = atol(argv[i] + 6);
+    } else if (!strncmp(argv[i], "-seed=", 6)) {
+      rng_state = strtoull(argv[i] + 6, NULL, 0) | 1;
+    } else if (!stat(argv[i], &st) && S_ISDIR(st.st_mode)) {
+      int n;
+      char **files = host_list_files(argv[i], "", &n);
+
+      for (j = 0; j < n; j++) corpus_add(files[j]);
+      host_free_list(files);
+    } else {
+      corpus_add(argv[i]);
+    }
+  }
+
+  /* the empty input always goes first */
+  LLVMFuzzerTestOneInput((const uint8_t *)"", 0);
+  for (i = 0; i < corpus_n; i++)
+    LLVMFuzzerTestOneInput(corpus[i].data, corpus[i].len);
+
+  for (r = 0; r < runs && corpus_n; r++) {
+    size_t len;
+    unsigned char *buf = mutate(&corpus[rng() % corpus_n], &len);
+
+    LLVMFuzzerTestOneInput(buf, len);
+    free(buf);
+  }
+
+  printf("%d inputs, %ld mutations\n", corpus_n, runs);
+  for (i = 0; i < corpus_n; i++) free(corpus[i].data);
+  free(corpus);
+  return 0;
+}
@@ -0,0 +1,82 @@
+//
+//  fw_tlv_bench.c
+//  AppleIntelWifiAdapter host tests
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+/*
+ * Micro-benchmark of the TLV walk over the bundled images:
+ *
+ *   fw_tlv_bench [-n rounds] dir...
+ *
+ * Every image is walked n times, sections split as the driver does; the
+ * result is the time per walk and the rate through the file. The walk
+ * copies nothing, so this is the cost of parsing, not of loading.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "IWLTlvView.h"
+#include "host_util.h"
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* one walk, returns the bytes of section code seen */
+static uint64_t walk(const unsigned char *raw, size_t len) {
+  struct iwl_tlv_file_view hdr;
+  struct iwl_tlv_iter it;
+  struct iwl_tlv_view tlv;
+  uint64_t code_bytes = 0;
+
+  if (iwl_tlv_file_open(raw, len, &hdr, &it) != IWL_TLV_VIEW_OK) return 0;
+  while (iwl_tlv_next(&it, &tlv)) {
+    uint32_t off, size;
+    const uint8_t *code;
+
+    if (iwl_tlv_sec_view(tlv.data, tlv.len, &off, &code, &size))
+      code_bytes += size;
+  }
+  return code_bytes;
+}
+
+int main(int argc, char **argv) {
+  long rounds = 10000, r;
+  int i, j, n;
+  volatile uint64_t sink = 0;
+
+  for (i = 1; i < argc; i++) {
+    char **files;
+
+    if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      rounds = atol(argv[++i]);
+      continue;
+    }
+    files = host_list_files(argv[i], ".ucode", &n);
+    for (j = 0; j < n; j++) {
+      size_t len;
+      unsigned char *raw = host_read_file(files[j], &len);
+      uint64_t start, ns;
+
+      if (!raw) continue;
+      start = now_ns();
+      for (r = 0; r < rounds; r++) sink += walk(raw, len);
+      ns = now_ns() - start;
+      printf("%-40s %8zu bytes %10.1f ns/walk %10.1f MB/s\n",
+             strrchr(files[j], '/') + 1, len,
+             rounds ? (double)ns / rounds : 0.0,
+             ns ? (double)len * rounds * 1e3 / ns : 0.0);
+      free(raw);
+    }
+    host_free_list(files);
+  }
+  return sink == 0;
+}
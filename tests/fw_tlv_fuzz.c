@@ -0,0 +1,45 @@
+//
+//  fw_tlv_fuzz.c
+//  AppleIntelWifiAdapter host tests
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+/*
+ * Fuzz target for fw/IWLTlvView.h: walks the input the way
+ * parseTLVFirmware() does and reads every byte of every view it hands
+ * out, so a view past the end of the input is an ASan report.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "IWLTlvView.h"
+
+static void touch(const uint8_t *p, size_t len) {
+  volatile uint8_t sum = 0;
+  size_t i;
+
+  for (i = 0; i < len; i++) sum ^= p[i];
+  (void)sum;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  struct iwl_tlv_file_view hdr;
+  struct iwl_tlv_iter it;
+  struct iwl_tlv_view tlv;
+
+  if (iwl_tlv_file_open(data, size, &hdr, &it) != IWL_TLV_VIEW_OK) return 0;
+  touch(hdr.human_readable, IWL_TLV_VIEW_NAME_LEN);
+
+  while (iwl_tlv_next(&it, &tlv)) {
+    uint32_t off, sec_size;
+    const uint8_t *code;
+
+    touch(tlv.data, tlv.len);
+    if (iwl_tlv_sec_view(tlv.data, tlv.len, &off, &code, &sec_size))
+      touch(code, sec_size);
+  }
+  if (it.err == IWL_TLV_VIEW_OK && it.left) abort();
+  return 0;
+}
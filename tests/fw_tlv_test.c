@@ -0,0 +1,179 @@
+//
+//  fw_tlv_test.c
+//  AppleIntelWifiAdapter host tests
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+/*
+ * fw/IWLTlvView.h against hand built files for every error it reports,
+ * and against every bundled firmware/ *.ucode image: each has to walk to
+ * the end cleanly with its runtime sections inside the file, and every
+ * truncation of it has to stop without reading past the cut (the cut
+ * copies are exactly sized, so ASan sees any overread).
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "IWLTlvView.h"
+#include "host_util.h"
+
+#define TLV_SEC_RT 19
+#define TLV_SEC_INIT 20
+#define TLV_SECURE_SEC_RT 24
+#define TLV_SECURE_SEC_INIT 25
+
+static void put_le32(unsigned char *p, uint32_t v) {
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+  p[2] = (unsigned char)(v >> 16);
+  p[3] = (unsigned char)(v >> 24);
+}
+
+/* a file header followed by @n TLVs of the given lengths, padded */
+static size_t build_file(unsigned char *buf, const uint32_t *lens, int n) {
+  size_t pos = IWL_TLV_VIEW_HDR_LEN;
+  int i;
+
+  memset(buf, 0, IWL_TLV_VIEW_HDR_LEN);
+  put_le32(buf + 4, IWL_TLV_VIEW_MAGIC);
+  memcpy(buf + 8, "host test", 9);
+  put_le32(buf + 8 + IWL_TLV_VIEW_NAME_LEN, 0x11223344);
+  put_le32(buf + 12 + IWL_TLV_VIEW_NAME_LEN, 42);
+  for (i = 0; i < n; i++) {
+    put_le32(buf + pos, TLV_SEC_RT + i);
+    put_le32(buf + pos + 4, lens[i]);
+    memset(buf + pos + 8, 0xa5, lens[i]);
+    pos += IWL_TLV_VIEW_TLV_LEN + ((lens[i] + 3) & ~3u);
+  }
+  return pos;
+}
+
+/* walks a heap copy of @len bytes of @src, returns the TLV count */
+static int walk_copy(const unsigned char *src, size_t len,
+                     enum iwl_tlv_view_err *open_err,
+                     enum iwl_tlv_view_err *walk_err) {
+  unsigned char *copy = (unsigned char *)malloc(len ? len : 1);
+  struct iwl_tlv_file_view hdr;
+  struct iwl_tlv_iter it;
+  struct iwl_tlv_view tlv;
+  volatile uint8_t sum = 0;
+  int n = 0;
+
+  memcpy(copy, src, len);
+  *walk_err = IWL_TLV_VIEW_OK;
+  *open_err = iwl_tlv_file_open(copy, len, &hdr, &it);
+  if (*open_err == IWL_TLV_VIEW_OK) {
+    while (iwl_tlv_next(&it, &tlv)) {
+      /* touch both ends of the view */
+      if (tlv.len) sum ^= tlv.data[0] ^ tlv.data[tlv.len - 1];
+      n++;
+    }
+    *walk_err = it.err;
+  }
+  (void)sum;
+  free(copy);
+  return n;
+}
+
+static void test_synthetic(void) {
+  static unsigned char buf[512];
+  const uint32_t lens[] = {4, 13, 0, 6};
+  enum iwl_tlv_view_err oe, we;
+  struct iwl_tlv_file_view hdr;
+  struct iwl_tlv_iter it;
+  struct iwl_tlv_view tlv;
+  uint32_t off, size;
+  const uint8_t *code;
+  size_t len = build_file(buf, lens, 4);
+
+  CHECK(iwl_tlv_file_open(buf, len, &hdr, &it) == IWL_TLV_VIEW_OK);
+  CHECK(hdr.ver == 0x11223344 && hdr.build == 42);
+  CHECK(!memcmp(hdr.human_readable, "host test", 9));
+  CHECK(iwl_tlv_next(&it, &tlv) && tlv.type == TLV_SEC_RT && tlv.len == 4);
+  CHECK(tlv.data == buf + IWL_TLV_VIEW_HDR_LEN + IWL_TLV_VIEW_TLV_LEN);
+  CHECK(iwl_tlv_next(&it, &tlv) && tlv.len == 13);
+  CHECK(iwl_tlv_sec_view(tlv.data, tlv.len, &off, &code, &size));
+  CHECK(off == 0xa5a5a5a5 && code == tlv.data + 4 && size == 9);
+  CHECK(iwl_tlv_next(&it, &tlv) && tlv.len == 0);
+  CHECK(!iwl_tlv_sec_view(tlv.data, tlv.len, &off, &code, &size));
+  CHECK(iwl_tlv_next(&it, &tlv) && tlv.len == 6);
+  CHECK(!iwl_tlv_next(&it, &tlv) && it.err == IWL_TLV_VIEW_OK);
+
+  /* the last TLV without its padding is fine */
+  CHECK(walk_copy(buf, len - 2, &oe, &we) == 4 && we == IWL_TLV_VIEW_OK);
+  /* a TLV one byte short of its length */
+  CHECK(walk_copy(buf, len - 3, &oe, &we) == 3 && we == IWL_TLV_VIEW_ERR_LEN);
+  /* stray bytes after the last TLV */
+  CHECK(walk_copy(buf, len + 3, &oe, &we) == 4 &&
+        we == IWL_TLV_VIEW_ERR_TRAILING);
+  /* a length that wraps when padded */
+  put_le32(buf + IWL_TLV_VIEW_HDR_LEN + 4, 0xfffffffe);
+  CHECK(walk_copy(buf, len, &oe, &we) == 0 && we == IWL_TLV_VIEW_ERR_LEN);
+
+  CHECK(walk_copy(buf, IWL_TLV_VIEW_HDR_LEN - 1, &oe, &we) == 0 &&
+        oe == IWL_TLV_VIEW_ERR_SHORT);
+  CHECK(walk_copy(buf, IWL_TLV_VIEW_HDR_LEN, &oe, &we) == 0 &&
+        oe == IWL_TLV_VIEW_OK && we == IWL_TLV_VIEW_OK);
+  buf[4] ^= 1;
+  CHECK(walk_copy(buf, len, &oe, &we) == 0 && oe == IWL_TLV_VIEW_ERR_MAGIC);
+}
+
+static int is_sec(uint32_t type) {
+  return type == TLV_SEC_RT || type == TLV_SEC_INIT ||
+         type == TLV_SECURE_SEC_RT || type == TLV_SECURE_SEC_INIT;
+}
+
+static void test_image(const char *path) {
+  size_t len, cut;
+  unsigned char *raw = host_read_file(path, &len);
+  struct iwl_tlv_file_view hdr;
+  struct iwl_tlv_iter it;
+  struct iwl_tlv_view tlv;
+  enum iwl_tlv_view_err oe, we;
+  int n = 0, secs = 0, bad = 0;
+
+  CHECK(raw != NULL);
+  if (!raw) return;
+  CHECK(iwl_tlv_file_open(raw, len, &hdr, &it) == IWL_TLV_VIEW_OK);
+  while (iwl_tlv_next(&it, &tlv)) {
+    uint32_t off, size;
+    const uint8_t *code;
+
+    n++;
+    if (!is_sec(tlv.type)) continue;
+    if (!iwl_tlv_sec_view(tlv.data, tlv.len, &off, &code, &size) ||
+        code < raw || code + size > raw + len)
+      bad++;
+    secs++;
+  }
+  CHECK(it.err == IWL_TLV_VIEW_OK);
+  CHECK(n > 0 && secs > 0 && bad == 0);
+  printf("%s: %d TLVs, %d sections, %.*s\n", path, n, secs,
+         (int)strnlen((const char *)hdr.human_readable,
+                      IWL_TLV_VIEW_NAME_LEN),
+         (const char *)hdr.human_readable);
+
+  /* every cut in the header and the first TLVs, then a stride through */
+  for (cut = 0; cut < len; cut += cut < 4096 ? 1 : 4093) {
+    walk_copy(raw, cut, &oe, &we);
+    CHECK(cut >= IWL_TLV_VIEW_HDR_LEN || oe == IWL_TLV_VIEW_ERR_SHORT);
+  }
+  free(raw);
+}
+
+int main(int argc, char **argv) {
+  int i, j, n;
+
+  test_synthetic();
+  for (i = 1; i < argc; i++) {
+    char **files = host_list_files(argv[i], ".ucode", &n);
+
+    CHECK(n > 0);
+    for (j = 0; j < n; j++) test_image(files[j]);
+    host_free_list(files);
+  }
+  return HOST_TEST_RESULT();
+}
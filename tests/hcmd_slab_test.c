@@ -0,0 +1,134 @@
+//
+//  hcmd_slab_test.c
+//  AppleIntelWifiAdapter host tests
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+/*
+ * trans/IWLHcmdSlab.h with the driver's size classes: random command
+ * sizes are taken and given back in random order, and every request is
+ * checked against a model that knows which buffers are out. A buffer is
+ * never handed out twice, a request goes to the smallest class that
+ * fits and has a buffer left, and it misses only if there is none. The
+ * counters the pool logs on teardown are checked as well.
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "IWLHcmdSlab.h"
+#include "host_util.h"
+
+#define MAX_OBJS 256
+
+struct model {
+  bool out[IWL_HCMD_POOL_CLASSES][MAX_OBJS];
+  uint32_t in_use[IWL_HCMD_POOL_CLASSES];
+  uint32_t in_use_max[IWL_HCMD_POOL_CLASSES];
+  uint32_t hits[IWL_HCMD_POOL_CLASSES];
+};
+
+static void test_classes(void) {
+  uint32_t total = 0;
+
+  for (int i = 0; i < IWL_HCMD_POOL_CLASSES; i++) {
+    /* iwl_hcmd_slab_get() takes the first class that fits */
+    if (i) {
+      CHECK(iwl_hcmd_pool_classes[i].obj_size >
+            iwl_hcmd_pool_classes[i - 1].obj_size);
+    }
+    /* the free stacks hold u16 indexes */
+    CHECK(iwl_hcmd_pool_classes[i].count <= MAX_OBJS);
+    total += iwl_hcmd_pool_classes[i].obj_size *
+             iwl_hcmd_pool_classes[i].count;
+  }
+  CHECK(total == 240 * 1024);
+}
+
+static void slabs_init(struct iwl_hcmd_slab *slab) {
+  for (int i = 0; i < IWL_HCMD_POOL_CLASSES; i++) {
+    memset(&slab[i], 0, sizeof(slab[i]));
+    slab[i].obj_size = iwl_hcmd_pool_classes[i].obj_size;
+    slab[i].count = iwl_hcmd_pool_classes[i].count;
+    slab[i].free = calloc(slab[i].count, sizeof(*slab[i].free));
+    iwl_hcmd_slab_reset(&slab[i]);
+  }
+}
+
+static int model_pick(const struct model *m, size_t size) {
+  for (int i = 0; i < IWL_HCMD_POOL_CLASSES; i++) {
+    if (size <= iwl_hcmd_pool_classes[i].obj_size &&
+        m->in_use[i] < iwl_hcmd_pool_classes[i].count)
+      return i;
+  }
+  return -1;
+}
+
+static void test_random(int ops) {
+  struct iwl_hcmd_slab slab[IWL_HCMD_POOL_CLASSES];
+  struct model m = {};
+  /* what is out, to give back in random order */
+  uint32_t held_class[1024], held_obj[1024];
+  int held = 0, misses = 0;
+
+  slabs_init(slab);
+  for (int n = 0; n < ops; n++) {
+    /* lean towards taking so the classes run dry now and then */
+    if (held < 1024 && (held == 0 || rand() % 8 < 5)) {
+      size_t size = rand() % 4 ? rand() % 600 : rand() % 5000;
+      int expect = model_pick(&m, size);
+      uint32_t obj = 0;
+      int i = iwl_hcmd_slab_get(slab, IWL_HCMD_POOL_CLASSES, size, &obj);
+
+      CHECK(i == expect);
+      if (i < 0) {
+        misses++;
+        continue;
+      }
+      CHECK(obj < slab[i].count);
+      CHECK(!m.out[i][obj]);
+      m.out[i][obj] = true;
+      m.hits[i]++;
+      if (++m.in_use[i] > m.in_use_max[i]) m.in_use_max[i] = m.in_use[i];
+      held_class[held] = i;
+      held_obj[held++] = obj;
+    } else {
+      int k = rand() % held;
+      uint32_t i = held_class[k], obj = held_obj[k];
+
+      iwl_hcmd_slab_put(&slab[i], obj);
+      m.out[i][obj] = false;
+      m.in_use[i]--;
+      held_class[k] = held_class[--held];
+      held_obj[k] = held_obj[held];
+    }
+  }
+  while (held) {
+    held--;
+    iwl_hcmd_slab_put(&slab[held_class[held]], held_obj[held]);
+    m.in_use[held_class[held]]--;
+  }
+
+  CHECK(misses > 0);
+  for (int i = 0; i < IWL_HCMD_POOL_CLASSES; i++) {
+    bool seen[MAX_OBJS] = {};
+
+    CHECK(slab[i].hits == m.hits[i]);
+    CHECK(slab[i].in_use_max == m.in_use_max[i]);
+    CHECK(slab[i].in_use_max == slab[i].count);
+    /* all back, each buffer exactly once */
+    CHECK(slab[i].free_count == slab[i].count);
+    for (uint32_t j = 0; j < slab[i].free_count; j++) {
+      CHECK(!seen[slab[i].free[j]]);
+      seen[slab[i].free[j]] = true;
+    }
+    free(slab[i].free);
+  }
+}
+
+int main(void) {
+  srand(1);
+  test_classes();
+  test_random(200000);
+  return HOST_TEST_RESULT();
+}
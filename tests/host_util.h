@@ -0,0 +1,100 @@
+//
+//  host_util.h
+//  AppleIntelWifiAdapter host tests
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+#ifndef TESTS_HOST_UTIL_H_
+#define TESTS_HOST_UTIL_H_
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Helpers shared by the host tests: a check that reports and counts
+ * failures instead of aborting, and file loading for the bundled images.
+ */
+static int host_failures __attribute__((unused));
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, \
+              #cond);                                                 \
+      host_failures++;                                                \
+    }                                                                 \
+  } while (0)
+
+#define HOST_TEST_RESULT() (host_failures ? 1 : 0)
+
+/* the whole file in an exactly sized heap buffer, NULL on error */
+static inline unsigned char *host_read_file(const char *path, size_t *len) {
+  FILE *f = fopen(path, "rb");
+  unsigned char *buf = NULL;
+  long size;
+
+  if (!f) return NULL;
+  if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0 &&
+      fseek(f, 0, SEEK_SET) == 0) {
+    buf = (unsigned char *)malloc(size ? (size_t)size : 1);
+    if (buf && fread(buf, 1, (size_t)size, f) != (size_t)size) {
+      free(buf);
+      buf = NULL;
+    }
+    *len = (size_t)size;
+  }
+  fclose(f);
+  return buf;
+}
+
+/*
+ * host_list_files - the paths of the files in @dir ending in @suffix,
+ * sorted, as a NULL terminated array the caller frees with
+ * host_free_list()
+ */
+static inline int host_cmp_str(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static inline char **host_list_files(const char *dir, const char *suffix,
+                                     int *count) {
+  DIR *d = opendir(dir);
+  struct dirent *e;
+  char **list = NULL;
+  size_t slen = strlen(suffix);
+  int n = 0;
+
+  *count = 0;
+  if (!d) return NULL;
+  while ((e = readdir(d))) {
+    size_t len = strlen(e->d_name);
+    char **grown;
+
+    if (e->d_name[0] == '.') continue;
+    if (len < slen || strcmp(e->d_name + len - slen, suffix)) continue;
+    grown = (char **)realloc(list, sizeof(*list) * (n + 2));
+    if (!grown) break;
+    list = grown;
+    list[n] = (char *)malloc(strlen(dir) + len + 2);
+    if (!list[n]) break;
+    sprintf(list[n], "%s/%s", dir, e->d_name);
+    list[++n] = NULL;
+  }
+  closedir(d);
+  if (list) qsort(list, n, sizeof(*list), host_cmp_str);
+  *count = n;
+  return list;
+}
+
+static inline void host_free_list(char **list) {
+  char **p;
+
+  if (!list) return;
+  for (p = list; *p; p++) free(*p);
+  free(list);
+}
+
+#endif  // TESTS_HOST_UTIL_H_
@@ -0,0 +1,195 @@
+//
+//  nvm_chunk_test.c
+//  AppleIntelWifiAdapter host tests
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+/*
+ * nvm/IWLNvmChunk.h: sections of random length, some a multiple of the
+ * chunk size, are read from a model of the firmware the way
+ * iwl_nvm_read_section_pipelined() reads them, batches of reads in
+ * flight and the ones past the end dropped. Now and then a response
+ * fails, is for another offset or has too much data. The outcome and the
+ * bytes must match reading the same firmware one chunk at a time, as
+ * iwl_nvm_read_section() does, with the response checks it had inline.
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "IWLNvmChunk.h"
+#include "host_util.h"
+
+#define CHUNK IWL_NVM_DEFAULT_CHUNK_SIZE
+#define PIPELINE 4 /* IWL_NVM_READ_PIPELINE */
+#define EEPROM_SIZE (16 * 1024)
+
+struct fw {
+  uint8_t section[EEPROM_SIZE + CHUNK];
+  uint32_t len;
+  uint32_t seed; /* which responses go wrong, by offset */
+  int fault_rate;
+};
+
+struct resp {
+  uint16_t status, offset, length;
+  uint8_t data[CHUNK + 16];
+};
+
+static uint32_t hash(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  return x ^ (x >> 16);
+}
+
+/* the NVM_ACCESS_CMD response to a read of @offset */
+static void fw_read(const struct fw *fw, uint16_t offset, struct resp *r) {
+  uint32_t h = hash(fw->seed ^ offset);
+
+  r->status = 0;
+  r->offset = offset;
+  if (offset >= fw->len) {
+    r->status = READ_NVM_CHUNK_NOT_VALID_ADDRESS;
+    r->length = 0;
+  } else {
+    r->length = fw->len - offset < CHUNK ? fw->len - offset : CHUNK;
+  }
+  memcpy(r->data, fw->section + offset, r->length);
+
+  if ((int)(h % 1000) >= fw->fault_rate) return;
+  switch ((h >> 10) % 3) {
+    case 0:
+      r->status = 3;
+      break;
+    case 1:
+      r->offset ^= CHUNK;
+      break;
+    default:
+      r->length = CHUNK + 1 + (h >> 12) % 16;
+      break;
+  }
+}
+
+/* iwl_nvm_read_chunk() and iwl_nvm_read_section() before the helpers */
+static int ref_read(const struct fw *fw, uint8_t *data, uint32_t size) {
+  uint32_t offset = 0;
+  int ret = CHUNK;
+
+  while (ret == CHUNK) {
+    struct resp r;
+
+    if (offset + CHUNK > size) return -ENOBUFS;
+    fw_read(fw, (uint16_t)offset, &r);
+    if (r.status) {
+      return offset && r.status == READ_NVM_CHUNK_NOT_VALID_ADDRESS
+                 ? (int)offset
+                 : -ENODATA;
+    }
+    if (r.offset != offset || r.length > CHUNK) return -EINVAL;
+    memcpy(data + offset, r.data, r.length);
+    ret = r.length;
+    offset += ret;
+  }
+  return offset;
+}
+
+/* iwl_nvm_read_section_pipelined() without the commands */
+static int pipe_read(const struct fw *fw, uint8_t *data, uint32_t size) {
+  static struct {
+    uint16_t offset;
+    int ret;
+    uint8_t data[CHUNK];
+  } rd[PIPELINE];
+  uint32_t offset = 0;
+
+  while (true) {
+    int i, n;
+
+    for (n = 0; n < PIPELINE; n++) {
+      uint16_t chunk_offset = offset + n * CHUNK;
+      struct resp r;
+
+      if ((uint32_t)chunk_offset + CHUNK > size) break;
+      rd[n].offset = chunk_offset;
+      fw_read(fw, chunk_offset, &r);
+      rd[n].ret = iwl_nvm_chunk_result(chunk_offset, r.status, r.offset,
+                                       r.length, sizeof(rd[n].data));
+      if (rd[n].ret > 0) memcpy(rd[n].data, r.data, rd[n].ret);
+    }
+    if (!n) return -ENOBUFS;
+
+    for (i = 0; i < n; i++) {
+      if (rd[i].ret < 0) return rd[i].ret;
+      if (!iwl_nvm_chunk_take(data, &offset, size, rd[i].offset, rd[i].data,
+                              rd[i].ret))
+        return -EINVAL;
+      if (rd[i].ret != CHUNK) return offset;
+    }
+  }
+}
+
+static void test_random(int rounds) {
+  static struct fw fw;
+  static uint8_t ref[EEPROM_SIZE], got[EEPROM_SIZE];
+  int outcomes[4] = {};
+
+  for (int n = 0; n < rounds; n++) {
+    uint32_t size = EEPROM_SIZE - (rand() % 3) * CHUNK;
+    int a, b;
+
+    fw.len = rand() % 2 ? (rand() % 9) * CHUNK : rand() % (EEPROM_SIZE + 1);
+    for (uint32_t i = 0; i < fw.len; i++) fw.section[i] = (uint8_t)rand();
+    fw.seed = rand();
+    fw.fault_rate = rand() % 2 ? 0 : 100;
+
+    memset(ref, 0xa5, sizeof(ref));
+    memset(got, 0xa5, sizeof(got));
+    a = ref_read(&fw, ref, size);
+    b = pipe_read(&fw, got, size);
+    CHECK(a == b);
+    if (a >= 0) {
+      CHECK(memcmp(ref, got, a) == 0);
+      CHECK(memcmp(got, fw.section, a) == 0);
+      /* only a full read of a fault-free section stops before the end */
+      CHECK((uint32_t)a == fw.len || fw.fault_rate);
+      outcomes[0]++;
+    } else {
+      outcomes[a == -ENOBUFS ? 1 : a == -ENODATA ? 2 : 3]++;
+    }
+  }
+  for (int i = 0; i < 4; i++) CHECK(outcomes[i] > 0);
+}
+
+static void test_take(void) {
+  uint8_t data[3 * CHUNK], chunk[CHUNK];
+  uint32_t len = 0;
+
+  memset(chunk, 1, sizeof(chunk));
+  CHECK(iwl_nvm_chunk_take(data, &len, sizeof(data), 0, chunk, CHUNK));
+  /* a chunk read twice, and one with a gap in front */
+  CHECK(!iwl_nvm_chunk_take(data, &len, sizeof(data), 0, chunk, CHUNK));
+  CHECK(!iwl_nvm_chunk_take(data, &len, sizeof(data), 2 * CHUNK, chunk, 1));
+  CHECK(len == CHUNK);
+  CHECK(iwl_nvm_chunk_take(data, &len, sizeof(data), CHUNK, chunk, CHUNK));
+  /* the last one may not run past the buffer */
+  CHECK(!iwl_nvm_chunk_take(data, &len, sizeof(data) - 1, len, chunk, CHUNK));
+  CHECK(iwl_nvm_chunk_take(data, &len, sizeof(data), len, chunk, CHUNK));
+  CHECK(len == sizeof(data));
+  CHECK(iwl_nvm_chunk_take(data, &len, sizeof(data), len, chunk, 0));
+  CHECK(!iwl_nvm_chunk_take(data, &len, sizeof(data), len, chunk, 1));
+
+  /* the end of a section of whole chunks, and a failed first read */
+  CHECK(iwl_nvm_chunk_result(CHUNK, READ_NVM_CHUNK_NOT_VALID_ADDRESS, 0, 0,
+                             CHUNK) == 0);
+  CHECK(iwl_nvm_chunk_result(0, READ_NVM_CHUNK_NOT_VALID_ADDRESS, 0, 0,
+                             CHUNK) == -ENODATA);
+}
+
+int main(void) {
+  srand(1);
+  test_take();
+  test_random(20000);
+  return HOST_TEST_RESULT();
+}
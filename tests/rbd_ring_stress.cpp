@@ -0,0 +1,152 @@
+//
+//  rbd_ring_stress.cpp
+//  AppleIntelWifiAdapter host tests
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+/*
+ * Two thread stress test of trans/IWLRbdRing.h. The rings are sized far
+ * below the traffic so both ends keep running into full and empty rings:
+ *
+ * - one ring, one producer, one consumer: every entry arrives exactly
+ *   once and in order;
+ * - two rings in a loop, the way an Rx queue and the Rx allocator use
+ *   rbd_empty and rbd_allocated: every RBD goes around and comes back
+ *   with what the other side wrote into it.
+ *
+ * Build with -fsanitize=thread (IWL_SANITIZE off) to have the races
+ * checked as well as the results.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <thread>
+
+#include "IWLRbdRing.h"
+#include "host_util.h"
+
+struct iwl_rx_mem_buffer {
+  uint32_t seq;
+  uint32_t page;
+};
+
+static void ring_init(struct iwl_rbd_ring *ring, uint32_t size) {
+  ring->entries = static_cast<iwl_rx_mem_buffer **>(
+      calloc(size, sizeof(*ring->entries)));
+  ring->size = size;
+  ring->head = 0;
+  ring->tail = 0;
+}
+
+static void test_fifo(uint32_t ring_size, uint32_t items) {
+  struct iwl_rbd_ring ring;
+  iwl_rx_mem_buffer *bufs = new iwl_rx_mem_buffer[items];
+  uint32_t bad = 0, got = 0;
+
+  ring_init(&ring, ring_size);
+  for (uint32_t i = 0; i < items; i++) bufs[i].seq = i;
+
+  std::thread producer([&] {
+    for (uint32_t i = 0; i < items; i++)
+      while (!iwl_rbd_ring_push(&ring, &bufs[i])) std::this_thread::yield();
+  });
+  std::thread consumer([&] {
+    while (got < items) {
+      iwl_rx_mem_buffer *rxb = iwl_rbd_ring_pop(&ring);
+
+      if (!rxb) {
+        std::this_thread::yield();
+        continue;
+      }
+      if (rxb != &bufs[got] || rxb->seq != got) bad++;
+      got++;
+    }
+  });
+  producer.join();
+  consumer.join();
+
+  CHECK(bad == 0);
+  CHECK(got == items);
+  CHECK(iwl_rbd_ring_count(&ring) == 0);
+  CHECK(iwl_rbd_ring_pop(&ring) == NULL);
+  free(ring.entries);
+  delete[] bufs;
+}
+
+/*
+ * The queue side hands its used RBDs over in batches and takes back what
+ * the allocator attached a "page" to; the allocator stamps each RBD with
+ * the round it saw, which the queue checks.
+ */
+static void test_allocator_loop(uint32_t pool, uint32_t rounds) {
+  struct iwl_rbd_ring empty, allocated;
+  iwl_rx_mem_buffer *bufs = new iwl_rx_mem_buffer[pool];
+  uint32_t *seen = new uint32_t[pool]();
+  uint32_t total = pool * rounds, bad = 0, alloc_bad = 0;
+  std::atomic<bool> done(false);
+
+  /* sized for the whole pool, like iwl_pcie_rx_alloc() does */
+  ring_init(&empty, pool);
+  ring_init(&allocated, pool);
+  for (uint32_t i = 0; i < pool; i++) {
+    bufs[i].seq = i;
+    bufs[i].page = 0;
+  }
+
+  std::thread allocator([&] {
+    while (!done) {
+      iwl_rx_mem_buffer *rxb = iwl_rbd_ring_pop(&empty);
+
+      if (!rxb) {
+        std::this_thread::yield();
+        continue;
+      }
+      rxb->page++;
+      if (!iwl_rbd_ring_push(&allocated, rxb)) alloc_bad++;
+    }
+  });
+  std::thread queue([&] {
+    uint32_t handed = 0, back = 0, next = 0;
+
+    while (back < total) {
+      /* a batch of used RBDs, as move_to_allocator() does */
+      for (int i = 0; i < 8 && handed < total && handed - back < pool; i++) {
+        if (!iwl_rbd_ring_push(&empty, &bufs[next])) {
+          bad++;
+          break;
+        }
+        next = (next + 1) % pool;
+        handed++;
+      }
+      iwl_rx_mem_buffer *rxb;
+      while ((rxb = iwl_rbd_ring_pop(&allocated)) != NULL) {
+        if (rxb->page != ++seen[rxb->seq]) bad++;
+        back++;
+      }
+    }
+    done = true;
+  });
+  queue.join();
+  allocator.join();
+
+  CHECK(bad == 0 && alloc_bad == 0);
+  for (uint32_t i = 0; i < pool; i++) CHECK(seen[i] == rounds);
+  CHECK(iwl_rbd_ring_count(&empty) == 0);
+  CHECK(iwl_rbd_ring_count(&allocated) == 0);
+  free(empty.entries);
+  free(allocated.entries);
+  delete[] seen;
+  delete[] bufs;
+}
+
+int main(int argc, char **argv) {
+  uint32_t scale = argc > 1 ? (uint32_t)atoi(argv[1]) : 1;
+
+  test_fifo(2, 20000 * scale);
+  test_fifo(8, 100000 * scale);
+  test_allocator_loop(16, 2000 * scale);
+  test_allocator_loop(512, 100 * scale);
+  return HOST_TEST_RESULT();
+}
@@ -0,0 +1,161 @@
+//
+//  rx_budget_test.c
+//  AppleIntelWifiAdapter host tests
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+/*
+ * trans/IWLRxBudget.h against
+ *
+ * - the budget check handleRx() had inline before, for every read/closed
+ *   pair and budget of a small ring;
+ * - a ring the "firmware" keeps closing RBs on while the driver runs the
+ *   irqHandler()/rxPoll() protocol: the interrupt stays masked while a
+ *   pass leaves RBs behind, no pass handles more than the budget (also
+ *   across emergency restarts), and every RB is handled once and in
+ *   order.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "IWLRxBudget.h"
+#include "host_util.h"
+
+/* the loop of handleRx() before the helper, reduced to its indexes */
+static uint32_t ref_stop(uint32_t i, uint32_t r, uint32_t size,
+                         uint32_t budget, bool *more) {
+  uint32_t handled = 0;
+
+  *more = false;
+  while (i != r) {
+    if (handled >= budget) {
+      *more = true;
+      break;
+    }
+    handled++;
+    i = (i + 1) & (size - 1);
+  }
+  return i;
+}
+
+static void test_exhaustive(uint32_t size) {
+  for (uint32_t read = 0; read < size; read++) {
+    for (uint32_t closed = 0; closed < size; closed++) {
+      for (uint32_t budget = 0; budget <= size + 1; budget++) {
+        bool more, ref_more;
+        uint32_t stop = iwl_rx_budget_stop(read, closed, size, budget, &more);
+
+        CHECK(stop == ref_stop(read, closed, size, budget, &ref_more));
+        CHECK(more == ref_more);
+      }
+    }
+  }
+}
+
+struct sim {
+  uint32_t size;
+  uint32_t budget;
+  uint32_t *ring;  /* the sequence number the firmware wrote into each RB */
+  uint32_t read;
+  uint32_t closed;
+  uint32_t next_seq;  /* of the next RB the firmware closes */
+  uint32_t expect;    /* of the next RB the driver handles */
+  bool masked;
+  bool poll_scheduled;
+  uint32_t passes;
+  uint32_t polls;
+};
+
+/* the firmware closes up to @n RBs, never the last free one */
+static void sim_fill(struct sim *s, uint32_t n) {
+  while (n-- && ((s->closed + 1) & (s->size - 1)) != s->read) {
+    s->ring[s->closed] = s->next_seq++;
+    s->closed = (s->closed + 1) & (s->size - 1);
+  }
+}
+
+/*
+ * handleRx(): one pass, restarted like the emergency path does at random
+ * points, with the firmware closing more RBs in between
+ */
+static bool sim_pass(struct sim *s) {
+  uint32_t handled = 0;
+  bool more;
+
+  s->passes++;
+  for (;;) {
+    uint32_t stop = iwl_rx_budget_stop(s->read, s->closed, s->size,
+                                       s->budget - handled, &more);
+    bool restart = false;
+
+    while (s->read != stop) {
+      CHECK(s->ring[s->read] == s->expect);
+      s->expect++;
+      handled++;
+      s->read = (s->read + 1) & (s->size - 1);
+      if (rand() % 16 == 0) {
+        sim_fill(s, rand() % 4);
+        restart = true;
+        break;
+      }
+    }
+    if (!restart) break;
+  }
+  CHECK(handled <= s->budget);
+  /* a pass that stopped early has handled its whole budget */
+  if (more) CHECK(handled == s->budget);
+  return more;
+}
+
+/* irqHandler(), then the rxPoll() passes the timer would run */
+static void sim_irq(struct sim *s) {
+  CHECK(!s->masked);
+  s->masked = true;
+  if (sim_pass(s)) s->poll_scheduled = true;
+  if (!s->poll_scheduled) s->masked = false;
+}
+
+static void sim_poll(struct sim *s) {
+  if (!s->poll_scheduled) return;
+  CHECK(s->masked);
+  s->polls++;
+  if (sim_pass(s)) return;
+  s->poll_scheduled = false;
+  s->masked = false;
+}
+
+static void test_protocol(uint32_t size, uint32_t budget, uint32_t rounds) {
+  struct sim s = {};
+
+  s.size = size;
+  s.budget = budget;
+  s.ring = calloc(size, sizeof(*s.ring));
+  for (uint32_t n = 0; n < rounds; n++) {
+    sim_fill(&s, rand() % size);
+    /* the interrupt only fires while it is unmasked */
+    if (!s.masked && s.read != s.closed) sim_irq(&s);
+    sim_poll(&s);
+  }
+  while (s.poll_scheduled) sim_poll(&s);
+  if (s.read != s.closed) sim_irq(&s);
+  while (s.poll_scheduled) sim_poll(&s);
+
+  CHECK(s.read == s.closed);
+  CHECK(s.expect == s.next_seq);
+  CHECK(!s.masked);
+  /* bursts larger than the budget did happen and went through polling */
+  if (size > 2 * budget) CHECK(s.polls > 0);
+  free(s.ring);
+}
+
+int main(void) {
+  srand(1);
+  test_exhaustive(8);
+  test_exhaustive(64);
+  test_protocol(8, 1, 10000);
+  test_protocol(256, 64, 10000);
+  test_protocol(512, 64, 10000);
+  test_protocol(4096, 64, 2000);
+  return HOST_TEST_RESULT();
+}
@@ -0,0 +1,132 @@
+//
+//  rx_handlers_test.cpp
+//  AppleIntelWifiAdapter host tests
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+/*
+ * trans/IWLRxHandlers.h: the Rx dispatch table built from random
+ * definition lists is checked, for every group id and opcode, against a
+ * scan of the list the way iwl_pcie_rx_handle_rb() decided before the
+ * table (the last handler registered for the ID, no_reclaim if any
+ * definition says so). Groups nothing registers for must stay
+ * unallocated, and a failed allocation or a bad group id must leave the
+ * table as it was.
+ */
+#include <stdlib.h>
+
+#include "IWLRxHandlers.h"
+#include "host_util.h"
+
+static void h0(IWLTransport *, struct iwl_rx_cmd_buffer *) {}
+static void h1(IWLTransport *, struct iwl_rx_cmd_buffer *) {}
+static void h2(IWLTransport *, struct iwl_rx_cmd_buffer *) {}
+static const iwl_rx_handler_fn fns[] = {NULL, h0, h1, h2};
+
+static int allocs;
+static bool fail_alloc;
+
+static struct iwl_rx_handler *alloc_group(void) {
+  if (fail_alloc) return NULL;
+  allocs++;
+  return static_cast<iwl_rx_handler *>(
+      calloc(IWL_RX_HANDLER_OPCODES, sizeof(struct iwl_rx_handler)));
+}
+
+static void free_table(struct iwl_rx_handler **table) {
+  for (int i = 0; i < IWL_RX_HANDLER_GROUPS; i++) {
+    free(table[i]);
+    table[i] = NULL;
+  }
+}
+
+static void check_against_defs(struct iwl_rx_handler **table,
+                               const struct iwl_rx_handler_def *defs, int n) {
+  for (int group = 0; group < 256; group++) {
+    bool used = false;
+
+    for (int i = 0; i < n; i++) used |= defs[i].cmd_id >> 8 == group;
+    if (group < IWL_RX_HANDLER_GROUPS) CHECK(!table[group] == !used);
+
+    for (int opcode = 0; opcode < 256; opcode++) {
+      const struct iwl_rx_handler *h = iwl_rx_handlers_get(
+          table, static_cast<uint8_t>(group), static_cast<uint8_t>(opcode));
+      iwl_rx_handler_fn fn = NULL;
+      bool no_reclaim = false;
+
+      for (int i = 0; i < n; i++) {
+        if (defs[i].cmd_id != (group << 8 | opcode)) continue;
+        if (defs[i].fn) fn = defs[i].fn;
+        no_reclaim |= defs[i].no_reclaim;
+      }
+      if (group >= IWL_RX_HANDLER_GROUPS) {
+        fn = NULL;
+        no_reclaim = false;
+      }
+      CHECK(h->fn == fn);
+      CHECK(h->no_reclaim == no_reclaim);
+    }
+  }
+}
+
+/* the shapes the driver's table has: a handler and a flag on one ID */
+static void test_merge(void) {
+  struct iwl_rx_handler *table[IWL_RX_HANDLER_GROUPS] = {};
+  const struct iwl_rx_handler_def defs[] = {
+      {0x1c, h0, false},   {0x1c, NULL, true}, /* TX_CMD */
+      {0xc5, NULL, true},  {0xc5, h1, false},  /* the other way around */
+      {0x4ff, h2, false},                      /* a wide ID */
+  };
+  int n = sizeof(defs) / sizeof(defs[0]);
+
+  allocs = 0;
+  for (int i = 0; i < n; i++)
+    CHECK(iwl_rx_handlers_add(table, &defs[i], alloc_group));
+  CHECK(allocs == 2);
+  check_against_defs(table, defs, n);
+  free_table(table);
+}
+
+static void test_errors(void) {
+  struct iwl_rx_handler *table[IWL_RX_HANDLER_GROUPS] = {};
+  const struct iwl_rx_handler_def bad_group = {0x1001, h0, true};
+  const struct iwl_rx_handler_def def = {0x301, h1, false};
+
+  CHECK(!iwl_rx_handlers_add(table, &bad_group, alloc_group));
+  fail_alloc = true;
+  CHECK(!iwl_rx_handlers_add(table, &def, alloc_group));
+  fail_alloc = false;
+  check_against_defs(table, NULL, 0);
+
+  CHECK(iwl_rx_handlers_add(table, &def, alloc_group));
+  check_against_defs(table, &def, 1);
+  free_table(table);
+}
+
+static void test_random(int rounds) {
+  for (int r = 0; r < rounds; r++) {
+    struct iwl_rx_handler *table[IWL_RX_HANDLER_GROUPS] = {};
+    struct iwl_rx_handler_def defs[64];
+    int n = rand() % 64;
+
+    for (int i = 0; i < n; i++) {
+      /* few groups and opcodes so IDs repeat */
+      defs[i].cmd_id =
+          static_cast<uint16_t>((rand() % 4) * 5 << 8 | (rand() % 16) * 17);
+      defs[i].fn = fns[rand() % 4];
+      defs[i].no_reclaim = rand() % 4 == 0;
+      CHECK(iwl_rx_handlers_add(table, &defs[i], alloc_group));
+    }
+    check_against_defs(table, defs, n);
+    free_table(table);
+  }
+}
+
+int main(void) {
+  srand(1);
+  test_merge();
+  test_errors();
+  test_random(200);
+  return HOST_TEST_RESULT();
+}
@@ -0,0 +1,215 @@
+//
+//  scan_index_test.cpp
+//  AppleIntelWifiAdapter host tests
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+/*
+ * mvm/IWLScanIndex.h driven the way IWL80211Device drives it: beacons
+ * from a few hundred BSSID/channel pairs (so the 64 buckets collide) are
+ * ingested into a cache of IWL_SCAN_CACHE_SIZE entries, with removals,
+ * expiry from the old end and flushes mixed in. After every step the
+ * index is checked against a plain list kept in the order the entries
+ * were last seen:
+ *
+ * - every cached key is found, and only those;
+ * - the LRU list walks the same in both directions as the model;
+ * - every entry sits in exactly one hash chain, the one of its key.
+ *
+ * The results prepareScanResults() builds from the LRU walk, through the
+ * channel bitmap and the RSSI insertion sort, are compared with a plain
+ * channel list search and a stable sort.
+ */
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "IWLScanIndex.h"
+#include "host_util.h"
+
+#define CACHE_SIZE 50  // IWL_SCAN_CACHE_SIZE
+#define KEYS 400
+
+struct entry {
+  entry* hash_next;
+  entry* lru_prev;
+  entry* lru_next;
+  uint8_t bssid[6];
+  struct {
+    uint32_t channel;
+  } channel;
+  uint32_t rssi;  // as IWLCachedScan keeps it, a negative dBm
+
+  uint8_t* getBSSID() { return bssid; }
+  uint32_t getRSSI() { return rssi; }
+};
+
+static void key_of(int k, uint8_t* bssid, uint32_t* channel) {
+  /* BSSIDs of one vendor prefix, repeated on a few channels */
+  static const uint8_t oui[3] = {0x00, 0x1b, 0x2f};
+
+  memcpy(bssid, oui, 3);
+  bssid[3] = 0;
+  bssid[4] = (uint8_t)(k / 4);
+  bssid[5] = (uint8_t)(k % 7);
+  *channel = 1 + (k % 4) * 12;
+}
+
+static void check(const iwl_scan_index<entry>& idx,
+                  const std::vector<entry*>& lru, entry* const* by_key) {
+  size_t chained = 0;
+
+  for (int k = 0; k < KEYS; k++) {
+    uint8_t bssid[6];
+    uint32_t channel;
+
+    key_of(k, bssid, &channel);
+    CHECK(idx.find(bssid, channel) == by_key[k]);
+  }
+
+  entry* e = idx.lru_head;
+  for (size_t i = 0; i < lru.size() && e; i++, e = e->lru_next)
+    CHECK(e == lru[i]);
+  CHECK(e == NULL);
+  e = idx.lru_tail;
+  for (size_t i = lru.size(); i > 0 && e; i--, e = e->lru_prev)
+    CHECK(e == lru[i - 1]);
+  CHECK(e == NULL);
+
+  for (int h = 0; h < IWL_SCAN_HASH_SIZE; h++) {
+    for (e = idx.hash[h]; e; e = e->hash_next) {
+      CHECK(iwl_scan_hash(e->bssid, e->channel.channel) == (uint32_t)h);
+      CHECK(std::find(lru.begin(), lru.end(), e) != lru.end());
+      chained++;
+    }
+  }
+  CHECK(chained == lru.size());
+}
+
+static void test_random(int steps) {
+  iwl_scan_index<entry> idx;
+  std::vector<entry*> lru;  // least recently seen first
+  entry* by_key[KEYS] = {};
+  int evictions = 0, updates = 0;
+
+  idx.clear();
+  for (int n = 0; n < steps; n++) {
+    int op = rand() % 100;
+
+    if (op < 85) {
+      /* a beacon: ingestBeacon() and addScan() */
+      int k = rand() % (rand() % 2 ? 60 : KEYS);
+      uint8_t bssid[6];
+      uint32_t channel;
+      entry* e;
+
+      key_of(k, bssid, &channel);
+      e = idx.find(bssid, channel);
+      if (e) {
+        idx.touch(e);
+        lru.erase(std::find(lru.begin(), lru.end(), e));
+        lru.push_back(e);
+        updates++;
+      } else {
+        if (lru.size() >= CACHE_SIZE) {
+          entry* old = idx.lru_head;
+
+          CHECK(old == lru.front());
+          idx.remove(old);
+          lru.erase(lru.begin());
+          for (int j = 0; j < KEYS; j++)
+            if (by_key[j] == old) by_key[j] = NULL;
+          delete old;
+          evictions++;
+        }
+        e = new entry();
+        memcpy(e->bssid, bssid, 6);
+        e->channel.channel = channel;
+        idx.insert(e);
+        lru.push_back(e);
+        by_key[k] = e;
+      }
+    } else if (op < 93 && !lru.empty()) {
+      /* any entry goes, the way removeScan() is called */
+      size_t i = rand() % lru.size();
+      entry* e = lru[i];
+
+      idx.remove(e);
+      lru.erase(lru.begin() + i);
+      for (int j = 0; j < KEYS; j++)
+        if (by_key[j] == e) by_key[j] = NULL;
+      delete e;
+    } else if (op < 99) {
+      /* expireScans() takes the oldest few */
+      for (int i = rand() % 4; i > 0 && idx.lru_head; i--) {
+        entry* e = idx.lru_head;
+
+        idx.remove(e);
+        lru.erase(lru.begin());
+        for (int j = 0; j < KEYS; j++)
+          if (by_key[j] == e) by_key[j] = NULL;
+        delete e;
+      }
+    } else {
+      /* flushScanCache() drops the index, the set frees the entries */
+      idx.clear();
+      for (entry* e : lru) delete e;
+      lru.clear();
+      memset(by_key, 0, sizeof(by_key));
+    }
+    check(idx, lru, by_key);
+  }
+
+  CHECK(evictions > 0 && updates > 0);
+  for (entry* e : lru) delete e;
+}
+
+static bool stronger(const entry* a, const entry* b) {
+  return (int32_t)a->rssi > (int32_t)b->rssi;
+}
+
+static void test_results(int rounds) {
+  for (int r = 0; r < rounds; r++) {
+    std::vector<entry> cache(rand() % (CACHE_SIZE + 1));
+    std::vector<uint32_t> channels(rand() % 4 ? rand() % 8 : 0);
+    std::vector<entry*> got(cache.size()), expect;
+    struct iwl_scan_chan_map map = {};
+    uint32_t count = 0;
+
+    /* channel numbers up to 300, so some fall off the bitmap */
+    for (uint32_t& ch : channels) ch = rand() % 2 ? rand() % 300 : rand() % 14;
+    for (entry& e : cache) {
+      e.channel.channel = rand() % 2 ? rand() % 300 : rand() % 14;
+      e.rssi = (uint32_t)-(20 + rand() % 16);
+    }
+
+    for (uint32_t ch : channels) iwl_scan_chan_map_set(&map, ch);
+    for (entry& e : cache) {
+      if (!channels.empty() && !iwl_scan_chan_map_test(&map, e.channel.channel))
+        continue;
+      iwl_scan_results_insert(got.data(), &count, &e);
+    }
+
+    for (entry& e : cache) {
+      if (channels.empty() ||
+          (e.channel.channel < 256 &&
+           std::find(channels.begin(), channels.end(), e.channel.channel) !=
+               channels.end()))
+        expect.push_back(&e);
+    }
+    std::stable_sort(expect.begin(), expect.end(), stronger);
+
+    CHECK(count == expect.size());
+    got.resize(count);
+    CHECK(got == expect);
+  }
+}
+
+int main(void) {
+  srand(1);
+  test_random(20000);
+  test_results(2000);
+  return HOST_TEST_RESULT();
+}
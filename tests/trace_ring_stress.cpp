@@ -0,0 +1,138 @@
+//
+//  trace_ring_stress.cpp
+//  AppleIntelWifiAdapter host tests
+//
+//  Copyright © 2020 IntelWifi for MacOS authors. All rights reserved.
+//
+
+/*
+ * IWLTraceRing.h, the ring behind iwl_trace_printf() and iwl_trace_dump():
+ *
+ * - one writer: a dump returns the last ring size records, oldest first,
+ *   and a slot another writer is still filling is left to it;
+ * - a ring far smaller than the traffic, several writers lapping each
+ *   other and a reader dumping all the while: every record the reader
+ *   takes is whole, one writer's record and time, and one writer's
+ *   records come out in the order it wrote them.
+ *
+ * Build with -fsanitize=thread (IWL_SANITIZE off) to have the races
+ * checked as well as the results.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "IWLTraceRing.h"
+#include "host_util.h"
+
+static void ring_init(struct iwl_trace_ring *ring, uint32_t size) {
+  ring->entries = static_cast<iwl_trace_entry *>(
+      calloc(size, sizeof(*ring->entries)));
+  ring->size = size;
+  ring->head = 0;
+}
+
+static void test_order() {
+  struct iwl_trace_ring ring;
+  char msg[IWL_TRACE_MSG_LEN], expect[IWL_TRACE_MSG_LEN] = {};
+  uint32_t first, head;
+  uint64_t time;
+
+  ring_init(&ring, 8);
+  for (uint32_t i = 0; i < 20; i++) {
+    snprintf(expect, sizeof(expect), "record %u\n", i);
+    CHECK(iwl_trace_ring_write(&ring, i * 10, expect));
+  }
+  iwl_trace_ring_span(&ring, &first, &head);
+  CHECK(first == 12 && head == 20);
+  /* overwritten ones are gone */
+  CHECK(!iwl_trace_ring_read(&ring, 11, &time, msg));
+  for (uint32_t i = first; i != head; i++) {
+    snprintf(expect, sizeof(expect), "record %u\n", i);
+    CHECK(iwl_trace_ring_read(&ring, i, &time, msg));
+    CHECK(time == i * 10);
+    CHECK(strcmp(msg, expect) == 0);
+  }
+
+  /* a writer still filling the slot a lap ago keeps it, the new one drops */
+  ring.entries[head % 8].seq = 2 * (head - 8) + 1;
+  CHECK(!iwl_trace_ring_write(&ring, 0, expect));
+  CHECK(!iwl_trace_ring_read(&ring, head, &time, msg));
+  CHECK(!iwl_trace_ring_read(&ring, head - 8, &time, msg));
+  CHECK(ring.entries[head % 8].seq == 2 * (head - 8) + 1);
+  free(ring.entries);
+}
+
+/* writer @w's record @n: a header, then one letter up to the end */
+static void make_msg(char *msg, uint32_t w, uint32_t n) {
+  int len = snprintf(msg, IWL_TRACE_MSG_LEN, "w%u n%u ", w, n);
+
+  memset(msg + len, 'a' + (w + n) % 26, IWL_TRACE_MSG_LEN - 1 - len);
+  msg[IWL_TRACE_MSG_LEN - 1] = '\0';
+}
+
+static void test_stress(uint32_t ring_size, uint32_t writers,
+                        uint32_t records) {
+  struct iwl_trace_ring ring;
+  std::atomic<uint32_t> done(0);
+  std::vector<std::thread> threads;
+  uint32_t bad = 0, taken = 0, dropped = 0, dumps = 0;
+
+  ring_init(&ring, ring_size);
+  for (uint32_t w = 0; w < writers; w++) {
+    threads.emplace_back([&, w] {
+      char msg[IWL_TRACE_MSG_LEN];
+      uint32_t lost = 0;
+
+      for (uint32_t n = 0; n < records; n++) {
+        make_msg(msg, w, n);
+        if (!iwl_trace_ring_write(&ring, (uint64_t)w << 32 | n, msg)) lost++;
+      }
+      __atomic_fetch_add(&dropped, lost, __ATOMIC_RELAXED);
+      done++;
+    });
+  }
+
+  while (done < writers) {
+    std::vector<uint32_t> last(writers, 0);
+    std::vector<bool> seen(writers, false);
+    char msg[IWL_TRACE_MSG_LEN], expect[IWL_TRACE_MSG_LEN];
+    uint32_t first, head, w, n;
+    uint64_t time;
+
+    iwl_trace_ring_span(&ring, &first, &head);
+    for (uint32_t i = first; i != head; i++) {
+      if (!iwl_trace_ring_read(&ring, i, &time, msg)) continue;
+      taken++;
+      w = (uint32_t)(time >> 32);
+      n = (uint32_t)time;
+      if (w >= writers || n >= records) {
+        bad++;
+        continue;
+      }
+      make_msg(expect, w, n);
+      if (memcmp(msg, expect, sizeof(msg)) || (seen[w] && n <= last[w]))
+        bad++;
+      seen[w] = true;
+      last[w] = n;
+    }
+    dumps++;
+  }
+  for (std::thread &t : threads) t.join();
+
+  printf("ring %u, %u writers: %u dumps took %u records, %u dropped\n",
+         ring_size, writers, dumps, taken, dropped);
+  CHECK(bad == 0);
+  CHECK(taken > 0);
+  free(ring.entries);
+}
+
+int main() {
+  test_order();
+  test_stress(4, 8, 200000);
+  test_stress(64, 4, 200000);
+  return HOST_TEST_RESULT();
+}